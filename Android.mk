@@ -17,15 +17,25 @@ LOCAL_SRC_FILES := \
     plugins_menu.c \
     mount_menu.c \
     wipe_menu.c \
+    wipe_scheduler.c \
+    restore_scheduler.c \
+    startup.c \
+    prefs.c \
+    gzstream.c \
+    untar.c \
+    raw_restore.c \
     install_menu.c \
     dirsize.c \
     nandroid.c \
+    nandroid_catalog.c \
+    nandroid_verify.c \
     nandroid_menu.c \
     overclock_menu.c \
     mkbootimg.c \
     unpackbootimg.c \
     mkbootfs.c \
     unyaffs.c \
+    mkyaffs2image.c \
     mounts.c 
 
 ##the world just isnt ready for API level 3 yet
@@ -48,7 +58,7 @@ LOCAL_STATIC_LIBRARIES :=
 LOCAL_STATIC_LIBRARIES += libext4_utils libz
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
-LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils liberase_image libdump_image libunyaffs libflash_image
+LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils liberase_image libdump_image libunyaffs libflash_image librawio
 
 BOARD_RECOVERY_DEFINES := BOARD_HAS_NO_SELECT_BUTTON BOARD_HAS_INVERTED_VOLUME BOARD_UMS_LUNFILE BOARD_LDPI_RECOVERY
 
@@ -58,13 +68,13 @@ $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
    ) \
 )
 
-LOCAL_STATIC_LIBRARIES += libstdc++ libc
+LOCAL_STATIC_LIBRARIES += libstdc++ libm libc
 
 LOCAL_C_INCLUDES += system/extras/ext4_utils
 include $(BUILD_EXECUTABLE)
 
 ##recovery symlinks
-RECOVERY_LINKS := flash_image dump_image erase_image format mkfs.ext4 mkbootimg unpack_bootimg mkbootfs reboot_android unyaffs keytest compute_size compute_files
+RECOVERY_LINKS := flash_image dump_image erase_image format mkfs.ext4 mkbootimg unpack_bootimg mkbootfs reboot_android unyaffs mkyaffs2image keytest compute_size compute_files
 RECOVERY_SYMLINKS := $(addprefix $(TARGET_RECOVERY_ROOT_OUT)/sbin/,$(RECOVERY_LINKS))
 $(RECOVERY_SYMLINKS): RECOVERY_BINARY := $(LOCAL_MODULE)
 $(RECOVERY_SYMLINKS): $(LOCAL_INSTALLED_MODULE)
@@ -75,6 +85,18 @@ $(RECOVERY_SYMLINKS): $(LOCAL_INSTALLED_MODULE)
 	$(hide) ln -sf $(RECOVERY_BINARY) $@
 ALL_DEFAULT_INSTALLED_MODULES += $(RECOVERY_SYMLINKS)
 
+##pre-decode res/images so ui_init() can map them instead of running libpng
+RECOVERY_RESPACK := $(TARGET_RECOVERY_ROOT_OUT)/res/images.pack
+RECOVERY_RESPACK_IMAGES := $(sort $(wildcard $(LOCAL_PATH)/res/images/*.png))
+RECOVERY_RESPACK_TOOL := $(HOST_OUT_EXECUTABLES)/mkrespack$(HOST_EXECUTABLE_SUFFIX)
+$(RECOVERY_RESPACK): PRIVATE_IMAGES := $(RECOVERY_RESPACK_IMAGES)
+$(RECOVERY_RESPACK): PRIVATE_TOOL := $(RECOVERY_RESPACK_TOOL)
+$(RECOVERY_RESPACK): $(RECOVERY_RESPACK_IMAGES) $(RECOVERY_RESPACK_TOOL)
+	@echo "Resource pack: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_TOOL) $@ $(PRIVATE_IMAGES)
+ALL_DEFAULT_INSTALLED_MODULES += $(RECOVERY_RESPACK)
+
 include $(CLEAR_VARS)
 RECOVERY_VERSION: VERS_FILE := $(LOCAL_MODULE)
 $(RECOVERY_VERSION) : $(LOCAL_INSTALLED_MODULE)
@@ -21,6 +21,7 @@
 // notice.
 
 #include <stdio.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -19,6 +19,10 @@
 
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "flashutils/flashutils.h"
+#include "flashutils/rawio.h"
 
 extern int __system (const char *command);
 
@@ -28,8 +32,8 @@ extern int __system (const char *command);
 static int
 restore_internal (const char *bml, const char *filename)
 {
-  char buf[4096];
-  int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+  int dstfd, srcfd;
+  long long copied;
 
   if (filename == NULL)
     srcfd = 0;
@@ -41,25 +45,26 @@ restore_internal (const char *bml, const char *filename)
 	  }
   dstfd = open (bml, O_RDWR | O_LARGEFILE);
   if (dstfd < 0)
-    return 3;
+	  {
+	    if (srcfd != 0)
+	      close (srcfd);
+	    return 3;
+	  }
   if (ioctl (dstfd, BML_UNLOCK_ALL, 0))
-    return 4;
-  do
 	  {
-	    total_read += bytes_read = read (srcfd, buf, 4096);
-	    if (!bytes_read)
-	      break;
-	    if (bytes_read < 4096)
-	      memset (&buf[bytes_read], 0, 4096 - bytes_read);
-	    if (write (dstfd, buf, 4096) < 4096)
-	      return 5;
+	    close (dstfd);
+	    if (srcfd != 0)
+	      close (srcfd);
+	    return 4;
 	  }
-  while (bytes_read == 4096);
+  // BML takes whole 4K pages
+  copied = rawio_copy (srcfd, dstfd, 4096);
 
-  close (dstfd);
-  close (srcfd);
-
-  return 0;
+  if (fsync (dstfd) || close (dstfd))
+    copied = -1;
+  if (srcfd != 0)
+    close (srcfd);
+  return copied < 0 ? 5 : 0;
 }
 
 int
@@ -102,52 +107,7 @@ cmd_bml_backup_raw_partition (const char *partition, const char *out_file)
 	    return -1;
 	  }
 
-  int ch;
-  FILE *in;
-  FILE *out;
-  int val = 0;
-  char buf[512];
-  unsigned sz = 0;
-  unsigned i;
-  int ret = -1;
-  char *in_file = bml;
-
-  in = fopen (in_file, "r");
-  if (in == NULL)
-    goto ERROR3;
-
-  out = fopen (out_file, "w");
-  if (out == NULL)
-    goto ERROR2;
-
-  fseek (in, 0L, SEEK_END);
-  sz = ftell (in);
-  fseek (in, 0L, SEEK_SET);
-
-  if (sz % 512)
-	  {
-	    while ((ch = fgetc (in)) != EOF)
-	      fputc (ch, out);
-	  }
-  else
-	  {
-	    for (i = 0; i < (sz / 512); i++)
-		    {
-		      if ((fread (buf, 512, 1, in)) != 1)
-			goto ERROR1;
-		      if ((fwrite (buf, 512, 1, out)) != 1)
-			goto ERROR1;
-		    }
-	  }
-
-  fsync (out);
-  ret = 0;
-ERROR1:
-  fclose (out);
-ERROR2:
-  fclose (in);
-ERROR3:
-  return ret;
+  return rawio_copy_path (bml, out_file, 0) < 0 ? -1 : 0;
 }
 
 int
@@ -175,3 +135,149 @@ cmd_bml_get_partition_device (const char *partition, char *device)
 {
   return -1;
 }
+
+// BML takes whole 4K pages, so a short last page is padded with zeros
+// as restore_internal() does.
+#define BML_PAGE 4096
+
+typedef struct
+{
+  FlashWriter base;
+  int fds[2];
+  int fd_count;
+  char page[BML_PAGE];
+  size_t page_len;
+} BmlRawWriter;
+
+static int
+bml_write_pages (BmlRawWriter * b, const char *data, size_t len)
+{
+  int i;
+
+  for (i = 0; i < b->fd_count; ++i)
+	  {
+	    const char *p = data;
+	    size_t left = len;
+
+	    while (left > 0)
+		    {
+		      ssize_t n = write (b->fds[i], p, left);
+
+		      if (n < 0 && errno == EINTR)
+			continue;
+		      if (n <= 0)
+			return -1;
+		      p += n;
+		      left -= n;
+		    }
+	  }
+  return 0;
+}
+
+static int
+bml_raw_writer_write (FlashWriter * w, const char *data, size_t len)
+{
+  BmlRawWriter *b = (BmlRawWriter *) w;
+  size_t whole;
+
+  if (b->page_len > 0)
+	  {
+	    size_t n = BML_PAGE - b->page_len;
+
+	    if (n > len)
+	      n = len;
+	    memcpy (b->page + b->page_len, data, n);
+	    b->page_len += n;
+	    data += n;
+	    len -= n;
+	    if (b->page_len < BML_PAGE)
+	      return 0;
+	    if (bml_write_pages (b, b->page, BML_PAGE))
+	      return -1;
+	    b->page_len = 0;
+	  }
+  whole = len - len % BML_PAGE;
+  if (whole > 0 && bml_write_pages (b, data, whole))
+    return -1;
+  memcpy (b->page, data + whole, len - whole);
+  b->page_len = len - whole;
+  return 0;
+}
+
+static int
+bml_raw_writer_close (FlashWriter * w)
+{
+  BmlRawWriter *b = (BmlRawWriter *) w;
+  int ret = 0;
+  int i;
+
+  if (b->page_len > 0)
+	  {
+	    memset (b->page + b->page_len, 0, BML_PAGE - b->page_len);
+	    ret = bml_write_pages (b, b->page, BML_PAGE);
+	  }
+  for (i = 0; i < b->fd_count; ++i)
+	  {
+	    if (fsync (b->fds[i]) || close (b->fds[i]))
+	      ret = -1;
+	  }
+  free (b);
+  return ret;
+}
+
+static int
+bml_open_unlocked (const char *bml)
+{
+  int fd = open (bml, O_RDWR | O_LARGEFILE);
+
+  if (fd >= 0 && ioctl (fd, BML_UNLOCK_ALL, 0))
+	  {
+	    close (fd);
+	    return -1;
+	  }
+  return fd;
+}
+
+FlashWriter *
+cmd_bml_open_raw_partition_writer (const char *partition)
+{
+  const char *bmls[2];
+  int count = 0;
+  BmlRawWriter *b;
+
+  // the same choice of devices as cmd_bml_restore_raw_partition()
+  if (partition[0] == '/')
+    bmls[count++] = partition;
+  else
+	  {
+	    if (strcmp (partition, "boot") != 0
+		&& strcmp (partition, "recovery") != 0
+		&& strcmp (partition, "recoveryonly") != 0)
+	      return NULL;
+	    if (strcmp (partition, "recoveryonly") != 0)
+	      bmls[count++] = "/dev/block/bml7";
+	    if (strcmp (partition, "boot") != 0)
+	      bmls[count++] = "/dev/block/bml8";
+	  }
+
+  b = calloc (1, sizeof (*b));
+  if (b == NULL)
+    return NULL;
+  for (b->fd_count = 0; b->fd_count < count; ++b->fd_count)
+	  {
+	    b->fds[b->fd_count] = bml_open_unlocked (bmls[b->fd_count]);
+	    if (b->fds[b->fd_count] < 0)
+		    {
+		      printf ("error opening %s\n", bmls[b->fd_count]);
+		      while (b->fd_count-- > 0)
+			close (b->fds[b->fd_count]);
+		      free (b);
+		      return NULL;
+		    }
+	  }
+  b->base.write = bml_raw_writer_write;
+  b->base.skip = NULL;
+  b->base.close = bml_raw_writer_close;
+  b->base.abort = NULL;
+  return &b->base;
+}
@@ -86,8 +86,7 @@ get_bootloader_message_mtd (struct bootloader_message *out, const Volume * v)
 {
   size_t write_size;
 
-  mtd_scan_partitions ();
-  const MtdPartition *part = mtd_find_partition_by_name (v->device);
+  const MtdPartition *part = mtd_lookup_partition (v->device);
 
   if (part == NULL || mtd_partition_info (part, NULL, NULL, &write_size))
 	  {
@@ -123,8 +122,7 @@ set_bootloader_message_mtd (const struct bootloader_message *in,
 {
   size_t write_size;
 
-  mtd_scan_partitions ();
-  const MtdPartition *part = mtd_find_partition_by_name (v->device);
+  const MtdPartition *part = mtd_lookup_partition (v->device);
 
   if (part == NULL || mtd_partition_info (part, NULL, NULL, &write_size))
 	  {
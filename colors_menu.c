@@ -7,45 +7,29 @@
 #include "recovery.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "prefs.h"
 
 char* RZR_DIR;
 
 void
 set_color (char red, char green, char blue)
 {
-  char txt;
+  unsigned char txt;
+  char rgb[32];
 
   if (green >= 150) txt = 0; else txt = 255;
-  FILE *fp = fopen ("/tmp/.rzrpref_rgb", "wb");
-
-  fwrite (&red, 1, 1, fp);
-  fwrite (&green, 1, 1, fp);
-  fwrite (&blue, 1, 1, fp);
-  fwrite (&txt, 1, 1, fp);
-  fclose (fp);
-  if (access ("/tmp/.rzrpref_rnd", F_OK) != -1) remove("/tmp/.rzrpref_rnd");
+  sprintf (rgb, "%u,%u,%u,%u", (unsigned char) red, (unsigned char) green,
+	   (unsigned char) blue, txt);
+  pref_set ("rgb", rgb);
+  pref_unset ("rnd");
 }
 
 void set_icon (char* icon) {
-  __system("rm /tmp/.rzrpref_icon*");
-  if (strcmp(icon,"rz")==0) {
-    ui_set_background(BACKGROUND_ICON_RZ);
-    char RZ_CMD[PATH_MAX];
-    sprintf(RZ_CMD, "echo > /tmp/.rzrpref_icon_rz", RZR_DIR);
-    __system(RZ_CMD);
-  }
-  if (strcmp(icon,"rw")==0) { 
-    ui_set_background(BACKGROUND_ICON_RW);
-    char RW_CMD[PATH_MAX];
-    sprintf(RW_CMD, "echo > /tmp/.rzrpref_icon_rw");
-    __system(RW_CMD);
-  }
-  if (strcmp(icon,"gm")==0) { 
-    ui_set_background(BACKGROUND_ICON_GM);
-    char RW_CMD[PATH_MAX];
-    sprintf(RW_CMD, "echo > /tmp/.rzrpref_icon_gm");
-    __system(RW_CMD);
-  }
+  if (strcmp(icon,"rz")==0) ui_set_background(BACKGROUND_ICON_RZ);
+  else if (strcmp(icon,"rw")==0) ui_set_background(BACKGROUND_ICON_RW);
+  else if (strcmp(icon,"gm")==0) ui_set_background(BACKGROUND_ICON_GM);
+  else return;
+  pref_set("icon", icon);
 }
 
 
@@ -66,9 +50,8 @@ set_random (int rnd)
   set_color (cR, cG, cB);
   if (rnd == 1)
   {
-    set_color(cR, cG, cB);
-    remove("/tmp/.rzrpref_rgb");
-    __system("echo rnd > /tmp/.rzrpref_rnd"); 
+    pref_unset("rgb");
+    pref_set("rnd", "1");
   }
 }
 
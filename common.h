@@ -35,6 +35,10 @@ int backwards_volume_keys_toggled();
 // so keep the output short and not too cryptic.
 void ui_print (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
+// Like ui_print("%s", str) but without the length limit; the whole
+// string is drawn with a single screen update.
+void ui_print_text (const char *str);
+
 // Display some header text followed by a menu of items, which appears
 // at the top of the screen (in place of any scrolling ui_print()
 // output, if necessary).
@@ -109,6 +113,14 @@ typedef struct
   const char *fs_options;
 
   const char *fs_options2;
+
+  int flags;			// VOLUME_* below, worked out from fs_type
 } Volume;
 
+#define VOLUME_RAMDISK	0x01	// "ramdisk": always mounted
+#define VOLUME_RAW	0x02	// "mtd", "emmc" or "bml": an image, not a filesystem
+#define VOLUME_MTD	0x04	// "mtd" or "yaffs2": lives on MTD flash
+#define VOLUME_EXT	0x08	// "ext2", "ext3" or "ext4"
+#define VOLUME_MOUNT	0x10	// "ext3", "ext4", "rfs" or "vfat": mounted with mount(2)
+
 #endif // RECOVERY_COMMON_H
@@ -5,7 +5,9 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	compile.c \
+	profile.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
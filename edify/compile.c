@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+// Compile() lowers the parser's tree (one malloc per node, per argv
+// array and per string) into a single block laid out as
+//
+//     Expr nodes[]     in evaluation (pre-)order; nodes[0] is the root
+//     Expr *args[]     every node's argv, back to back
+//     char strings[]   each distinct name/literal stored once
+//
+// Functions still receive Expr* argv[] exactly as before, so builtins
+// and device extensions work unchanged; they just walk memory that is
+// contiguous and shared.
+
+typedef struct
+{
+  char *pool;
+  size_t len, cap;
+  int *slots;			// offset + 1 into pool, 0 if empty
+  int size, count;
+} InternTable;
+
+static unsigned int
+hash_string (const char *s)
+{
+  unsigned int h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+static int intern (InternTable * t, const char *s);
+
+static int
+intern_grow (InternTable * t)
+{
+  int *old = t->slots;
+  int old_size = t->size;
+  int *slots = calloc (old_size ? old_size * 2 : 256, sizeof (int));
+  int i;
+
+  if (slots == NULL)
+    return -1;
+  t->slots = slots;
+  t->size = old_size ? old_size * 2 : 256;
+  for (i = 0; i < old_size; ++i)
+	  {
+	    if (old[i] == 0)
+	      continue;
+	    unsigned int h = hash_string (t->pool + old[i] - 1) & (t->size - 1);
+
+	    while (t->slots[h] != 0)
+	      h = (h + 1) & (t->size - 1);
+	    t->slots[h] = old[i];
+	  }
+  free (old);
+  return 0;
+}
+
+// Returns the offset of s in the pool, adding it if it's new, or -1
+// if out of memory.
+static int
+intern (InternTable * t, const char *s)
+{
+  if (t->count * 2 >= t->size && intern_grow (t) != 0)
+    return -1;
+
+  unsigned int h = hash_string (s) & (t->size - 1);
+
+  while (t->slots[h] != 0)
+	  {
+	    if (strcmp (t->pool + t->slots[h] - 1, s) == 0)
+	      return t->slots[h] - 1;
+	    h = (h + 1) & (t->size - 1);
+	  }
+
+  size_t n = strlen (s) + 1;
+
+  if (t->len + n > t->cap)
+	  {
+	    char *pool = realloc (t->pool, (t->len + n) * 2);
+
+	    if (pool == NULL)
+	      return -1;
+	    t->pool = pool;
+	    t->cap = (t->len + n) * 2;
+	  }
+  memcpy (t->pool + t->len, s, n);
+  t->slots[h] = t->len + 1;
+  t->len += n;
+  ++t->count;
+  return t->slots[h] - 1;
+}
+
+static void
+count_nodes (Expr * e, int *nodes, int *args)
+{
+  int i;
+
+  ++*nodes;
+  *args += e->argc;
+  for (i = 0; i < e->argc; ++i)
+    count_nodes (e->argv[i], nodes, args);
+}
+
+typedef struct
+{
+  Expr *nodes;
+  Expr **args;
+  int next_node;
+  int next_arg;
+  int *name_offsets;		// by pre-order node index
+  char *strings;
+} Emitter;
+
+static int
+intern_names (Expr * e, InternTable * t, int *offsets, int *index)
+{
+  int i;
+
+  if ((offsets[(*index)++] = intern (t, e->name)) < 0)
+    return -1;
+  for (i = 0; i < e->argc; ++i)
+	  {
+	    if (intern_names (e->argv[i], t, offsets, index) != 0)
+	      return -1;
+	  }
+  return 0;
+}
+
+static Expr *
+emit (Emitter * em, Expr * e)
+{
+  int index = em->next_node++;
+  Expr *out = &em->nodes[index];
+  int i;
+
+  out->fn = e->fn;
+  out->name = em->strings + em->name_offsets[index];
+  out->argc = e->argc;
+  out->start = e->start;
+  out->end = e->end;
+  out->argv = e->argc ? &em->args[em->next_arg] : NULL;
+  em->next_arg += e->argc;
+  for (i = 0; i < e->argc; ++i)
+    out->argv[i] = emit (em, e->argv[i]);
+  return out;
+}
+
+void
+FreeExpr (Expr * e)
+{
+  int i;
+
+  if (e == NULL)
+    return;
+  for (i = 0; i < e->argc; ++i)
+    FreeExpr (e->argv[i]);
+  free (e->argv);
+  // Build() gives operators a static name; everything else came
+  // from the lexer.
+  if (e->fn == Literal || strcmp (e->name, "(operator)") != 0)
+    free (e->name);
+  free (e);
+}
+
+Expr *
+Compile (Expr * root)
+{
+  int node_count = 0, arg_count = 0, index = 0;
+
+  count_nodes (root, &node_count, &arg_count);
+
+  InternTable t;
+
+  memset (&t, 0, sizeof (t));
+  int *offsets = malloc (node_count * sizeof (int));
+  size_t nodes_size = node_count * sizeof (Expr);
+  size_t args_size = arg_count * sizeof (Expr *);
+  char *block = NULL;
+
+  if (offsets != NULL && intern_names (root, &t, offsets, &index) == 0)
+    block = malloc (nodes_size + args_size + t.len);
+  if (block == NULL)
+	  {
+	    fprintf (stderr, "failed to allocate compiled script\n");
+	    free (offsets);
+	    free (t.pool);
+	    free (t.slots);
+	    FreeExpr (root);
+	    return NULL;
+	  }
+
+  Emitter em;
+
+  em.nodes = (Expr *) block;
+  em.args = (Expr **) (block + nodes_size);
+  em.strings = block + nodes_size + args_size;
+  em.next_node = 0;
+  em.next_arg = 0;
+  em.name_offsets = offsets;
+  memcpy (em.strings, t.pool, t.len);
+
+  Expr *compiled = emit (&em, root);
+
+  free (offsets);
+  free (t.pool);
+  free (t.slots);
+  FreeExpr (root);
+  return compiled;
+}
@@ -37,7 +37,11 @@ BooleanString (const char *s)
 char *
 Evaluate (State * state, Expr * expr)
 {
-  Value *v = expr->fn (expr->name, state, expr->argc, expr->argv);
+  // Skip the Value wrapper for the most common case.
+  if (expr->fn == Literal)
+    return strdup (expr->name);
+
+  Value *v = EvaluateValue (state, expr);
 
   if (v == NULL)
     return NULL;
@@ -57,6 +61,8 @@ Evaluate (State * state, Expr * expr)
 Value *
 EvaluateValue (State * state, Expr * expr)
 {
+  if (gProfileEnabled && expr->fn != Literal)
+    return ProfileEvaluate (state, expr);
   return expr->fn (expr->name, state, expr->argc, expr->argv);
 }
 
@@ -548,31 +554,30 @@ RegisterBuiltins ()
 int
 ReadArgs (State * state, Expr * argv[], int count, ...)
 {
-  char **args = malloc (count * sizeof (char *));
   va_list v;
-
-  va_start (v, count);
   int i;
 
+  va_start (v, count);
   for (i = 0; i < count; ++i)
 	  {
-	    args[i] = Evaluate (state, argv[i]);
-	    if (args[i] == NULL)
+	    char **out = va_arg (v, char **);
+
+	    *out = Evaluate (state, argv[i]);
+	    if (*out == NULL)
 		    {
 		      va_end (v);
+		      va_start (v, count);
 		      int j;
 
 		      for (j = 0; j < i; ++j)
 			      {
-				free (args[j]);
+				free (*(va_arg (v, char **)));
 			      }
-		      free (args);
+		      va_end (v);
 		      return -1;
 		    }
-	    *(va_arg (v, char **)) = args[i];
 	  }
   va_end (v);
-  free (args);
   return 0;
 }
 
@@ -582,31 +587,30 @@ ReadArgs (State * state, Expr * argv[], int count, ...)
 int
 ReadValueArgs (State * state, Expr * argv[], int count, ...)
 {
-  Value **args = malloc (count * sizeof (Value *));
   va_list v;
-
-  va_start (v, count);
   int i;
 
+  va_start (v, count);
   for (i = 0; i < count; ++i)
 	  {
-	    args[i] = EvaluateValue (state, argv[i]);
-	    if (args[i] == NULL)
+	    Value **out = va_arg (v, Value **);
+
+	    *out = EvaluateValue (state, argv[i]);
+	    if (*out == NULL)
 		    {
 		      va_end (v);
+		      va_start (v, count);
 		      int j;
 
 		      for (j = 0; j < i; ++j)
 			      {
-				FreeValue (args[j]);
+				FreeValue (*(va_arg (v, Value **)));
 			      }
-		      free (args);
+		      va_end (v);
 		      return -1;
 		    }
-	    *(va_arg (v, Value **)) = args[i];
 	  }
   va_end (v);
-  free (args);
   return 0;
 }
 
@@ -666,6 +670,45 @@ ReadValueVarArgs (State * state, int argc, Expr * argv[])
   return args;
 }
 
+// Like ReadVarArgs(), but literal arguments are not copied: their
+// entries point at the script's own strings and must not be modified.
+// Release the result with FreeSharedArgs().
+char **
+ReadSharedVarArgs (State * state, int argc, Expr * argv[])
+{
+  char **args = (char **) malloc (argc * sizeof (char *));
+  int i = 0;
+
+  for (i = 0; i < argc; ++i)
+	  {
+	    if (argv[i]->fn == Literal)
+		    {
+		      args[i] = argv[i]->name;
+		      continue;
+		    }
+	    args[i] = Evaluate (state, argv[i]);
+	    if (args[i] == NULL)
+		    {
+		      FreeSharedArgs (args, i, argv);
+		      return NULL;
+		    }
+	  }
+  return args;
+}
+
+void
+FreeSharedArgs (char **args, int argc, Expr * argv[])
+{
+  int i;
+
+  for (i = 0; i < argc; ++i)
+	  {
+	    if (argv[i]->fn != Literal)
+	      free (args[i]);
+	  }
+  free (args);
+}
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value *
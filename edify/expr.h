@@ -17,6 +17,7 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -98,6 +99,16 @@ Value *SequenceFn (const char *name, State * state, int argc, Expr * argv[]);
 // of arguments.
 Expr *Build (Function fn, YYLTYPE loc, int count, ...);
 
+// Lower a tree returned by yyparse() into one contiguous block (nodes
+// in evaluation order, all argv arrays, and interned strings) and free
+// the tree.  The result evaluates exactly like the tree did and is
+// released with a single free().  The tree is freed either way; NULL
+// if memory ran out.
+Expr *Compile (Expr * root);
+
+// Free a tree as built by the parser (not a compiled one).
+void FreeExpr (Expr * e);
+
 // Global builtins, registered by RegisterBuiltins().
 Value *IfElseFn (const char *name, State * state, int argc, Expr * argv[]);
 Value *AssertFn (const char *name, State * state, int argc, Expr * argv[]);
@@ -157,6 +168,12 @@ char **ReadVarArgs (State * state, int argc, Expr * argv[]);
 // Values it contains.
 Value **ReadValueVarArgs (State * state, int argc, Expr * argv[]);
 
+// Like ReadVarArgs(), but literal arguments are not copied: their
+// entries point at the script's own strings and must not be modified.
+// Release the result with FreeSharedArgs().
+char **ReadSharedVarArgs (State * state, int argc, Expr * argv[]);
+void FreeSharedArgs (char **args, int argc, Expr * argv[]);
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value *ErrorAbort (State * state, char *format, ...);
@@ -167,4 +184,24 @@ Value *StringValue (char *str);
 // Free a Value object.
 void FreeValue (Value * v);
 
+// --- optional profiling (profile.c) ---
+
+// Nonzero once ProfileStart() has been called.
+extern int gProfileEnabled;
+
+// Start recording call counts and wall time per function and per
+// line of state->script.  Must be called before evaluating the script.
+void ProfileStart (State * state);
+
+// Evaluate expr, charging the time to its function and script line.
+// EvaluateValue() calls this when profiling is enabled.
+Value *ProfileEvaluate (State * state, Expr * expr);
+
+// Charge 'bytes' of data processed to the function currently being
+// evaluated.  A no-op when profiling is disabled.
+void ProfileAddBytes (long long bytes);
+
+// Write the report, sorted by self time, to f.
+void ProfileReport (FILE * f);
+
 #endif // _EXPRESSION_H
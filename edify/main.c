@@ -44,6 +44,15 @@ expect (const char *expr_str, const char *expected, int *errors)
 	    return 0;
 	  }
 
+  // Everything is evaluated the way the updater does it: compiled.
+  e = Compile (e);
+  if (e == NULL)
+	  {
+	    fprintf (stderr, "out of memory compiling \"%s\"\n", expr_str);
+	    ++*errors;
+	    return 0;
+	  }
+
   State state;
 
   state.cookie = NULL;
@@ -51,6 +60,7 @@ expect (const char *expr_str, const char *expected, int *errors)
   state.errmsg = NULL;
 
   result = Evaluate (&state, e);
+  free (e);
   free (state.errmsg);
   free (state.script);
   if (result == NULL && expected != NULL)
@@ -219,6 +229,11 @@ main (int argc, char **argv)
   printf ("parse returned %d; %d errors encountered\n", error, error_count);
   if (error == 0 || error_count > 0)
 	  {
+	    if (error_count == 0 && (root = Compile (root)) == NULL)
+		    {
+		      printf ("out of memory compiling script\n");
+		      return 1;
+		    }
 
 	    ExprDump (0, root, buffer);
 
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+
+// Optional per-function and per-line profiling of script evaluation.
+// Nothing here runs unless ProfileStart() has been called; after that
+// every non-literal Expr evaluated goes through ProfileEvaluate().
+
+int gProfileEnabled = 0;
+
+typedef struct
+{
+  const char *name;
+  long long calls;
+  long long total_ns;		// including nested calls
+  long long self_ns;
+  long long bytes;
+} FnProfile;
+
+typedef struct
+{
+  long long calls;
+  long long self_ns;
+  long long bytes;
+} LineProfile;
+
+typedef struct
+{
+  FnProfile *fn;
+  int line;
+  long long start_ns;
+  long long child_ns;
+} ProfileFrame;
+
+// Each profile is allocated on its own so that the FnProfile pointers
+// held by open frames survive the table being resized underneath them.
+static FnProfile **fn_profiles = NULL;
+static int fn_profile_size = 0;
+static int fn_profile_count = 0;
+
+static const char *profile_script = NULL;
+static int *line_starts = NULL;	// offset of the first char of each line
+static int line_count = 0;
+static LineProfile *line_profiles = NULL;
+
+static ProfileFrame *frames = NULL;
+static int frame_count = 0;
+static int frame_size = 0;
+
+static long long
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Operators are all built with the name "(operator)"; give them
+// something more useful for the report.
+static const char *
+profile_name (Expr * expr)
+{
+  if (strcmp (expr->name, "(operator)") != 0)
+    return expr->name;
+  if (expr->fn == SequenceFn)
+    return "(;)";
+  if (expr->fn == ConcatFn)
+    return "(+)";
+  if (expr->fn == EqualityFn)
+    return "(==)";
+  if (expr->fn == InequalityFn)
+    return "(!=)";
+  if (expr->fn == LogicalAndFn)
+    return "(&&)";
+  if (expr->fn == LogicalOrFn)
+    return "(||)";
+  if (expr->fn == LogicalNotFn)
+    return "(!)";
+  if (expr->fn == IfElseFn)
+    return "(if)";
+  return expr->name;
+}
+
+static unsigned int
+hash_name (const char *s)
+{
+  unsigned int h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+// Several call sites share a name (each has its own copy of the
+// string), so the table is keyed by content, not by pointer.  NULL
+// if out of memory.
+static FnProfile *
+find_fn_profile (const char *name)
+{
+  if (fn_profile_count * 2 >= fn_profile_size)
+	  {
+	    int new_size = fn_profile_size ? fn_profile_size * 2 : 64;
+	    FnProfile **table = calloc (new_size, sizeof (FnProfile *));
+	    int i;
+
+	    if (table == NULL)
+	      return NULL;
+	    for (i = 0; i < fn_profile_size; ++i)
+		    {
+		      if (fn_profiles[i] == NULL)
+			continue;
+		      unsigned int h =
+			hash_name (fn_profiles[i]->name) & (new_size - 1);
+		      while (table[h] != NULL)
+			h = (h + 1) & (new_size - 1);
+		      table[h] = fn_profiles[i];
+		    }
+	    free (fn_profiles);
+	    fn_profiles = table;
+	    fn_profile_size = new_size;
+	  }
+
+  unsigned int h = hash_name (name) & (fn_profile_size - 1);
+
+  while (fn_profiles[h] != NULL)
+	  {
+	    if (strcmp (fn_profiles[h]->name, name) == 0)
+	      return fn_profiles[h];
+	    h = (h + 1) & (fn_profile_size - 1);
+	  }
+  FnProfile *fn = calloc (1, sizeof (FnProfile));
+
+  if (fn == NULL)
+    return NULL;
+  fn->name = name;
+  fn_profiles[h] = fn;
+  ++fn_profile_count;
+  return fn;
+}
+
+// 0-based line containing script offset 'pos'.
+static int
+line_for_offset (int pos)
+{
+  int lo = 0, hi = line_count - 1;
+
+  while (lo < hi)
+	  {
+	    int mid = (lo + hi + 1) / 2;
+
+	    if (line_starts[mid] <= pos)
+	      lo = mid;
+	    else
+	      hi = mid - 1;
+	  }
+  return lo;
+}
+
+void
+ProfileStart (State * state)
+{
+  const char *p;
+  int n = 1;
+
+  profile_script = state->script;
+  for (p = profile_script; *p; ++p)
+	  {
+	    if (*p == '\n')
+	      ++n;
+	  }
+  line_starts = malloc (n * sizeof (int));
+  line_profiles = calloc (n, sizeof (LineProfile));
+  line_starts[0] = 0;
+  line_count = 1;
+  for (p = profile_script; *p; ++p)
+	  {
+	    if (*p == '\n')
+	      line_starts[line_count++] = p - profile_script + 1;
+	  }
+  gProfileEnabled = 1;
+}
+
+Value *
+ProfileEvaluate (State * state, Expr * expr)
+{
+  FnProfile *fn = find_fn_profile (profile_name (expr));
+
+  if (frame_count >= frame_size && fn != NULL)
+	  {
+	    int new_size = frame_size * 2 + 16;
+	    ProfileFrame *grown =
+	      realloc (frames, new_size * sizeof (ProfileFrame));
+
+	    if (grown == NULL)
+	      fn = NULL;
+	    else
+		    {
+		      frames = grown;
+		      frame_size = new_size;
+		    }
+	  }
+  // Out of memory: still evaluate, just leave this call out.
+  if (fn == NULL)
+    return expr->fn (expr->name, state, expr->argc, expr->argv);
+
+  ProfileFrame *f = &frames[frame_count++];
+
+  f->fn = fn;
+  f->line = line_for_offset (expr->start);
+  f->child_ns = 0;
+  f->start_ns = now_ns ();
+
+  Value *v = expr->fn (expr->name, state, expr->argc, expr->argv);
+
+  // The table may have been reallocated by nested calls.
+  f = &frames[--frame_count];
+  long long elapsed = now_ns () - f->start_ns;
+  long long self = elapsed - f->child_ns;
+
+  f->fn->calls++;
+  f->fn->total_ns += elapsed;
+  f->fn->self_ns += self;
+  line_profiles[f->line].calls++;
+  line_profiles[f->line].self_ns += self;
+  if (frame_count > 0)
+    frames[frame_count - 1].child_ns += elapsed;
+  return v;
+}
+
+void
+ProfileAddBytes (long long bytes)
+{
+  if (!gProfileEnabled || frame_count == 0)
+    return;
+  ProfileFrame *f = &frames[frame_count - 1];
+
+  f->fn->bytes += bytes;
+  line_profiles[f->line].bytes += bytes;
+}
+
+static int
+fn_profile_compare (const void *a, const void *b)
+{
+  const FnProfile *fa = *(const FnProfile **) a;
+  const FnProfile *fb = *(const FnProfile **) b;
+
+  if (fa->self_ns != fb->self_ns)
+    return fa->self_ns < fb->self_ns ? 1 : -1;
+  return strcmp (fa->name, fb->name);
+}
+
+static int
+line_profile_compare (const void *a, const void *b)
+{
+  int la = *(const int *) a;
+  int lb = *(const int *) b;
+
+  if (line_profiles[la].self_ns != line_profiles[lb].self_ns)
+    return line_profiles[la].self_ns < line_profiles[lb].self_ns ? 1 : -1;
+  return la - lb;
+}
+
+#define PROFILE_MAX_LINES 25
+#define PROFILE_SOURCE_COLS 48
+
+void
+ProfileReport (FILE * f)
+{
+  int i, n;
+
+  if (!gProfileEnabled)
+    return;
+
+  FnProfile **fns = malloc (fn_profile_count * sizeof (FnProfile *));
+
+  for (i = 0, n = 0; i < fn_profile_size; ++i)
+	  {
+	    if (fn_profiles[i] != NULL)
+	      fns[n++] = fn_profiles[i];
+	  }
+  qsort (fns, n, sizeof (FnProfile *), fn_profile_compare);
+
+  fprintf (f, "edify profile by function (times in ms):\n");
+  fprintf (f, "%-28s %8s %10s %10s %12s\n", "function", "calls", "self",
+	   "total", "bytes");
+  for (i = 0; i < n; ++i)
+	  {
+	    fprintf (f, "%-28s %8lld %10.1f %10.1f %12lld\n", fns[i]->name,
+		     fns[i]->calls, fns[i]->self_ns / 1e6,
+		     fns[i]->total_ns / 1e6, fns[i]->bytes);
+	  }
+  free (fns);
+
+  int *lines = malloc (line_count * sizeof (int));
+
+  for (i = 0, n = 0; i < line_count; ++i)
+	  {
+	    if (line_profiles[i].calls > 0)
+	      lines[n++] = i;
+	  }
+  qsort (lines, n, sizeof (int), line_profile_compare);
+
+  fprintf (f, "edify profile by script line (top %d, times in ms):\n",
+	   PROFILE_MAX_LINES);
+  fprintf (f, "%6s %8s %10s %12s  %s\n", "line", "calls", "self", "bytes",
+	   "source");
+  for (i = 0; i < n && i < PROFILE_MAX_LINES; ++i)
+	  {
+	    int l = lines[i];
+	    const char *src = profile_script + line_starts[l];
+	    int len = strcspn (src, "\n");
+
+	    while (len > 0 && (*src == ' ' || *src == '\t'))
+		    {
+		      ++src;
+		      --len;
+		    }
+	    if (len > PROFILE_SOURCE_COLS)
+	      len = PROFILE_SOURCE_COLS;
+	    fprintf (f, "%6d %8lld %10.1f %12lld  %.*s\n", l + 1,
+		     line_profiles[l].calls, line_profiles[l].self_ns / 1e6,
+		     line_profiles[l].bytes, len, src);
+	  }
+  free (lines);
+}
@@ -6,6 +6,8 @@
 #include "recovery.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "minui/minui.h"
+#include "prefs.h"
 #include "plugins_menu.h"
 
 char* backuppath;
@@ -207,11 +209,7 @@ int set_backuppath(const char* sdpath)
     printf("Created new directory %s\n", sdpath);
   }  
   
-  __system("rm /tmp/.rzrpref_nandloc");
-  FILE *fp;
-  fp = fopen("/tmp/.rzrpref_nandloc", "w");
-  fprintf(fp, "%s\0", backuppath);
-  fclose(fp);
+  pref_set("nandloc", backuppath);
   ensure_path_unmounted(sdpath);
   
   return 0;
@@ -219,25 +217,16 @@ int set_backuppath(const char* sdpath)
 
 void set_repeat_scroll_delay(char *delay)
 {
-  __system("rm /tmp/.rzrpref_scroll");
-  FILE *fp = fopen("/tmp/.rzrpref_scroll", "w");
-  fprintf(fp, "%s\0", delay);
-  fclose(fp);
+  pref_set("scroll", delay);
+  ev_set_keyhold_delay(atoi(delay));
 }
 
 char* get_current_delay()
 
 {
-  char* delay = calloc(5, sizeof(char));
-  if (access("/tmp/.rzrpref_scroll",F_OK) != -1)
-  {
-    FILE *fp = fopen("/tmp/.rzrpref_scroll" ,"r");
-    fgets(delay, 5, fp);
-  }
-  else
-  {
-    delay = "185";
-  }
+  static char delay[8];
+  if (pref_get("scroll", delay, sizeof(delay)) != 0)
+    strcpy(delay, "185");
   return delay;
 }
 
@@ -301,17 +290,13 @@ void set_usb_fat_only(int fat_only)
 {
   if (fat_only == 1) 
   {
-    FILE* fp = fopen ("/tmp/.rzrpref_usb" ,"w");
-	fprintf(fp, "fat\0\n");
+    pref_set("usb", "fat");
     ui_print("Set FAT-only for USB mass storage.\n");  
-	fclose(fp);
   }	
   if (fat_only == 0) 
   {
-    FILE* fp = fopen("/tmp/.rzrpref_usb", "w");
-	fprintf(fp, "ext\0\n");
+    pref_set("usb", "ext");
 	ui_print("Set FAT + EXT for USB mass storage\n");
-	fclose(fp);
   }	 
 }
    	 
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "flashutils/flashutils.h"
 
@@ -187,3 +188,60 @@ get_partition_device (const char *partition, char *device)
 	    return -1;
 	  }
 }
+
+FlashWriter *
+open_raw_partition_writer (const char *partitionType, const char *partition)
+{
+  int type = detect_partition (partitionType, partition);
+
+  switch (type)
+	  {
+	  case MTD:
+	    return cmd_mtd_open_raw_partition_writer (partition);
+	  case MMC:
+	    return cmd_mmc_open_raw_partition_writer (partition);
+	  case BML:
+	    return cmd_bml_open_raw_partition_writer (partition);
+	  default:
+	    return NULL;
+	  }
+}
+
+int
+flash_writer_write (FlashWriter * w, const char *data, size_t len)
+{
+  return w->write (w, data, len);
+}
+
+int
+flash_writer_skip (FlashWriter * w, off_t len)
+{
+  static const char zeros[64 * 1024];
+
+  if (w->skip != NULL)
+    return w->skip (w, len);
+  while (len > 0)
+	  {
+	    size_t n = len > (off_t) sizeof (zeros) ? sizeof (zeros) : len;
+
+	    if (w->write (w, zeros, n) != 0)
+	      return -1;
+	    len -= n;
+	  }
+  return 0;
+}
+
+int
+flash_writer_close (FlashWriter * w)
+{
+  return w->close (w);
+}
+
+void
+flash_writer_abort (FlashWriter * w)
+{
+  if (w->abort != NULL)
+    w->abort (w);
+  else
+    w->close (w);
+}
@@ -1,6 +1,25 @@
 #ifndef FLASHUTILS_H
 #define FLASHUTILS_H
 
+#include <sys/types.h>
+
+// A raw partition being written front to back, for images that arrive
+// as a stream (eg. out of a .img.gz) rather than as a file to copy.
+// Each flash type embeds this at the start of its own context.
+typedef struct FlashWriter FlashWriter;
+
+struct FlashWriter
+{
+  int (*write) (FlashWriter * w, const char *data, size_t len);
+  // leave 'len' bytes as they are; NULL if the flash can't, and
+  // flash_writer_skip() writes zeros instead
+  int (*skip) (FlashWriter * w, off_t len);
+  int (*close) (FlashWriter * w);
+  // give up on the image, leaving out anything held back until close;
+  // NULL if there is nothing to leave out
+  void (*abort) (FlashWriter * w);
+};
+
 int restore_raw_partition (const char *partitionType, const char *partition,
 			   const char *filename);
 int backup_raw_partition (const char *partitionType, const char *partition,
@@ -11,6 +30,17 @@ int mount_partition (const char *partition, const char *mount_point,
 		     const char *filesystem, int read_only);
 int get_partition_device (const char *partition, char *device);
 
+// Open a raw partition for streaming an image onto it; NULL on error.
+// The write, skip and close calls return 0 on success, and close()
+// frees the writer whether or not it succeeds.  After a failed write
+// use flash_writer_abort() instead of close(), which also frees it.
+FlashWriter *open_raw_partition_writer (const char *partitionType,
+					const char *partition);
+int flash_writer_write (FlashWriter * w, const char *data, size_t len);
+int flash_writer_skip (FlashWriter * w, off_t len);
+int flash_writer_close (FlashWriter * w);
+void flash_writer_abort (FlashWriter * w);
+
 #define FLASH_MTD 0
 #define FLASH_MMC 1
 #define FLASH_BML 2
@@ -29,6 +59,7 @@ extern int cmd_mtd_mount_partition (const char *partition,
 				    const char *mount_point,
 				    const char *filesystem, int read_only);
 extern int cmd_mtd_get_partition_device (const char *partition, char *device);
+extern FlashWriter *cmd_mtd_open_raw_partition_writer (const char *partition);
 
 extern int cmd_mmc_restore_raw_partition (const char *partition,
 					  const char *filename);
@@ -41,6 +72,7 @@ extern int cmd_mmc_mount_partition (const char *partition,
 				    const char *mount_point,
 				    const char *filesystem, int read_only);
 extern int cmd_mmc_get_partition_device (const char *partition, char *device);
+extern FlashWriter *cmd_mmc_open_raw_partition_writer (const char *partition);
 
 extern int cmd_bml_restore_raw_partition (const char *partition,
 					  const char *filename);
@@ -53,6 +85,7 @@ extern int cmd_bml_mount_partition (const char *partition,
 				    const char *mount_point,
 				    const char *filesystem, int read_only);
 extern int cmd_bml_get_partition_device (const char *partition, char *device);
+extern FlashWriter *cmd_bml_open_raw_partition_writer (const char *partition);
 
 extern int device_flash_type ();
 extern int get_flash_type (const char *fs_type);
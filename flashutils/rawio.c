@@ -0,0 +1,258 @@
+#define _LARGEFILE64_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "flashutils/rawio.h"
+
+#define READ_RETRIES 3
+
+typedef struct
+{
+  RawioSource next;
+  void *cookie;
+  char *buf[2];
+  ssize_t len[2];		// 0 at the end, -1 on error
+  int full[2];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+} RawioCopy;
+
+static ssize_t
+read_fully (int fd, char *buf, size_t len, off64_t offset)
+{
+  size_t done = 0;
+  int retries = 0;
+
+  while (done < len)
+	  {
+	    ssize_t n = offset < 0 ? read (fd, buf + done, len - done) :
+	      pread64 (fd, buf + done, len - done, offset + done);
+
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    if (n < 0 && offset >= 0 && errno == EIO && ++retries < READ_RETRIES)
+		    {
+		      fprintf (stderr, "rawio: read error at 0x%llx, retrying\n",
+			       (long long) (offset + done));
+		      continue;
+		    }
+	    if (n < 0)
+	      return -1;
+	    if (n == 0)
+	      break;
+	    done += n;
+	  }
+  return done;
+}
+
+static int
+write_fully (int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+	  {
+	    ssize_t n = write (fd, buf, len);
+
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    if (n <= 0)
+	      return -1;
+	    buf += n;
+	    len -= n;
+	  }
+  return 0;
+}
+
+// Waits for buffer 'i' to be free; returns 0 if the copy was stopped.
+static int
+wait_empty (RawioCopy * c, int i)
+{
+  int ok;
+
+  pthread_mutex_lock (&c->lock);
+  while (c->full[i] && !c->stop)
+    pthread_cond_wait (&c->cond, &c->lock);
+  ok = !c->stop;
+  pthread_mutex_unlock (&c->lock);
+  return ok;
+}
+
+static void
+hand_over (RawioCopy * c, int i, ssize_t len)
+{
+  pthread_mutex_lock (&c->lock);
+  c->len[i] = len;
+  c->full[i] = 1;
+  pthread_cond_broadcast (&c->cond);
+  pthread_mutex_unlock (&c->lock);
+}
+
+static void *
+reader_thread (void *cookie)
+{
+  RawioCopy *c = (RawioCopy *) cookie;
+  int i = 0;
+  int fd, more;
+  off64_t offset;
+  size_t len;
+
+  while ((more = c->next (c->cookie, &fd, &offset, &len)) > 0)
+	  {
+	    int to_eof = len == 0;
+
+	    while (to_eof || len > 0)
+		    {
+		      size_t want = !to_eof && len < RAWIO_CHUNK ? len : RAWIO_CHUNK;
+		      ssize_t n;
+
+		      if (!wait_empty (c, i))
+			return NULL;
+		      n = read_fully (fd, c->buf[i], want, offset);
+		      if (n < 0 || (n < (ssize_t) want && !to_eof))
+			      {
+				hand_over (c, i, -1);
+				return NULL;
+			      }
+		      if (n == 0)
+			break;
+		      hand_over (c, i, n);
+		      i ^= 1;
+		      if (offset >= 0)
+			offset += n;
+		      if (!to_eof)
+			len -= n;
+		      else if (n < (ssize_t) want)
+			break;
+		    }
+	  }
+  if (wait_empty (c, i))
+    hand_over (c, i, more < 0 ? -1 : 0);
+  return NULL;
+}
+
+long long
+rawio_copy_pieces (RawioSource next, void *cookie, int out_fd, size_t pad)
+{
+  RawioCopy c;
+  pthread_t reader;
+  long long total = 0;
+  int i = 0;
+  ssize_t n;
+
+  memset (&c, 0, sizeof (c));
+  c.next = next;
+  c.cookie = cookie;
+  c.buf[0] = malloc (RAWIO_CHUNK);
+  c.buf[1] = malloc (RAWIO_CHUNK);
+  pthread_mutex_init (&c.lock, NULL);
+  pthread_cond_init (&c.cond, NULL);
+  if (c.buf[0] == NULL || c.buf[1] == NULL ||
+      pthread_create (&reader, NULL, reader_thread, &c) != 0)
+	  {
+	    total = -1;
+	    goto out;
+	  }
+
+  for (;;)
+	  {
+	    pthread_mutex_lock (&c.lock);
+	    while (!c.full[i])
+	      pthread_cond_wait (&c.cond, &c.lock);
+	    n = c.len[i];
+	    pthread_mutex_unlock (&c.lock);
+	    if (n <= 0)
+		    {
+		      if (n < 0)
+			total = -1;
+		      break;
+		    }
+
+	    // a short last piece is padded out in place
+	    if (pad > 1 && n % pad && n + pad - n % pad <= RAWIO_CHUNK)
+		    {
+		      memset (c.buf[i] + n, 0, pad - n % pad);
+		      n += pad - n % pad;
+		    }
+	    if (write_fully (out_fd, c.buf[i], n))
+		    {
+		      total = -1;
+		      break;
+		    }
+	    total += n;
+
+	    pthread_mutex_lock (&c.lock);
+	    c.full[i] = 0;
+	    pthread_cond_broadcast (&c.cond);
+	    pthread_mutex_unlock (&c.lock);
+	    i ^= 1;
+	  }
+
+  pthread_mutex_lock (&c.lock);
+  c.stop = 1;
+  pthread_cond_broadcast (&c.cond);
+  pthread_mutex_unlock (&c.lock);
+  pthread_join (reader, NULL);
+out:
+  free (c.buf[0]);
+  free (c.buf[1]);
+  pthread_mutex_destroy (&c.lock);
+  pthread_cond_destroy (&c.cond);
+  return total;
+}
+
+typedef struct
+{
+  int fd;
+  int given;
+} WholeFile;
+
+static int
+whole_file (void *cookie, int *fd, off64_t * offset, size_t * len)
+{
+  WholeFile *f = (WholeFile *) cookie;
+
+  if (f->given)
+    return 0;
+  f->given = 1;
+  *fd = f->fd;
+  *offset = -1;
+  *len = 0;
+  return 1;
+}
+
+long long
+rawio_copy (int in_fd, int out_fd, size_t pad)
+{
+  WholeFile f = { in_fd, 0 };
+
+  return rawio_copy_pieces (whole_file, &f, out_fd, pad);
+}
+
+long long
+rawio_copy_path (const char *in_path, const char *out_path, size_t pad)
+{
+  int in, out;
+  long long ret;
+
+  in = open (in_path, O_RDONLY | O_LARGEFILE);
+  if (in < 0)
+    return -1;
+  out = open (out_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+  if (out < 0)
+	  {
+	    close (in);
+	    return -1;
+	  }
+  ret = rawio_copy (in, out, pad);
+  if (fsync (out) && errno != EINVAL)
+    ret = -1;
+  if (close (out))
+    ret = -1;
+  close (in);
+  return ret;
+}
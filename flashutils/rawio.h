@@ -0,0 +1,35 @@
+#ifndef FLASHUTILS_RAWIO_H
+#define FLASHUTILS_RAWIO_H
+
+#include <sys/types.h>
+
+// Raw partition dumps and restores go through here: a reader thread
+// fills one large buffer while the caller writes out the other, so
+// the source and the destination are both kept busy with big requests
+// instead of taking turns at 512 bytes or 4K.
+
+#define RAWIO_CHUNK (1024 * 1024)
+
+// The next piece of input, read from '*fd' at '*offset' (or from where
+// it is when '*offset' is -1) for '*len' bytes, or to the end of the
+// file if '*len' is 0.  Return 1 for a piece, 0 when there are no more,
+// -1 on error.
+typedef int (*RawioSource) (void *cookie, int *fd, off64_t * offset,
+			    size_t * len);
+
+// Copies the pieces to 'out_fd' in order.  With 'pad' above 1 a piece
+// that ends short of a multiple of it is padded with zeros, for
+// devices written in whole pages.  Short reads and writes and EINTR are
+// retried, and a failed positioned read is tried again a few times.
+// Returns the number of bytes written, or -1.
+long long rawio_copy_pieces (RawioSource next, void *cookie, int out_fd,
+			     size_t pad);
+
+// Copies the rest of 'in_fd' to 'out_fd'.
+long long rawio_copy (int in_fd, int out_fd, size_t pad);
+
+// The same between two paths; the output is fsync()ed.
+long long rawio_copy_path (const char *in_path, const char *out_path,
+			   size_t pad);
+
+#endif
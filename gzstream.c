@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "gzstream.h"
+
+#define GZSTREAM_BUF (128 * 1024)
+
+struct GzStream
+{
+  int fd;
+  int gzip;
+  int eof;			// nothing more to read from fd
+  int done;			// nothing more to inflate
+  z_stream z;			// next_in/avail_in track 'in' in both modes
+  unsigned char in[GZSTREAM_BUF];
+};
+
+// Tops up 'in' after whatever is still unread.  Returns the number of
+// bytes added, 0 at the end of the file, or -1.
+static ssize_t
+refill (GzStream * s)
+{
+  ssize_t n;
+
+  if (s->z.avail_in > 0 && s->z.next_in != s->in)
+    memmove (s->in, s->z.next_in, s->z.avail_in);
+  s->z.next_in = s->in;
+  do
+    n = read (s->fd, s->in + s->z.avail_in, sizeof (s->in) - s->z.avail_in);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return -1;
+  if (n == 0)
+    s->eof = 1;
+  s->z.avail_in += n;
+  return n;
+}
+
+GzStream *
+gzstream_fdopen (int fd)
+{
+  GzStream *s = calloc (1, sizeof (*s));
+
+  if (s == NULL)
+	  {
+	    close (fd);
+	    return NULL;
+	  }
+  s->fd = fd;
+  s->z.next_in = s->in;
+  while (s->z.avail_in < 2 && !s->eof)
+	  {
+	    if (refill (s) < 0)
+		    {
+		      gzstream_close (s);
+		      return NULL;
+		    }
+	  }
+  if (s->z.avail_in >= 2 && s->in[0] == 0x1f && s->in[1] == 0x8b)
+	  {
+	    // 16: expect a gzip header and trailer rather than zlib's
+	    if (inflateInit2 (&s->z, 15 + 16) != Z_OK)
+		    {
+		      gzstream_close (s);
+		      errno = ENOMEM;
+		      return NULL;
+		    }
+	    s->gzip = 1;
+	  }
+  return s;
+}
+
+GzStream *
+gzstream_open (const char *path)
+{
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  return gzstream_fdopen (fd);
+}
+
+static ssize_t
+read_plain (GzStream * s, unsigned char *out, size_t len)
+{
+  size_t got = 0;
+
+  while (got < len)
+	  {
+	    size_t n;
+
+	    if (s->z.avail_in == 0)
+		    {
+		      if (s->eof)
+			break;
+		      // large reads skip the copy through 'in'
+		      if (len - got >= sizeof (s->in))
+			      {
+				ssize_t r = read (s->fd, out + got, len - got);
+
+				if (r < 0 && errno == EINTR)
+				  continue;
+				if (r < 0)
+				  return -1;
+				if (r == 0)
+				  s->eof = 1;
+				got += r;
+				continue;
+			      }
+		      if (refill (s) < 0)
+			return -1;
+		      continue;
+		    }
+	    n = len - got < s->z.avail_in ? len - got : s->z.avail_in;
+	    memcpy (out + got, s->z.next_in, n);
+	    s->z.next_in += n;
+	    s->z.avail_in -= n;
+	    got += n;
+	  }
+  return got;
+}
+
+static ssize_t
+read_gzip (GzStream * s, unsigned char *out, size_t len)
+{
+  s->z.next_out = out;
+  s->z.avail_out = len;
+  while (s->z.avail_out > 0 && !s->done)
+	  {
+	    int ret;
+
+	    if (s->z.avail_in == 0 && !s->eof && refill (s) < 0)
+	      return -1;
+	    ret = inflate (&s->z, Z_NO_FLUSH);
+	    if (ret == Z_STREAM_END)
+		    {
+		      // another member may follow; anything else is ignored,
+		      // as gzip -d does with trailing garbage
+		      if (s->z.avail_in == 0 && !s->eof && refill (s) < 0)
+			return -1;
+		      if (s->z.avail_in > 0 && s->z.next_in[0] == 0x1f)
+			inflateReset (&s->z);
+		      else
+			s->done = 1;
+		      continue;
+		    }
+	    if (ret != Z_OK && (ret != Z_BUF_ERROR || s->eof))
+		    {
+		      // corrupt, or the file ends mid-member
+		      errno = EIO;
+		      return -1;
+		    }
+	  }
+  return len - s->z.avail_out;
+}
+
+ssize_t
+gzstream_read (GzStream * s, void *buf, size_t len)
+{
+  if (s->gzip)
+    return read_gzip (s, buf, len);
+  return read_plain (s, buf, len);
+}
+
+int
+gzstream_skip (GzStream * s, off_t len)
+{
+  unsigned char scratch[16 * 1024];
+
+  if (!s->gzip)
+	  {
+	    off_t n = len < (off_t) s->z.avail_in ? len : (off_t) s->z.avail_in;
+
+	    s->z.next_in += n;
+	    s->z.avail_in -= n;
+	    len -= n;
+	    if (len == 0)
+	      return 0;
+	    off_t pos = lseek (s->fd, len, SEEK_CUR);
+
+	    if (pos >= 0)
+		    {
+		      struct stat st;
+
+		      // lseek() is happy to go past the end of a file
+		      if (fstat (s->fd, &st) == 0 && S_ISREG (st.st_mode)
+			  && pos > st.st_size)
+			      {
+				errno = EIO;
+				return -1;
+			      }
+		      return 0;
+		    }
+	    // a pipe; read through it instead
+	  }
+  while (len > 0)
+	  {
+	    ssize_t n = gzstream_read (s, scratch,
+				       len < (off_t) sizeof (scratch) ?
+				       (size_t) len : sizeof (scratch));
+
+	    if (n <= 0)
+		    {
+		      if (n == 0)
+			errno = EIO;
+		      return -1;
+		    }
+	    len -= n;
+	  }
+  return 0;
+}
+
+int
+gzstream_compressed (const GzStream * s)
+{
+  return s->gzip;
+}
+
+void
+gzstream_close (GzStream * s)
+{
+  if (s == NULL)
+    return;
+  if (s->gzip)
+    inflateEnd (&s->z);
+  close (s->fd);
+  free (s);
+}
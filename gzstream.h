@@ -0,0 +1,32 @@
+#ifndef RECOVERY_GZSTREAM_H
+#define RECOVERY_GZSTREAM_H
+
+#include <sys/types.h>
+
+// A buffered reader that inflates gzip input as it goes and passes
+// anything else through unchanged, so callers handle "foo.tar" and
+// "foo.tgz" (or "foo.img" and "foo.img.gz") with the same code.
+// Concatenated gzip members are read as one stream.
+
+typedef struct GzStream GzStream;
+
+GzStream *gzstream_open (const char *path);
+
+// Takes over 'fd'; it is closed by gzstream_close().
+GzStream *gzstream_fdopen (int fd);
+
+// Reads up to 'len' bytes; short only at the end of the stream.
+// Returns the number read, 0 at the end, or -1 (errno set) on an
+// I/O error or corrupt input.
+ssize_t gzstream_read (GzStream * s, void *buf, size_t len);
+
+// Discards 'len' bytes; seeks instead when the input is not
+// compressed.  Returns 0, or -1 if the stream ended first.
+int gzstream_skip (GzStream * s, off_t len);
+
+// Whether the input turned out to be gzip.
+int gzstream_compressed (const GzStream * s);
+
+void gzstream_close (GzStream * s);
+
+#endif
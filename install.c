@@ -18,8 +18,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -109,6 +114,137 @@ handle_firmware_update (char *type, char *filename, ZipArchive * zip)
   return INSTALL_SUCCESS;
 }
 
+// Commands from the update binary are drained off the socket by a
+// dedicated thread as fast as they arrive, so the updater never waits
+// on the UI.  The installing thread takes everything received so far in
+// one go, coalesces it (runs of ui_print become one screen update, only
+// the last set_progress of a run is applied) and applies it.
+#define CMD_CHANNEL_SNDBUF (256 * 1024)
+#define CMD_READ_SIZE 4096
+
+typedef struct
+{
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *data;			// bytes received but not yet taken
+  size_t len, cap;
+  double arrived;		// when the oldest of them was read
+  int eof;
+} CmdChannel;
+
+// Timing counters for one script phase; a phase starts at each
+// "progress" command (phase 0 is everything before the first one).
+typedef struct
+{
+  double start;
+  int prints;
+  int progress_updates;
+  int progress_applied;
+  size_t bytes;
+  double max_latency;		// read off the socket -> taken
+} CmdPhase;
+
+#define CMD_MAX_PHASES 64
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+cmd_channel_thread (void *cookie)
+{
+  CmdChannel *ch = (CmdChannel *) cookie;
+  char buf[CMD_READ_SIZE];
+  ssize_t n;
+
+  for (;;)
+	  {
+	    n = read (ch->fd, buf, sizeof (buf));
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    double arrived = now_seconds ();
+
+	    pthread_mutex_lock (&ch->lock);
+	    if (n <= 0)
+		    {
+		      ch->eof = 1;
+		      pthread_cond_signal (&ch->cond);
+		      pthread_mutex_unlock (&ch->lock);
+		      break;
+		    }
+	    if (ch->len + n > ch->cap)
+		    {
+		      size_t cap = ch->cap ? ch->cap : CMD_READ_SIZE;
+
+		      while (cap < ch->len + n)
+			cap *= 2;
+		      char *data = realloc (ch->data, cap);
+
+		      if (data == NULL)
+			      {
+				// Out of memory: drop this chunk rather than
+				// stop draining the updater.
+				pthread_mutex_unlock (&ch->lock);
+				continue;
+			      }
+		      ch->data = data;
+		      ch->cap = cap;
+		    }
+	    if (ch->len == 0)
+	      ch->arrived = arrived;
+	    memcpy (ch->data + ch->len, buf, n);
+	    ch->len += n;
+	    pthread_cond_signal (&ch->cond);
+	    pthread_mutex_unlock (&ch->lock);
+	  }
+  return NULL;
+}
+
+// Text collected from consecutive ui_print commands.
+typedef struct
+{
+  char *str;
+  size_t len, cap;
+} PrintBuffer;
+
+static void
+print_buffer_append (PrintBuffer * pb, const char *str)
+{
+  size_t n = strlen (str);
+
+  if (pb->len + n + 1 > pb->cap)
+	  {
+	    size_t cap = pb->cap ? pb->cap : 1024;
+
+	    while (cap < pb->len + n + 1)
+	      cap *= 2;
+	    char *s = realloc (pb->str, cap);
+
+	    if (s == NULL)
+	      return;
+	    pb->str = s;
+	    pb->cap = cap;
+	  }
+  memcpy (pb->str + pb->len, str, n + 1);
+  pb->len += n;
+}
+
+static void
+print_buffer_flush (PrintBuffer * pb)
+{
+  if (pb->len > 0)
+	  {
+	    ui_print_text (pb->str);
+	    pb->len = 0;
+	  }
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary (const char *path, ZipArchive * zip)
@@ -162,7 +298,18 @@ try_update_binary (const char *path, ZipArchive * zip)
 
   int pipefd[2];
 
-  pipe (pipefd);
+  // A stream socket rather than a pipe: the update binary still just
+  // sees a writable fd, but we can give it a much larger buffer.
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, pipefd) < 0)
+	  {
+	    LOGE ("Can't create command channel: %s\n", strerror (errno));
+	    mzCloseZipArchive (zip);
+	    ui_reset_progress();
+	    return INSTALL_ERROR;
+	  }
+  int sndbuf = CMD_CHANNEL_SNDBUF;
+
+  setsockopt (pipefd[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
 
   // When executing the update binary contained in the package, the
   // arguments passed are:
@@ -224,75 +371,198 @@ try_update_binary (const char *path, ZipArchive * zip)
   char *firmware_type = NULL;
   char *firmware_filename = NULL;
 
-  char buffer[1024];
-  FILE *from_child = fdopen (pipefd[0], "r");
+  CmdChannel ch;
 
-  while (fgets (buffer, sizeof (buffer), from_child) != NULL)
-	  {
-	    char *command = strtok (buffer, " \n");
+  memset (&ch, 0, sizeof (ch));
+  ch.fd = pipefd[0];
+  pthread_mutex_init (&ch.lock, NULL);
+  pthread_cond_init (&ch.cond, NULL);
+
+  pthread_t reader;
 
-	    if (command == NULL)
+  pthread_create (&reader, NULL, cmd_channel_thread, &ch);
+
+  CmdPhase phases[CMD_MAX_PHASES];
+  int phase = 0;
+
+  memset (phases, 0, sizeof (phases));
+  phases[0].start = now_seconds ();
+
+  PrintBuffer pb = { NULL, 0, 0 };
+  char *pending = NULL;		// received bytes not yet parsed
+  size_t pending_len = 0;
+  int eof = 0;
+
+  while (!eof)
+	  {
+	    pthread_mutex_lock (&ch.lock);
+	    while (ch.len == 0 && !ch.eof)
 		    {
-		      continue;
+		      pthread_cond_wait (&ch.cond, &ch.lock);
 		    }
-	    else if (strcmp (command, "progress") == 0)
-		    {
-		      char *fraction_s = strtok (NULL, " \n");
-		      char *seconds_s = strtok (NULL, " \n");
+	    // Take everything received so far.
+	    char *data = ch.data;
+	    size_t len = ch.len;
+	    double arrived = ch.arrived;
 
-		      float fraction = strtof (fraction_s, NULL);
-		      int seconds = strtol (seconds_s, NULL, 10);
+	    eof = ch.eof;
+	    ch.data = NULL;
+	    ch.len = ch.cap = 0;
+	    pthread_mutex_unlock (&ch.lock);
 
-		      ui_show_progress (fraction *
-					(1 - VERIFICATION_PROGRESS_FRACTION),
-					seconds);
-		    }
-	    else if (strcmp (command, "set_progress") == 0)
+	    if (len > 0)
 		    {
-		      char *fraction_s = strtok (NULL, " \n");
-		      float fraction = strtof (fraction_s, NULL);
+		      // Only the wait for the taker; drawing is not counted.
+		      double latency = now_seconds () - arrived;
+
+		      if (latency > phases[phase].max_latency)
+			phases[phase].max_latency = latency;
 
-		      ui_set_progress (fraction);
+		      char *p = realloc (pending, pending_len + len + 1);
+
+		      if (p != NULL)
+			      {
+				pending = p;
+				memcpy (pending + pending_len, data, len);
+				pending_len += len;
+			      }
+		      phases[phase].bytes += len;
 		    }
-	    else if (strcmp (command, "firmware") == 0)
+	    free (data);
+	    if (pending == NULL)
+	      continue;
+	    pending[pending_len] = '\0';
+
+	    int set_progress = 0;
+	    float set_fraction = 0;
+	    char *line = pending;
+	    char *end;
+
+	    for (;;)
 		    {
-		      char *type = strtok (NULL, " \n");
-		      char *filename = strtok (NULL, " \n");
+		      end = strchr (line, '\n');
+		      if (end == NULL)
+			      {
+				// A partial line waits for the rest, unless
+				// the updater has gone away.
+				if (!eof || *line == '\0')
+				  break;
+				end = line + strlen (line);
+			      }
+		      *end = '\0';
 
-		      if (type != NULL && filename != NULL)
+		      char *command = strtok (line, " ");
+
+		      line = end < pending + pending_len ? end + 1 : end;
+		      if (command == NULL)
+			      {
+				continue;
+			      }
+		      else if (strcmp (command, "progress") == 0)
 			      {
-				if (firmware_type != NULL)
+				char *fraction_s = strtok (NULL, " ");
+				char *seconds_s = strtok (NULL, " ");
+
+				float fraction =
+				  fraction_s ? strtof (fraction_s, NULL) : 0;
+				int seconds =
+				  seconds_s ? strtol (seconds_s, NULL, 10) : 0;
+
+				// Keep ordering: earlier output belongs to the
+				// previous scope.
+				print_buffer_flush (&pb);
+				if (set_progress)
 					{
-					  LOGE
-					    ("ignoring attempt to do multiple firmware updates");
+					  ui_set_progress (set_fraction);
+					  phases[phase].progress_applied++;
+					  set_progress = 0;
 					}
-				else
+				if (phase < CMD_MAX_PHASES - 1)
 					{
-					  firmware_type = strdup (type);
-					  firmware_filename =
-					    strdup (filename);
+					  phase++;
+					  phases[phase].start = now_seconds ();
 					}
+				ui_show_progress (fraction *
+						  (1 -
+						   VERIFICATION_PROGRESS_FRACTION),
+						  seconds);
 			      }
-		    }
-	    else if (strcmp (command, "ui_print") == 0)
-		    {
-		      char *str = strtok (NULL, "\n");
+		      else if (strcmp (command, "set_progress") == 0)
+			      {
+				char *fraction_s = strtok (NULL, " ");
+
+				if (fraction_s != NULL)
+					{
+					  set_fraction = strtof (fraction_s, NULL);
+					  set_progress = 1;
+					}
+				phases[phase].progress_updates++;
+			      }
+		      else if (strcmp (command, "firmware") == 0)
+			      {
+				char *type = strtok (NULL, " ");
+				char *filename = strtok (NULL, " ");
 
-		      if (str)
+				if (type != NULL && filename != NULL)
+					{
+					  if (firmware_type != NULL)
+						  {
+						    LOGE
+						      ("ignoring attempt to do multiple firmware updates");
+						  }
+					  else
+						  {
+						    firmware_type = strdup (type);
+						    firmware_filename =
+						      strdup (filename);
+						  }
+					}
+			      }
+		      else if (strcmp (command, "ui_print") == 0)
 			      {
-				ui_print ("%s", str);
+				char *str = strtok (NULL, "");
+
+				print_buffer_append (&pb, str ? str : "\n");
+				phases[phase].prints++;
 			      }
 		      else
 			      {
-				ui_print ("\n");
+				LOGE ("unknown command [%s]\n", command);
 			      }
 		    }
-	    else
+
+	    print_buffer_flush (&pb);
+	    if (set_progress)
 		    {
-		      LOGE ("unknown command [%s]\n", command);
+		      ui_set_progress (set_fraction);
+		      phases[phase].progress_applied++;
 		    }
+
+	    // Keep the unparsed remainder for the next round.
+	    pending_len -= line - pending;
+	    memmove (pending, line, pending_len);
+	  }
+  pthread_join (reader, NULL);
+  close (pipefd[0]);
+  pthread_mutex_destroy (&ch.lock);
+  pthread_cond_destroy (&ch.cond);
+  free (ch.data);
+  free (pending);
+  free (pb.str);
+
+  double finished = now_seconds ();
+  int i;
+
+  for (i = 0; i <= phase; ++i)
+	  {
+	    double until = i < phase ? phases[i + 1].start : finished;
+
+	    LOGI ("updater phase %d: %.2fs, %lu bytes, %d ui_print, "
+		  "%d/%d set_progress applied, max latency %.1fms\n", i,
+		  until - phases[i].start, (unsigned long) phases[i].bytes,
+		  phases[i].prints, phases[i].progress_applied,
+		  phases[i].progress_updates, phases[i].max_latency * 1000);
 	  }
-  fclose (from_child);
 
   int status;
 
@@ -17,3 +17,15 @@ LOCAL_C_INCLUDES +=\
 
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mkrespack.c
+LOCAL_MODULE := mkrespack
+LOCAL_C_INCLUDES += \
+    external/libpng \
+    external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_LDLIBS += -lm
+
+include $(BUILD_HOST_EXECUTABLE)
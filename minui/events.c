@@ -16,10 +16,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <linux/input.h>
 
@@ -29,6 +33,12 @@
 
 #define MAX_DEVICES 16
 
+// epoll cookie for the key-repeat timer; device cookies are 0..MAX_DEVICES-1
+#define EV_TIMER_ID MAX_DEVICES
+
+// Number of input_events pulled from a device per read()
+#define EV_BATCH 64
+
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS	50
 
@@ -37,23 +47,14 @@
 #define ABS_MT_TOUCH_MAJOR 0x30
 #define SYN_MT_REPORT 2
 
-int keyhold_delay;
+#define DEFAULT_KEYHOLD_DELAY 185
 
 // The amount of time in ms to delay before duplicating a held down key.
-void get_keyhold_delay()
+static int keyhold_delay = DEFAULT_KEYHOLD_DELAY;
+
+void ev_set_keyhold_delay(int ms)
 {
-  if (access("/tmp/.rzrpref_scroll",F_OK) != -1)
-  {
-    FILE *fp = fopen("/tmp/.rzrpref_scroll" ,"r");
-    char* delay = calloc(5, sizeof(char));
-
-    fgets(delay, 5, fp);
-    keyhold_delay = atoi(delay);
-  }
-  else
-  {
-    keyhold_delay = 185;
-  }
+    keyhold_delay = ms > 0 ? ms : DEFAULT_KEYHOLD_DELAY;
 }
 
 enum {
@@ -75,7 +76,7 @@ struct position {
 };
 
 struct ev {
-    struct pollfd *fd;
+    int fd;
 
     struct virtualkey *vks;
     int vk_count;
@@ -84,9 +85,14 @@ struct ev {
     int down;
 };
 
-static struct pollfd ev_fds[MAX_DEVICES];
 static struct ev evs[MAX_DEVICES];
 static unsigned ev_count = 0;
+static int ev_epollfd = -1;
+static int ev_timerfd = -1;
+
+// Events left over from the last batched read(), all from device ev_pending_dev
+static struct input_event ev_pending[EV_BATCH];
+static unsigned ev_pending_len = 0, ev_pending_pos = 0, ev_pending_dev = 0;
 
 static inline int ABS(int x) {
     return x<0?-x:x;
@@ -135,7 +141,7 @@ static int vk_init(struct ev *e)
     e->vk_count = 0;
 
     len = strlen(vk_path);
-    len = ioctl(e->fd->fd, EVIOCGNAME(sizeof(vk_path) - len), vk_path + len);
+    len = ioctl(e->fd, EVIOCGNAME(sizeof(vk_path) - len), vk_path + len);
     if (len <= 0)
         return -1;
 
@@ -167,12 +173,12 @@ static int vk_init(struct ev *e)
 
     e->down = DOWN_NOT;
 
-    ioctl(e->fd->fd, EVIOCGABS(ABS_X), &e->p.xi);
-    ioctl(e->fd->fd, EVIOCGABS(ABS_Y), &e->p.yi);
+    ioctl(e->fd, EVIOCGABS(ABS_X), &e->p.xi);
+    ioctl(e->fd, EVIOCGABS(ABS_Y), &e->p.yi);
     e->p.synced = 0;
 
-    ioctl(e->fd->fd, EVIOCGABS(ABS_MT_POSITION_X), &e->mt_p.xi);
-    ioctl(e->fd->fd, EVIOCGABS(ABS_MT_POSITION_Y), &e->mt_p.yi);
+    ioctl(e->fd, EVIOCGABS(ABS_MT_POSITION_X), &e->mt_p.xi);
+    ioctl(e->fd, EVIOCGABS(ABS_MT_POSITION_Y), &e->mt_p.yi);
     e->mt_p.synced = 0;
 
     e->vks = malloc(sizeof(*e->vks) * e->vk_count);
@@ -205,19 +211,28 @@ int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
+    struct epoll_event epev;
     int fd;
 
+    ev_epollfd = epoll_create(MAX_DEVICES + 1);
+    if (ev_epollfd < 0)
+        return -1;
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
 //            fprintf(stderr,"/dev/input/%s\n", de->d_name);
             if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
+            fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_NONBLOCK);
             if(fd < 0) continue;
 
-            ev_fds[ev_count].fd = fd;
-            ev_fds[ev_count].events = POLLIN;
-            evs[ev_count].fd = &ev_fds[ev_count];
+            epev.events = EPOLLIN;
+            epev.data.u32 = ev_count;
+            if (epoll_ctl(ev_epollfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+                close(fd);
+                continue;
+            }
+            evs[ev_count].fd = fd;
 
             /* Load virtualkeys if there are any */
             vk_init(&evs[ev_count]);
@@ -225,8 +240,21 @@ int ev_init(void)
             ev_count++;
             if(ev_count == MAX_DEVICES) break;
         }
+        closedir(dir);
     }
 
+    ev_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (ev_timerfd >= 0) {
+        epev.events = EPOLLIN;
+        epev.data.u32 = EV_TIMER_ID;
+        if (epoll_ctl(ev_epollfd, EPOLL_CTL_ADD, ev_timerfd, &epev) < 0) {
+            close(ev_timerfd);
+            ev_timerfd = -1;
+        }
+    }
+    if (ev_timerfd < 0)
+        LOGW("minui: no key-repeat timer available\n");
+
     return 0;
 }
 
@@ -237,8 +265,34 @@ void ev_exit(void)
 		free(evs[ev_count].vks);
 		evs[ev_count].vk_count = 0;
 	}
-        close(ev_fds[ev_count].fd);
+        close(evs[ev_count].fd);
+    }
+    if (ev_timerfd >= 0) {
+        close(ev_timerfd);
+        ev_timerfd = -1;
+    }
+    if (ev_epollfd >= 0) {
+        close(ev_epollfd);
+        ev_epollfd = -1;
     }
+    ev_pending_len = ev_pending_pos = 0;
+}
+
+void ev_repeat(unsigned enable)
+{
+    struct itimerspec its;
+
+    if (ev_timerfd < 0)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    if (enable) {
+        its.it_value.tv_sec = keyhold_delay / 1000;
+        its.it_value.tv_nsec = (keyhold_delay % 1000) * 1000000L;
+        its.it_interval = its.it_value;
+    }
+    // (Re)arming or disarming also discards any expirations not yet read.
+    timerfd_settime(ev_timerfd, 0, &its, NULL);
 }
 
 static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
@@ -383,35 +437,52 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 1;
 }
 
-int ev_get(struct input_event *ev, unsigned dont_wait, unsigned keyheld)
+int ev_get(struct input_event *ev, unsigned dont_wait)
 {
-    int r;
-    unsigned n;
-
-    do {
-        // When keyheld is true, that means the previous event
-        // was an up/down keypress so wait keyhold_delay.
-	
-	//int keyhold_delay = 185;
-	get_keyhold_delay();
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : keyheld ? keyhold_delay : -1);
-
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) {
-                        if (!vk_modify(&evs[n], ev))
-                            return 0;
-                    }
-                }
+    struct epoll_event events[MAX_DEVICES + 1];
+    uint64_t expirations;
+    int r, i, repeat;
+    ssize_t len;
+
+    for (;;) {
+        while (ev_pending_pos < ev_pending_len) {
+            *ev = ev_pending[ev_pending_pos++];
+            if (!vk_modify(&evs[ev_pending_dev], ev))
+                return 0;
+        }
+
+        r = epoll_wait(ev_epollfd, events, ev_count + 1, dont_wait ? 0 : -1);
+        if (r <= 0) {
+            if (dont_wait)
+                return -1;
+            continue;
+        }
+
+        // Devices are level-triggered: if one batch is already pending,
+        // any other ready device is simply reported again next time.
+        repeat = 0;
+        for (i = 0; i < r; i++) {
+            unsigned n = events[i].data.u32;
+
+            if (n == EV_TIMER_ID) {
+                if (read(ev_timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    repeat = 1;
+                continue;
+            }
+            if (ev_pending_pos < ev_pending_len)
+                continue;
+
+            len = read(evs[n].fd, ev_pending, sizeof(ev_pending));
+            if (len >= (ssize_t) sizeof(*ev)) {
+                ev_pending_len = len / sizeof(*ev);
+                ev_pending_pos = 0;
+                ev_pending_dev = n;
             }
-        } else if (r == 0 && keyheld) {
-            // If a timeout occurred when keyheld was set, let the
-            // caller know so it can generate a repeated event.
-            return 1;
         }
-    } while(dont_wait == 0);
 
-    return -1;
+        // A real event (possibly the key release) takes priority over a
+        // repeat that fired in the same wakeup.
+        if (repeat && ev_pending_pos >= ev_pending_len)
+            return 1;
+    }
 }
@@ -45,7 +45,13 @@ struct input_event;
 
 int ev_init (void);
 void ev_exit (void);
-int ev_get (struct input_event *ev, unsigned dont_wait, unsigned keyheld);
+// Returns 0 with *ev filled in, 1 when the key-repeat timer fired, or -1
+// if dont_wait is set and nothing is pending.
+int ev_get (struct input_event *ev, unsigned dont_wait);
+// Arm (or disarm) the key-repeat timer, using the configured keyhold delay.
+void ev_repeat (unsigned enable);
+// Set the keyhold delay in ms; 0 or less restores the default.
+void ev_set_keyhold_delay (int ms);
 
 // Resources
 
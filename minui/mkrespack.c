@@ -0,0 +1,237 @@
+// mkrespack [-a] <out.pack> <image.png>...
+//
+// Decodes the recovery's images into the pack described in respack.h.
+// Images with no translucent pixels are stored as RGB_565, the
+// framebuffer's own format; the rest as RGBA_8888.  -a stores every
+// image as RGBA_8888 instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <pixelflinger/format.h>
+#include <png.h>
+
+#include "respack.h"
+
+typedef struct
+{
+  RespackEntry entry;
+  unsigned char *pixels;
+} Image;
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+// Decodes 'path' to RGBA rows, the same way res_create_surface() does.
+static unsigned char *
+read_png (const char *path, unsigned *width, unsigned *height)
+{
+  png_structp png_ptr = NULL;
+  png_infop info_ptr = NULL;
+  unsigned char *rgba = NULL;
+  unsigned char *row = NULL;
+  FILE *fp = fopen (path, "rb");
+  unsigned x, y;
+
+  if (fp == NULL)
+    return NULL;
+  png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png_ptr == NULL || (info_ptr = png_create_info_struct (png_ptr)) == NULL)
+    goto fail;
+  if (setjmp (png_jmpbuf (png_ptr)))
+    goto fail;
+
+  png_init_io (png_ptr, fp);
+  png_read_info (png_ptr, info_ptr);
+  png_set_expand (png_ptr);	// palette and tRNS to RGB(A)
+  png_set_strip_16 (png_ptr);
+  png_set_gray_to_rgb (png_ptr);
+  png_read_update_info (png_ptr, info_ptr);
+
+  int channels = png_get_channels (png_ptr, info_ptr);
+
+  *width = png_get_image_width (png_ptr, info_ptr);
+  *height = png_get_image_height (png_ptr, info_ptr);
+  if (channels != 3 && channels != 4)
+    goto fail;
+  rgba = malloc ((size_t) * width * *height * 4);
+  row = malloc ((size_t) * width * channels);
+  if (rgba == NULL || row == NULL)
+    goto fail;
+
+  for (y = 0; y < *height; ++y)
+	  {
+	    unsigned char *out = rgba + (size_t) y * *width * 4;
+
+	    png_read_row (png_ptr, row, NULL);
+	    for (x = 0; x < *width; ++x)
+		    {
+		      out[x * 4] = row[x * channels];
+		      out[x * 4 + 1] = row[x * channels + 1];
+		      out[x * 4 + 2] = row[x * channels + 2];
+		      out[x * 4 + 3] = channels == 4 ? row[x * channels + 3] : 0xff;
+		    }
+	  }
+  free (row);
+  png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+  fclose (fp);
+  return rgba;
+
+fail:
+  free (row);
+  free (rgba);
+  png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+  fclose (fp);
+  return NULL;
+}
+
+static int
+load_image (const char *path, int keep_rgba, Image * image)
+{
+  struct stat st;
+  unsigned width, height;
+  const char *base = strrchr (path, '/') ? strrchr (path, '/') + 1 : path;
+  size_t name_len = strlen (base);
+  size_t i, pixels;
+
+  if (name_len > 4 && strcmp (base + name_len - 4, ".png") == 0)
+    name_len -= 4;
+  if (name_len >= RESPACK_NAME_LEN)
+	  {
+	    fprintf (stderr, "mkrespack: name too long: %s\n", path);
+	    return -1;
+	  }
+  unsigned char *rgba = read_png (path, &width, &height);
+
+  if (rgba == NULL || stat (path, &st) < 0)
+	  {
+	    fprintf (stderr, "mkrespack: can't decode %s\n", path);
+	    free (rgba);
+	    return -1;
+	  }
+
+  memset (image, 0, sizeof (*image));
+  memcpy (image->entry.name, base, name_len);
+  image->entry.width = width;
+  image->entry.height = height;
+  image->entry.stride = width;
+  image->entry.png_size = st.st_size;
+  pixels = (size_t) width * height;
+
+  int opaque = !keep_rgba;
+
+  for (i = 0; opaque && i < pixels; ++i)
+    opaque = rgba[i * 4 + 3] == 0xff;
+  if (!opaque)
+	  {
+	    image->entry.format = GGL_PIXEL_FORMAT_RGBA_8888;
+	    image->entry.size = pixels * 4;
+	    image->pixels = rgba;
+	    return 0;
+	  }
+
+  image->entry.format = GGL_PIXEL_FORMAT_RGB_565;
+  image->entry.size = pixels * 2;
+  image->pixels = malloc (pixels * 2);
+  if (image->pixels == NULL)
+	  {
+	    free (rgba);
+	    return -1;
+	  }
+  for (i = 0; i < pixels; ++i)
+	  {
+	    unsigned char *p = rgba + i * 4;
+	    unsigned v = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) | (p[2] >> 3);
+
+	    image->pixels[i * 2] = v;
+	    image->pixels[i * 2 + 1] = v >> 8;
+	  }
+  free (rgba);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned char zeros[RESPACK_ALIGN];
+  int keep_rgba = 0;
+  int first = 1;
+  int count, i;
+
+  if (argc > 1 && strcmp (argv[1], "-a") == 0)
+	  {
+	    keep_rgba = 1;
+	    first = 2;
+	  }
+  if (argc - first < 2)
+	  {
+	    fprintf (stderr, "usage: mkrespack [-a] <out.pack> <image.png>...\n");
+	    return 1;
+	  }
+  count = argc - first - 1;
+
+  Image *images = calloc (count, sizeof (Image));
+  uint32_t offset = sizeof (RespackHeader) + count * sizeof (RespackEntry);
+
+  if (images == NULL)
+    return 1;
+  for (i = 0; i < count; ++i)
+	  {
+	    if (load_image (argv[first + 1 + i], keep_rgba, &images[i]) < 0)
+	      return 1;
+	    offset = (offset + RESPACK_ALIGN - 1) & ~(RESPACK_ALIGN - 1);
+	    images[i].entry.offset = offset;
+	    offset += images[i].entry.size;
+	  }
+
+  FILE *out = fopen (argv[first], "wb");
+  unsigned char buf[sizeof (RespackEntry)];
+  long pos;
+
+  if (out == NULL)
+	  {
+	    perror (argv[first]);
+	    return 1;
+	  }
+  memset (buf, 0, sizeof (buf));
+  memcpy (buf, RESPACK_MAGIC, 8);
+  put32 (buf + 8, count);
+  fwrite (buf, sizeof (RespackHeader), 1, out);
+  for (i = 0; i < count; ++i)
+	  {
+	    RespackEntry *e = &images[i].entry;
+
+	    memset (buf, 0, sizeof (buf));
+	    memcpy (buf, e->name, RESPACK_NAME_LEN);
+	    put32 (buf + 32, e->width);
+	    put32 (buf + 36, e->height);
+	    put32 (buf + 40, e->stride);
+	    put32 (buf + 44, e->format);
+	    put32 (buf + 48, e->offset);
+	    put32 (buf + 52, e->size);
+	    put32 (buf + 56, e->png_size);
+	    fwrite (buf, sizeof (RespackEntry), 1, out);
+	  }
+  for (i = 0; i < count; ++i)
+	  {
+	    pos = ftell (out);
+	    fwrite (zeros, images[i].entry.offset - pos, 1, out);
+	    fwrite (images[i].pixels, images[i].entry.size, 1, out);
+	    free (images[i].pixels);
+	  }
+  free (images);
+  if (fclose (out) != 0)
+	  {
+	    perror (argv[first]);
+	    return 1;
+	  }
+  return 0;
+}
@@ -19,9 +19,11 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,15 +34,93 @@
 #include <png.h>
 
 #include "minui.h"
+#include "respack.h"
 
-// libpng gives "undefined reference to 'pow'" errors, and I have no
-// idea how to convince the build system to link with -lm.  We don't
-// need this functionality (it's used for gamma adjustment) so provide
-// a dummy implementation to satisfy the linker.
-double
-pow (double x, double y)
+// The pack is mapped once, read-only, for the life of the process;
+// surfaces made from it point into the mapping rather than copying.
+static const unsigned char *pack_data;
+static size_t pack_size;
+static int pack_tried;
+
+static void
+map_pack (void)
+{
+  struct stat st;
+  const RespackHeader *header;
+  int fd;
+
+  pack_tried = 1;
+  fd = open (RESPACK_PATH, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat (fd, &st) == 0 && st.st_size >= (off_t) sizeof (RespackHeader))
+	  {
+	    void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	    if (map != MAP_FAILED)
+		    {
+		      pack_data = map;
+		      pack_size = st.st_size;
+		    }
+	  }
+  close (fd);
+  if (pack_data == NULL)
+    return;
+
+  header = (const RespackHeader *) pack_data;
+  if (memcmp (header->magic, RESPACK_MAGIC, sizeof (header->magic)) != 0 ||
+      header->count > (pack_size - sizeof (RespackHeader)) /
+      sizeof (RespackEntry))
+	  {
+	    fprintf (stderr, "ignoring bad %s\n", RESPACK_PATH);
+	    munmap ((void *) pack_data, pack_size);
+	    pack_data = NULL;
+	  }
+}
+
+static int
+res_create_pack_surface (const char *name, gr_surface * pSurface)
 {
-  return x;
+  const RespackHeader *header;
+  const RespackEntry *entry;
+  char pngPath[256];
+  struct stat st;
+  unsigned i;
+
+  if (!pack_tried)
+    map_pack ();
+  if (pack_data == NULL)
+    return -1;
+
+  header = (const RespackHeader *) pack_data;
+  entry = (const RespackEntry *) (header + 1);
+  for (i = 0; i < header->count; ++i, ++entry)
+	  {
+	    if (strncmp (entry->name, name, RESPACK_NAME_LEN) == 0)
+	      break;
+	  }
+  if (i == header->count || entry->offset > pack_size ||
+      entry->size > pack_size - entry->offset)
+    return -1;
+
+  // A device can drop its own PNGs over ours after the pack is built;
+  // those win.
+  snprintf (pngPath, sizeof (pngPath), "/res/images/%s.png", name);
+  if (stat (pngPath, &st) == 0 && st.st_size != entry->png_size)
+    return -1;
+
+  GGLSurface *surface = malloc (sizeof (GGLSurface));
+
+  if (surface == NULL)
+    return -1;
+  surface->version = sizeof (GGLSurface);
+  surface->width = entry->width;
+  surface->height = entry->height;
+  surface->stride = entry->stride;
+  surface->data = (GGLubyte *) (pack_data + entry->offset);
+  surface->format = entry->format;
+  *pSurface = (gr_surface) surface;
+  return 0;
 }
 
 int
@@ -53,6 +133,9 @@ res_create_surface (const char *name, gr_surface * pSurface)
   png_structp png_ptr = NULL;
   png_infop info_ptr = NULL;
 
+  if (res_create_pack_surface (name, pSurface) == 0)
+    return 0;
+
   snprintf (resPath, sizeof (resPath) - 1, "/res/images/%s.png", name);
   resPath[sizeof (resPath) - 1] = '\0';
   FILE *fp = fopen (resPath, "rb");
@@ -0,0 +1,42 @@
+#ifndef _MINUI_RESPACK_H_
+#define _MINUI_RESPACK_H_
+
+#include <stdint.h>
+
+// /res/images.pack holds every image under res/images already decoded
+// into the pixel format gr_blit() textures from, so res_create_surface()
+// can point a surface straight at the mapped file instead of running
+// libpng.  mkrespack writes it at build time.
+//
+//   RespackHeader
+//   RespackEntry[count]
+//   pixel data, each image RESPACK_ALIGN-aligned
+//
+// All fields are little-endian, like the devices that read it.
+
+#define RESPACK_PATH "/res/images.pack"
+#define RESPACK_MAGIC "RZRPACK1"
+#define RESPACK_NAME_LEN 32
+#define RESPACK_ALIGN 16
+
+typedef struct
+{
+  char magic[8];
+  uint32_t count;
+  uint32_t reserved;
+} RespackHeader;
+
+typedef struct
+{
+  char name[RESPACK_NAME_LEN];	// eg. "icon_rz", without ".png"
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;		// in pixels, like GGLSurface
+  uint32_t format;		// GGL_PIXEL_FORMAT_*
+  uint32_t offset;		// of the pixels, from the start of the file
+  uint32_t size;		// of the pixels, in bytes
+  uint32_t png_size;		// of the .png it came from
+  uint32_t reserved;
+} RespackEntry;
+
+#endif
@@ -6,7 +6,8 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
-	Zip.c
+	Zip.c \
+	ZipIndex.c
 
 LOCAL_C_INCLUDES += \
 	external/zlib \
@@ -22,9 +22,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
+#include "Hash.h"
 
 typedef enum
 { DMISSING, DDIR, DILLEGAL } DirStatus;
@@ -192,145 +195,855 @@ dirCreateHierarchy (const char *path, int mode,
   return 0;
 }
 
-int
-dirUnlinkHierarchy (const char *path)
+/* Deletion engine behind dirUnlinkTree().
+ *
+ * The tree is first expanded breadth-first from the root until there
+ * are enough subdirectories to keep the workers busy; files met on the
+ * way are unlinked at once.  Workers then remove the leaf subtrees
+ * relative to directory fds, using d_type to avoid a stat per entry.
+ * Expanded directories are removed last, deepest first, unless
+ * something below them was excluded.
+ */
+
+static char *normalizePath (const char *path);
+
+#define DIR_UNLINK_THREADS 4
+#define DIR_UNLINK_EXPAND_DEPTH 3
+#define DIR_UNLINK_MIN_WORK (DIR_UNLINK_THREADS * 4)
+
+typedef struct
+{
+  char *path;
+  int parent;			/* index of the parent work item, or -1 */
+  volatile int kept;		/* something below was excluded */
+} UnlinkWork;
+
+typedef struct
+{
+  const char *const *exclude;
+  UnlinkWork *work;
+  int workCount;
+  int leafStart;		/* work[leafStart..] go to the workers */
+  int nextWork;
+  int doneWork;
+  pthread_mutex_t lock;
+  DirUnlinkProgress progress;
+  void *cookie;
+  volatile int error;		/* errno of the first failure */
+} UnlinkWalk;
+
+static bool
+isExcluded (UnlinkWalk * w, const char *path)
+{
+  const char *const *e;
+
+  if (w->exclude == NULL)
+    return false;
+  for (e = w->exclude; *e != NULL; ++e)
+	  {
+	    if (strcmp (*e, path) == 0)
+	      return true;
+	  }
+  return false;
+}
+
+static void
+unlinkFailed (UnlinkWalk * w, const char *path)
+{
+  int err = errno ? errno : EIO;	/* before stdio can change it */
+
+  fprintf (stderr, "can't remove %s: %s\n", path, strerror (err));
+  if (w->error == 0)
+    w->error = err;
+}
+
+static bool
+entryIsDir (int dirFd, const struct dirent *de)
 {
   struct stat st;
-  DIR *dir;
+
+  if (de->d_type != DT_UNKNOWN)
+    return de->d_type == DT_DIR;
+  if (fstatat (dirFd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return false;
+  return S_ISDIR (st.st_mode);
+}
+
+/* Remove the directory 'name' in dirFd and everything below it; path
+ * is a PATH_MAX buffer holding its full name.  Returns true if an
+ * excluded entry was kept (so the directory itself stays too).
+ */
+static bool
+unlinkSubtree (UnlinkWalk * w, int dirFd, const char *name, char *path)
+{
+  int fd = openat (dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  DIR *dir = fd < 0 ? NULL : fdopendir (fd);
   struct dirent *de;
-  int fail = 0;
+  size_t pathLen = strlen (path);
+  bool kept = false;
 
-  /* is it a file or directory? */
-  if (lstat (path, &st) < 0)
+  if (dir == NULL)
 	  {
-	    return -1;
+	    unlinkFailed (w, path);
+	    if (fd >= 0)
+	      close (fd);
+	    return true;
+	  }
+  while ((de = readdir (dir)) != NULL)
+	  {
+	    if (!strcmp (de->d_name, "..") || !strcmp (de->d_name, "."))
+	      continue;
+	    if (pathLen + 1 + strlen (de->d_name) >= PATH_MAX)
+		    {
+		      errno = ENAMETOOLONG;
+		      unlinkFailed (w, path);
+		      kept = true;
+		      continue;
+		    }
+	    path[pathLen] = '/';
+	    strcpy (path + pathLen + 1, de->d_name);
+
+	    if (isExcluded (w, path))
+		    {
+		      kept = true;
+		      continue;
+		    }
+	    if (entryIsDir (fd, de))
+		    {
+		      if (unlinkSubtree (w, fd, de->d_name, path))
+			kept = true;
+		    }
+	    else if (unlinkat (fd, de->d_name, 0) < 0)
+		    {
+		      unlinkFailed (w, path);
+		      kept = true;
+		    }
 	  }
+  path[pathLen] = '\0';
+  closedir (dir);
 
-  /* a file, so unlink it */
-  if (!S_ISDIR (st.st_mode))
+  if (kept)
+    return true;
+  if (unlinkat (dirFd, name, AT_REMOVEDIR) < 0)
 	  {
-	    return unlink (path);
+	    unlinkFailed (w, path);
+	    return true;
 	  }
+  return false;
+}
 
-  /* a directory, so open handle */
-  dir = opendir (path);
-  if (dir == NULL)
+static void
+addUnlinkWork (UnlinkWalk * w, const char *path, int parent)
+{
+  UnlinkWork *work =
+    realloc (w->work, (w->workCount + 1) * sizeof (UnlinkWork));
+
+  if (work == NULL || (work[w->workCount].path = strdup (path)) == NULL)
 	  {
-	    return -1;
+	    if (work != NULL)
+	      w->work = work;
+	    errno = ENOMEM;
+	    unlinkFailed (w, path);
+	    if (parent >= 0)
+	      w->work[parent].kept = 1;
+	    return;
 	  }
+  work[w->workCount].parent = parent;
+  work[w->workCount].kept = 0;
+  w->work = work;
+  w->workCount++;
+}
+
+/* Queue the subdirectories of work[i] and unlink everything else in
+ * it.
+ */
+static void
+expandUnlinkWork (UnlinkWalk * w, int i)
+{
+  char path[PATH_MAX];
+  int fd = open (w->work[i].path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  DIR *dir = fd < 0 ? NULL : fdopendir (fd);
+  struct dirent *de;
 
-  /* recurse over components */
-  errno = 0;
+  if (dir == NULL)
+	  {
+	    unlinkFailed (w, w->work[i].path);
+	    if (fd >= 0)
+	      close (fd);
+	    w->work[i].kept = 1;
+	    return;
+	  }
   while ((de = readdir (dir)) != NULL)
 	  {
-//TODO: don't blow the stack
-	    char dn[PATH_MAX];
-
 	    if (!strcmp (de->d_name, "..") || !strcmp (de->d_name, "."))
+	      continue;
+	    if (snprintf (path, sizeof (path), "%s/%s",
+			  strcmp (w->work[i].path, "/") ? w->work[i].path : "",
+			  de->d_name) >= (int) sizeof (path))
 		    {
+		      errno = ENAMETOOLONG;
+		      unlinkFailed (w, w->work[i].path);
+		      w->work[i].kept = 1;
 		      continue;
 		    }
-	    snprintf (dn, sizeof (dn), "%s/%s", path, de->d_name);
-	    if (dirUnlinkHierarchy (dn) < 0)
+	    if (isExcluded (w, path))
 		    {
-		      fail = 1;
-		      break;
+		      w->work[i].kept = 1;
+		      continue;
+		    }
+	    if (entryIsDir (fd, de))
+	      addUnlinkWork (w, path, i);
+	    else if (unlinkat (fd, de->d_name, 0) < 0)
+		    {
+		      unlinkFailed (w, path);
+		      w->work[i].kept = 1;
 		    }
-	    errno = 0;
 	  }
-  /* in case readdir or unlink_recursive failed */
-  if (fail || errno < 0)
-	  {
-	    int save = errno;
+  closedir (dir);
+}
 
-	    closedir (dir);
-	    errno = save;
-	    return -1;
-	  }
+static void *
+unlinkWorker (void *cookie)
+{
+  UnlinkWalk *w = (UnlinkWalk *) cookie;
+  char path[PATH_MAX];
 
-  /* close directory handle */
-  if (closedir (dir) < 0)
+  for (;;)
 	  {
-	    return -1;
-	  }
+	    pthread_mutex_lock (&w->lock);
+	    int i = w->nextWork++;
 
-  /* delete target directory */
-  return rmdir (path);
+	    pthread_mutex_unlock (&w->lock);
+	    if (i >= w->workCount)
+	      break;
+
+	    strcpy (path, w->work[i].path);
+	    if (unlinkSubtree (w, AT_FDCWD, w->work[i].path, path))
+	      w->work[i].kept = 1;
+
+	    if (w->progress != NULL)
+		    {
+		      pthread_mutex_lock (&w->lock);
+		      w->progress (++w->doneWork, w->workCount - w->leafStart,
+				   w->cookie);
+		      pthread_mutex_unlock (&w->lock);
+		    }
+	  }
+  return NULL;
 }
 
 int
-dirSetHierarchyPermissions (const char *path,
-			    int uid, int gid, int dirMode, int fileMode)
+dirUnlinkTree (const char *path, const char *const *exclude, bool keepRoot,
+	       DirUnlinkProgress progress, void *cookie)
 {
+  UnlinkWalk w;
   struct stat st;
+  int i, depth;
+
+  if (lstat (path, &st) < 0)
+    return -1;
+  if (!S_ISDIR (st.st_mode))
+    return keepRoot ? 0 : unlink (path);
+
+  char *root = normalizePath (path);
+
+  if (root == NULL)
+    return -1;
+  memset (&w, 0, sizeof (w));
+  w.exclude = exclude;
+  w.progress = progress;
+  w.cookie = cookie;
+  pthread_mutex_init (&w.lock, NULL);
 
-  if (lstat (path, &st))
+  addUnlinkWork (&w, root, -1);
+  free (root);
+  w.leafStart = 0;
+  for (depth = 0; depth < DIR_UNLINK_EXPAND_DEPTH && w.error != ENOMEM &&
+       w.workCount - w.leafStart < DIR_UNLINK_MIN_WORK; ++depth)
 	  {
-	    return -1;
+	    int end = w.workCount;
+
+	    for (i = w.leafStart; i < end; ++i)
+	      expandUnlinkWork (&w, i);
+	    w.leafStart = end;
+	    if (w.leafStart == w.workCount)
+	      break;
 	  }
 
-  /* ignore symlinks */
-  if (S_ISLNK (st.st_mode))
+  if (w.leafStart < w.workCount)
 	  {
-	    return 0;
+	    pthread_t threads[DIR_UNLINK_THREADS];
+	    int n = w.workCount - w.leafStart < DIR_UNLINK_THREADS ?
+	      w.workCount - w.leafStart : DIR_UNLINK_THREADS;
+
+	    w.nextWork = w.leafStart;
+	    for (i = 1; i < n; ++i)
+		    {
+		      if (pthread_create (&threads[i], NULL, unlinkWorker, &w)
+			  != 0)
+			break;
+		    }
+	    n = i;
+	    unlinkWorker (&w);
+	    for (i = 1; i < n; ++i)
+	      pthread_join (threads[i], NULL);
 	  }
 
-  /* directories and files get different permissions */
-  if (chown (path, uid, gid) ||
-      chmod (path, S_ISDIR (st.st_mode) ? dirMode : fileMode))
+  /* Children always come after their parent, so walking backwards
+   * removes the expanded directories deepest first.
+   */
+  for (i = w.workCount - 1; i >= 0; --i)
 	  {
+	    UnlinkWork *work = &w.work[i];
+
+	    if (i < w.leafStart && !work->kept && !(i == 0 && keepRoot) &&
+		rmdir (work->path) < 0)
+		    {
+		      unlinkFailed (&w, work->path);
+		      work->kept = 1;
+		    }
+	    if (work->kept && work->parent >= 0)
+	      w.work[work->parent].kept = 1;
+	  }
+
+  for (i = 0; i < w.workCount; ++i)
+    free (w.work[i].path);
+  free (w.work);
+  pthread_mutex_destroy (&w.lock);
+  if (w.error != 0)
+	  {
+	    errno = w.error;
 	    return -1;
 	  }
+  return 0;
+}
+
+int
+dirUnlinkHierarchy (const char *path)
+{
+  return dirUnlinkTree (path, NULL, false, NULL, NULL);
+}
+
+/* Permission engine behind dirApplyPermissions().
+ *
+ * Every path named by a request gets a PathRules record (in a minzip
+ * HashTable) holding the index of the last recursive and the last
+ * single request for it.  Each tree is walked once, relative to
+ * directory fds; the request that applies to a node is the highest
+ * index among the recursive requests on its ancestor chain and any
+ * request for the node itself, which is exactly what running them in
+ * order would have left behind.
+ */
 
-  /* recurse over directory components */
-  if (S_ISDIR (st.st_mode))
+#define DIR_PERM_THREADS 4
+
+typedef struct
+{
+  char *path;
+  int recursive;		/* index of last recursive request, or -1 */
+  int single;			/* index of last single request, or -1 */
+  volatile int visited;		/* single request applied during a walk */
+} PathRules;
+
+typedef struct
+{
+  char *path;
+  int active;			/* recursive request covering this dir */
+} PermWork;
+
+typedef struct
+{
+  const DirPermission *perms;
+  HashTable *rules;
+  PermWork *work;
+  int workCount;
+  int nextWork;
+  pthread_mutex_t lock;
+  volatile int failed;
+} PermWalk;
+
+static unsigned int
+hashPath (const char *path)
+{
+  unsigned int hash = 0;
+
+  while (*path)
+    hash = hash * 31 + (unsigned char) *path++;
+  return hash;
+}
+
+static int
+hashcmpPathRules (const void *tableItem, const void *looseItem)
+{
+  return strcmp (((const PathRules *) tableItem)->path,
+		 (const char *) looseItem);
+}
+
+static PathRules *
+findPathRules (HashTable * rules, const char *path)
+{
+  return (PathRules *) mzHashTableLookup (rules, hashPath (path),
+					  (void *) path, hashcmpPathRules,
+					  false);
+}
+
+static void
+freePathRules (void *ptr)
+{
+  PathRules *r = (PathRules *) ptr;
+
+  free (r->path);
+  free (r);
+}
+
+/* Copy path without repeated or trailing slashes. */
+static char *
+normalizePath (const char *path)
+{
+  char *out = strdup (path);
+  char *o = out;
+  const char *p;
+
+  if (out == NULL)
+    return NULL;
+  for (p = path; *p; ++p)
 	  {
-	    DIR *dir = opendir (path);
+	    if (*p == '/' && o > out && o[-1] == '/')
+	      continue;
+	    *o++ = *p;
+	  }
+  if (o > out + 1 && o[-1] == '/')
+    --o;
+  *o = '\0';
+  return out;
+}
+
+static int
+maxIndex (int a, int b)
+{
+  return a > b ? a : b;
+}
 
-	    if (dir == NULL)
+/* Bring one node to uid/gid/mode, skipping whatever already matches.
+ * dirFd/name are used with the *at() calls; follow selects chown(2)
+ * vs lchown(2) semantics.
+ */
+static int
+applyPermission (int dirFd, const char *name, const char *path,
+		 const struct stat *st, int uid, int gid, int mode,
+		 bool follow)
+{
+  bool chowned = false;
+
+  mode &= 07777;
+  if (st->st_uid != (uid_t) uid || st->st_gid != (gid_t) gid)
+	  {
+	    if (fchownat (dirFd, name, uid, gid,
+			  follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
 		    {
+		      fprintf (stderr, "chown of %s to %d %d failed: %s\n",
+			       path, uid, gid, strerror (errno));
 		      return -1;
 		    }
+	    chowned = true;
+	  }
+  /* chown clears the set-id bits, so those have to be put back */
+  if ((int) (st->st_mode & 07777) != mode ||
+      (chowned && (mode & (S_ISUID | S_ISGID))))
+	  {
+	    if (fchmodat (dirFd, name, mode, 0) < 0)
+		    {
+		      fprintf (stderr, "chmod of %s to %o failed: %s\n",
+			       path, mode, strerror (errno));
+		      return -1;
+		    }
+	  }
+  return 0;
+}
+
+/* Settings for a node reached by a walk; returns the recursive request
+ * that covers its children.
+ */
+static int
+applyWalkedNode (PermWalk * w, int dirFd, const char *name,
+		 const char *path, const struct stat *st, int active)
+{
+  PathRules *r = findPathRules (w->rules, path);
+  int childActive = active;
+  int idx;
+
+  if (r != NULL)
+    childActive = maxIndex (active, r->recursive);
+  idx = childActive;
+  if (r != NULL && r->single >= 0)
+	  {
+	    idx = maxIndex (idx, r->single);
+	    r->visited = 1;
+	  }
+  if (idx < 0)
+    return childActive;
+
+  const DirPermission *p = &w->perms[idx];
+  int mode = p->fileMode < 0 || S_ISDIR (st->st_mode) ?
+    p->dirMode : p->fileMode;
+
+  if (applyPermission (dirFd, name, path, st, p->uid, p->gid, mode, false))
+    w->failed = 1;
+  return childActive;
+}
+
+/* Walk the directory open as dirFd (which is consumed); path is a
+ * PATH_MAX buffer holding its name.
+ */
+static void
+walkPermissions (PermWalk * w, int dirFd, char *path, int active)
+{
+  DIR *dir = fdopendir (dirFd);
+  struct dirent *de;
+  size_t pathLen = strlen (path);
 
-	    errno = 0;
-	    const struct dirent *de;
+  if (dir == NULL)
+	  {
+	    fprintf (stderr, "can't open %s: %s\n", path, strerror (errno));
+	    close (dirFd);
+	    w->failed = 1;
+	    return;
+	  }
+  while ((de = readdir (dir)) != NULL)
+	  {
+	    struct stat st;
+
+	    if (!strcmp (de->d_name, "..") || !strcmp (de->d_name, "."))
+	      continue;
+	    if (pathLen + 1 + strlen (de->d_name) >= PATH_MAX)
+		    {
+		      w->failed = 1;
+		      continue;
+		    }
+	    path[pathLen] = '/';
+	    strcpy (path + pathLen + 1, de->d_name);
 
-	    while (errno == 0 && (de = readdir (dir)) != NULL)
+	    if (fstatat (dirfd (dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
 		    {
-		      if (!strcmp (de->d_name, "..")
-			  || !strcmp (de->d_name, "."))
+		      w->failed = 1;
+		      continue;
+		    }
+	    /* symlinks are skipped, as before */
+	    if (S_ISLNK (st.st_mode))
+	      continue;
+
+	    int childActive =
+	      applyWalkedNode (w, dirfd (dir), de->d_name, path, &st, active);
+
+	    if (S_ISDIR (st.st_mode))
+		    {
+		      int fd = openat (dirfd (dir), de->d_name,
+				       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+		      if (fd < 0)
 			      {
+				w->failed = 1;
 				continue;
 			      }
+		      walkPermissions (w, fd, path, childActive);
+		    }
+	  }
+  path[pathLen] = '\0';
+  closedir (dir);
+}
 
-		      char dn[PATH_MAX];
+static void *
+permissionWorker (void *cookie)
+{
+  PermWalk *w = (PermWalk *) cookie;
+  char path[PATH_MAX];
 
-		      snprintf (dn, sizeof (dn), "%s/%s", path, de->d_name);
-		      if (!dirSetHierarchyPermissions
-			  (dn, uid, gid, dirMode, fileMode))
-			      {
-				errno = 0;
-			      }
-		      else if (errno == 0)
-			      {
-				errno = -1;
-			      }
+  for (;;)
+	  {
+	    pthread_mutex_lock (&w->lock);
+	    int i = w->nextWork++;
+
+	    pthread_mutex_unlock (&w->lock);
+	    if (i >= w->workCount)
+	      break;
+
+	    int fd = open (w->work[i].path,
+			   O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+	    if (fd < 0)
+		    {
+		      w->failed = 1;
+		      continue;
 		    }
+	    strcpy (path, w->work[i].path);
+	    walkPermissions (w, fd, path, w->work[i].active);
+	  }
+  return NULL;
+}
+
+static void
+addPermWork (PermWalk * w, const char *path, int active)
+{
+  PermWork *work = realloc (w->work, (w->workCount + 1) * sizeof (PermWork));
+
+  if (work == NULL || (work[w->workCount].path = strdup (path)) == NULL)
+	  {
+	    if (work != NULL)
+	      w->work = work;
+	    w->failed = 1;
+	    return;
+	  }
+  work[w->workCount].active = active;
+  w->work = work;
+  w->workCount++;
+}
+
+/* Apply the root of a recursive request and its immediate children;
+ * subdirectories are queued for the workers.
+ */
+static void
+startPermissionWalk (PermWalk * w, PathRules * root)
+{
+  struct stat st;
+  char path[PATH_MAX];
+
+  if (lstat (root->path, &st) < 0)
+	  {
+	    fprintf (stderr, "can't stat %s: %s\n", root->path, strerror (errno));
+	    w->failed = 1;
+	    return;
+	  }
+  if (S_ISLNK (st.st_mode))
+    return;
+
+  int active = applyWalkedNode (w, AT_FDCWD, root->path, root->path, &st, -1);
+
+  if (!S_ISDIR (st.st_mode))
+    return;
 
-	    if (errno != 0)
+  int dirFd = open (root->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  DIR *dir = dirFd < 0 ? NULL : fdopendir (dirFd);
+  struct dirent *de;
+
+  if (dir == NULL)
+	  {
+	    fprintf (stderr, "can't open %s: %s\n", root->path, strerror (errno));
+	    if (dirFd >= 0)
+	      close (dirFd);
+	    w->failed = 1;
+	    return;
+	  }
+  while ((de = readdir (dir)) != NULL)
+	  {
+	    if (!strcmp (de->d_name, "..") || !strcmp (de->d_name, "."))
+	      continue;
+	    snprintf (path, sizeof (path), "%s/%s",
+		      strcmp (root->path, "/") ? root->path : "", de->d_name);
+	    if (fstatat (dirFd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
 		    {
-		      int save = errno;
+		      w->failed = 1;
+		      continue;
+		    }
+	    if (S_ISLNK (st.st_mode))
+	      continue;
 
-		      closedir (dir);
-		      errno = save;
-		      return -1;
+	    int childActive =
+	      applyWalkedNode (w, dirFd, de->d_name, path, &st, active);
+
+	    if (S_ISDIR (st.st_mode))
+	      addPermWork (w, path, childActive);
+	  }
+  closedir (dir);
+}
+
+/* True if some proper ancestor of path is the root of a recursive
+ * request and that walk will reach path.  Walks don't follow
+ * symlinks, so an ancestor only counts if every directory between it
+ * and path is a real one; otherwise path gets a walk of its own.
+ */
+static bool
+hasRecursiveAncestor (HashTable * rules, const char *path)
+{
+  char buf[PATH_MAX];
+  char *slash;
+  struct stat st;
+
+  strncpy (buf, path, sizeof (buf) - 1);
+  buf[sizeof (buf) - 1] = '\0';
+  while ((slash = strrchr (buf, '/')) != NULL)
+	  {
+	    if (slash == buf)
+		    {
+		      if (buf[1] == '\0')
+			break;
+		      buf[1] = '\0';
 		    }
+	    else
+	      *slash = '\0';
+	    PathRules *r = findPathRules (rules, buf);
 
-	    if (closedir (dir))
+	    if (r != NULL && r->recursive >= 0)
+	      return true;
+	    if (lstat (buf, &st) < 0 || !S_ISDIR (st.st_mode))
+	      return false;
+	  }
+  return false;
+}
+
+/* Apply requests none of which is a plain request on a symlink, so
+ * that each node's result only depends on the requests naming it or
+ * an ancestor of it.
+ */
+static int
+applyPermissionBatch (const DirPermission * perms, int count)
+{
+  PermWalk w;
+  HashIter iter;
+  int i;
+
+  memset (&w, 0, sizeof (w));
+  w.perms = perms;
+  w.rules = mzHashTableCreate (mzHashSize (count), freePathRules);
+  if (w.rules == NULL)
+    return -1;
+  pthread_mutex_init (&w.lock, NULL);
+
+  for (i = 0; i < count; ++i)
+	  {
+	    char *path = normalizePath (perms[i].path);
+
+	    if (path == NULL)
 		    {
-		      return -1;
+		      w.failed = 1;
+		      continue;
+		    }
+	    PathRules *r = findPathRules (w.rules, path);
+
+	    if (r == NULL)
+		    {
+		      r = calloc (1, sizeof (PathRules));
+		      r->path = path;
+		      r->recursive = r->single = -1;
+		      mzHashTableLookup (w.rules, hashPath (path), r,
+					 hashcmpPathRules, true);
 		    }
+	    else
+		    {
+		      free (path);
+		    }
+	    if (perms[i].fileMode < 0)
+	      r->single = i;
+	    else
+	      r->recursive = i;
 	  }
 
-  return 0;
+  /* One walk per outermost recursive request. */
+  for (mzHashIterBegin (w.rules, &iter); !mzHashIterDone (&iter);
+       mzHashIterNext (&iter))
+	  {
+	    PathRules *r = (PathRules *) mzHashIterData (&iter);
+
+	    if (r->recursive >= 0 && !hasRecursiveAncestor (w.rules, r->path))
+	      startPermissionWalk (&w, r);
+	  }
+
+  if (w.workCount > 0)
+	  {
+	    pthread_t threads[DIR_PERM_THREADS];
+	    int n = w.workCount < DIR_PERM_THREADS ?
+	      w.workCount : DIR_PERM_THREADS;
+
+	    for (i = 1; i < n; ++i)
+		    {
+		      if (pthread_create (&threads[i], NULL, permissionWorker,
+					  &w) != 0)
+			break;
+		    }
+	    n = i;
+	    permissionWorker (&w);
+	    for (i = 1; i < n; ++i)
+	      pthread_join (threads[i], NULL);
+	  }
+
+  /* Single requests no walk reached: outside every recursive tree. */
+  for (mzHashIterBegin (w.rules, &iter); !mzHashIterDone (&iter);
+       mzHashIterNext (&iter))
+	  {
+	    PathRules *r = (PathRules *) mzHashIterData (&iter);
+	    struct stat st;
+
+	    if (r->single < 0 || r->visited)
+	      continue;
+	    if (stat (r->path, &st) < 0)
+		    {
+		      fprintf (stderr, "can't stat %s: %s\n", r->path,
+			       strerror (errno));
+		      w.failed = 1;
+		      continue;
+		    }
+	    if (applyPermission (AT_FDCWD, r->path, r->path, &st,
+				 perms[r->single].uid, perms[r->single].gid,
+				 perms[r->single].dirMode, true))
+	      w.failed = 1;
+	  }
+
+  for (i = 0; i < w.workCount; ++i)
+    free (w.work[i].path);
+  free (w.work);
+  mzHashTableFree (w.rules);
+  pthread_mutex_destroy (&w.lock);
+  return w.failed ? -1 : 0;
+}
+
+/* A plain request on a symlink changes whatever the link points at,
+ * which may be in one of the trees, so it can't be reordered against
+ * the other requests.  The list is split around each one, and it is
+ * applied on its own in between.
+ */
+int
+dirApplyPermissions (const DirPermission * perms, int count)
+{
+  int failed = 0;
+  int start = 0;
+  int i;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    struct stat st;
+
+	    if (perms[i].fileMode >= 0 || lstat (perms[i].path, &st) < 0 ||
+		!S_ISLNK (st.st_mode))
+	      continue;
+	    if (i > start && applyPermissionBatch (perms + start, i - start))
+	      failed = 1;
+	    start = i + 1;
+	    if (stat (perms[i].path, &st) < 0)
+		    {
+		      fprintf (stderr, "can't stat %s: %s\n", perms[i].path,
+			       strerror (errno));
+		      failed = 1;
+		      continue;
+		    }
+	    if (applyPermission (AT_FDCWD, perms[i].path, perms[i].path, &st,
+				 perms[i].uid, perms[i].gid, perms[i].dirMode,
+				 true))
+	      failed = 1;
+	  }
+  if (count > start && applyPermissionBatch (perms + start, count - start))
+    failed = 1;
+  return failed ? -1 : 0;
+}
+
+int
+dirSetHierarchyPermissions (const char *path,
+			    int uid, int gid, int dirMode, int fileMode)
+{
+  DirPermission perm;
+
+  perm.path = path;
+  perm.uid = uid;
+  perm.gid = gid;
+  perm.dirMode = dirMode;
+  perm.fileMode = fileMode;
+  return dirApplyPermissions (&perm, 1);
 }
@@ -40,6 +40,21 @@ int dirCreateHierarchy (const char *path, int mode,
  */
 int dirUnlinkHierarchy (const char *path);
 
+/* Called as each subtree finishes; <done> of <total> so far.
+ */
+typedef void (*DirUnlinkProgress) (int done, int total, void *cookie);
+
+/* rm -rf <path>, with the work spread over worker threads.
+ *
+ * <exclude> is an optional NULL-terminated list of full paths (no
+ * trailing slash) to leave alone along with everything below them.
+ * If <keepRoot> is true only the contents of <path> are removed.
+ * Carries on past errors; returns -1 (and sets errno) if anything
+ * could not be removed.
+ */
+int dirUnlinkTree (const char *path, const char *const *exclude,
+		   bool keepRoot, DirUnlinkProgress progress, void *cookie);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
@@ -48,4 +63,28 @@ int dirUnlinkHierarchy (const char *path);
 int dirSetHierarchyPermissions (const char *path,
 				int uid, int gid, int dirMode, int fileMode);
 
+/* One set_perm_recursive request, or a plain set_perm of <path> to
+ * <dirMode> when <fileMode> is negative.
+ */
+typedef struct
+{
+  const char *path;
+  int uid;
+  int gid;
+  int dirMode;
+  int fileMode;
+} DirPermission;
+
+/* Apply a list of requests with the same result as running them in
+ * order, but walking each tree only once: every node ends up with the
+ * last request that covers it.  Trees are walked relative to directory
+ * fds, nodes that already match are not touched, and subtrees are
+ * spread over worker threads.  Plain requests follow symlinks (like
+ * chown/chmod), and each one that names a symlink is applied in its
+ * place between two batches; recursive ones skip symlinks.
+ *
+ * Returns 0 on success, -1 if anything could not be applied.
+ */
+int dirApplyPermissions (const DirPermission * perms, int count);
+
 #endif // MINZIP_DIRUTIL_H_
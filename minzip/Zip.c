@@ -19,12 +19,11 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "ZipIndex.h"
 
 #undef NDEBUG			// do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -100,70 +99,29 @@ dumpEntry (const ZipEntry * pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * (This is a qsort callback.)
  *
- * Compare two ZipEntry structs, by name.
+ * Order ZipEntry structs by name, as unsigned bytes, so that every name
+ * sharing a prefix sorts into one run.  Entries with the same name stay
+ * in central directory order, which is also the order of their names
+ * in the mapping.
  */
 static int
-hashcmpZipEntry (const void *ventry1, const void *ventry2)
+compareZipEntries (const void *ventry1, const void *ventry2)
 {
   const ZipEntry *entry1 = (const ZipEntry *) ventry1;
   const ZipEntry *entry2 = (const ZipEntry *) ventry2;
+  unsigned int len = entry1->fileNameLen < entry2->fileNameLen ?
+    entry1->fileNameLen : entry2->fileNameLen;
+  int diff = memcmp (entry1->fileName, entry2->fileName, len);
 
+  if (diff != 0)
+    return diff;
   if (entry1->fileNameLen != entry2->fileNameLen)
-    return entry1->fileNameLen - entry2->fileNameLen;
-  return memcmp (entry1->fileName, entry2->fileName, entry1->fileNameLen);
-}
-
-/*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
- */
-static int
-hashcmpZipName (const void *ventry, const void *vname)
-{
-  const ZipEntry *entry = (const ZipEntry *) ventry;
-  const char *name = (const char *) vname;
-  unsigned int nameLen = strlen (name);
-
-  if (entry->fileNameLen != nameLen)
-    return entry->fileNameLen - nameLen;
-  return memcmp (entry->fileName, name, nameLen);
-}
-
-/*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
- */
-static unsigned int
-computeHash (const char *name, int nameLen)
-{
-  unsigned int hash = 2;
-
-  while (nameLen--)
-    hash = hash * 31 + *name++;
-
-  return hash;
-}
-
-static void
-addEntryToHashTable (HashTable * pHash, ZipEntry * pEntry)
-{
-  unsigned int itemHash = computeHash (pEntry->fileName, pEntry->fileNameLen);
-  const ZipEntry *found;
-
-  found = (const ZipEntry *) mzHashTableLookup (pHash,
-						itemHash, pEntry,
-						hashcmpZipEntry, true);
-  if (found != pEntry)
-	  {
-	    LOGW ("WARNING: duplicate entry '%.*s' in Zip\n",
-		  found->fileNameLen, found->fileName);
-	    /* keep going */
-	  }
+    return entry1->fileNameLen < entry2->fileNameLen ? -1 : 1;
+  if (entry1->fileName != entry2->fileName)
+    return entry1->fileName < entry2->fileName ? -1 : 1;
+  return 0;
 }
 
 static int
@@ -194,8 +152,8 @@ validFilename (const char *fileName, unsigned int fileNameLen)
 
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * is in fact a Zip, we scan out the contents of the central directory,
+ * sort it by name and index it.
  *
  * Returns "true" on success.
  */
@@ -263,8 +221,7 @@ parseZipArchive (ZipArchive * pArchive, const MemMapping * pMap)
    */
   pArchive->numEntries = numEntries;
   pArchive->pEntries = (ZipEntry *) calloc (numEntries, sizeof (ZipEntry));
-  pArchive->pHash = mzHashTableCreate (mzHashSize (numEntries), NULL);
-  if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+  if (pArchive->pEntries == NULL)
     goto bail;
 
   ptr = pMap->addr + cdOffset;
@@ -304,79 +261,7 @@ parseZipArchive (ZipArchive * pArchive, const MemMapping * pMap)
 		      goto bail;
 		    }
 
-#if SORT_ENTRIES
-	    /* Figure out where this entry should go (binary search).
-	     */
-	    if (i > 0)
-		    {
-		      int low, high;
-
-		      low = 0;
-		      high = i - 1;
-		      while (low <= high)
-			      {
-				int mid;
-				int diff;
-				int diffLen;
-
-				mid = low + ((high - low) / 2);	// avoid overflow
-
-				if (pArchive->pEntries[mid].fileNameLen <
-				    fileNameLen)
-					{
-					  diffLen =
-					    pArchive->pEntries[mid].
-					    fileNameLen;
-					}
-				else
-					{
-					  diffLen = fileNameLen;
-					}
-				diff =
-				  strncmp (pArchive->pEntries[mid].fileName,
-					   fileName, diffLen);
-				if (diff == 0)
-					{
-					  diff =
-					    pArchive->pEntries[mid].
-					    fileNameLen - fileNameLen;
-					}
-				if (diff < 0)
-					{
-					  low = mid + 1;
-					}
-				else if (diff > 0)
-					{
-					  high = mid - 1;
-					}
-				else
-					{
-					  high = mid;
-					  break;
-					}
-			      }
-
-		      unsigned int target = high + 1;
-
-		      assert (target <= i);
-		      if (target != i)
-			      {
-				/* It belongs somewhere other than at the end of
-				 * the list.  Make some room at [target].
-				 */
-				memmove (pArchive->pEntries + target + 1,
-					 pArchive->pEntries + target,
-					 (i - target) * sizeof (ZipEntry));
-			      }
-		      pEntry = &pArchive->pEntries[target];
-		    }
-	    else
-		    {
-		      pEntry = &pArchive->pEntries[0];
-		    }
-#else
 	    pEntry = &pArchive->pEntries[i];
-#endif
 
 	    //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
 	    //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -436,38 +321,27 @@ parseZipArchive (ZipArchive * pArchive, const MemMapping * pMap)
 		      goto bail;
 		    }
 
-#if !SORT_ENTRIES
-	    /* Add to hash table; no need to lock here.
-	     * Can't do this now if we're sorting, because entries
-	     * will move around.
-	     */
-	    addEntryToHashTable (pArchive->pHash, pEntry);
-#endif
-
 	    //dumpEntry(pEntry);
 	    ptr += CENHDR + fileNameLen + extraLen + commentLen;
 	  }
 
-#if SORT_ENTRIES
-  /* If we're sorting, we have to wait until all entries
-   * are in their final places, otherwise the pointers will
-   * probably point to the wrong things.
+  /* Sorting once here is O(n log n); keeping the array sorted as the
+   * entries came in cost a memmove per entry.
    */
-  for (i = 0; i < numEntries; i++)
+  qsort (pArchive->pEntries, numEntries, sizeof (ZipEntry),
+	 compareZipEntries);
+  if (!mzBuildZipIndex (&pArchive->index, pArchive->pEntries, numEntries))
 	  {
-	    /* Add to hash table; no need to lock here.
-	     */
-	    addEntryToHashTable (pArchive->pHash, &pArchive->pEntries[i]);
+	    LOGW ("Unable to index %d entries\n", numEntries);
+	    goto bail;
 	  }
-#endif
 
   result = true;
 
 bail:
   if (!result)
 	  {
-	    mzHashTableFree (pArchive->pHash);
-	    pArchive->pHash = NULL;
+	    mzFreeZipIndex (&pArchive->index);
 	  }
   return result;
 }
@@ -556,10 +430,9 @@ mzCloseZipArchive (ZipArchive * pArchive)
 
   free (pArchive->pEntries);
 
-  mzHashTableFree (pArchive->pHash);
+  mzFreeZipIndex (&pArchive->index);
 
   pArchive->fd = -1;
-  pArchive->pHash = NULL;
   pArchive->pEntries = NULL;
 }
 
@@ -571,11 +444,59 @@ mzCloseZipArchive (ZipArchive * pArchive)
 const ZipEntry *
 mzFindZipEntry (const ZipArchive * pArchive, const char *entryName)
 {
-  unsigned int itemHash = computeHash (entryName, strlen (entryName));
+  int i = mzZipIndexLookup (&pArchive->index, pArchive->pEntries,
+			    entryName, strlen (entryName));
+
+  return i < 0 ? NULL : &pArchive->pEntries[i];
+}
+
+/*
+ * Find the run of entries whose names begin with "prefix".  Since the
+ * entries are sorted, they're contiguous: [*pFirst, *pEnd).
+ *
+ * Returns the number of matching entries.
+ */
+unsigned int
+mzFindZipEntryRange (const ZipArchive * pArchive, const char *prefix,
+		     unsigned int *pFirst, unsigned int *pEnd)
+{
+  unsigned int prefixLen = strlen (prefix);
+  unsigned int low = 0, high = pArchive->numEntries;
+  unsigned int first;
+
+  /* first entry whose name isn't less than the prefix */
+  while (low < high)
+	  {
+	    unsigned int mid = low + (high - low) / 2;
+	    const ZipEntry *pEntry = pArchive->pEntries + mid;
+	    unsigned int len = pEntry->fileNameLen < prefixLen ?
+	      pEntry->fileNameLen : prefixLen;
+	    int diff = memcmp (pEntry->fileName, prefix, len);
+
+	    if (diff < 0 || (diff == 0 && pEntry->fileNameLen < prefixLen))
+	      low = mid + 1;
+	    else
+	      high = mid;
+	  }
+  first = low;
 
-  return (const ZipEntry *) mzHashTableLookup (pArchive->pHash,
-					       itemHash, (char *) entryName,
-					       hashcmpZipName, false);
+  /* first entry past it that doesn't begin with the prefix */
+  high = pArchive->numEntries;
+  while (low < high)
+	  {
+	    unsigned int mid = low + (high - low) / 2;
+	    const ZipEntry *pEntry = pArchive->pEntries + mid;
+
+	    if (pEntry->fileNameLen >= prefixLen &&
+		memcmp (pEntry->fileName, prefix, prefixLen) == 0)
+	      low = mid + 1;
+	    else
+	      high = mid;
+	  }
+
+  *pFirst = first;
+  *pEnd = low;
+  return low - first;
 }
 
 /*
@@ -1127,56 +1048,21 @@ mzExtractRecursive (const ZipArchive * pArchive,
   helper.bufLen = 0;
 
   /* Walk through the entries and extract anything whose path begins
-   * with zpath.
-   //TODO: since the entries are sorted, binary search for the first match
-   //      and stop after the first non-match.
+   * with zpath.  The entries are sorted, so those are one run.
    */
-  unsigned int i;
-  bool seenMatch = false;
+  unsigned int i, end;
   int ok = true;
 
-  for (i = 0; i < pArchive->numEntries; i++)
-	  {
-	    ZipEntry *pEntry = pArchive->pEntries + i;
-
-	    if (pEntry->fileNameLen < zipDirLen)
-		    {
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-		      /* No chance of matching.
-		       */
-#if SORT_ENTRIES
-		      if (seenMatch)
-			      {
-				/* Since the entries are sorted, we can give up
-				 * on the first mismatch after the first match.
-				 */
-				break;
-			      }
-#endif
-		      continue;
-		    }
-	    /* If zpath is empty, this strncmp() will match everything,
-	     * which is what we want.
-	     */
-	    if (strncmp (pEntry->fileName, zpath, zipDirLen) != 0)
-		    {
-#if SORT_ENTRIES
-		      if (seenMatch)
-			      {
-				/* Since the entries are sorted, we can give up
-				 * on the first mismatch after the first match.
-				 */
-				break;
-			      }
-#endif
-		      continue;
-		    }
-	    /* This entry begins with zipDir, so we'll extract it.
-	     */
-	    seenMatch = true;
+  /* If zpath is empty, this will match everything, which is what we want.
+   */
+  mzFindZipEntryRange (pArchive, zpath, &i, &end);
+  for (; i < end; i++)
+	  {
+	    ZipEntry *pEntry = pArchive->pEntries + i;
 
 	    /* Find the target location of the entry.
 	     */
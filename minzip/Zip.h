@@ -11,8 +11,8 @@
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
+#include "ZipIndex.h"
 
 /*
  * One entry in the Zip archive.  Treat this as opaque -- use accessors below.
@@ -43,8 +43,8 @@ typedef struct ZipArchive
 {
   int fd;
   unsigned int numEntries;
-  ZipEntry *pEntries;
-  HashTable *pHash;		// maps file name to ZipEntry
+  ZipEntry *pEntries;		// sorted by name
+  ZipIndex index;		// maps file name to ZipEntry
   MemMapping map;
 } ZipArchive;
 
@@ -81,6 +81,14 @@ void mzCloseZipArchive (ZipArchive * pArchive);
 const ZipEntry *mzFindZipEntry (const ZipArchive * pArchive,
 				const char *entryName);
 
+/*
+ * Find the entries whose names begin with "prefix": they are entries
+ * [*pFirst, *pEnd) by index.  Returns how many there are.
+ */
+unsigned int mzFindZipEntryRange (const ZipArchive * pArchive,
+				  const char *prefix, unsigned int *pFirst,
+				  unsigned int *pEnd);
+
 /*
  * Get the number of entries in the Zip archive.
  */
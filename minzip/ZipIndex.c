@@ -0,0 +1,336 @@
+/*
+ * Name index for the entries of a Zip archive.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Zip.h"
+#include "ZipIndex.h"
+#include "Log.h"
+
+/*
+ * Below this many entries a linear-probing table is already about one
+ * probe per lookup, and building a perfect hash isn't worth it.
+ */
+#define PERFECT_HASH_MIN_ENTRIES 256
+
+/* Average entries per bucket of the perfect hash. */
+#define PERFECT_HASH_BUCKET_SIZE 4
+
+/* Displacements tried per bucket before giving up on a perfect hash. */
+#define PERFECT_HASH_MAX_TRIES 65536
+
+/* A displacement with this bit set names its (single) slot directly. */
+#define DIRECT_SLOT 0x80000000u
+
+/*
+ * 64-bit FNV-1a.  The top half picks the perfect-hash bucket, and the
+ * bottom half is kept in the index to check slots against.
+ */
+static uint64_t
+hashName (const char *name, unsigned int nameLen)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  while (nameLen--)
+	  {
+	    hash ^= (unsigned char) *name++;
+	    hash *= 0x100000001b3ULL;
+	  }
+  return hash;
+}
+
+/* The finalizer of splitmix64; spreads a displaced hash over the slots. */
+static uint64_t
+mix (uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static unsigned int
+displacedSlot (uint64_t hash, unsigned int displacement,
+	       unsigned int numSlots)
+{
+  return mix (hash + displacement * 0x9e3779b97f4a7c15ULL) % numSlots;
+}
+
+static unsigned int
+bucketOf (uint64_t hash, unsigned int numBuckets)
+{
+  return (unsigned int) (hash >> 32) % numBuckets;
+}
+
+static bool
+sameName (const ZipEntry * pEntry, const char *name, unsigned int nameLen)
+{
+  return pEntry->fileNameLen == nameLen &&
+    memcmp (pEntry->fileName, name, nameLen) == 0;
+}
+
+/*
+ * Hash-and-displace: the entries are split into small buckets, and
+ * the biggest buckets are placed first, each by trying displacements
+ * until all of its entries land in free slots.  Buckets of one entry
+ * come last and just take whatever slots are left.
+ */
+static bool
+buildPerfect (ZipIndex * pIndex, unsigned int numEntries,
+	      const uint64_t * hashes)
+{
+  unsigned int numBuckets =
+    (numEntries + PERFECT_HASH_BUCKET_SIZE - 1) / PERFECT_HASH_BUCKET_SIZE;
+  unsigned int *bucketStart = NULL;	// entries of bucket b are
+  unsigned int *bucketEntries = NULL;	// bucketEntries[bucketStart[b]...]
+  unsigned int *order = NULL;		// buckets, biggest first
+  unsigned int *sizeCount = NULL;
+  unsigned int maxSize = 0;
+  unsigned int i, b, n;
+  unsigned int freeSlot = 0;
+  bool ok = false;
+
+  pIndex->numSlots = numEntries;
+  pIndex->numBuckets = numBuckets;
+  pIndex->slotHashes = calloc (numEntries, sizeof (unsigned int));
+  pIndex->slotEntries = calloc (numEntries, sizeof (unsigned int));
+  pIndex->displacements = calloc (numBuckets, sizeof (unsigned int));
+  bucketStart = calloc (numBuckets + 1, sizeof (unsigned int));
+  bucketEntries = malloc (numEntries * sizeof (unsigned int));
+  order = malloc (numBuckets * sizeof (unsigned int));
+  if (pIndex->slotHashes == NULL || pIndex->slotEntries == NULL ||
+      pIndex->displacements == NULL || bucketStart == NULL ||
+      bucketEntries == NULL || order == NULL)
+    goto bail;
+
+  /* Counting sort of the entries into buckets... */
+  for (i = 0; i < numEntries; i++)
+    bucketStart[bucketOf (hashes[i], numBuckets) + 1]++;
+  for (b = 0; b < numBuckets; b++)
+	  {
+	    unsigned int size = bucketStart[b + 1];
+
+	    if (size > maxSize)
+	      maxSize = size;
+	    bucketStart[b + 1] += bucketStart[b];
+	  }
+  for (i = 0; i < numEntries; i++)
+	  {
+	    b = bucketOf (hashes[i], numBuckets);
+	    /* bucketStart[b] is advanced here and restored below */
+	    bucketEntries[bucketStart[b]++] = i;
+	  }
+  for (b = numBuckets; b > 0; b--)
+    bucketStart[b] = bucketStart[b - 1];
+  bucketStart[0] = 0;
+
+  /* ...and of the buckets by size, biggest first. */
+  sizeCount = calloc (maxSize + 2, sizeof (unsigned int));
+  if (sizeCount == NULL)
+    goto bail;
+  for (b = 0; b < numBuckets; b++)
+    sizeCount[maxSize - (bucketStart[b + 1] - bucketStart[b]) + 1]++;
+  for (i = 1; i <= maxSize + 1; i++)
+    sizeCount[i] += sizeCount[i - 1];
+  for (b = 0; b < numBuckets; b++)
+    order[sizeCount[maxSize - (bucketStart[b + 1] - bucketStart[b])]++] = b;
+
+  for (n = 0; n < numBuckets; n++)
+	  {
+	    const unsigned int *members;
+	    unsigned int size, d;
+
+	    b = order[n];
+	    members = bucketEntries + bucketStart[b];
+	    size = bucketStart[b + 1] - bucketStart[b];
+	    if (size == 0)
+	      break;
+
+	    if (size == 1)
+		    {
+		      while (pIndex->slotEntries[freeSlot] != 0)
+			freeSlot++;
+		      pIndex->displacements[b] = DIRECT_SLOT | freeSlot;
+		      pIndex->slotHashes[freeSlot] = (unsigned int) hashes[members[0]];
+		      pIndex->slotEntries[freeSlot] = members[0] + 1;
+		      continue;
+		    }
+
+	    for (d = 0; d < PERFECT_HASH_MAX_TRIES; d++)
+		    {
+		      unsigned int j, k;
+
+		      for (j = 0; j < size; j++)
+			      {
+				unsigned int slot =
+				  displacedSlot (hashes[members[j]], d,
+						 numEntries);
+
+				if (pIndex->slotEntries[slot] != 0)
+				  break;
+				/* claim it for now, so the bucket can't
+				 * land two entries on one slot */
+				pIndex->slotEntries[slot] = members[j] + 1;
+			      }
+		      if (j == size)
+			break;
+		      for (k = 0; k < j; k++)
+			pIndex->slotEntries[displacedSlot (hashes[members[k]],
+							   d, numEntries)] = 0;
+		    }
+	    if (d == PERFECT_HASH_MAX_TRIES)
+		    {
+		      LOGV ("No perfect hash for %d entries\n", numEntries);
+		      goto bail;
+		    }
+	    pIndex->displacements[b] = d;
+	    for (i = 0; i < size; i++)
+		    {
+		      unsigned int slot =
+			displacedSlot (hashes[members[i]], d, numEntries);
+
+		      pIndex->slotHashes[slot] = (unsigned int) hashes[members[i]];
+		    }
+	  }
+  ok = true;
+
+bail:
+  free (bucketStart);
+  free (bucketEntries);
+  free (order);
+  free (sizeCount);
+  if (!ok)
+    mzFreeZipIndex (pIndex);
+  return ok;
+}
+
+static bool
+buildProbing (ZipIndex * pIndex, const ZipEntry * pEntries,
+	      unsigned int numEntries, const uint64_t * hashes)
+{
+  unsigned int numSlots = 1;
+  unsigned int i;
+
+  /* no more than half full */
+  while (numSlots < numEntries * 2)
+    numSlots <<= 1;
+  pIndex->numSlots = numSlots;
+  pIndex->numBuckets = 0;
+  pIndex->displacements = NULL;
+  pIndex->slotHashes = calloc (numSlots, sizeof (unsigned int));
+  pIndex->slotEntries = calloc (numSlots, sizeof (unsigned int));
+  if (pIndex->slotHashes == NULL || pIndex->slotEntries == NULL)
+	  {
+	    mzFreeZipIndex (pIndex);
+	    return false;
+	  }
+
+  for (i = 0; i < numEntries; i++)
+	  {
+	    unsigned int slot = (unsigned int) hashes[i] & (numSlots - 1);
+
+	    while (pIndex->slotEntries[slot] != 0)
+		    {
+		      const ZipEntry *pOther =
+			pEntries + pIndex->slotEntries[slot] - 1;
+
+		      if (pIndex->slotHashes[slot] == (unsigned int) hashes[i] &&
+			  sameName (pOther, pEntries[i].fileName,
+				    pEntries[i].fileNameLen))
+			break;
+		      slot = (slot + 1) & (numSlots - 1);
+		    }
+	    if (pIndex->slotEntries[slot] != 0)
+	      continue;		// a duplicate; keep the first
+	    pIndex->slotHashes[slot] = (unsigned int) hashes[i];
+	    pIndex->slotEntries[slot] = i + 1;
+	  }
+  return true;
+}
+
+bool
+mzBuildZipIndex (ZipIndex * pIndex, const ZipEntry * pEntries,
+		 unsigned int numEntries)
+{
+  uint64_t *hashes;
+  bool duplicates = false;
+  bool ok = false;
+  unsigned int i;
+
+  memset (pIndex, 0, sizeof (*pIndex));
+  hashes = malloc (numEntries * sizeof (uint64_t));
+  if (hashes == NULL)
+    return false;
+  for (i = 0; i < numEntries; i++)
+	  {
+	    hashes[i] = hashName (pEntries[i].fileName, pEntries[i].fileNameLen);
+	    /* sorted, so any duplicates are next to each other */
+	    if (i > 0 && sameName (&pEntries[i - 1], pEntries[i].fileName,
+				   pEntries[i].fileNameLen))
+		    {
+		      LOGW ("WARNING: duplicate entry '%.*s' in Zip\n",
+			    pEntries[i].fileNameLen, pEntries[i].fileName);
+		      duplicates = true;
+		    }
+	  }
+
+  /* A perfect hash can't have two entries under one name. */
+  if (numEntries >= PERFECT_HASH_MIN_ENTRIES && !duplicates)
+    ok = buildPerfect (pIndex, numEntries, hashes);
+  if (!ok)
+    ok = buildProbing (pIndex, pEntries, numEntries, hashes);
+
+  free (hashes);
+  return ok;
+}
+
+void
+mzFreeZipIndex (ZipIndex * pIndex)
+{
+  free (pIndex->slotHashes);
+  free (pIndex->slotEntries);
+  free (pIndex->displacements);
+  memset (pIndex, 0, sizeof (*pIndex));
+}
+
+int
+mzZipIndexLookup (const ZipIndex * pIndex, const ZipEntry * pEntries,
+		  const char *name, unsigned int nameLen)
+{
+  uint64_t hash;
+  unsigned int slot;
+
+  if (pIndex->numSlots == 0)
+    return -1;
+  hash = hashName (name, nameLen);
+
+  if (pIndex->numBuckets > 0)
+	  {
+	    unsigned int d =
+	      pIndex->displacements[bucketOf (hash, pIndex->numBuckets)];
+
+	    slot = (d & DIRECT_SLOT) ? d & ~DIRECT_SLOT :
+	      displacedSlot (hash, d, pIndex->numSlots);
+	    if (pIndex->slotHashes[slot] == (unsigned int) hash &&
+		sameName (pEntries + pIndex->slotEntries[slot] - 1, name,
+			  nameLen))
+	      return pIndex->slotEntries[slot] - 1;
+	    return -1;
+	  }
+
+  slot = (unsigned int) hash & (pIndex->numSlots - 1);
+  while (pIndex->slotEntries[slot] != 0)
+	  {
+	    if (pIndex->slotHashes[slot] == (unsigned int) hash &&
+		sameName (pEntries + pIndex->slotEntries[slot] - 1, name,
+			  nameLen))
+	      return pIndex->slotEntries[slot] - 1;
+	    slot = (slot + 1) & (pIndex->numSlots - 1);
+	  }
+  return -1;
+}
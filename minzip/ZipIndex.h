@@ -0,0 +1,46 @@
+/*
+ * Name index for the entries of a Zip archive.
+ */
+#ifndef _MINZIP_ZIP_INDEX
+#define _MINZIP_ZIP_INDEX
+
+#include <stdbool.h>
+
+struct ZipEntry;
+
+/*
+ * The index is built once when the archive is opened and never
+ * changes, so it needs no tombstones or resizing.  It is kept as flat
+ * parallel arrays: a probe only touches the 4-byte hash of each slot
+ * and goes to the entry itself once the hash matches.
+ *
+ * Large archives get a minimal perfect hash (hash-and-displace), which
+ * finds any name with a single probe; smaller ones, or ones where that
+ * can't be built, use linear probing in a half-empty table.
+ */
+typedef struct ZipIndex
+{
+  unsigned int numSlots;	// numEntries if perfect, else a power of two
+  unsigned int *slotHashes;	// check hash of the entry in each slot
+  unsigned int *slotEntries;	// entry index + 1, 0 for an empty slot
+  unsigned int numBuckets;	// 0 unless perfect
+  unsigned int *displacements;	// per bucket
+} ZipIndex;
+
+/*
+ * Index "numEntries" entries, which must be sorted by name.  Where a
+ * name appears more than once, the first is the one found.
+ */
+bool mzBuildZipIndex (ZipIndex * pIndex, const struct ZipEntry *pEntries,
+		      unsigned int numEntries);
+
+void mzFreeZipIndex (ZipIndex * pIndex);
+
+/*
+ * Returns the index of the entry called "name", or -1.
+ */
+int mzZipIndexLookup (const ZipIndex * pIndex,
+		      const struct ZipEntry *pEntries, const char *name,
+		      unsigned int nameLen);
+
+#endif /*_MINZIP_ZIP_INDEX*/
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,6 +13,8 @@
 #include <stdarg.h>
 #include <fcntl.h>
 
+#include <zlib.h>
+
 #include <private/android_filesystem_config.h>
 
 /* NOTES
@@ -20,6 +24,13 @@
 ** - dotfiles are ignored
 ** - directories named 'root' are ignored
 ** - device notes, pipes, etc are not supported (error)
+**
+** The tree is walked first (in the same sorted order as always), which
+** gives the list of entries to emit.  A pool of reader threads then
+** loads file contents a bounded distance ahead of the writer, which
+** emits entries strictly in list order, so the archive is byte for byte
+** what it used to be.  Output goes through one buffer, either to stdout
+** or, with -z, through zlib to a gzip stream on stdout.
 */
 
 void die(const char *why, ...)
@@ -37,6 +48,103 @@ void die(const char *why, ...)
 static int verbose = 0;
 static int total_size = 0;
 
+#define READER_THREADS 4
+#define PREFETCH_FILES 64
+#define PREFETCH_BYTES (4 * 1024 * 1024)
+#define OUTPUT_BUFFER (256 * 1024)
+
+typedef struct {
+    char *in;
+    char *out;
+    int olen;
+    struct stat s;      /* already through fix_stat() */
+    char *data;         /* file contents or link target */
+    unsigned size;
+    int ready;
+} entry;
+
+static entry *entries = 0;
+static int entry_count = 0;
+static int entry_alloc = 0;
+
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t consumed = PTHREAD_COND_INITIALIZER;
+static int next_load = 0;       /* next entry a reader will pick up */
+static int next_emit = 0;       /* next entry the writer will emit */
+static long bytes_ahead = 0;    /* loaded but not yet emitted */
+
+static char obuf[OUTPUT_BUFFER];
+static int obuf_len = 0;
+static int gzip_level = -1;     /* -1: plain cpio */
+static z_stream zs;
+
+static void write_all(const char *data, unsigned len)
+{
+    while(len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            die("cannot write output: %s", strerror(errno));
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void _deflate(const char *data, unsigned len, int flush)
+{
+    char zbuf[64 * 1024];
+
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+    do {
+        zs.next_out = (Bytef *) zbuf;
+        zs.avail_out = sizeof(zbuf);
+        if(deflate(&zs, flush) == Z_STREAM_ERROR) die("deflate failed");
+        write_all(zbuf, sizeof(zbuf) - zs.avail_out);
+    } while(zs.avail_out == 0);
+}
+
+static void _sink(const char *data, unsigned len)
+{
+    if(gzip_level >= 0) {
+        _deflate(data, len, Z_NO_FLUSH);
+    } else {
+        write_all(data, len);
+    }
+}
+
+static void _flush()
+{
+    _sink(obuf, obuf_len);
+    obuf_len = 0;
+}
+
+static void _output(const char *data, unsigned len)
+{
+    if(obuf_len + len > sizeof(obuf)) {
+        _flush();
+        /* big file contents skip the buffer */
+        if(len >= sizeof(obuf)) {
+            _sink(data, len);
+            return;
+        }
+    }
+    memcpy(obuf + obuf_len, data, len);
+    obuf_len += len;
+}
+
+static void _pad()
+{
+    static const char zeros[4] = { 0, };
+
+    if(total_size & 3) {
+        _output(zeros, 4 - (total_size & 3));
+        total_size = (total_size + 3) & ~3;
+    }
+}
+
 static void fix_stat(const char *path, struct stat *s)
 {
     fs_config(path, S_ISDIR(s->st_mode), &s->st_uid, &s->st_gid, &s->st_mode);
@@ -48,17 +156,14 @@ static void _eject(struct stat *s, char *out, int olen, char *data, unsigned dat
     // approximate range that was being used already, and avoiding small
     // values which may be special.
     static unsigned next_inode = 300000;
+    char header[6 + 8*13 + 1];
 
-    while(total_size & 3) {
-        total_size++;
-        putchar(0);
-    }
+    _pad();
 
-    fix_stat(out, s);
 //    fprintf(stderr, "_eject %s: mode=0%o\n", out, s->st_mode);
 
-    printf("%06x%08x%08x%08x%08x%08x%08x"
-           "%08x%08x%08x%08x%08x%08x%08x%s%c",
+    sprintf(header, "%06x%08x%08x%08x%08x%08x%08x"
+           "%08x%08x%08x%08x%08x%08x%08x",
            0x070701,
            next_inode++,  //  s.st_ino,
            s->st_mode,
@@ -72,36 +177,150 @@ static void _eject(struct stat *s, char *out, int olen, char *data, unsigned dat
            0, // devmajor
            0, // devminor,
            olen + 1,
-           0,
-           out,
            0
            );
+    _output(header, 6 + 8*13);
+    _output(out, olen + 1);
 
     total_size += 6 + 8*13 + olen + 1;
 
     if(strlen(out) != olen) die("ACK!");
 
-    while(total_size & 3) {
-        total_size++;
-        putchar(0);
-    }
+    _pad();
 
     if(datasize) {
-        fwrite(data, datasize, 1, stdout);
+        _output(data, datasize);
         total_size += datasize;
     }
 }
 
 static void _eject_trailer()
 {
+    static const char zeros[256] = { 0, };
     struct stat s;
     memset(&s, 0, sizeof(s));
+    fix_stat("TRAILER!!!", &s);
     _eject(&s, "TRAILER!!!", 10, 0, 0);
 
-    while(total_size & 0xff) {
-        total_size++;
-        putchar(0);
+    if(total_size & 0xff) {
+        _output(zeros, 256 - (total_size & 0xff));
+        total_size = (total_size + 0xff) & ~0xff;
+    }
+}
+
+static entry *_add_entry(const char *in, const char *out, int olen, struct stat *s)
+{
+    if(entry_count == entry_alloc) {
+        entry_alloc = entry_alloc ? entry_alloc * 2 : 256;
+        entries = realloc(entries, entry_alloc * sizeof(entry));
+        if(entries == 0) die("cannot allocate %d entries", entry_alloc);
+    }
+    entry *e = &entries[entry_count++];
+    memset(e, 0, sizeof(*e));
+    e->in = strdup(in);
+    e->out = strdup(out);
+    if(e->in == 0 || e->out == 0) die("cannot allocate names for '%s'", in);
+    e->olen = olen;
+    e->s = *s;
+    fix_stat(out, &e->s);
+    return e;
+}
+
+static void _load(entry *e)
+{
+    unsigned done = 0;
+    int fd;
+
+    fd = open(e->in, O_RDONLY);
+    if(fd < 0) die("cannot open '%s' for read", e->in);
+
+    e->data = (char*) malloc(e->size ? e->size : 1);
+    if(e->data == 0) die("cannot allocate %d bytes", e->size);
+
+    while(done < e->size) {
+        ssize_t n = read(fd, e->data + done, e->size - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) die("cannot read %d bytes", e->size);
+        done += n;
+    }
+    close(fd);
+}
+
+/* Readers stay at most PREFETCH_FILES entries and PREFETCH_BYTES ahead of
+ * the writer, except that the entry the writer is waiting on is always
+ * loaded. */
+static void *_reader(void *unused)
+{
+    pthread_mutex_lock(&load_lock);
+    for(;;) {
+        while(next_load < entry_count && entries[next_load].ready)
+            next_load++;
+        if(next_load >= entry_count) break;
+
+        entry *e = &entries[next_load];
+        if(next_load != next_emit &&
+           (next_load - next_emit >= PREFETCH_FILES ||
+            bytes_ahead + e->size > PREFETCH_BYTES)) {
+            pthread_cond_wait(&consumed, &load_lock);
+            continue;
+        }
+        next_load++;
+        bytes_ahead += e->size;
+        pthread_mutex_unlock(&load_lock);
+
+        _load(e);
+
+        pthread_mutex_lock(&load_lock);
+        e->ready = 1;
+        pthread_cond_broadcast(&loaded);
     }
+    pthread_mutex_unlock(&load_lock);
+    return 0;
+}
+
+static void _emit_all()
+{
+    pthread_t threads[READER_THREADS];
+    int started = 0;
+    int i;
+
+    for(i = 0; i < READER_THREADS; i++) {
+        if(pthread_create(&threads[started], NULL, _reader, NULL) == 0)
+            started++;
+    }
+
+    for(i = 0; i < entry_count; i++) {
+        entry *e = &entries[i];
+
+        if(started == 0 && !e->ready) {
+            _load(e);
+            e->ready = 1;
+        }
+        pthread_mutex_lock(&load_lock);
+        while(!e->ready)
+            pthread_cond_wait(&loaded, &load_lock);
+        pthread_mutex_unlock(&load_lock);
+
+        _eject(&e->s, e->out, e->olen, e->data, e->size);
+
+        pthread_mutex_lock(&load_lock);
+        if(S_ISREG(e->s.st_mode))
+            bytes_ahead -= e->size;
+        next_emit = i + 1;
+        pthread_cond_broadcast(&consumed);
+        pthread_mutex_unlock(&load_lock);
+
+        free(e->data);
+        free(e->in);
+        free(e->out);
+        e->data = 0;
+    }
+
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(entries);
+    entries = 0;
+    entry_count = entry_alloc = 0;
 }
 
 static void _archive(char *in, char *out, int ilen, int olen);
@@ -156,6 +375,7 @@ static void _archive_dir(char *in, char *out, int ilen, int olen)
         }
         ++entries;
     }
+    closedir(d);
 
     qsort(names, entries, sizeof(char*), compare);
 
@@ -184,6 +404,7 @@ static void _archive_dir(char *in, char *out, int ilen, int olen)
 static void _archive(char *in, char *out, int ilen, int olen)
 {
     struct stat s;
+    entry *e;
 
     if(verbose) {
         fprintf(stderr,"_archive('%s','%s',%d,%d)\n",
@@ -193,32 +414,23 @@ static void _archive(char *in, char *out, int ilen, int olen)
     if(lstat(in, &s)) die("could not stat '%s'\n", in);
 
     if(S_ISREG(s.st_mode)){
-        char *tmp;
-        int fd;
-
-        fd = open(in, O_RDONLY);
-        if(fd < 0) die("cannot open '%s' for read", in);
-
-        tmp = (char*) malloc(s.st_size);
-        if(tmp == 0) die("cannot allocate %d bytes", s.st_size);
-
-        if(read(fd, tmp, s.st_size) != s.st_size) {
-            die("cannot read %d bytes", s.st_size);
-        }
-
-        _eject(&s, out, olen, tmp, s.st_size);
-
-        free(tmp);
-        close(fd);
+        e = _add_entry(in, out, olen, &s);
+        e->size = s.st_size;
     } else if(S_ISDIR(s.st_mode)) {
-        _eject(&s, out, olen, 0, 0);
+        e = _add_entry(in, out, olen, &s);
+        e->ready = 1;
         _archive_dir(in, out, ilen, olen);
     } else if(S_ISLNK(s.st_mode)) {
         char buf[1024];
         int size;
         size = readlink(in, buf, 1024);
         if(size < 0) die("cannot read symlink '%s'", in);
-        _eject(&s, out, olen, buf, size);
+        e = _add_entry(in, out, olen, &s);
+        e->data = malloc(size ? size : 1);
+        if(e->data == 0) die("cannot allocate %d bytes", size);
+        memcpy(e->data, buf, size);
+        e->size = size;
+        e->ready = 1;
     } else {
         die("Unknown '%s' (mode %d)?\n", in, s.st_mode);
     }
@@ -240,6 +452,19 @@ int mkbootfs_main(int argc, char *argv[])
     argc--;
     argv++;
 
+    /* -z[level]: gzip the archive in-process */
+    if(argc > 0 && !strncmp(*argv, "-z", 2)) {
+        gzip_level = (*argv)[2] ? atoi(*argv + 2) : 6;
+        if(gzip_level < 1 || gzip_level > 9) gzip_level = 6;
+        memset(&zs, 0, sizeof(zs));
+        /* windowBits 15 + 16 asks zlib for a gzip wrapper */
+        if(deflateInit2(&zs, gzip_level, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+            die("cannot initialize zlib");
+        argc--;
+        argv++;
+    }
+
     if(argc == 0) die("no directories to process?!");
 
     while(argc-- > 0){
@@ -255,7 +480,14 @@ int mkbootfs_main(int argc, char *argv[])
         argv++;
     }
 
+    _emit_all();
     _eject_trailer();
+    _flush();
+
+    if(gzip_level >= 0) {
+        _deflate(0, 0, Z_FINISH);
+        deflateEnd(&zs);
+    }
 
     return 0;
 }
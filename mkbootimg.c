@@ -21,37 +21,155 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #include "mincrypt/sha.h"
 #include "bootimg.h"
-
-static void *load_file(const char *fn, unsigned *_sz)
+#include "mkbootimg.h"
+
+/* Sections are never loaded into memory.  Each one is described by the
+ * file (and offset) it comes from; the id hash is computed over an mmap
+ * of the sources, and the data goes to the image with copy_file_range()
+ * or sendfile(), so building or unpacking an image costs no more than a
+ * page of heap whatever the kernel and ramdisk sizes.
+ *
+ * With --update an existing image is used as the source of every section
+ * not given on the command line.  If no kept section has to move, only
+ * the header and the replaced sections are rewritten in place; otherwise
+ * a new image is streamed next to the old one and renamed over it.
+ */
+
+#define COPY_CHUNK (1024 * 1024)
+
+typedef struct {
+    int fd;             /* -1 if the section is empty */
+    off_t offset;
+    unsigned size;
+    int replaced;       /* given on the command line */
+} boot_section;
+
+enum { KERNEL, RAMDISK, SECOND, NUM_SECTIONS };
+
+static unsigned pad_size(unsigned size, unsigned pagesize)
 {
-    char *data;
-    int sz;
-    int fd;
-
-    data = 0;
-    fd = open(fn, O_RDONLY);
-    if(fd < 0) return 0;
+    return (size + pagesize - 1) & ~(pagesize - 1);
+}
 
-    sz = lseek(fd, 0, SEEK_END);
-    if(sz < 0) goto oops;
+static int copy_fallback(int in, off_t in_off, int out, size_t len)
+{
+    char buf[64 * 1024];
+
+    while (len > 0) {
+        ssize_t n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), in_off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        char *p = buf;
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t w = write(out, p, left);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            p += w;
+            left -= w;
+        }
+        in_off += n;
+        len -= n;
+    }
+    return 0;
+}
 
-    if(lseek(fd, 0, SEEK_SET) != 0) goto oops;
+/* Copies len bytes at in_off in 'in' to the current position of 'out',
+ * inside the kernel when it can. */
+int bootimg_copy(int in, off_t in_off, int out, size_t len)
+{
+#ifdef __NR_copy_file_range
+    while (len > 0) {
+        loff_t off = in_off;
+        ssize_t n = syscall(__NR_copy_file_range, in, &off, out, NULL,
+                            len < COPY_CHUNK ? len : COPY_CHUNK, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        in_off += n;
+        len -= n;
+    }
+    if (len == 0) return 0;
+#endif
+    while (len > 0) {
+        off_t off = in_off;
+        ssize_t n = sendfile(out, in, &off, len < COPY_CHUNK ? len : COPY_CHUNK);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        in_off += n;
+        len -= n;
+    }
+    if (len == 0) return 0;
+    return copy_fallback(in, in_off, out, len);
+}
 
-    data = (char*) malloc(sz);
-    if(data == 0) goto oops;
+static int open_section(const char *fn, boot_section *sec)
+{
+    struct stat st;
 
-    if(read(fd, data, sz) != sz) goto oops;
-    close(fd);
+    sec->fd = open(fn, O_RDONLY);
+    if(sec->fd < 0) return -1;
+    if(fstat(sec->fd, &st) < 0 || st.st_size > 0xffffffffLL) {
+        close(sec->fd);
+        sec->fd = -1;
+        return -1;
+    }
+    sec->offset = 0;
+    sec->size = st.st_size;
+    sec->replaced = 1;
+    return 0;
+}
 
-    if(_sz) *_sz = sz;
-    return data;
+/* returns -1 if the section can't be read in full */
+static int hash_section(SHA_CTX *ctx, const boot_section *sec)
+{
+    long pagemask = sysconf(_SC_PAGESIZE) - 1;
+    off_t start = sec->offset & ~(off_t)pagemask;
+    size_t len = sec->size + (sec->offset - start);
+    unsigned done = 0;
+
+    if(sec->size == 0) return 0;
+    unsigned char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, sec->fd, start);
+    if(map != MAP_FAILED) {
+        const unsigned char *data = map + (sec->offset - start);
+        madvise(map, len, MADV_SEQUENTIAL);
+        while(done < sec->size) {
+            unsigned n = sec->size - done < COPY_CHUNK ? sec->size - done : COPY_CHUNK;
+            SHA_update(ctx, data + done, n);
+            done += n;
+        }
+        munmap(map, len);
+        return 0;
+    }
 
-oops:
-    close(fd);
-    if(data != 0) free(data);
+    unsigned char buf[64 * 1024];
+    while(done < sec->size) {
+        unsigned n = sec->size - done < sizeof(buf) ? sec->size - done : sizeof(buf);
+        ssize_t r = pread(sec->fd, buf, n, sec->offset + done);
+        if(r <= 0) {
+            if(r < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        SHA_update(ctx, buf, r);
+        done += r;
+    }
     return 0;
 }
 
@@ -67,6 +185,7 @@ int mkbootimg_usage(void)
             "       [ --pagesize <pagesize> ]\n"
             "       [ --ramdiskaddr <address> ]\n"
             "       -o|--output <filename>\n"
+            "   or: mkbootimg --update <boot.img> [ any of the above ]\n"
             );
     return 1;
 }
@@ -86,28 +205,79 @@ int write_padding(int fd, unsigned pagesize, unsigned itemsize)
 
     count = pagesize - (itemsize & pagemask);
 
-    if(write(fd, padding, count) != (signed)count) {
-        return -1;
-    } else {
-        return 0;
+    /* pages may be bigger than the zero buffer */
+    while(count > 0) {
+        unsigned n = count < sizeof(padding) ? count : sizeof(padding);
+        if(write(fd, padding, n) != (signed)n) {
+            return -1;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+/* Any power of two the header fits in. */
+static int valid_page_size(unsigned pagesize)
+{
+    return pagesize >= sizeof(boot_img_hdr) && (pagesize & (pagesize - 1)) == 0;
+}
+
+/* Writes the sections marked in 'which' at their places in the image. */
+static int write_sections(int fd, boot_section *secs, unsigned pagesize, int which)
+{
+    off_t offset = pagesize;
+    int i;
+
+    for(i = 0; i < NUM_SECTIONS; i++) {
+        if(which & (1 << i) && secs[i].size > 0) {
+            if(lseek(fd, offset, SEEK_SET) != offset) return -1;
+            if(bootimg_copy(secs[i].fd, secs[i].offset, fd, secs[i].size)) return -1;
+            if(write_padding(fd, pagesize, secs[i].size)) return -1;
+        }
+        offset += pad_size(secs[i].size, pagesize);
     }
+    return 0;
+}
+
+/* Where the old image's sections start, and where the last one ends. */
+static off_t old_layout(const boot_img_hdr *old, off_t *offsets)
+{
+    unsigned sizes[NUM_SECTIONS] = { old->kernel_size, old->ramdisk_size, old->second_size };
+    off_t offset = old->page_size;
+    int i;
+
+    for(i = 0; i < NUM_SECTIONS; i++) {
+        offsets[i] = offset;
+        offset += pad_size(sizes[i], old->page_size);
+    }
+    return offset;
 }
 
 int mkbootimg_main(int argc, char **argv)
 {
     boot_img_hdr hdr;
+    boot_img_hdr old;
+    boot_section secs[NUM_SECTIONS];
+    off_t old_offsets[NUM_SECTIONS];
+    off_t old_end = 0;
 
     char *kernel_fn = 0;
-    void *kernel_data = 0;
     char *ramdisk_fn = 0;
-    void *ramdisk_data = 0;
     char *second_fn = 0;
-    void *second_data = 0;
-    char *cmdline = "";
+    char *cmdline = 0;
     char *bootimg = 0;
-    char *board = "";
-    unsigned pagesize = 2048;
-    int fd;
+    char *update = 0;
+    char *board = 0;
+    char tmpname[PATH_MAX];
+    unsigned pagesize = 0;
+    unsigned base = 0;
+    int have_base = 0;
+    unsigned ramdisk_addr = 0;
+    int have_ramdisk_addr = 0;
+    int fd = -1;
+    int image_fd = -1;
+    int in_place = 0;
+    int i;
     SHA_CTX ctx;
     const uint8_t* sha;
 
@@ -115,6 +285,8 @@ int mkbootimg_main(int argc, char **argv)
     argv++;
 
     memset(&hdr, 0, sizeof(hdr));
+    memset(secs, 0, sizeof(secs));
+    for(i = 0; i < NUM_SECTIONS; i++) secs[i].fd = -1;
 
         /* default load addresses */
     hdr.kernel_addr =  0x10008000;
@@ -132,6 +304,8 @@ int mkbootimg_main(int argc, char **argv)
         argv += 2;
         if(!strcmp(arg, "--output") || !strcmp(arg, "-o")) {
             bootimg = val;
+        } else if(!strcmp(arg, "--update")) {
+            update = val;
         } else if(!strcmp(arg, "--kernel")) {
             kernel_fn = val;
         } else if(!strcmp(arg, "--ramdisk")) {
@@ -141,18 +315,16 @@ int mkbootimg_main(int argc, char **argv)
         } else if(!strcmp(arg, "--cmdline")) {
             cmdline = val;
         } else if(!strcmp(arg, "--base")) {
-            unsigned base = strtoul(val, 0, 16);
-            hdr.kernel_addr =  base + 0x00008000;
-            hdr.ramdisk_addr = base + 0x01000000;
-            hdr.second_addr =  base + 0x00F00000;
-            hdr.tags_addr =    base + 0x00000100;
+            base = strtoul(val, 0, 16);
+            have_base = 1;
         } else if(!strcmp(arg, "--ramdiskaddr")) {
-            hdr.ramdisk_addr = strtoul(val, 0, 16);
+            ramdisk_addr = strtoul(val, 0, 16);
+            have_ramdisk_addr = 1;
         } else if(!strcmp(arg, "--board")) {
             board = val;
         } else if(!strcmp(arg,"--pagesize")) {
             pagesize = strtoul(val, 0, 10);
-            if ((pagesize != 2048) && (pagesize != 4096)) {
+            if (!valid_page_size(pagesize)) {
                 fprintf(stderr,"error: unsupported page size %d\n", pagesize);
                 return -1;
             }
@@ -160,104 +332,192 @@ int mkbootimg_main(int argc, char **argv)
             return mkbootimg_usage();
         }
     }
-    hdr.page_size = pagesize;
 
+    if(update) {
+        if(bootimg) {
+            fprintf(stderr,"error: --update and --output are exclusive\n");
+            return mkbootimg_usage();
+        }
+        bootimg = update;
+        image_fd = open(update, O_RDWR);
+        if(image_fd < 0 || pread(image_fd, &old, sizeof(old), 0) != sizeof(old) ||
+           memcmp(old.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0 ||
+           !valid_page_size(old.page_size)) {
+            fprintf(stderr,"error: '%s' is not a boot image\n", update);
+            if(image_fd >= 0) close(image_fd);
+            return 1;
+        }
+        /* start from the old header; the options override it */
+        memcpy(&hdr, &old, sizeof(hdr));
+        memset(hdr.id, 0, sizeof(hdr.id));
+        if(!pagesize) pagesize = old.page_size;
+        old_end = old_layout(&old, old_offsets);
+
+        unsigned sizes[NUM_SECTIONS] = { old.kernel_size, old.ramdisk_size, old.second_size };
+        for(i = 0; i < NUM_SECTIONS; i++) {
+            if(sizes[i] == 0) continue;
+            secs[i].fd = image_fd;
+            secs[i].offset = old_offsets[i];
+            secs[i].size = sizes[i];
+        }
+    } else {
+        if(bootimg == 0) {
+            fprintf(stderr,"error: no output filename specified\n");
+            return mkbootimg_usage();
+        }
+
+        if(kernel_fn == 0) {
+            fprintf(stderr,"error: no kernel image specified\n");
+            return mkbootimg_usage();
+        }
 
-    if(bootimg == 0) {
-        fprintf(stderr,"error: no output filename specified\n");
-        return mkbootimg_usage();
+        if(ramdisk_fn == 0) {
+            fprintf(stderr,"error: no ramdisk image specified\n");
+            return mkbootimg_usage();
+        }
+        if(!pagesize) pagesize = 2048;
+        if(!cmdline) cmdline = "";
+        if(!board) board = "";
+        memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
     }
+    hdr.page_size = pagesize;
 
-    if(kernel_fn == 0) {
-        fprintf(stderr,"error: no kernel image specified\n");
-        return mkbootimg_usage();
+    if(have_base) {
+        hdr.kernel_addr =  base + 0x00008000;
+        hdr.ramdisk_addr = base + 0x01000000;
+        hdr.second_addr =  base + 0x00F00000;
+        hdr.tags_addr =    base + 0x00000100;
     }
-
-    if(ramdisk_fn == 0) {
-        fprintf(stderr,"error: no ramdisk image specified\n");
-        return mkbootimg_usage();
+    if(have_ramdisk_addr) {
+        hdr.ramdisk_addr = ramdisk_addr;
     }
 
-    if(strlen(board) >= BOOT_NAME_SIZE) {
-        fprintf(stderr,"error: board name too large\n");
-        return mkbootimg_usage();
+    if(board) {
+        if(strlen(board) >= BOOT_NAME_SIZE) {
+            fprintf(stderr,"error: board name too large\n");
+            return mkbootimg_usage();
+        }
+        memset(hdr.name, 0, sizeof(hdr.name));
+        strcpy((char *)hdr.name, board);
     }
 
-    strcpy((char *)hdr.name, board);
-
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-
-    if(strlen(cmdline) > (BOOT_ARGS_SIZE - 1)) {
-        fprintf(stderr,"error: kernel commandline too large\n");
-        return 1;
+    if(cmdline) {
+        if(strlen(cmdline) > (BOOT_ARGS_SIZE - 1)) {
+            fprintf(stderr,"error: kernel commandline too large\n");
+            return 1;
+        }
+        memset(hdr.cmdline, 0, sizeof(hdr.cmdline));
+        strcpy((char*)hdr.cmdline, cmdline);
     }
-    strcpy((char*)hdr.cmdline, cmdline);
 
-    kernel_data = load_file(kernel_fn, &hdr.kernel_size);
-    if(kernel_data == 0) {
+    if(kernel_fn && open_section(kernel_fn, &secs[KERNEL])) {
         fprintf(stderr,"error: could not load kernel '%s'\n", kernel_fn);
         return 1;
     }
 
-    if(!strcmp(ramdisk_fn,"NONE")) {
-        ramdisk_data = 0;
-        hdr.ramdisk_size = 0;
-    } else {
-        ramdisk_data = load_file(ramdisk_fn, &hdr.ramdisk_size);
-        if(ramdisk_data == 0) {
+    if(ramdisk_fn) {
+        if(!strcmp(ramdisk_fn,"NONE")) {
+            secs[RAMDISK].fd = -1;
+            secs[RAMDISK].size = 0;
+            secs[RAMDISK].replaced = 1;
+        } else if(open_section(ramdisk_fn, &secs[RAMDISK])) {
             fprintf(stderr,"error: could not load ramdisk '%s'\n", ramdisk_fn);
             return 1;
         }
     }
 
-    if(second_fn) {
-        second_data = load_file(second_fn, &hdr.second_size);
-        if(second_data == 0) {
-            fprintf(stderr,"error: could not load secondstage '%s'\n", second_fn);
-            return 1;
-        }
+    if(second_fn && open_section(second_fn, &secs[SECOND])) {
+        fprintf(stderr,"error: could not load secondstage '%s'\n", second_fn);
+        return 1;
     }
 
+    hdr.kernel_size = secs[KERNEL].size;
+    hdr.ramdisk_size = secs[RAMDISK].size;
+    hdr.second_size = secs[SECOND].size;
+
     /* put a hash of the contents in the header so boot images can be
      * differentiated based on their first 2k.
      */
     SHA_init(&ctx);
-    SHA_update(&ctx, kernel_data, (int)hdr.kernel_size);
+    if(hash_section(&ctx, &secs[KERNEL])) goto read_fail;
     SHA_update(&ctx, &hdr.kernel_size, (int)sizeof(hdr.kernel_size));
-    SHA_update(&ctx, ramdisk_data, hdr.ramdisk_size);
+    if(hash_section(&ctx, &secs[RAMDISK])) goto read_fail;
     SHA_update(&ctx, &hdr.ramdisk_size, (int)sizeof(hdr.ramdisk_size));
-    SHA_update(&ctx, second_data, (int)hdr.second_size);
+    if(hash_section(&ctx, &secs[SECOND])) goto read_fail;
     SHA_update(&ctx, &hdr.second_size, (int)sizeof(hdr.second_size));
     sha = SHA_final(&ctx);
     memcpy(hdr.id, sha,
            SHA_DIGEST_SIZE > sizeof(hdr.id) ? sizeof(hdr.id) : SHA_DIGEST_SIZE);
 
-    fd = open(bootimg, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if(fd < 0) {
-        fprintf(stderr,"error: could not create '%s'\n", bootimg);
-        return 1;
+    if(update) {
+        /* kept sections must stay where they are */
+        off_t offset = pagesize;
+        in_place = pagesize == old.page_size;
+        for(i = 0; i < NUM_SECTIONS; i++) {
+            if(!secs[i].replaced && secs[i].size > 0 && offset != old_offsets[i])
+                in_place = 0;
+            offset += pad_size(secs[i].size, pagesize);
+        }
+    }
+
+    int which = 0;
+    if(in_place) {
+        fd = image_fd;
+        for(i = 0; i < NUM_SECTIONS; i++)
+            if(secs[i].replaced) which |= 1 << i;
+    } else {
+        which = (1 << NUM_SECTIONS) - 1;
+        if(update) {
+            snprintf(tmpname, sizeof(tmpname), "%s.tmp", update);
+            bootimg = tmpname;
+        }
+        fd = open(bootimg, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if(fd < 0) {
+            fprintf(stderr,"error: could not create '%s'\n", bootimg);
+            return 1;
+        }
     }
 
+    if(lseek(fd, 0, SEEK_SET) != 0) goto fail;
     if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
     if(write_padding(fd, pagesize, sizeof(hdr))) goto fail;
-
-    if(write(fd, kernel_data, hdr.kernel_size) != (signed)hdr.kernel_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.kernel_size)) goto fail;
-
-    if(write(fd, ramdisk_data, hdr.ramdisk_size) != (signed)hdr.ramdisk_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.ramdisk_size)) goto fail;
-
-    if(second_data) {
-        if(write(fd, second_data, hdr.second_size) != (signed)hdr.second_size) goto fail;
-        if(write_padding(fd, pagesize, hdr.ramdisk_size)) goto fail;
+    if(write_sections(fd, secs, pagesize, which)) goto fail;
+
+    if(in_place) {
+        off_t end = pagesize;
+        struct stat st;
+        for(i = 0; i < NUM_SECTIONS; i++)
+            end += pad_size(secs[i].size, pagesize);
+        /* drop the tail of a shrunken last section, but leave anything
+         * that was appended after the old image alone */
+        if(end < old_end && fstat(fd, &st) == 0 && st.st_size <= old_end &&
+           ftruncate(fd, end) < 0) goto fail;
     }
-
+    if(fsync(fd) < 0 && errno != EINVAL) goto fail;
+    if(update && !in_place && rename(tmpname, update) < 0) goto fail;
+    if(fd != image_fd) close(fd);
+
+    for(i = 0; i < NUM_SECTIONS; i++)
+        if(secs[i].fd >= 0 && secs[i].fd != image_fd) close(secs[i].fd);
+    if(image_fd >= 0) close(image_fd);
+    if(update)
+        printf("%s: %s\n", update, in_place ? "updated in place" : "rewritten");
     return 0;
 
+read_fail:
+    fprintf(stderr,"error: could not read the sections to hash them\n");
+    for(i = 0; i < NUM_SECTIONS; i++)
+        if(secs[i].fd >= 0 && secs[i].fd != image_fd) close(secs[i].fd);
+    if(image_fd >= 0) close(image_fd);
+    return 1;
+
 fail:
-    unlink(bootimg);
-    close(fd);
     fprintf(stderr,"error: failed writing '%s': %s\n", bootimg,
             strerror(errno));
+    if(!in_place) unlink(bootimg);
+    if(fd >= 0 && fd != image_fd) close(fd);
+    for(i = 0; i < NUM_SECTIONS; i++)
+        if(secs[i].fd >= 0 && secs[i].fd != image_fd) close(secs[i].fd);
+    if(image_fd >= 0) close(image_fd);
     return 1;
 }
@@ -1 +1,2 @@
 int mkbootimg_main(int argc, char **argv);
+int bootimg_copy(int in, off_t in_off, int out, size_t len);
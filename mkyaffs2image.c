@@ -0,0 +1,578 @@
+/*
+ * mkyaffs2image: build a yaffs2 file system image from a directory tree
+ *
+ * Counterpart of unyaffs.c.  This program is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2 as published by the Free Software Foundation.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "unyaffs.h"
+#include "mkyaffs2image.h"
+
+/*
+ * The tree is written one directory at a time: the headers and data of
+ * all the plain entries of a directory, then each subdirectory's header
+ * followed by its contents.  Restoring such an image reads it front to
+ * back.  Chunks (data + packed tags in the spare area) are assembled in
+ * place in a buffer of BATCH_CHUNKS chunks, file data is read straight
+ * into it with readv(), and the buffer goes out in one write() when it
+ * fills up.
+ */
+
+#define DEFAULT_CHUNK_SIZE 2048
+#define DEFAULT_SPARE_SIZE 64
+#define CHUNKS_PER_BLOCK 64
+#define BATCH_CHUNKS 256	/* four erase blocks */
+#define YAFFS_OBJECTID_ROOT 1
+#define YAFFS_FIRST_OBJECT_ID 257	/* 2..256 are reserved */
+#define YAFFS_LOWEST_SEQUENCE_NUMBER 0x00001000
+#define HEADER_BYTE_COUNT 0xffff
+
+typedef struct {
+	char *name;
+	struct stat st;
+} dir_entry;
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	unsigned id;		/* 0 if the slot is empty */
+} hard_link;
+
+typedef struct {
+	int out;
+	int chunk_size;
+	int stride;		/* chunk + spare */
+	unsigned char *buf;
+	int used;		/* chunks assembled in buf */
+	unsigned long long flushed;	/* chunks already written */
+
+	unsigned next_id;
+	hard_link *links;
+	int nlinks;
+	int nslots;
+
+	const char *const *exclude;
+	char path[PATH_MAX];
+	int errors;
+	int broken;		/* the image can't be written any more */
+	int objects;
+} mkyaffs_state;
+
+static unsigned char column_parity[256];
+
+/*
+ * Bit 0 is the parity of the whole byte; bits 2-7 are the column
+ * parities p1', p1, p2', p2, p4', p4 used by yaffs_ECCCalculateOther().
+ */
+static void
+init_column_parity(void)
+{
+	int b;
+
+	for (b = 0; b < 256; b++) {
+#define BIT(n) ((b >> (n)) & 1)
+		unsigned char p = 0;
+
+		p |= (BIT(7) ^ BIT(6) ^ BIT(5) ^ BIT(4)) << 7;
+		p |= (BIT(3) ^ BIT(2) ^ BIT(1) ^ BIT(0)) << 6;
+		p |= (BIT(7) ^ BIT(6) ^ BIT(3) ^ BIT(2)) << 5;
+		p |= (BIT(5) ^ BIT(4) ^ BIT(1) ^ BIT(0)) << 4;
+		p |= (BIT(7) ^ BIT(5) ^ BIT(3) ^ BIT(1)) << 3;
+		p |= (BIT(6) ^ BIT(4) ^ BIT(2) ^ BIT(0)) << 2;
+		p |= (BIT(7) ^ BIT(6) ^ BIT(5) ^ BIT(4) ^
+		      BIT(3) ^ BIT(2) ^ BIT(1) ^ BIT(0));
+		column_parity[b] = p;
+#undef BIT
+	}
+}
+
+/* The kernel checks this over the tags part when it reads them back. */
+static void
+tags_ecc(const unsigned char *data, unsigned n, yaffs_ECCOther *ecc)
+{
+	unsigned char col = 0;
+	unsigned line = 0, line_prime = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		unsigned char b = column_parity[data[i]];
+
+		col ^= b;
+		if (b & 1) {
+			line ^= i;
+			line_prime ^= ~i;
+		}
+	}
+	ecc->colParity = (col >> 2) & 0x3f;
+	ecc->lineParity = line;
+	ecc->lineParityPrime = line_prime;
+}
+
+static int
+flush_chunks(mkyaffs_state *s)
+{
+	const unsigned char *p = s->buf;
+	size_t left = (size_t)s->used * s->stride;
+
+	while (left > 0) {
+		ssize_t n = write(s->out, p, left);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write image");
+			s->broken = 1;
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+	s->flushed += s->used;
+	s->used = 0;
+	return 0;
+}
+
+/* Room for at least one more chunk; returns how many fit. */
+static int
+reserve_chunks(mkyaffs_state *s)
+{
+	if (s->used == BATCH_CHUNKS && flush_chunks(s) < 0)
+		return -1;
+	return BATCH_CHUNKS - s->used;
+}
+
+static unsigned char *
+chunk_at(mkyaffs_state *s, int i)
+{
+	return s->buf + (size_t)i * s->stride;
+}
+
+/* Pads the next chunk in the buffer and fills in its spare area. */
+static void
+finish_chunk(mkyaffs_state *s, unsigned obj_id, unsigned chunk_id,
+	     unsigned bytes)
+{
+	unsigned char *chunk = chunk_at(s, s->used);
+	unsigned long long index = s->flushed + s->used;
+	yaffs_PackedTags2 pt;
+
+	if (bytes < (unsigned)s->chunk_size && bytes != HEADER_BYTE_COUNT)
+		memset(chunk + bytes, 0xff, s->chunk_size - bytes);
+
+	memset(&pt, 0, sizeof(pt));
+	pt.t.sequenceNumber = YAFFS_LOWEST_SEQUENCE_NUMBER +
+		index / CHUNKS_PER_BLOCK;
+	pt.t.objectId = obj_id;
+	pt.t.chunkId = chunk_id;
+	pt.t.byteCount = bytes;
+	tags_ecc((const unsigned char *)&pt.t, sizeof(pt.t), &pt.ecc);
+
+	memset(chunk + s->chunk_size, 0xff, s->stride - s->chunk_size);
+	memcpy(chunk + s->chunk_size, &pt, sizeof(pt));
+	s->used++;
+}
+
+static int
+write_header(mkyaffs_state *s, unsigned id, unsigned parent,
+	     yaffs_ObjectType type, const char *name, const struct stat *st,
+	     const char *alias, unsigned equivalent)
+{
+	yaffs_ObjectHeader oh;
+	unsigned char *chunk;
+
+	if (reserve_chunks(s) < 0)
+		return -1;
+
+	memset(&oh, 0xff, sizeof(oh));
+	oh.type = type;
+	oh.parentObjectId = parent;
+	memset(oh.name, 0, sizeof(oh.name));
+	strncpy(oh.name, name, YAFFS_MAX_NAME_LENGTH);
+	if (type != YAFFS_OBJECT_TYPE_HARDLINK) {
+		oh.yst_mode = st->st_mode;
+		oh.yst_uid = st->st_uid;
+		oh.yst_gid = st->st_gid;
+		oh.yst_atime = st->st_atime;
+		oh.yst_mtime = st->st_mtime;
+		oh.yst_ctime = st->st_ctime;
+		oh.yst_rdev = st->st_rdev;
+	}
+	if (type == YAFFS_OBJECT_TYPE_FILE)
+		oh.fileSize = st->st_size;
+	if (type == YAFFS_OBJECT_TYPE_HARDLINK)
+		oh.equivalentObjectId = equivalent;
+	if (type == YAFFS_OBJECT_TYPE_SYMLINK) {
+		memset(oh.alias, 0, sizeof(oh.alias));
+		strncpy(oh.alias, alias, YAFFS_MAX_ALIAS_LENGTH);
+	}
+	oh.inbandShadowsObject = 0;
+	oh.inbandIsShrink = 0;
+	oh.shadowsObject = 0;
+	oh.isShrink = 0;
+
+	chunk = chunk_at(s, s->used);
+	memcpy(chunk, &oh, sizeof(oh));
+	memset(chunk + sizeof(oh), 0xff, s->chunk_size - sizeof(oh));
+	finish_chunk(s, id, 0, HEADER_BYTE_COUNT);
+	s->objects++;
+	return 0;
+}
+
+/* Streams the file into data chunks 1..n, as many per readv() as fit. */
+static int
+write_file_data(mkyaffs_state *s, int dirfd, const char *name, unsigned id,
+		off_t size)
+{
+	struct iovec iov[BATCH_CHUNKS];
+	unsigned chunk_id = 1;
+	off_t left = size;
+	int fd, i, n;
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "can't open %s: %s\n", s->path, strerror(errno));
+		return -1;
+	}
+	while (left > 0) {
+		n = reserve_chunks(s);
+		if (n < 0)
+			break;
+		if ((off_t)n * s->chunk_size > left)
+			n = (left + s->chunk_size - 1) / s->chunk_size;
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = chunk_at(s, s->used + i);
+			iov[i].iov_len = s->chunk_size;
+		}
+		if (left < (off_t)n * s->chunk_size)
+			iov[n - 1].iov_len = left - (off_t)(n - 1) * s->chunk_size;
+
+		ssize_t got = readv(fd, iov, n);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		for (i = 0; i < n && got > 0; i++) {
+			unsigned bytes = got < (ssize_t)iov[i].iov_len ?
+				(unsigned)got : iov[i].iov_len;
+
+			finish_chunk(s, id, chunk_id++, bytes);
+			got -= bytes;
+			left -= bytes;
+			/* a short chunk in the middle would corrupt the file */
+			if (bytes < iov[i].iov_len)
+				goto out;
+		}
+	}
+out:
+	close(fd);
+	if (left > 0) {
+		fprintf(stderr, "%s: short read (%lld bytes missing)\n", s->path,
+			(long long)left);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the object id already written for this inode, or 0. */
+static unsigned
+find_hard_link(mkyaffs_state *s, const struct stat *st, unsigned id)
+{
+	unsigned h;
+
+	if (s->nlinks * 2 >= s->nslots) {
+		hard_link *old = s->links;
+		int old_size = s->nslots, i;
+
+		s->nslots = old_size ? old_size * 2 : 256;
+		s->links = calloc(s->nslots, sizeof(hard_link));
+		if (s->links == NULL) {
+			s->links = old;
+			s->nslots = old_size;
+			return 0;
+		}
+		for (i = 0; i < old_size; i++) {
+			if (old[i].id == 0)
+				continue;
+			h = ((unsigned)old[i].ino * 2654435761U) & (s->nslots - 1);
+			while (s->links[h].id != 0)
+				h = (h + 1) & (s->nslots - 1);
+			s->links[h] = old[i];
+		}
+		free(old);
+	}
+
+	h = ((unsigned)st->st_ino * 2654435761U) & (s->nslots - 1);
+	while (s->links[h].id != 0) {
+		if (s->links[h].ino == st->st_ino && s->links[h].dev == st->st_dev)
+			return s->links[h].id;
+		h = (h + 1) & (s->nslots - 1);
+	}
+	s->links[h].dev = st->st_dev;
+	s->links[h].ino = st->st_ino;
+	s->links[h].id = id;
+	s->nlinks++;
+	return 0;
+}
+
+static int
+is_excluded(mkyaffs_state *s)
+{
+	const char *const *e;
+
+	for (e = s->exclude; e != NULL && *e != NULL; e++) {
+		if (strcmp(s->path, *e) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const dir_entry *)a)->name,
+		      ((const dir_entry *)b)->name);
+}
+
+/* Lists the directory, sorted by name, with each entry lstat()ed. */
+static dir_entry *
+read_entries(mkyaffs_state *s, int dirfd, int *count)
+{
+	dir_entry *entries = NULL;
+	int n = 0, allocd = 0;
+	struct dirent *de;
+	DIR *d;
+	int fd = dup(dirfd);
+
+	*count = 0;
+	if (fd < 0 || (d = fdopendir(fd)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (n == allocd) {
+			allocd = allocd ? allocd * 2 : 64;
+			dir_entry *e = realloc(entries, allocd * sizeof(dir_entry));
+
+			if (e == NULL)
+				break;
+			entries = e;
+		}
+		if (fstatat(dirfd, de->d_name, &entries[n].st,
+			    AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		entries[n].name = strdup(de->d_name);
+		if (entries[n].name != NULL)
+			n++;
+	}
+	closedir(d);
+	qsort(entries, n, sizeof(dir_entry), compare_entries);
+	*count = n;
+	return entries;
+}
+
+static int
+write_entry(mkyaffs_state *s, int dirfd, unsigned parent, dir_entry *e)
+{
+	unsigned id = s->next_id++;
+	unsigned equivalent;
+	char alias[YAFFS_MAX_ALIAS_LENGTH + 2];
+	mode_t mode = e->st.st_mode;
+	ssize_t len;
+
+	if (!S_ISDIR(mode) && e->st.st_nlink > 1 &&
+	    (equivalent = find_hard_link(s, &e->st, id)) != 0)
+		return write_header(s, id, parent, YAFFS_OBJECT_TYPE_HARDLINK,
+				    e->name, &e->st, NULL, equivalent);
+
+	if (S_ISREG(mode)) {
+		if (e->st.st_size > INT_MAX) {
+			fprintf(stderr, "%s: too large for yaffs2\n", s->path);
+			return -1;
+		}
+		if (write_header(s, id, parent, YAFFS_OBJECT_TYPE_FILE,
+				 e->name, &e->st, NULL, 0) < 0)
+			return -1;
+		return write_file_data(s, dirfd, e->name, id, e->st.st_size);
+	}
+	if (S_ISLNK(mode)) {
+		len = readlinkat(dirfd, e->name, alias, sizeof(alias) - 1);
+		if (len < 0 || len > YAFFS_MAX_ALIAS_LENGTH) {
+			fprintf(stderr, "%s: bad or too long symlink\n", s->path);
+			return -1;
+		}
+		alias[len] = '\0';
+		return write_header(s, id, parent, YAFFS_OBJECT_TYPE_SYMLINK,
+				    e->name, &e->st, alias, 0);
+	}
+	if (S_ISDIR(mode))
+		return write_header(s, id, parent, YAFFS_OBJECT_TYPE_DIRECTORY,
+				    e->name, &e->st, NULL, 0);
+	return write_header(s, id, parent, YAFFS_OBJECT_TYPE_SPECIAL,
+			    e->name, &e->st, NULL, 0);
+}
+
+static int
+write_directory(mkyaffs_state *s, int dirfd, unsigned dir_id)
+{
+	size_t pathlen = strlen(s->path);
+	dir_entry *entries;
+	int count, pass, i;
+
+	entries = read_entries(s, dirfd, &count);
+	if (count == 0) {
+		free(entries);
+		return 0;
+	}
+
+	/* plain entries first, then each subdirectory and its contents */
+	for (pass = 0; pass < 2 && !s->broken; pass++) {
+		for (i = 0; i < count && !s->broken; i++) {
+			dir_entry *e = &entries[i];
+			int is_dir = S_ISDIR(e->st.st_mode);
+
+			if (is_dir != pass)
+				continue;
+			snprintf(s->path + pathlen, sizeof(s->path) - pathlen,
+				 "/%s", e->name);
+			if (is_excluded(s))
+				continue;
+			/* yaffs makes its own lost+found at the root */
+			if (is_dir && dir_id == YAFFS_OBJECTID_ROOT &&
+			    strcmp(e->name, "lost+found") == 0)
+				continue;
+
+			unsigned id = s->next_id;
+
+			if (write_entry(s, dirfd, dir_id, e) < 0) {
+				s->errors++;
+				continue;
+			}
+			if (!is_dir)
+				continue;
+
+			int fd = openat(dirfd, e->name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+			if (fd < 0) {
+				fprintf(stderr, "can't open %s: %s\n", s->path,
+					strerror(errno));
+				s->errors++;
+				continue;
+			}
+			write_directory(s, fd, id);
+			close(fd);
+		}
+	}
+	s->path[pathlen] = '\0';
+
+	for (i = 0; i < count; i++)
+		free(entries[i].name);
+	free(entries);
+	return 0;
+}
+
+int
+mkyaffs2image(const char *dir, const char *image, int chunk_size,
+	      int spare_size, const char *const *exclude)
+{
+	mkyaffs_state s;
+	struct timespec start, end;
+	int rootfd;
+
+	if (chunk_size < (int)sizeof(yaffs_ObjectHeader) ||
+	    spare_size < (int)sizeof(yaffs_PackedTags2)) {
+		fprintf(stderr, "chunk %d / spare %d too small\n", chunk_size,
+			spare_size);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_column_parity();
+
+	memset(&s, 0, sizeof(s));
+	s.chunk_size = chunk_size;
+	s.stride = chunk_size + spare_size;
+	s.next_id = YAFFS_FIRST_OBJECT_ID;
+	s.exclude = exclude;
+	snprintf(s.path, sizeof(s.path), "%s", dir);
+	/* exclusions are full paths; keep "/" from doubling up */
+	if (strcmp(s.path, "/") == 0)
+		s.path[0] = '\0';
+
+	rootfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0) {
+		fprintf(stderr, "can't open %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	s.buf = malloc((size_t)BATCH_CHUNKS * s.stride);
+	s.out = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (s.buf == NULL || s.out < 0) {
+		fprintf(stderr, "can't create %s: %s\n", image, strerror(errno));
+		free(s.buf);
+		close(rootfd);
+		if (s.out >= 0)
+			close(s.out);
+		return 1;
+	}
+
+	write_directory(&s, rootfd, YAFFS_OBJECTID_ROOT);
+	close(rootfd);
+	if (s.broken || flush_chunks(&s) < 0)
+		s.errors++;
+	if (close(s.out) < 0) {
+		perror("close image");
+		s.errors++;
+	}
+	free(s.buf);
+	free(s.links);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("mkyaffs2image: %d objects, %llu chunks in %ld ms%s\n",
+	       s.objects, s.flushed,
+	       (end.tv_sec - start.tv_sec) * 1000 +
+	       (end.tv_nsec - start.tv_nsec) / 1000000,
+	       s.errors ? " (with errors)" : "");
+	return s.errors ? 1 : 0;
+}
+
+int mkyaffs2image_main(int argc, char **argv)
+{
+	int chunk_size = DEFAULT_CHUNK_SIZE;
+	int spare_size = DEFAULT_SPARE_SIZE;
+	int i = 1;
+
+	while (i + 1 < argc && argv[i][0] == '-') {
+		if (strcmp(argv[i], "-c") == 0)
+			chunk_size = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			spare_size = atoi(argv[i + 1]);
+		else
+			break;
+		i += 2;
+	}
+	if (argc - i != 2) {
+		printf("Usage: mkyaffs2image [-c chunk_size] [-s spare_size] dir image_file_name\n");
+		printf("  defaults: -c %d -s %d (use -c 4096 -s 128 for 4KiB pages)\n",
+		       DEFAULT_CHUNK_SIZE, DEFAULT_SPARE_SIZE);
+		exit(1);
+	}
+	return mkyaffs2image(argv[i], argv[i + 1], chunk_size, spare_size,
+			     NULL);
+}
@@ -0,0 +1,2 @@
+int mkyaffs2image(const char *dir, const char *image, int chunk_size, int spare_size, const char *const *exclude);
+int mkyaffs2image_main(int argc, char **argv);
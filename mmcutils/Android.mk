@@ -11,6 +11,8 @@ endif
 LOCAL_SRC_FILES := \
 	mmcutils.c
 
+LOCAL_C_INCLUDES += bootable/recovery
+
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
 
@@ -38,8 +38,13 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>		// for _IOW, _IOR, mount()
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
 
 #include "mmcutils.h"
+#include "flashutils/flashutils.h"
+#include "flashutils/rawio.h"
 
 unsigned ext3_count = 0;
 char *ext3_partitions[] = { "system", "userdata", "cache", "NONE" };
@@ -488,108 +493,16 @@ mmc_mount_partition (const MmcPartition * partition, const char *mount_point,
 int
 mmc_raw_copy (const MmcPartition * partition, char *in_file)
 {
-  int ch;
-  FILE *in;
-  FILE *out;
-  int val = 0;
-  char buf[512];
-  unsigned sz = 0;
-  unsigned i;
-  int ret = -1;
-  char *out_file = partition->device_index;
-
-  in = fopen (in_file, "r");
-  if (in == NULL)
-    goto ERROR3;
-
-  out = fopen (out_file, "w");
-  if (out == NULL)
-    goto ERROR2;
-
-  fseek (in, 0L, SEEK_END);
-  sz = ftell (in);
-  fseek (in, 0L, SEEK_SET);
-
-  if (sz % 512)
-	  {
-	    while ((ch = fgetc (in)) != EOF)
-	      fputc (ch, out);
-	  }
-  else
-	  {
-	    for (i = 0; i < (sz / 512); i++)
-		    {
-		      if ((fread (buf, 512, 1, in)) != 1)
-			goto ERROR1;
-		      if ((fwrite (buf, 512, 1, out)) != 1)
-			goto ERROR1;
-		    }
-	  }
-
-  fsync (out);
-  ret = 0;
-ERROR1:
-  fclose (out);
-ERROR2:
-  fclose (in);
-ERROR3:
-  return ret;
-
+  return rawio_copy_path (in_file, partition->device_index, 0) < 0 ? -1 : 0;
 }
 
 
 int
 mmc_raw_dump_internal (const char *in_file, const char *out_file)
 {
-  int ch;
-  FILE *in;
-  FILE *out;
-  int val = 0;
-  char buf[512];
-  unsigned sz = 0;
-  unsigned i;
-  int ret = -1;
-
-  in = fopen (in_file, "r");
-  if (in == NULL)
-    goto ERROR3;
-
-  out = fopen (out_file, "w");
-  if (out == NULL)
-    goto ERROR2;
-
-  fseek (in, 0L, SEEK_END);
-  sz = ftell (in);
-  fseek (in, 0L, SEEK_SET);
-
-  if (sz % 512)
-	  {
-	    while ((ch = fgetc (in)) != EOF)
-	      fputc (ch, out);
-	  }
-  else
-	  {
-	    for (i = 0; i < (sz / 512); i++)
-		    {
-		      if ((fread (buf, 512, 1, in)) != 1)
-			goto ERROR1;
-		      if ((fwrite (buf, 512, 1, out)) != 1)
-			goto ERROR1;
-		    }
-	  }
-
-  fsync (out);
-  ret = 0;
-ERROR1:
-  fclose (out);
-ERROR2:
-  fclose (in);
-ERROR3:
-  return ret;
-
+  return rawio_copy_path (in_file, out_file, 0) < 0 ? -1 : 0;
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition * partition, char *out_file)
 {
@@ -655,6 +568,122 @@ ERROR3:
 
 }
 
+// Older kernel headers don't have these.
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12,114,size_t)
+#endif
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12,125)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+// Some controllers time out on one huge discard, so go in chunks.
+#define DISCARD_CHUNK (256ULL * 1024 * 1024)
+#define ZERO_FILL_SIZE (1024 * 1024)
+
+static int
+mmc_zero_fill (int fd, uint64_t size)
+{
+  uint64_t range[2] = { 0, size };
+
+  if (ioctl (fd, BLKZEROOUT, &range) == 0)
+    return 0;
+
+  char *zeros = calloc (1, ZERO_FILL_SIZE);
+  uint64_t pos = 0;
+
+  if (zeros == NULL)
+    return -1;
+  while (pos < size)
+	  {
+	    size_t len = size - pos < ZERO_FILL_SIZE ?
+	      (size_t) (size - pos) : ZERO_FILL_SIZE;
+	    ssize_t written = pwrite64 (fd, zeros, len, pos);
+
+	    if (written <= 0)
+		    {
+		      if (written < 0 && errno == EINTR)
+			continue;
+		      free (zeros);
+		      return -1;
+		    }
+	    pos += written;
+	  }
+  free (zeros);
+  return fsync (fd);
+}
+
+int
+mmc_discard_device (const char *device, int flags)
+{
+  uint64_t size, pos;
+  int fd;
+  int ret = -1;
+
+  // mtdblock and bml are block views of raw NAND: writing zeros through
+  // them skips the erase, wears the chip and leaves the OOB/ECC stale.
+  if (strncmp (device, "/dev/block/mtdblock", 19) == 0 ||
+      strncmp (device, "/dev/block/bml", 14) == 0)
+	  {
+	    errno = EOPNOTSUPP;
+	    return -1;
+	  }
+  fd = open (device, O_RDWR);
+  if (fd < 0)
+    return -1;
+  if (ioctl (fd, BLKGETSIZE64, &size) < 0)
+    goto done;
+
+  unsigned long request = (flags & MMC_DISCARD_SECURE) ?
+    BLKSECDISCARD : BLKDISCARD;
+
+  for (pos = 0; pos < size; pos += DISCARD_CHUNK)
+	  {
+	    uint64_t range[2];
+
+	    range[0] = pos;
+	    range[1] = size - pos < DISCARD_CHUNK ? size - pos : DISCARD_CHUNK;
+	    if (ioctl (fd, request, &range) < 0)
+	      break;
+	  }
+  if (pos >= size)
+	  {
+	    ret = 0;
+	    goto done;
+	  }
+  // A discard that fails part way leaves the rest of the device as it
+  // was, so the fallback starts over from the beginning.
+  printf ("%s of %s failed (%s)\n",
+	  (flags & MMC_DISCARD_SECURE) ? "BLKSECDISCARD" : "BLKDISCARD",
+	  device, strerror (errno));
+  if (flags & MMC_DISCARD_ZERO)
+	  {
+	    printf ("Zero-filling %s instead\n", device);
+	    ret = mmc_zero_fill (fd, size);
+	  }
+  else
+	  {
+	    errno = EOPNOTSUPP;
+	  }
+
+done:
+  if (ret < 0)
+	  {
+	    int save = errno;
+
+	    close (fd);
+	    errno = save;
+	    return -1;
+	  }
+  close (fd);
+  return 0;
+}
+
 int
 cmd_mmc_restore_raw_partition (const char *partition, const char *filename)
 {
@@ -693,6 +722,8 @@ cmd_mmc_backup_raw_partition (const char *partition, const char *filename)
 	  }
 }
 
+// Nothing to do: eMMC needs no erase before it is written.  Recovery
+// discards the partition first when the fast wipe mode asks for it.
 int
 cmd_mmc_erase_raw_partition (const char *partition)
 {
@@ -736,3 +767,83 @@ cmd_mmc_get_partition_device (const char *partition, char *device)
   strcpy (device, p->device_index);
   return 0;
 }
+
+typedef struct
+{
+  FlashWriter base;
+  int fd;
+} MmcRawWriter;
+
+static int
+mmc_raw_writer_write (FlashWriter * w, const char *data, size_t len)
+{
+  MmcRawWriter *m = (MmcRawWriter *) w;
+
+  while (len > 0)
+	  {
+	    ssize_t n = write (m->fd, data, len);
+
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    if (n <= 0)
+	      return -1;
+	    data += n;
+	    len -= n;
+	  }
+  return 0;
+}
+
+static int
+mmc_raw_writer_skip (FlashWriter * w, off_t len)
+{
+  MmcRawWriter *m = (MmcRawWriter *) w;
+
+  return lseek (m->fd, len, SEEK_CUR) == (off_t) - 1 ? -1 : 0;
+}
+
+static int
+mmc_raw_writer_close (FlashWriter * w)
+{
+  MmcRawWriter *m = (MmcRawWriter *) w;
+  int ret = 0;
+
+  if (fsync (m->fd))
+    ret = -1;
+  if (close (m->fd))
+    ret = -1;
+  free (m);
+  return ret;
+}
+
+FlashWriter *
+cmd_mmc_open_raw_partition_writer (const char *partition)
+{
+  const char *device = partition;
+  MmcRawWriter *m;
+
+  if (partition[0] != '/')
+	  {
+	    const MmcPartition *p;
+
+	    mmc_scan_partitions ();
+	    p = mmc_find_partition_by_name (partition);
+	    if (p == NULL)
+	      return NULL;
+	    device = p->device_index;
+	  }
+  m = calloc (1, sizeof (*m));
+  if (m == NULL)
+    return NULL;
+  m->fd = open (device, O_WRONLY | O_LARGEFILE);
+  if (m->fd < 0)
+	  {
+	    printf ("error opening %s: %s\n", device, strerror (errno));
+	    free (m);
+	    return NULL;
+	  }
+  m->base.write = mmc_raw_writer_write;
+  m->base.skip = mmc_raw_writer_skip;
+  m->base.close = mmc_raw_writer_close;
+  m->base.abort = NULL;
+  return &m->base;
+}
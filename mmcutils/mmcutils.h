@@ -83,6 +83,15 @@ int mmc_raw_copy (const MmcPartition * partition, char *in_file);
 int mmc_raw_read (const MmcPartition * partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition * partition, char *data, int data_size);
 
+/* Flags for mmc_discard_device() */
+#define MMC_DISCARD_SECURE        1	/* BLKSECDISCARD instead of BLKDISCARD */
+#define MMC_DISCARD_ZERO          2	/* zero-fill if discard isn't supported */
+
+/* Discard every block of a block device.  Returns -1 with errno set to
+ * EOPNOTSUPP if the device can't discard and MMC_DISCARD_ZERO wasn't
+ * given, or if it is an mtdblock/bml view of raw NAND (never zeroed). */
+int mmc_discard_device (const char *device, int flags);
+
 int format_ext2_device (const char *device);
 int format_ext3_device (const char *device);
 
@@ -6,6 +6,7 @@
 #include "recovery.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "prefs.h"
 
 #ifndef BOARD_UMS_LUNFILE
 #define BOARD_UMS_LUNFILE	"/sys/devices/platform/usb_mass_storage/lun0/file"
@@ -92,15 +93,9 @@ is_usb_storage_enabled ()
 
 void show_usb_menu()
 {
-  char *mode = calloc(5, sizeof(char)+1);
+  char mode[8];
  
-  if (access("/tmp/.rzrpref_usb", F_OK) != -1) 
-  {
-    FILE* fp = fopen("/tmp/.rzrpref_usb", "r");
-	fgets(mode, 5, fp);
-	fclose(fp);
-  }
-  else mode = "fat";
+  if (pref_get("usb", mode, sizeof(mode)) != 0) strcpy(mode, "fat");
   
   int ext;
   if (strcmp(mode,"ext") == 0) ext = 1;
@@ -19,87 +19,216 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
 
+/* The table is kept between calls and only re-read when it may have
+ * changed: /proc/mounts reports POLLERR|POLLPRI whenever anything is
+ * mounted or unmounted, and recovery's own (u)mounts invalidate it
+ * directly.  All strings point into one copy of the file's text, and
+ * lookups go through hashes by mount point and by device.
+ */
 typedef struct
 {
   MountedVolume *volumes;
   int volumes_allocd;
   int volume_count;
+  char *text;			// the file, NUL-split into fields
+  size_t text_allocd;
+  int *by_mount_point;		// index + 1, 0 if empty
+  int *by_device;
+  int hash_size;
+  int fd;			// kept open for poll()
+  int valid;
 } MountsState;
 
 static MountsState g_mounts_state = {
   NULL,				// volumes
   0,				// volumes_allocd
-  0				// volume_count
+  0,				// volume_count
+  NULL,				// text
+  0,				// text_allocd
+  NULL,				// by_mount_point
+  NULL,				// by_device
+  0,				// hash_size
+  -1,				// fd
+  0				// valid
 };
 
-static inline void
-free_volume_internals (const MountedVolume * volume, int zero)
+#define PROC_MOUNTS_FILENAME   "/proc/mounts"
+
+void
+invalidate_mounted_volumes ()
 {
-  free ((char *) volume->device);
-  free ((char *) volume->mount_point);
-  free ((char *) volume->filesystem);
-  free ((char *) volume->flags);
-  if (zero)
+  g_mounts_state.valid = 0;
+}
+
+static unsigned int
+hash_string (const char *s)
+{
+  unsigned int h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+static void
+hash_insert (int *table, const char *key, int index)
+{
+  unsigned int mask = g_mounts_state.hash_size - 1;
+  unsigned int h = hash_string (key) & mask;
+
+  while (table[h] != 0)
 	  {
-	    memset ((void *) volume, 0, sizeof (*volume));
+	    // keep the first entry, as the old linear search did
+	    const MountedVolume *v = &g_mounts_state.volumes[table[h] - 1];
+
+	    if (table == g_mounts_state.by_device ?
+		strcmp (v->device, key) == 0 :
+		strcmp (v->mount_point, key) == 0)
+	      return;
+	    h = (h + 1) & mask;
 	  }
+  table[h] = index + 1;
 }
 
-#define PROC_MOUNTS_FILENAME   "/proc/mounts"
-
-int
-scan_mounted_volumes ()
+static int
+rebuild_hashes ()
 {
-  char buf[2048];
-  const char *bufp;
-  int fd;
-  ssize_t nbytes;
+  MountsState *s = &g_mounts_state;
+  int size = 16;
+  int i;
 
-  if (g_mounts_state.volumes == NULL)
+  while (size < s->volume_count * 2)
+    size *= 2;
+  if (size != s->hash_size)
 	  {
-	    const int numv = 32;
-	    MountedVolume *volumes = malloc (numv * sizeof (*volumes));
+	    int *mp = realloc (s->by_mount_point, size * sizeof (int));
+	    int *dev = realloc (s->by_device, size * sizeof (int));
 
-	    if (volumes == NULL)
+	    if (mp != NULL)
+	      s->by_mount_point = mp;
+	    if (dev != NULL)
+	      s->by_device = dev;
+	    if (mp == NULL || dev == NULL)
 		    {
 		      errno = ENOMEM;
 		      return -1;
 		    }
-	    g_mounts_state.volumes = volumes;
-	    g_mounts_state.volumes_allocd = numv;
-	    memset (volumes, 0, numv * sizeof (*volumes));
+	    s->hash_size = size;
 	  }
-  else
+  memset (s->by_mount_point, 0, size * sizeof (int));
+  memset (s->by_device, 0, size * sizeof (int));
+  for (i = 0; i < s->volume_count; i++)
 	  {
-	    /* Free the old volume strings.
-	     */
-	    int i;
+	    hash_insert (s->by_mount_point, s->volumes[i].mount_point, i);
+	    hash_insert (s->by_device, s->volumes[i].device, i);
+	  }
+  return 0;
+}
+
+// Read the whole file, however big, into g_mounts_state.text.
+static ssize_t
+read_proc_mounts ()
+{
+  MountsState *s = &g_mounts_state;
+  size_t len = 0;
 
-	    for (i = 0; i < g_mounts_state.volume_count; i++)
+  if (s->fd < 0)
+	  {
+	    s->fd = open (PROC_MOUNTS_FILENAME, O_RDONLY);
+	    if (s->fd < 0)
+	      return -1;
+	  }
+  else if (lseek (s->fd, 0, SEEK_SET) < 0)
+	  {
+	    return -1;
+	  }
+  for (;;)
+	  {
+	    if (len + 1 >= s->text_allocd)
 		    {
-		      free_volume_internals (&g_mounts_state.volumes[i], 1);
+		      size_t size = s->text_allocd ? s->text_allocd * 2 : 4096;
+		      char *text = realloc (s->text, size);
+
+		      if (text == NULL)
+			      {
+				errno = ENOMEM;
+				return -1;
+			      }
+		      s->text = text;
+		      s->text_allocd = size;
 		    }
-	  }
-  g_mounts_state.volume_count = 0;
 
-  /* Open and read the file contents.
-   */
-  fd = open (PROC_MOUNTS_FILENAME, O_RDONLY);
-  if (fd < 0)
-	  {
-	    goto bail;
+	    ssize_t n = read (s->fd, s->text + len, s->text_allocd - len - 1);
+
+	    if (n < 0)
+		    {
+		      if (errno == EINTR)
+			continue;
+		      return -1;
+		    }
+	    if (n == 0)
+	      break;
+	    len += n;
 	  }
-  nbytes = read (fd, buf, sizeof (buf) - 1);
-  close (fd);
-  if (nbytes < 0)
+  s->text[len] = '\0';
+  return len;
+}
+
+// True if the kernel says the table changed since we last looked.
+static int
+proc_mounts_changed ()
+{
+  struct pollfd pfd;
+
+  if (g_mounts_state.fd < 0)
+    return 1;
+  pfd.fd = g_mounts_state.fd;
+  pfd.events = POLLERR | POLLPRI;
+  pfd.revents = 0;
+  if (poll (&pfd, 1, 0) < 0)
+    return 1;
+  return (pfd.revents & (POLLERR | POLLPRI)) != 0;
+}
+
+// Next space-separated field of the line at *p, NUL-terminated in
+// place.
+static char *
+next_field (char **p)
+{
+  char *start = *p + strspn (*p, " \t");
+
+  if (*start == '\0')
 	  {
-	    goto bail;
+	    *p = start;
+	    return NULL;
 	  }
-  buf[nbytes] = '\0';
+  char *end = start + strcspn (start, " \t");
+
+  if (*end != '\0')
+    *end++ = '\0';
+  *p = end;
+  return start;
+}
+
+int
+scan_mounted_volumes ()
+{
+  MountsState *s = &g_mounts_state;
+
+  if (proc_mounts_changed ())
+    s->valid = 0;
+  if (s->valid)
+    return 0;
+  s->volume_count = 0;
+
+  if (read_proc_mounts () < 0)
+    goto bail;
 
   /* Parse the contents of the file, which looks like:
    *
@@ -115,110 +244,99 @@ scan_mounted_volumes ()
    * The zeroes at the end are dummy placeholder fields to make the
    * output match Linux's /etc/mtab, but don't represent anything here.
    */
-  bufp = buf;
-  while (nbytes > 0)
+  char *line = s->text;
+
+  while (*line)
 	  {
-	    char device[64];
-	    char mount_point[64];
-	    char filesystem[64];
-	    char flags[128];
-	    int matches;
+	    char *eol = strchr (line, '\n');
+	    char *next = eol ? eol + 1 : line + strlen (line);
+	    char *p = line;
+	    char *device, *mount_point, *filesystem, *flags;
 
-	    /* %as is a gnu extension that malloc()s a string for each field.
-	     */
-	    matches = sscanf (bufp, "%63s %63s %63s %127s",
-			      device, mount_point, filesystem, flags);
+	    if (eol)
+	      *eol = '\0';
+	    device = next_field (&p);
+	    mount_point = device ? next_field (&p) : NULL;
+	    filesystem = mount_point ? next_field (&p) : NULL;
+	    flags = filesystem ? next_field (&p) : NULL;
 
-	    if (matches == 4)
-		    {
-		      device[sizeof (device) - 1] = '\0';
-		      mount_point[sizeof (mount_point) - 1] = '\0';
-		      filesystem[sizeof (filesystem) - 1] = '\0';
-		      flags[sizeof (flags) - 1] = '\0';
-
-		      MountedVolume *v =
-			&g_mounts_state.volumes[g_mounts_state.
-						volume_count++];
-		      v->device = strdup (device);
-		      v->mount_point = strdup (mount_point);
-		      v->filesystem = strdup (filesystem);
-		      v->flags = strdup (flags);
-		    }
-	    else
+	    if (flags != NULL)
 		    {
-		      printf ("matches was %d on <<%.40s>>\n", matches, bufp);
-		    }
+		      if (s->volume_count == s->volumes_allocd)
+			      {
+				int numv = s->volumes_allocd ?
+				  s->volumes_allocd * 2 : 32;
+				MountedVolume *volumes =
+				  realloc (s->volumes, numv * sizeof (*volumes));
 
-	    /* Eat the line.
-	     */
-	    while (nbytes > 0 && *bufp != '\n')
-		    {
-		      bufp++;
-		      nbytes--;
+				if (volumes == NULL)
+					{
+					  errno = ENOMEM;
+					  goto bail;
+					}
+				s->volumes = volumes;
+				s->volumes_allocd = numv;
+			      }
+		      MountedVolume *v = &s->volumes[s->volume_count++];
+
+		      v->device = device;
+		      v->mount_point = mount_point;
+		      v->filesystem = filesystem;
+		      v->flags = flags;
 		    }
-	    if (nbytes > 0)
+	    else if (device != NULL)
 		    {
-		      bufp++;
-		      nbytes--;
+		      printf ("can't parse mount line <<%.40s>>\n", line);
 		    }
+	    line = next;
 	  }
 
+  if (rebuild_hashes () < 0)
+    goto bail;
+  s->valid = 1;
   return 0;
 
 bail:
-//TODO: free the strings we've allocated.
-  g_mounts_state.volume_count = 0;
+  s->volume_count = 0;
+  s->valid = 0;
   return -1;
 }
 
-const MountedVolume *
-find_mounted_volume_by_device (const char *device)
+static const MountedVolume *
+hash_find (const int *table, const char *key, int by_device)
 {
-  if (g_mounts_state.volumes != NULL)
-	  {
-	    int i;
+  MountsState *s = &g_mounts_state;
 
-	    for (i = 0; i < g_mounts_state.volume_count; i++)
-		    {
-		      MountedVolume *v = &g_mounts_state.volumes[i];
+  if (table == NULL || s->volume_count == 0)
+    return NULL;
 
-		      /* May be null if it was unmounted and we haven't rescanned.
-		       */
-		      if (v->device != NULL)
-			      {
-				if (strcmp (v->device, device) == 0)
-					{
-					  return v;
-					}
-			      }
-		    }
+  unsigned int mask = s->hash_size - 1;
+  unsigned int h = hash_string (key) & mask;
+
+  while (table[h] != 0)
+	  {
+	    const MountedVolume *v = &s->volumes[table[h] - 1];
+	    const char *k = by_device ? v->device : v->mount_point;
+
+	    /* May be null if it was unmounted and we haven't rescanned.
+	     */
+	    if (k != NULL && strcmp (k, key) == 0)
+	      return v;
+	    h = (h + 1) & mask;
 	  }
   return NULL;
 }
 
 const MountedVolume *
-find_mounted_volume_by_mount_point (const char *mount_point)
+find_mounted_volume_by_device (const char *device)
 {
-  if (g_mounts_state.volumes != NULL)
-	  {
-	    int i;
-
-	    for (i = 0; i < g_mounts_state.volume_count; i++)
-		    {
-		      MountedVolume *v = &g_mounts_state.volumes[i];
+  return hash_find (g_mounts_state.by_device, device, 1);
+}
 
-		      /* May be null if it was unmounted and we haven't rescanned.
-		       */
-		      if (v->mount_point != NULL)
-			      {
-				if (strcmp (v->mount_point, mount_point) == 0)
-					{
-					  return v;
-					}
-			      }
-		    }
-	  }
-  return NULL;
+const MountedVolume *
+find_mounted_volume_by_mount_point (const char *mount_point)
+{
+  return hash_find (g_mounts_state.by_mount_point, mount_point, 0);
 }
 
 int
@@ -232,7 +350,10 @@ unmount_mounted_volume (const MountedVolume * volume)
 
   if (ret == 0)
 	  {
-	    free_volume_internals (volume, 1);
+	    /* The strings belong to the table; just forget them.
+	     */
+	    memset ((void *) volume, 0, sizeof (*volume));
+	    invalidate_mounted_volumes ();
 	    return 0;
 	  }
   return ret;
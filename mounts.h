@@ -25,8 +25,16 @@ typedef struct
   const char *flags;
 } MountedVolume;
 
+/* Cheap when nothing has been (un)mounted since the last call; the
+ * table is only re-read when it may have changed.
+ */
 int scan_mounted_volumes (void);
 
+/* Force the next scan_mounted_volumes() to re-read /proc/mounts.  Call
+ * after mounting something.
+ */
+void invalidate_mounted_volumes (void);
+
 const MountedVolume *find_mounted_volume_by_device (const char *device);
 
 const MountedVolume *find_mounted_volume_by_mount_point (const char
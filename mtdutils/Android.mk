@@ -5,13 +5,14 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := mtdutils.c
+LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_MODULE := libmtdutils
 include $(BUILD_STATIC_LIBRARY)
 
 ifeq ($(BOARD_USES_BML_OVER_MTD),true)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := bml_over_mtd.c
-LOCAL_C_INCLUDES += bootable/recovery/mtdutils
+LOCAL_C_INCLUDES += bootable/recovery/mtdutils bootable/recovery
 LOCAL_MODULE := libbml_over_mtd
 LOCAL_MODULE_TAGS := eng
 LOCAL_CFLAGS += -Dmain=bml_over_mtd_main
@@ -25,8 +26,8 @@ LOCAL_MODULE_CLASS := UTILITY_EXECUTABLES
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/symbols/utilities
 LOCAL_MODULE_STEM := bml_over_mtd
-LOCAL_C_INCLUDES += bootable/recovery/mtdutils
-LOCAL_STATIC_LIBRARIES := libmtdutils libcutils libc
+LOCAL_C_INCLUDES += bootable/recovery/mtdutils bootable/recovery
+LOCAL_STATIC_LIBRARIES := libmtdutils libflashutils librawio libcutils libc
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 include $(BUILD_EXECUTABLE)
 endif
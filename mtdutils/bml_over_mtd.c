@@ -30,6 +30,7 @@
 #include <mtd/mtd-user.h>
 
 #include "mtdutils.h"
+#include "flashutils/rawio.h"
 
 typedef struct BmlOverMtdReadContext
 {
@@ -514,6 +515,50 @@ ReleaseBlockMapping (const unsigned short *blockMapping)
   free ((void *) blockMapping);
 }
 
+// Consecutive blocks that are either all good or all remapped to
+// consecutive reservoir blocks make one run, read in one go.
+typedef struct
+{
+  const unsigned short *blockMapping;
+  int numBlocks;
+  int currblock;
+  size_t erase_size;
+  int srcFd;
+  int resFd;
+} BmlRunSource;
+
+static int
+next_bml_run (void *cookie, int *fd, off64_t * offset, size_t * len)
+{
+  BmlRunSource *runs = (BmlRunSource *) cookie;
+  const unsigned short *map = runs->blockMapping;
+  int start = runs->currblock;
+  int end = start + 1;
+
+  if (start >= runs->numBlocks)
+    return 0;
+  if (map[start] == 0xffff)
+	  {
+	    //Good blocks, use src partition
+	    while (end < runs->numBlocks && map[end] == 0xffff)
+	      ++end;
+	    *fd = runs->srcFd;
+	    *offset = (off64_t) start * runs->erase_size;
+	  }
+  else
+	  {
+	    //Bad blocks, use mapped blocks in reservoir partition
+	    while (end < runs->numBlocks && map[end] != 0xffff &&
+		   map[end] == map[end - 1] + 1)
+	      ++end;
+	    *fd = runs->resFd;
+	    *offset = (off64_t) map[start] * runs->erase_size;
+	  }
+  *len = (end - start) * runs->erase_size;
+  runs->currblock = end;
+  return 1;
+}
+
 static int
 dump_bml_partition (const MtdPartition * pSrcPart,
 		    const MtdPartition * pReservoirPart,
@@ -547,92 +592,28 @@ dump_bml_partition (const MtdPartition * pSrcPart,
 	    return -1;
 	  }
 
+  BmlRunSource runs;
 
-  int numBlocks = pSrcPart->size / pSrcPart->erase_size;
-  int currblock = 0;
+  runs.blockMapping = blockMapping;
+  runs.numBlocks = pSrcPart->size / pSrcPart->erase_size;
+  runs.currblock = 0;
+  runs.erase_size = pSrcPart->erase_size;
+  runs.srcFd = pSrcRead->fd;
+  runs.resFd = pResRead->fd;
 
-  for (; currblock < numBlocks; ++currblock)
-	  {
-	    int srcFd = -1;
-
-	    if (blockMapping[currblock] == 0xffff)
-		    {
-		      //Good block, use src partition
-		      srcFd = pSrcRead->fd;
-		      if (lseek64
-			  (pSrcRead->fd, currblock * pSrcPart->erase_size,
-			   SEEK_SET) == -1)
-			      {
-				close (fd);
-				bml_over_mtd_read_close (pSrcRead);
-				bml_over_mtd_read_close (pResRead);
-				fprintf (stderr,
-					 "dump_bml_partition: lseek in src partition failed\n");
-				return -1;
-			      }
-		    }
-	    else
-		    {
-		      //Bad block, use mapped block in reservoir partition
-		      srcFd = pResRead->fd;
-		      if (lseek64
-			  (pResRead->fd,
-			   blockMapping[currblock] * pSrcPart->erase_size,
-			   SEEK_SET) == -1)
-			      {
-				close (fd);
-				bml_over_mtd_read_close (pSrcRead);
-				bml_over_mtd_read_close (pResRead);
-				fprintf (stderr,
-					 "dump_bml_partition: lseek in reservoir partition failed\n");
-				return -1;
-			      }
-		    }
-	    size_t blockBytesRead = 0;
-
-	    while (blockBytesRead < pSrcPart->erase_size)
-		    {
-		      ssize_t len =
-			read (srcFd, pSrcRead->buffer + blockBytesRead,
-			      pSrcPart->erase_size - blockBytesRead);
-
-		      if (len <= 0)
-			      {
-				close (fd);
-				bml_over_mtd_read_close (pSrcRead);
-				bml_over_mtd_read_close (pResRead);
-				fprintf (stderr,
-					 "dump_bml_partition: reading partition failed\n");
-				return -1;
-			      }
-		      blockBytesRead += len;
-		    }
-
-	    size_t blockBytesWritten = 0;
-
-	    while (blockBytesWritten < pSrcPart->erase_size)
-		    {
-		      ssize_t len =
-			write (fd, pSrcRead->buffer + blockBytesWritten,
-			       pSrcPart->erase_size - blockBytesWritten);
-
-		      if (len <= 0)
-			      {
-				close (fd);
-				bml_over_mtd_read_close (pSrcRead);
-				bml_over_mtd_read_close (pResRead);
-				fprintf (stderr,
-					 "dump_bml_partition: writing partition dump file failed\n");
-				return -1;
-			      }
-		      blockBytesWritten += len;
-		    }
-
-	  }
+  long long copied = rawio_copy_pieces (next_bml_run, &runs, fd, 0);
 
   bml_over_mtd_read_close (pSrcRead);
   bml_over_mtd_read_close (pResRead);
 
+  if (copied < 0)
+	  {
+	    close (fd);
+	    unlink (filename);
+	    fprintf (stderr, "dump_bml_partition: copying partition failed\n");
+	    return -1;
+	  }
+
   if (close (fd))
 	  {
 	    unlink (filename);
@@ -22,11 +22,13 @@
 #include <errno.h>
 #include <sys/mount.h>		// for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <pthread.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
 
 #include "mtdutils.h"
+#include "flashutils/flashutils.h"
 
 struct MtdReadContext
 {
@@ -61,12 +63,19 @@ static MtdState g_mtd_state = {
   -1				// partition_count
 };
 
+// Restores run on several threads, each of which may rescan.  Scans
+// and lookups share this lock, and a rescan only touches the entries
+// that actually changed, so a partition found earlier stays valid.
+static pthread_mutex_t g_mtd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
+#define MTD_MAX_PARTITIONS  32
 
-int
-mtd_scan_partitions ()
+static int
+scan_partitions_locked (void)
 {
   char buf[2048];
+  char seen[MTD_MAX_PARTITIONS];
   const char *bufp;
   int fd;
   int i;
@@ -74,7 +83,7 @@ mtd_scan_partitions ()
 
   if (g_mtd_state.partitions == NULL)
 	  {
-	    const int nump = 32;
+	    const int nump = MTD_MAX_PARTITIONS;
 	    MtdPartition *partitions = malloc (nump * sizeof (*partitions));
 
 	    if (partitions == NULL)
@@ -87,22 +96,7 @@ mtd_scan_partitions ()
 	    memset (partitions, 0, nump * sizeof (*partitions));
 	  }
   g_mtd_state.partition_count = 0;
-
-  /* Initialize all of the entries to make things easier later.
-   * (Lets us handle sparsely-numbered partitions, which
-   * may not even be possible.)
-   */
-  for (i = 0; i < g_mtd_state.partitions_allocd; i++)
-	  {
-	    MtdPartition *p = &g_mtd_state.partitions[i];
-
-	    if (p->name != NULL)
-		    {
-		      free (p->name);
-		      p->name = NULL;
-		    }
-	    p->device_index = -1;
-	  }
+  memset (seen, 0, sizeof (seen));
 
   /* Open and read the file contents.
    */
@@ -145,19 +139,26 @@ mtd_scan_partitions ()
 	    /* This will fail on the first line, which just contains
 	     * column headers.
 	     */
-	    if (matches == 4)
+	    if (matches == 4 && mtdnum >= 0
+		&& mtdnum < g_mtd_state.partitions_allocd)
 		    {
 		      MtdPartition *p = &g_mtd_state.partitions[mtdnum];
 
+		      if (p->name == NULL || strcmp (p->name, mtdname) != 0)
+			      {
+				free (p->name);
+				p->name = strdup (mtdname);
+				if (p->name == NULL)
+					{
+					  p->device_index = -1;
+					  errno = ENOMEM;
+					  goto bail;
+					}
+			      }
 		      p->device_index = mtdnum;
 		      p->size = mtdsize;
 		      p->erase_size = mtderasesize;
-		      p->name = strdup (mtdname);
-		      if (p->name == NULL)
-			      {
-				errno = ENOMEM;
-				goto bail;
-			      }
+		      seen[mtdnum] = 1;
 		      g_mtd_state.partition_count++;
 		    }
 
@@ -175,6 +176,20 @@ mtd_scan_partitions ()
 		    }
 	  }
 
+  /* Drop whatever has gone from /proc/mtd since the last scan.
+   */
+  for (i = 0; i < g_mtd_state.partitions_allocd; i++)
+	  {
+	    MtdPartition *p = &g_mtd_state.partitions[i];
+
+	    if (!seen[i] && p->name != NULL)
+		    {
+		      free (p->name);
+		      p->name = NULL;
+		      p->device_index = -1;
+		    }
+	  }
+
   return g_mtd_state.partition_count;
 
 bail:
@@ -183,8 +198,19 @@ bail:
   return -1;
 }
 
-const MtdPartition *
-mtd_find_partition_by_name (const char *name)
+int
+mtd_scan_partitions ()
+{
+  int ret;
+
+  pthread_mutex_lock (&g_mtd_lock);
+  ret = scan_partitions_locked ();
+  pthread_mutex_unlock (&g_mtd_lock);
+  return ret;
+}
+
+static const MtdPartition *
+find_partition_locked (const char *name)
 {
   if (g_mtd_state.partitions != NULL)
 	  {
@@ -206,6 +232,29 @@ mtd_find_partition_by_name (const char *name)
   return NULL;
 }
 
+const MtdPartition *
+mtd_find_partition_by_name (const char *name)
+{
+  const MtdPartition *p;
+
+  pthread_mutex_lock (&g_mtd_lock);
+  p = find_partition_locked (name);
+  pthread_mutex_unlock (&g_mtd_lock);
+  return p;
+}
+
+const MtdPartition *
+mtd_lookup_partition (const char *name)
+{
+  const MtdPartition *p = NULL;
+
+  pthread_mutex_lock (&g_mtd_lock);
+  if (scan_partitions_locked () > 0)
+    p = find_partition_locked (name);
+  pthread_mutex_unlock (&g_mtd_lock);
+  return p;
+}
+
 int
 mtd_mount_partition (const MtdPartition * partition, const char *mount_point,
 		     const char *filesystem, int read_only)
@@ -734,12 +783,7 @@ cmd_mtd_restore_raw_partition (const char *partition_name,
   void *data;
   unsigned sz;
 
-  if (mtd_scan_partitions () <= 0)
-	  {
-	    printf ("error scanning partitions");
-	    return -1;
-	  }
-  const MtdPartition *partition = mtd_find_partition_by_name (partition_name);
+  const MtdPartition *partition = mtd_lookup_partition (partition_name);
 
   if (partition == NULL)
 	  {
@@ -916,13 +960,7 @@ cmd_mtd_backup_raw_partition (const char *partition_name,
   int wrote;
   int len;
 
-  if (mtd_scan_partitions () <= 0)
-	  {
-	    printf ("error scanning partitions");
-	    return -1;
-	  }
-
-  partition = mtd_find_partition_by_name (partition_name);
+  partition = mtd_lookup_partition (partition_name);
   if (partition == NULL)
 	  {
 	    printf ("can't find %s partition", partition_name);
@@ -993,12 +1031,7 @@ cmd_mtd_erase_raw_partition (const char *partition_name)
   size_t total_size;
   size_t erase_size;
 
-  if (mtd_scan_partitions () <= 0)
-	  {
-	    printf ("error scanning partitions");
-	    return -1;
-	  }
-  const MtdPartition *p = mtd_find_partition_by_name (partition_name);
+  const MtdPartition *p = mtd_lookup_partition (partition_name);
 
   if (p == NULL)
 	  {
@@ -1038,10 +1071,9 @@ int
 cmd_mtd_mount_partition (const char *partition, const char *mount_point,
 			 const char *filesystem, int read_only)
 {
-  mtd_scan_partitions ();
   const MtdPartition *p;
 
-  p = mtd_find_partition_by_name (partition);
+  p = mtd_lookup_partition (partition);
   if (p == NULL)
 	  {
 	    return -1;
@@ -1052,11 +1084,150 @@ cmd_mtd_mount_partition (const char *partition, const char *mount_point,
 int
 cmd_mtd_get_partition_device (const char *partition, char *device)
 {
-  mtd_scan_partitions ();
-  MtdPartition *p = mtd_find_partition_by_name (partition);
+  const MtdPartition *p = mtd_lookup_partition (partition);
 
   if (p == NULL)
     return -1;
   sprintf (device, "/dev/block/mtdblock%d", p->device_index);
   return 0;
 }
+
+// As in cmd_mtd_restore_raw_partition(), the first erase block goes on
+// last, so a restore cut short doesn't leave a bootable half image.
+typedef struct
+{
+  FlashWriter base;
+  MtdPartition partition;	// own copy, good for the re-open in close
+  MtdWriteContext *out;
+  char *first;
+  size_t first_len;
+} MtdRawWriter;
+
+static int
+mtd_raw_writer_write (FlashWriter * w, const char *data, size_t len)
+{
+  MtdRawWriter *m = (MtdRawWriter *) w;
+  size_t erase_size = m->partition.erase_size;
+
+  if (m->first_len < erase_size)
+	  {
+	    size_t n = erase_size - m->first_len;
+
+	    if (n > len)
+	      n = len;
+	    memcpy (m->first + m->first_len, data, n);
+	    m->first_len += n;
+	    data += n;
+	    len -= n;
+	    if (m->first_len < erase_size)
+	      return 0;
+	    // hold its place
+	    memset (m->first + erase_size, 0, erase_size);
+	    if (mtd_write_data (m->out, m->first + erase_size, erase_size) !=
+		(ssize_t) erase_size)
+	      return -1;
+	  }
+  if (len > 0 && mtd_write_data (m->out, data, len) != (ssize_t) len)
+    return -1;
+  return 0;
+}
+
+static int
+mtd_raw_writer_close (FlashWriter * w)
+{
+  MtdRawWriter *m = (MtdRawWriter *) w;
+  int ret = 0;
+
+  if (m->first_len < m->partition.erase_size)
+	  {
+	    // it all fit in one block, which hasn't been written yet
+	    if (mtd_write_data (m->out, m->first, m->first_len) !=
+		(ssize_t) m->first_len)
+	      ret = -1;
+	  }
+  if (mtd_write_close (m->out))
+    ret = -1;
+  if (ret == 0 && m->first_len == m->partition.erase_size)
+	  {
+	    m->out = mtd_write_partition (&m->partition);
+	    if (m->out == NULL)
+	      ret = -1;
+	    else
+		    {
+		      if (mtd_write_data (m->out, m->first, m->first_len) !=
+			  (ssize_t) m->first_len)
+			ret = -1;
+		      if (mtd_write_close (m->out))
+			ret = -1;
+		    }
+	  }
+  free (m->partition.name);
+  free (m->first);
+  free (m);
+  return ret;
+}
+
+// The image is incomplete, so the first block, held back until now,
+// must not go on; the zeros standing in for it stay.
+static void
+mtd_raw_writer_abort (FlashWriter * w)
+{
+  MtdRawWriter *m = (MtdRawWriter *) w;
+
+  mtd_write_close (m->out);
+  free (m->partition.name);
+  free (m->first);
+  free (m);
+}
+
+// Copies the entry out while holding the scan lock, so the writer
+// doesn't depend on the shared table after open.
+static int
+copy_partition (const char *name, MtdPartition * out)
+{
+  const MtdPartition *p = NULL;
+
+  pthread_mutex_lock (&g_mtd_lock);
+  if (scan_partitions_locked () > 0)
+    p = find_partition_locked (name);
+  if (p != NULL)
+	  {
+	    *out = *p;
+	    out->name = strdup (p->name);
+	  }
+  pthread_mutex_unlock (&g_mtd_lock);
+  return p != NULL ? 0 : -1;
+}
+
+FlashWriter *
+cmd_mtd_open_raw_partition_writer (const char *partition_name)
+{
+  MtdRawWriter *m;
+
+  m = calloc (1, sizeof (*m));
+  if (m == NULL)
+    return NULL;
+  if (copy_partition (partition_name, &m->partition) != 0)
+	  {
+	    printf ("can't find %s partition\n", partition_name);
+	    free (m);
+	    return NULL;
+	  }
+  // the first block, and zeros to stand in for it
+  m->first = malloc (m->partition.erase_size * 2);
+  if (m->partition.name != NULL && m->first != NULL)
+    m->out = mtd_write_partition (&m->partition);
+  if (m->out == NULL)
+	  {
+	    printf ("error writing %s\n", partition_name);
+	    free (m->partition.name);
+	    free (m->first);
+	    free (m);
+	    return NULL;
+	  }
+  m->base.write = mtd_raw_writer_write;
+  m->base.skip = NULL;
+  m->base.close = mtd_raw_writer_close;
+  m->base.abort = mtd_raw_writer_abort;
+  return &m->base;
+}
@@ -25,6 +25,11 @@ int mtd_scan_partitions (void);
 
 const MtdPartition *mtd_find_partition_by_name (const char *name);
 
+/* rescan and find "name" in one step, safe against other threads doing
+ * the same.  NULL if the scan fails or there is no such partition.
+ */
+const MtdPartition *mtd_lookup_partition (const char *name);
+
 /* mount_point is like "/system"
  * filesystem is like "yaffs2"
  */
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <linux/input.h>
 #include <sys/wait.h>
@@ -21,6 +22,26 @@
 #include "nandroid.h"
 #include "install_menu.h"
 #include "dirsize.h"
+#include "mkyaffs2image.h"
+#include "unyaffs.h"
+#include "prefs.h"
+#include "nandroid_catalog.h"
+#include "nandroid_verify.h"
+#include "restore_scheduler.h"
+#include "raw_restore.h"
+
+#include <zlib.h>
+
+// yaffs2 volumes can be backed up as file-level yaffs2 images instead of
+// tarballs; these only hold the files, not the free space, and restore
+// through unyaffs in one sequential pass.
+#define YAFFS2_CHUNK_SIZE 2048
+#define YAFFS2_SPARE_SIZE 64
+
+#define BACKUP_BUF (128 * 1024)
+
+// The backup being written, for the catalogue.
+static CatalogEntry backup_entry;
 
 int reboot_afterwards;
 char timestamp[64];
@@ -108,11 +129,96 @@ void get_prefix(char partitions)
 }
   
   
+int get_yaffs2_images()
+{
+  return pref_isset("yaffs2img");
+}
+
+void set_yaffs2_images(int on)
+{
+  if (on) pref_set("yaffs2img", "1");
+  else pref_unset("yaffs2img");
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Runs 'cmd', a tar writing to stdout, and stores what it writes in
+// 'path', taking the CRC on the way so the catalogue doesn't have to
+// read the archive back.
+static int tar_to_file(const char* cmd, const char* path)
+{
+  int pipefd[2];
+  int status = 0;
+  int failed = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    LOGE("Can't create %s (%s)\n", path, strerror(errno));
+    return -1;
+  }
+  if (pipe(pipefd) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    dup2(pipefd[1], 1);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+    execl("/sbin/sh", "sh", "-c", cmd, NULL);
+    _exit(127);
+  }
+  close(pipefd[1]);
+
+  unsigned char* buf = malloc(BACKUP_BUF);
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  long long size = 0;
+  ssize_t n = 0;
+  if (pid < 0 || buf == NULL) failed = 1;
+  while (!failed)
+  {
+    n = read(pipefd[0], buf, BACKUP_BUF);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    crc = crc32(crc, buf, n);
+    // on a full card, closing the pipe below stops tar
+    if (write_all(fd, buf, n)) failed = 1;
+    size += n;
+  }
+  close(pipefd[0]);
+  if (pid > 0) waitpid(pid, &status, 0);
+  if (close(fd) || n < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+  free(buf);
+  if (failed) return -1;
+  catalog_add_file(&backup_entry, strrchr(path, '/') + 1, size, crc);
+  return 0;
+}
+
+static int is_yaffs2_volume(Volume *v)
+{
+  return (v->flags & VOLUME_MTD) && !(v->flags & VOLUME_RAW);
+}
+
 int backup_partition(const char* partition, const char* PREFIX, int compress, int progress)
 {
   Volume *v = volume_for_path(partition);
   char* NANDROID_DIR = get_nandroid_dir();
   char TAR_OPTS[5]="c";
+  char archive[PATH_MAX];
   if (progress) strcat(TAR_OPTS, "v");
   char* EXTENSION = NULL;
   if (compress) {
@@ -138,9 +244,10 @@ int backup_partition(const char* partition, const char* PREFIX, int compress, in
 
   //totalfiles = compute_files(partition);
   char tar_cmd[1024];
-  sprintf(tar_cmd, "cd %s/.android_secure && tar %s %s/secure.%s .", STORAGE_ROOT, TAR_OPTS, PREFIX, EXTENSION);
-  printf("tar_cmd: %s\n", tar_cmd);
-  if (__system(tar_cmd))
+  sprintf(tar_cmd, "cd %s/.android_secure && tar %s - .", STORAGE_ROOT, TAR_OPTS);
+  sprintf(archive, "%s/secure.%s", PREFIX, EXTENSION);
+  printf("tar_cmd: %s > %s\n", tar_cmd, archive);
+  if (tar_to_file(tar_cmd, archive))
   {
     ui_print("Failed!\n");
     status = -1;
@@ -154,7 +261,28 @@ int backup_partition(const char* partition, const char* PREFIX, int compress, in
   return status;
   } 
     
-  if (strcmp(v->fs_type, "mtd") != 0 && strcmp(v->fs_type, "emmc") != 0 && strcmp(v->fs_type, "bml"))
+  if (is_yaffs2_volume(v) && get_yaffs2_images())
+  {
+    const char *exclude[] = { "/data/media", NULL };
+    char image[PATH_MAX];
+    sprintf(image, "%s%s.yaffs2", PREFIX, partition);
+    printf("backing up %s to %s\n", partition, image);
+    ensure_path_mounted(partition);
+    status = mkyaffs2image(partition, image, YAFFS2_CHUNK_SIZE, YAFFS2_SPARE_SIZE, exclude) ? -1 : 0;
+    ensure_path_unmounted(partition);
+    if (status)
+    {
+      ui_print("Failed!\n");
+    }
+    else
+    {
+      ui_print("Success!\n");
+      ui_reset_text_col();
+    }
+    return status;
+  }
+
+  if (!(v->flags & VOLUME_RAW))
   {
     ensure_path_mounted(partition);
 	
@@ -163,14 +291,15 @@ int backup_partition(const char* partition, const char* PREFIX, int compress, in
 	char tar_cmd[1024];
   if (strcmp(partition, "/data") == 0)
   {
-    sprintf(tar_cmd, "cd %s && tar %s %s%s.%s . --exclude './media'", partition, TAR_OPTS, PREFIX, partition, EXTENSION, partition);
+    sprintf(tar_cmd, "cd %s && tar %s - . --exclude './media'", partition, TAR_OPTS);
   }
   else
 	{
-	  sprintf(tar_cmd, "cd %s && tar %s %s%s.%s .", partition, TAR_OPTS, PREFIX, partition, EXTENSION, partition);
+	  sprintf(tar_cmd, "cd %s && tar %s - .", partition, TAR_OPTS);
 	}
-	printf("tar_cmd: %s\n", tar_cmd);
-  if (__system(tar_cmd))
+	sprintf(archive, "%s%s.%s", PREFIX, partition, EXTENSION);
+	printf("tar_cmd: %s > %s\n", tar_cmd, archive);
+  if (tar_to_file(tar_cmd, archive))
 	{
 	  ui_print("Failed!\n");
 	  ensure_path_unmounted(partition);
@@ -211,122 +340,152 @@ int backup_partition(const char* partition, const char* PREFIX, int compress, in
   return status;
 }  
 
-int restore_partition(const char* partition, const char* PREFIX, int progress)
+// checks of the restore in progress, see nandroid_native()
+static BackupVerify *restore_verify = NULL;
+
+static int archive_verified(const char* path)
 {
-  char* STORAGE_ROOT = get_storage_root();
-  Volume *v = volume_for_path(partition);
-  
-  char TAR_OPTS[5]="x";
-  if (progress) strcat(TAR_OPTS, "v");
-  char* EXTENSION = NULL;
-  int compress;
+  if (restore_verify == NULL) return 1;
+  if (verify_backup_ok(restore_verify, strrchr(path, '/') + 1)) return 1;
+  ui_print("%s is damaged, not restoring it.\n", strrchr(path, '/') + 1);
+  return 0;
+}
+
+enum { RESTORE_TAR, RESTORE_SECURE, RESTORE_YAFFS2, RESTORE_RAW };
+
+// one partition of the restore, the cookie of its RestoreJob
+typedef struct
+{
+  const char* partition;
+  const char* PREFIX;
+  int progress;
+  int kind;
+  char archive[PATH_MAX];
+  char TAR_OPTS[5];
+} PartitionRestore;
+
+static void find_archive(PartitionRestore* r)
+{
+  Volume *v = volume_for_path(r->partition);
   char tarfilename[PATH_MAX];
   char tgzfilename[PATH_MAX];
-  if (strstr(partition, ".android_secure"))
+  if (strstr(r->partition, ".android_secure"))
   {
-    sprintf(tarfilename, "%s/secure.tar", PREFIX, partition);
-    sprintf(tgzfilename, "%s/secure.tar.gz", PREFIX, partition);
+    r->kind = RESTORE_SECURE;
+    sprintf(tarfilename, "%s/secure.tar", r->PREFIX);
+    sprintf(tgzfilename, "%s/secure.tar.gz", r->PREFIX);
   }
   else
   {
-    sprintf(tarfilename, "%s%s.tar", PREFIX, partition);
-    sprintf(tgzfilename, "%s%s.tar.gz", PREFIX, partition);
+    sprintf(tarfilename, "%s%s.tar", r->PREFIX, r->partition);
+    sprintf(tgzfilename, "%s%s.tar.gz", r->PREFIX, r->partition);
+    sprintf(r->archive, "%s%s.yaffs2", r->PREFIX, r->partition);
+    if (is_yaffs2_volume(v) && access(r->archive, F_OK) != -1) r->kind = RESTORE_YAFFS2;
+    else if (v->flags & VOLUME_RAW) r->kind = RESTORE_RAW;
+    else r->kind = RESTORE_TAR;
   }
-  
-  if (access(tgzfilename, F_OK) != -1 && access(tarfilename, F_OK) == -1) compress = 1;
-  if (access(tarfilename, F_OK) != -1 && access(tgzfilename, F_OK) == -1) compress = 0;
-  if (compress) {
-    strcat(TAR_OPTS, "z");
-	EXTENSION = "tar.gz";
+  if (r->kind == RESTORE_RAW)
+  {
+    sprintf(r->archive, "%s%s.img", r->PREFIX, r->partition);
+    if (access(r->archive, F_OK) == -1) strcat(r->archive, ".gz");
   }
-  else
+  else if (r->kind != RESTORE_YAFFS2)
   {
-    EXTENSION = "tar";
+    strcpy(r->TAR_OPTS, "x");
+    if (r->progress) strcat(r->TAR_OPTS, "v");
+    if (access(tgzfilename, F_OK) != -1 && access(tarfilename, F_OK) == -1)
+    {
+      strcat(r->TAR_OPTS, "z");
+      strcpy(r->archive, tgzfilename);
+    }
+    else
+    {
+      strcpy(r->archive, tarfilename);
+    }
+    strcat(r->TAR_OPTS, "f");
   }
-  strcat(TAR_OPTS, "f");
+}
+
+// empties the partition, once its archive is known to be good
+static int restore_prepare(RestoreJob* job)
+{
+  PartitionRestore* r = (PartitionRestore*) job->cookie;
+  find_archive(r);
+  printf("restoring %s from %s\n", r->partition, r->archive);
+  if (!archive_verified(r->archive)) return -1;
+
+  if (r->kind == RESTORE_SECURE)
+  {
+    char secure_path[PATH_MAX];
+    sprintf(secure_path, "%s/.android_secure", get_storage_root());
+    delete_tree(secure_path, NULL, 1);
+  }
+  else if (r->kind != RESTORE_RAW) //raw images are written over whole
+  {
+    if (format_volume(r->partition) != 0)
+    {
+      LOGE("Can't format %s\n", r->partition);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int restore_extract(RestoreJob* job)
+{
+  PartitionRestore* r = (PartitionRestore*) job->cookie;
   int status;
 
-  ui_print("Restoring %s... ", partition);
-  
-  if (strstr(partition, ".android_secure"))
+  if (r->kind == RESTORE_SECURE)
   {
-  char rm_cmd[PATH_MAX];
-  sprintf(rm_cmd, "rm -rf %s/.android_secure/*", STORAGE_ROOT);
-  __system(rm_cmd);
-  char tar_cmd[PATH_MAX];  
-  sprintf(tar_cmd, "tar %s %s/secure.%s -C %s/.android_secure", TAR_OPTS, PREFIX, EXTENSION, STORAGE_ROOT);
-  printf("tar_cmd: %s\n", tar_cmd);
-  if (__system(tar_cmd))
+    char tar_cmd[PATH_MAX];
+    sprintf(tar_cmd, "tar %s %s -C %s/.android_secure", r->TAR_OPTS, r->archive, get_storage_root());
+    printf("tar_cmd: %s\n", tar_cmd);
+    return __system(tar_cmd) ? -1 : 0;
+  }
+  //never unpack into the mount point itself
+  if (r->kind != RESTORE_RAW && ensure_path_mounted(r->partition) != 0)
   {
-    ui_print("Failed!\n");
-    status = -1;
-  } 
-  else
-	{
-	  ui_print("Success!\n");
-    	  ui_reset_text_col();
-    	  status = 0;
-	}
-  ui_reset_progress();
-  return status;
+    LOGE("Can't mount %s\n", r->partition);
+    return -1;
   }
-  
-  if (strcmp(v->fs_type, "mtd") != 0 && strcmp(v->fs_type, "emmc") != 0 && strcmp(v->fs_type, "bml"))
-  { 
-    format_volume(partition);
-  ensure_path_mounted(partition);
+  if (r->kind == RESTORE_YAFFS2)
+  {
+    status = unyaffs_extract(r->archive, r->partition, YAFFS2_CHUNK_SIZE, YAFFS2_SPARE_SIZE) ? -1 : 0;
+    ensure_path_unmounted(r->partition);
+    return status;
+  }
+  if (r->kind == RESTORE_TAR)
+  {
     char tar_cmd[1024];
-  sprintf(tar_cmd, "tar %s %s%s.%s -C %s", TAR_OPTS, PREFIX, partition, EXTENSION, partition);
-	printf("tar_cmd: %s\n", tar_cmd);
-	if (__system(tar_cmd))
-	{
-	  ui_print("Failed!\n");
-	  ensure_path_unmounted(partition);
-	  status = -1;
-	} 
-	else
-	{
-	  ui_print("Success!\n");
-	  ui_reset_text_col();
-	  ensure_path_unmounted(partition);
-	  status = 0;
-	}
+    sprintf(tar_cmd, "tar %s %s -C %s", r->TAR_OPTS, r->archive, r->partition);
+    printf("tar_cmd: %s\n", tar_cmd);
+    status = __system(tar_cmd) ? -1 : 0;
+    ensure_path_unmounted(r->partition);
+    return status;
   }
-  else //must be mtd, bml, or emmc - restore raw
-  {
-    printf("must be raw...\n");
-         
-	//must pull the / off the partition name for flash_img...
-	char* strptr = strstr(partition, "/") +  1;
-	char* result = calloc(strlen(strptr) + 1, sizeof(char));
-	strcpy(result, strptr);  
-	
 
-	char rawimg[PATH_MAX];
-	char flash_cmd[PATH_MAX];
-	strcpy(rawimg, PREFIX);
-	strcat(rawimg, partition);
-	strcat(rawimg, ".img");
-	printf("restoring %s to %s...\n", rawimg, partition);
-	sprintf(flash_cmd, "flash_img %s %s", result, rawimg);
-	printf("flash_cmd: %s\n", flash_cmd);
-    if (!__system(flash_cmd))
-	{
-	  ui_print("Failed!\n");
-	  ensure_path_unmounted(partition);
-	  status = -1;
-	}
-	else
-	{
-	  ui_print("Success!\n");
-	  ui_reset_text_col();
-	  ensure_path_unmounted(partition);
-	  status = 0;
-	}
-  }
-  ui_reset_progress();
-  return status;
-} 
+  //must be mtd, bml, or emmc - stream the image straight on
+  Volume *v = volume_for_path(r->partition);
+  ensure_path_unmounted(r->partition);
+  return restore_raw_image(v->fs_type, v->device, r->archive) ? -1 : 0;
+}
+
+static void add_restore_job(RestoreJob* jobs, PartitionRestore* parts, int* count,
+                            const char* partition, const char* PREFIX, int progress)
+{
+  RestoreJob* job = &jobs[*count];
+  PartitionRestore* r = &parts[*count];
+  r->partition = partition;
+  r->PREFIX = PREFIX;
+  r->progress = progress;
+  job->label = partition;
+  job->path = strstr(partition, ".android_secure") ? get_storage_root() : partition;
+  job->prepare = restore_prepare;
+  job->extract = restore_extract;
+  job->cookie = r;
+  (*count)++;
+}
 
 void nandroid_native(const char* operation, char* subname, char partitions, int show_progress, int compress)
 {
@@ -334,6 +493,25 @@ void nandroid_native(const char* operation, char* subname, char partitions, int
   char* STORAGE_ROOT = get_storage_root();
   printf("STORAGE_ROOT: %s\n", STORAGE_ROOT);
   
+  //check the archives while the battery is looked at, before anything is wiped
+  BackupVerify verify;
+  if (strcmp(operation, "restore") == 0)
+  {
+    const char* prefixes[10];
+    int n = 0;
+    char backup[PATH_MAX];
+    if (partitions & BOOT) prefixes[n++] = "boot.";
+    if (partitions & SYSTEM) prefixes[n++] = "system.";
+    if (partitions & DATA) { prefixes[n++] = "data."; prefixes[n++] = "datadata."; }
+    if (partitions & CACHE) prefixes[n++] = "cache.";
+    if (partitions & ASECURE) prefixes[n++] = "secure.";
+    if (partitions & SDEXT) prefixes[n++] = "sd-ext.";
+    prefixes[n] = NULL;
+    ensure_path_mounted(STORAGE_ROOT);
+    sprintf(backup, "%s/%s", get_nandroid_dir(), subname);
+    verify_backup_start(&verify, backup, prefixes);
+  }
+
   int ENERGY;
   
   FILE *fs = fopen ("/sys/class/power_supply/battery/status", "r");
@@ -350,7 +528,11 @@ void nandroid_native(const char* operation, char* subname, char partitions, int
   
   if (ENERGY < 20)
   {
-    if (!ask_question("Insufficient battery power. Continue?")) return;
+    if (!ask_question("Insufficient battery power. Continue?"))
+    {
+      if (strcmp(operation, "restore") == 0) verify_backup_cancel(&verify);
+      return;
+    }
   }
   fclose(fc);
   fclose(fs);
@@ -373,6 +555,7 @@ void nandroid_native(const char* operation, char* subname, char partitions, int
     starttime = time(NULL);
 	printf("START: %ld\n", starttime);
     get_prefix(partitions);
+	memset(&backup_entry, 0, sizeof(backup_entry));
 	ui_print("%s\n", PREFIX);
 	ui_print("Calculating space\n");
         ui_print("requirements...\n");
@@ -500,35 +683,36 @@ void nandroid_native(const char* operation, char* subname, char partitions, int
 	printf("PREFIX: %s\n", PREFIX);
 	printf("START: %ld\n", starttime);
 	
-    if (boot) 
-	{
-	  if (restore_partition("/boot", PREFIX, show_progress)) failed = 1;
-	}    
-	if (system) 
-	{
-	  if (restore_partition("/system", PREFIX, show_progress)) failed = 1;
-	}
-    if (data) 
-	{
-	  if (restore_partition("/data", PREFIX, show_progress)) failed = 1;
-	  if (volume_present("/datadata"))
-	  {
-	    if (restore_partition("/datadata", PREFIX, show_progress)) failed = 1;
-	  }
-	}
-    if (cache) 
+	if (verify.count > 0) ui_print("Verifying backup...\n");
+	int bad = verify_backup_wait(&verify);
+	printf("VERIFIED: %ld\n", time(NULL));
+	if (bad)
 	{
-	  if (restore_partition("/cache", PREFIX, show_progress)) failed = 1;
+	  ui_print("%d file(s) failed verification!\n", bad);
+	  failed = 1;
 	}
-    if (asecure) 
-    {
-	  printf("About to restore .android_secure...\n");
-	  if (restore_partition(".android_secure", PREFIX, show_progress)) failed = 1;
-    }
-    if (sdext) 
+	restore_verify = &verify;
+	
+	//formats overlap extracts, and separate chips restore side by side
+	RestoreJob jobs[MAX_RESTORE_JOBS];
+	PartitionRestore parts[MAX_RESTORE_JOBS];
+	int count = 0;
+	memset(jobs, 0, sizeof(jobs));
+	memset(parts, 0, sizeof(parts));
+	if (boot) add_restore_job(jobs, parts, &count, "/boot", PREFIX, show_progress);
+	if (system) add_restore_job(jobs, parts, &count, "/system", PREFIX, show_progress);
+	if (data)
 	{
-	  if (restore_partition("/sd-ext", PREFIX, show_progress)) failed = 1;
+	  add_restore_job(jobs, parts, &count, "/data", PREFIX, show_progress);
+	  if (volume_present("/datadata")) add_restore_job(jobs, parts, &count, "/datadata", PREFIX, show_progress);
 	}
+	if (cache) add_restore_job(jobs, parts, &count, "/cache", PREFIX, show_progress);
+	if (asecure) add_restore_job(jobs, parts, &count, ".android_secure", PREFIX, show_progress);
+	if (sdext) add_restore_job(jobs, parts, &count, "/sd-ext", PREFIX, show_progress);
+	if (run_restore_jobs(jobs, count)) failed = 1;
+	ui_reset_progress();
+	ui_reset_text_col();
+	restore_verify = NULL;
   }
   printf("%s finished.\n", operation);
   endtime = time(NULL);
@@ -536,16 +720,25 @@ void nandroid_native(const char* operation, char* subname, char partitions, int
   elapsed = endtime - starttime;
   printf("ELAPSED: %ld\n", elapsed);
   
+  if (strcmp(operation, "backup") == 0) 
+  {
+    //catalogue it: sizes of everything, and CRCs of what tar_to_file didn't write
+    char nandroid_dir[PATH_MAX];
+    strcpy(nandroid_dir, PREFIX);
+    *strrchr(nandroid_dir, '/') = '\0';
+    ensure_path_mounted(STORAGE_ROOT);
+    backup_entry.created = starttime;
+    backup_entry.seconds = elapsed;
+    catalog_scan_backup(nandroid_dir, strrchr(PREFIX, '/') + 1, 1, &backup_entry);
+    catalog_write_manifest(nandroid_dir, &backup_entry);
+    catalog_update(nandroid_dir, &backup_entry);
+  }
   
   if (failed != 1) if (reboot) reboot_android();
   
-  //this part isnt quite working yet - gets 0 byte filesizes in PREFIX?
   if (strcmp(operation, "backup") == 0) 
   {
-    ensure_path_mounted(STORAGE_ROOT);
-	printf("PREFIX: %s\n", PREFIX);
-	set_clearTotal_intent(1); //clear the previous running total so it doesnt get added to the backup total
-    ui_print("Space used: %ld MB\n", compute_size(PREFIX, 1)/1024/1024);
+    ui_print("Space used: %lld MB\n", backup_entry.bytes / 1024 / 1024);
   }
   ui_print("Elapsed time: %ld seconds\n", elapsed);
 }
@@ -1,2 +1,4 @@
 void nandroid_native(const char* operation, char* subname, char partitions, int show_progress, int compress);
 int get_clearTotal_intent();
+int get_yaffs2_images();
+void set_yaffs2_images(int on);
@@ -0,0 +1,500 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_catalog.h"
+
+#define CATALOG_FILE ".catalog"
+#define CATALOG_TMP ".catalog.tmp"
+#define CATALOG_BUF (128 * 1024)
+#define MANIFEST_FILE ".manifest"
+#define MANIFEST_TMP ".manifest.tmp"
+
+// Which partition each backup file holds, by its name.
+static const struct
+{
+  const char *prefix;
+  char letter;
+} partition_files[] =
+{
+  {"boot.", 'B'},
+  {"data.", 'D'},
+  {"datadata.", 'D'},
+  {"cache.", 'C'},
+  {"system.", 'S'},
+  {"secure.", 'A'},
+  {"sd-ext.", 'E'},
+  {NULL, 0}
+};
+
+static int
+split_fields (char *line, char **fields, int max)
+{
+  int n = 0;
+
+  line[strcspn (line, "\n")] = '\0';
+  while (line != NULL && n < max)
+    fields[n++] = strsep (&line, "\t");
+  return n;
+}
+
+static int
+crc_file (const char *path, unsigned long *crc)
+{
+  unsigned char *buf = malloc (CATALOG_BUF);
+  int fd = open (path, O_RDONLY);
+  ssize_t n = -1;
+
+  if (buf != NULL && fd >= 0)
+	  {
+	    *crc = crc32 (0L, Z_NULL, 0);
+	    while ((n = read (fd, buf, CATALOG_BUF)) > 0)
+	      *crc = crc32 (*crc, buf, n);
+	  }
+  if (fd >= 0)
+    close (fd);
+  free (buf);
+  return n == 0 ? 0 : -1;
+}
+
+// get_prefix() names backups <device>-<partitions>-YYYYMMDD-HHMM.
+static time_t
+time_from_name (const char *name, time_t fallback)
+{
+  const char *p = strrchr (name, '-');
+  struct tm tm;
+
+  if (p == NULL || p == name)
+    return fallback;
+  do
+    --p;
+  while (p > name && *p != '-');
+  if (*p == '-')
+    ++p;
+  memset (&tm, 0, sizeof (tm));
+  if (sscanf (p, "%4d%2d%2d-%2d%2d", &tm.tm_year, &tm.tm_mon,
+	      &tm.tm_mday, &tm.tm_hour, &tm.tm_min) != 5)
+    return fallback;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  return mktime (&tm);
+}
+
+void
+catalog_add_file (CatalogEntry * e, const char *file, long long size,
+		  unsigned long crc)
+{
+  CatalogFile *f = NULL;
+  int i;
+
+  for (i = 0; i < e->file_count; ++i)
+	  {
+	    if (strcmp (e->files[i].name, file) == 0)
+	      f = &e->files[i];
+	  }
+  if (f == NULL)
+	  {
+	    if (e->file_count == CATALOG_MAX_FILES)
+	      return;
+	    f = &e->files[e->file_count++];
+	    strlcpy (f->name, file, sizeof (f->name));
+	  }
+  f->size = size;
+  f->crc = crc;
+  f->has_crc = 1;
+}
+
+int
+catalog_scan_backup (const char *dir, const char *name, int checksum,
+		     CatalogEntry * e)
+{
+  static const char order[] = "BDCSAE";
+  CatalogFile old[CATALOG_MAX_FILES];
+  int old_count = e->file_count;
+  char path[PATH_MAX], file[PATH_MAX];
+  char has[128];
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+  int i, j;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  d = opendir (path);
+  if (d == NULL)
+    return -1;
+  memcpy (old, e->files, sizeof (old));
+  if (old_count == 0)
+    old_count = catalog_read_manifest (path, old, CATALOG_MAX_FILES);
+  memset (has, 0, sizeof (has));
+  strlcpy (e->name, name, sizeof (e->name));
+  e->file_count = 0;
+  e->bytes = 0;
+  e->compressed = 0;
+  while ((de = readdir (d)) != NULL)
+	  {
+	    CatalogFile *f;
+	    size_t len = strlen (de->d_name);
+
+	    if (de->d_name[0] == '.'
+		|| fstatat (dirfd (d), de->d_name, &st, 0) < 0
+		|| !S_ISREG (st.st_mode))
+	      continue;
+	    if (e->file_count == CATALOG_MAX_FILES
+		|| len >= sizeof (e->files[0].name))
+		    {
+		      LOGW ("catalogue: skipping %s/%s\n", path, de->d_name);
+		      continue;
+		    }
+	    f = &e->files[e->file_count++];
+	    strcpy (f->name, de->d_name);
+	    f->size = st.st_size;
+	    f->has_crc = 0;
+	    for (i = 0; i < old_count; ++i)
+		    {
+		      if (old[i].has_crc && old[i].size == f->size
+			  && strcmp (old[i].name, f->name) == 0)
+			      {
+				f->crc = old[i].crc;
+				f->has_crc = 1;
+			      }
+		    }
+	    if (!f->has_crc && checksum)
+		    {
+		      snprintf (file, sizeof (file), "%s/%s", path, f->name);
+		      f->has_crc = crc_file (file, &f->crc) == 0;
+		    }
+	    e->bytes += f->size;
+	    if (len > 3 && strcmp (de->d_name + len - 3, ".gz") == 0)
+	      e->compressed = 1;
+	    for (j = 0; partition_files[j].prefix != NULL; ++j)
+		    {
+		      if (strncmp (de->d_name, partition_files[j].prefix,
+				   strlen (partition_files[j].prefix)) == 0)
+			has[(int) partition_files[j].letter] = 1;
+		    }
+	  }
+  closedir (d);
+
+  for (i = j = 0; order[i] != '\0'; ++i)
+	  {
+	    if (has[(int) order[i]])
+	      e->partitions[j++] = order[i];
+	  }
+  e->partitions[j] = '\0';
+  if (stat (path, &st) == 0)
+    e->mtime = st.st_mtime;
+  if (e->created == 0)
+    e->created = time_from_name (name, e->mtime);
+  return 0;
+}
+
+int
+catalog_write_manifest (const char *dir, CatalogEntry * e)
+{
+  char path[PATH_MAX], tmp[PATH_MAX];
+  struct stat st;
+  FILE *fp;
+  int i, ret;
+
+  snprintf (path, sizeof (path), "%s/%s/%s", dir, e->name, MANIFEST_FILE);
+  snprintf (tmp, sizeof (tmp), "%s/%s/%s", dir, e->name, MANIFEST_TMP);
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+	  {
+	    LOGW ("can't write %s (%s)\n", tmp, strerror (errno));
+	    return -1;
+	  }
+  for (i = 0; i < e->file_count; ++i)
+	  {
+	    if (e->files[i].has_crc)
+	      fprintf (fp, "%08lx\t%lld\t%s\n", e->files[i].crc,
+		       e->files[i].size, e->files[i].name);
+	  }
+  ret = fflush (fp) != 0 || fsync (fileno (fp)) != 0 || ferror (fp);
+  if (fclose (fp) != 0 || ret || rename (tmp, path) != 0)
+	  {
+	    LOGW ("can't write %s (%s)\n", path, strerror (errno));
+	    unlink (tmp);
+	    return -1;
+	  }
+  snprintf (path, sizeof (path), "%s/%s", dir, e->name);
+  if (stat (path, &st) == 0)
+    e->mtime = st.st_mtime;
+  return 0;
+}
+
+int
+catalog_read_manifest (const char *backup, CatalogFile * files, int max)
+{
+  char path[PATH_MAX], line[256];
+  char *f[3];
+  int count = 0;
+  FILE *fp;
+
+  snprintf (path, sizeof (path), "%s/%s", backup, MANIFEST_FILE);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return 0;
+  while (count < max && fgets (line, sizeof (line), fp) != NULL)
+	  {
+	    if (split_fields (line, f, 3) != 3)
+	      continue;
+	    strlcpy (files[count].name, f[2], sizeof (files[count].name));
+	    files[count].crc = strtoul (f[0], NULL, 16);
+	    files[count].size = strtoll (f[1], NULL, 10);
+	    files[count].has_crc = 1;
+	    ++count;
+	  }
+  fclose (fp);
+  return count;
+}
+
+static CatalogEntry *
+add_entry (Catalog * cat)
+{
+  CatalogEntry *grown = realloc (cat->entries,
+				 (cat->count + 1) * sizeof (CatalogEntry));
+
+  if (grown == NULL)
+    return NULL;
+  cat->entries = grown;
+  memset (&grown[cat->count], 0, sizeof (CatalogEntry));
+  return &grown[cat->count++];
+}
+
+static int
+find_entry (const Catalog * cat, const char *name)
+{
+  int i;
+
+  for (i = 0; i < cat->count; ++i)
+	  {
+	    if (strcmp (cat->entries[i].name, name) == 0)
+	      return i;
+	  }
+  return -1;
+}
+
+static void
+read_catalog (const char *dir, Catalog * cat)
+{
+  char path[PATH_MAX], line[1024];
+  char *f[7];
+  CatalogEntry *e = NULL;
+  FILE *fp;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, CATALOG_FILE);
+  fp = fopen (path, "r");
+  if (fp == NULL)
+    return;
+  while (fgets (line, sizeof (line), fp) != NULL)
+	  {
+	    int n = split_fields (line, f, 7);
+
+	    if (n == 7 && strcmp (f[0], "B") == 0)
+		    {
+		      e = add_entry (cat);
+		      if (e == NULL)
+			break;
+		      strlcpy (e->name, f[1], sizeof (e->name));
+		      e->created = strtol (f[2], NULL, 10);
+		      e->mtime = strtol (f[3], NULL, 10);
+		      strlcpy (e->partitions, strcmp (f[4], "-") ? f[4] : "",
+			       sizeof (e->partitions));
+		      e->compressed = atoi (f[5]);
+		      e->seconds = atoi (f[6]);
+		    }
+	    else if (n == 4 && strcmp (f[0], "F") == 0 && e != NULL
+		     && e->file_count < CATALOG_MAX_FILES)
+		    {
+		      CatalogFile *file = &e->files[e->file_count++];
+
+		      strlcpy (file->name, f[1], sizeof (file->name));
+		      file->size = strtoll (f[2], NULL, 10);
+		      file->has_crc = strcmp (f[3], "-") != 0;
+		      file->crc = strtoul (f[3], NULL, 16);
+		      e->bytes += file->size;
+		    }
+	  }
+  fclose (fp);
+}
+
+static int
+write_catalog (const char *dir, const Catalog * cat)
+{
+  char path[PATH_MAX], tmp[PATH_MAX];
+  FILE *fp;
+  int i, j, ret;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, CATALOG_FILE);
+  snprintf (tmp, sizeof (tmp), "%s/%s", dir, CATALOG_TMP);
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+	  {
+	    LOGW ("can't write %s (%s)\n", tmp, strerror (errno));
+	    return -1;
+	  }
+  fprintf (fp, "# nandroid catalogue\n");
+  for (i = 0; i < cat->count; ++i)
+	  {
+	    const CatalogEntry *e = &cat->entries[i];
+
+	    fprintf (fp, "B\t%s\t%ld\t%ld\t%s\t%d\t%d\n", e->name,
+		     (long) e->created, (long) e->mtime,
+		     e->partitions[0] ? e->partitions : "-", e->compressed,
+		     e->seconds);
+	    for (j = 0; j < e->file_count; ++j)
+		    {
+		      const CatalogFile *f = &e->files[j];
+
+		      if (f->has_crc)
+			fprintf (fp, "F\t%s\t%lld\t%08lx\n", f->name, f->size,
+				 f->crc);
+		      else
+			fprintf (fp, "F\t%s\t%lld\t-\n", f->name, f->size);
+		    }
+	  }
+  ret = fflush (fp) != 0 || fsync (fileno (fp)) != 0 || ferror (fp);
+  if (fclose (fp) != 0 || ret || rename (tmp, path) != 0)
+	  {
+	    LOGW ("can't write %s (%s)\n", path, strerror (errno));
+	    unlink (tmp);
+	    return -1;
+	  }
+  return 0;
+}
+
+static int
+newest_first (const void *a, const void *b)
+{
+  const CatalogEntry *ea = a, *eb = b;
+
+  if (ea->created != eb->created)
+    return ea->created < eb->created ? 1 : -1;
+  return strcmp (eb->name, ea->name);
+}
+
+int
+catalog_load (const char *dir, Catalog * cat)
+{
+  struct dirent *de;
+  struct stat st;
+  char *seen;
+  int loaded, i, j, changed = 0;
+  DIR *d;
+
+  cat->entries = NULL;
+  cat->count = 0;
+  d = opendir (dir);
+  if (d == NULL)
+    return -1;
+  read_catalog (dir, cat);
+  loaded = cat->count;
+  seen = calloc (loaded + 1, 1);
+  if (seen == NULL)
+	  {
+	    closedir (d);
+	    return -1;
+	  }
+
+  while ((de = readdir (d)) != NULL)
+	  {
+	    if (de->d_name[0] == '.'
+		|| (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+		|| fstatat (dirfd (d), de->d_name, &st, 0) < 0
+		|| !S_ISDIR (st.st_mode))
+	      continue;
+	    i = find_entry (cat, de->d_name);
+	    if (i >= 0 && i < loaded)
+		    {
+		      seen[i] = 1;
+		      if (cat->entries[i].mtime == st.st_mtime)
+			continue;
+		    }
+	    else if (add_entry (cat) != NULL)
+	      i = cat->count - 1;
+	    else
+	      continue;
+	    // new, or changed since it was catalogued (eg. compressed)
+	    if (catalog_scan_backup (dir, de->d_name, 0, &cat->entries[i]) < 0
+		&& i >= loaded)
+	      cat->count--;
+	    changed = 1;
+	  }
+  closedir (d);
+
+  // drop backups that have gone
+  for (i = j = 0; i < cat->count; ++i)
+	  {
+	    if (i < loaded && !seen[i])
+		    {
+		      changed = 1;
+		      continue;
+		    }
+	    if (i != j)
+	      cat->entries[j] = cat->entries[i];
+	    ++j;
+	  }
+  cat->count = j;
+  free (seen);
+
+  if (changed)
+    write_catalog (dir, cat);
+  qsort (cat->entries, cat->count, sizeof (CatalogEntry), newest_first);
+  return 0;
+}
+
+void
+catalog_free (Catalog * cat)
+{
+  free (cat->entries);
+  cat->entries = NULL;
+  cat->count = 0;
+}
+
+int
+catalog_update (const char *dir, const CatalogEntry * e)
+{
+  Catalog cat;
+  CatalogEntry *slot;
+  int i, ret;
+
+  if (catalog_load (dir, &cat) < 0)
+    return -1;
+  i = find_entry (&cat, e->name);
+  slot = i >= 0 ? &cat.entries[i] : add_entry (&cat);
+  if (slot != NULL)
+    *slot = *e;
+  ret = slot != NULL ? write_catalog (dir, &cat) : -1;
+  catalog_free (&cat);
+  return ret;
+}
+
+int
+catalog_remove (const char *dir, const char *name)
+{
+  Catalog cat;
+  int i, ret = 0;
+
+  if (catalog_load (dir, &cat) < 0)
+    return -1;
+  i = find_entry (&cat, name);
+  if (i >= 0)
+	  {
+	    memmove (&cat.entries[i], &cat.entries[i + 1],
+		     (cat.count - i - 1) * sizeof (CatalogEntry));
+	    cat.count--;
+	    ret = write_catalog (dir, &cat);
+	  }
+  catalog_free (&cat);
+  return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef RECOVERY_NANDROID_CATALOG_H
+#define RECOVERY_NANDROID_CATALOG_H
+
+#include <time.h>
+
+// Each nandroid directory keeps a catalogue of its backups in
+// <dir>/.catalog, so the restore browser can list them (newest first,
+// with sizes) without walking every backup on the card:
+//
+//   B <name> <created> <dir mtime> <partitions> <compressed> <seconds>
+//   F <file> <size> <crc32 or ->
+//
+// fields separated by tabs, each B line followed by its F lines.
+
+#define CATALOG_MAX_FILES 12
+
+typedef struct
+{
+  char name[32];		// eg. "system.tar.gz"
+  long long size;
+  unsigned long crc;		// CRC-32 of the whole file
+  int has_crc;
+} CatalogFile;
+
+typedef struct
+{
+  char name[256];		// of the backup's directory
+  time_t created;
+  time_t mtime;			// of the directory when last scanned
+  char partitions[8];		// "BDCSAE", as in get_prefix()
+  int compressed;
+  int seconds;			// time the backup took, 0 if unknown
+  long long bytes;		// total of the files
+  int file_count;
+  CatalogFile files[CATALOG_MAX_FILES];
+} CatalogEntry;
+
+typedef struct
+{
+  CatalogEntry *entries;
+  int count;
+} Catalog;
+
+// Loads the catalogue of 'dir', first bringing it up to date with the
+// backups actually there: one readdir, and only new or changed backups
+// are scanned.  Entries are sorted newest first.  Returns -1 if 'dir'
+// can't be read.
+int catalog_load (const char *dir, Catalog * cat);
+void catalog_free (Catalog * cat);
+
+// Describes the backup dir/name from its files.  CRCs already in 'e'
+// (or, failing that, in the backup's manifest) for files of the same
+// size are kept; with 'checksum' set the others are computed,
+// otherwise they are left unknown.
+int catalog_scan_backup (const char *dir, const char *name, int checksum,
+			 CatalogEntry * e);
+
+// Records a file written by the backup engine along with its CRC.
+void catalog_add_file (CatalogEntry * e, const char *file, long long size,
+		       unsigned long crc);
+
+// Each backup also carries its own checksums in <backup>/.manifest,
+// "<crc32> <size> <file>" per line, so they survive the backup being
+// copied elsewhere.  Writing it refreshes e->mtime.
+int catalog_write_manifest (const char *dir, CatalogEntry * e);
+
+// Reads <backup>/.manifest into 'files'; returns how many there were.
+int catalog_read_manifest (const char *backup, CatalogFile * files, int max);
+
+// Adds 'e' to the catalogue of 'dir', replacing any entry of that name.
+int catalog_update (const char *dir, const CatalogEntry * e);
+int catalog_remove (const char *dir, const char *name);
+
+#endif
@@ -12,7 +12,10 @@
 #include "roots.h"
 #include "strings.h"
 #include "nandroid_menu.h"
+#include "nandroid.h"
 #include "install_menu.h"
+#include "prefs.h"
+#include "nandroid_catalog.h"
 
 int sdext_present = 0;
 int reboot_nandroid = 0;
@@ -22,12 +25,10 @@ char* NANDROID_DIR;
 
 char* get_nandroid_path()
 {
-  if (access("/tmp/.rzrpref_nandloc", F_OK) != -1)
+  static char path[PATH_MAX];
+  if (pref_get("nandloc", path, sizeof(path)) == 0)
   {
-    FILE *fp = fopen("/tmp/.rzrpref_nandloc", "r");
-	backuppath = calloc (40, sizeof(char));
-	
-	fgets(backuppath, 40, fp);
+	backuppath = path;
 	printf("Nandroid directory: %s\n", backuppath);
   }
   return backuppath;
@@ -206,13 +207,9 @@ nandroid_adv_r_choose_file (char *filename, char *nandroid_folder)
     "",
     NULL
   };
-  char path[PATH_MAX] = "";
-  DIR *dir;
-  struct dirent *de;
-  int total = 0;
-  int i;
-  char **files;
+  Catalog cat;
   char **list;
+  int i;
 
   if (ensure_path_mounted (nandroid_folder) != 0)
 	  {
@@ -220,88 +217,47 @@ nandroid_adv_r_choose_file (char *filename, char *nandroid_folder)
 	    return;
 	  }
 
-  dir = opendir (nandroid_folder);
-  if (dir == NULL)
+  // newest first, from the catalogue rather than a walk of the card
+  if (catalog_load (nandroid_folder, &cat) != 0)
 	  {
 	    LOGE ("Couldn't open directory %s\n", nandroid_folder);
 	    return;
 	  }
-
-  while ((de = readdir (dir)) != NULL)
+  if (cat.count == 0)
 	  {
-	    if (de->d_name[0] != '.')
-		    {
-		      total++;
-		    }
+	    LOGE ("No nandroid backups found\n");
+	    catalog_free (&cat);
+	    return;
 	  }
 
-  if (total == 0)
+  list = (char **) malloc ((cat.count + 1) * sizeof (char *));
+  for (i = 0; i < cat.count; i++)
 	  {
-	    LOGE ("No nandroid backups found\n");
-	    if (closedir (dir) < 0)
-		    {
-		      LOGE ("Failed to close directory %s\n", path);
-		      goto out;	// eww, maybe this can be done better
-		    }
+	    list[i] = (char *) malloc (strlen (cat.entries[i].name) + 24);
+	    sprintf (list[i], "%s (%lldMB)", cat.entries[i].name,
+		     cat.entries[i].bytes / 1024 / 1024);
 	  }
-  else
-	  {
-	    files = (char **) malloc ((total + 1) * sizeof (char *));
-	    files[total] = NULL;
-
-	    list = (char **) malloc ((total + 1) * sizeof (char *));
-	    list[total] = NULL;
+  list[cat.count] = NULL;
 
-	    rewinddir (dir);
-
-	    i = 0;
-	    while ((de = readdir (dir)) != NULL)
-		    {
-		      if (de->d_name[0] != '.')
-			      {
-				files[i] =
-				  (char *) malloc (strlen (nandroid_folder) +
-						   strlen (de->d_name) + 1);
-				strcpy (files[i], nandroid_folder);
-				strcat (files[i], de->d_name);
-
-				list[i] =
-				  (char *) malloc (strlen (de->d_name) + 1);
-				strcpy (list[i], de->d_name);
-
-				i++;
-			      }
-		    }
-
-	    if (closedir (dir) < 0)
-		    {
-		      LOGE ("Failure closing directory %s\n", path);
-		      goto out;	// again, eww
-		    }
-
-	    sortlist(list, total); //sort it alphabetically
-	    int chosen_item = -1;
+  int chosen_item = -1;
 
-	    while (chosen_item < 0)
+  while (chosen_item < 0)
+	  {
+	    chosen_item =
+	      get_menu_selection (headers, list, 0,
+				  chosen_item < 0 ? 0 : chosen_item);
+	    if (chosen_item >= 0 && chosen_item != ITEM_BACK)
 		    {
-		      chosen_item =
-			get_menu_selection (headers, list, 0,
-					    chosen_item <
-					    0 ? 0 : chosen_item);
-		      if (chosen_item >= 0 && chosen_item != ITEM_BACK)
-			      {
-				strcpy (filename, list[chosen_item]);
-			      }
+		      strcpy (filename, cat.entries[chosen_item].name);
 		    }
 	  }
-out:
-  for (i = 0; i < total; i++)
+
+  for (i = 0; i < cat.count; i++)
 	  {
-	    free (files[i]);
 	    free (list[i]);
 	  }
-  free (files);
   free (list);
+  catalog_free (&cat);
 }
 
 void
@@ -652,7 +608,7 @@ show_delete_menu()
   filename[0] = NULL;
   headers[2] = backuppath;
   char operation[PATH_MAX];
-  char del_cmd[PATH_MAX];
+  char del_path[PATH_MAX];
   int chosen_item = -1;
 
   while (chosen_item != ITEM_BACK) 
@@ -665,7 +621,7 @@ show_delete_menu()
         nandroid_adv_r_choose_file (filename, backuppath);
         headers[4] = filename;
 	sprintf(operation, "Delete %s", filename);
-	sprintf(del_cmd,"rm -rf %s/%s", backuppath, filename);
+	sprintf(del_path,"%s/%s", backuppath, filename);
         break;
       case D_ITEM_D:  
         if (confirm_selection("Are you sure?", operation, 0))
@@ -673,8 +629,9 @@ show_delete_menu()
 	if (strcmp(filename,"") != 0) 
 	  {  
             ui_print("Deleting %s...\n", filename);
-	    ui_show_indeterminate_progress();
-	    __system(del_cmd);
+	    delete_tree(del_path, NULL, 0);
+	    ui_reset_progress();
+	    catalog_remove(backuppath, filename);
 	    ui_print("Done!\n", filename);
 	  } else {
 	    ui_print("You must select a backup first!\n");
@@ -913,6 +870,7 @@ show_nandroid_menu ()
     "Nandroid Restore",
     "Compress existing backup",
     "Delete backup",
+    "Toggle yaffs2 image backups",
     //"Restore Clockwork backup",
     NULL
   };
@@ -921,7 +879,8 @@ show_nandroid_menu ()
 #define ITEM_ADV_RESTORE 1
 #define ITEM_COMPRESS    2
 #define ITEM_DELETE	 	 3
-//#define ITEM_CWM		 4
+#define ITEM_YAFFS2	 4
+//#define ITEM_CWM		 5
 
   int chosen_item = -1;
 
@@ -945,6 +904,11 @@ show_nandroid_menu ()
 		    case ITEM_DELETE:
 		      show_delete_menu();
 		      break;
+		    case ITEM_YAFFS2:
+		      set_yaffs2_images(!get_yaffs2_images());
+		      ui_print("yaffs2 volumes will be backed up as %s.\n",
+			       get_yaffs2_images() ? "yaffs2 images" : "tarballs");
+		      break;
 			/*case ITEM_CWM:
 			  show_cwm_menu();
 			  break;*/
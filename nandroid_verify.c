@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_verify.h"
+
+#define VERIFY_BUF (1024 * 1024)
+
+static void *
+verify_thread (void *cookie)
+{
+  VerifyJob *job = (VerifyJob *) cookie;
+  struct timespec start, end;
+  unsigned char *buf = malloc (VERIFY_BUF);
+  unsigned long crc = crc32 (0L, Z_NULL, 0);
+  long long total = 0;
+  ssize_t n = -1;
+  int fd = open (job->path, O_RDONLY);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (buf != NULL && fd >= 0)
+	  {
+	    while (!*job->cancel && (n = read (fd, buf, VERIFY_BUF)) > 0)
+		    {
+		      crc = crc32 (crc, buf, n);
+		      total += n;
+		    }
+	  }
+  if (fd >= 0)
+    close (fd);
+  free (buf);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  job->status = n == 0 && total == job->size && crc == job->crc ?
+    VERIFY_OK : VERIFY_BAD;
+  if (!*job->cancel)
+	  {
+	    LOGI ("verified %s: %s (%lld bytes in %ld ms)\n", job->name,
+		  job->status == VERIFY_OK ? "ok" : "BAD", total,
+		  (end.tv_sec - start.tv_sec) * 1000 +
+		  (end.tv_nsec - start.tv_nsec) / 1000000);
+	    if (job->status == VERIFY_BAD)
+	      LOGE ("%s is damaged\n", job->name);
+	  }
+  return NULL;
+}
+
+// Older backups have no manifest, but the catalogue may have
+// checksummed them when they were made.
+static int
+files_from_catalogue (const char *backup, CatalogFile * files)
+{
+  char dir[PATH_MAX];
+  char *name;
+  Catalog cat;
+  int i, count = 0;
+
+  strlcpy (dir, backup, sizeof (dir));
+  name = strrchr (dir, '/');
+  if (name == NULL)
+    return 0;
+  *name++ = '\0';
+  if (catalog_load (dir, &cat) < 0)
+    return 0;
+  for (i = 0; i < cat.count; ++i)
+	  {
+	    if (strcmp (cat.entries[i].name, name) == 0)
+		    {
+		      count = cat.entries[i].file_count;
+		      memcpy (files, cat.entries[i].files,
+			      count * sizeof (CatalogFile));
+		    }
+	  }
+  catalog_free (&cat);
+  return count;
+}
+
+void
+verify_backup_start (BackupVerify * v, const char *backup,
+		     const char *const *prefixes)
+{
+  CatalogFile files[CATALOG_MAX_FILES];
+  int count, i, p;
+
+  memset (v, 0, sizeof (*v));
+  count = catalog_read_manifest (backup, files, CATALOG_MAX_FILES);
+  if (count == 0)
+    count = files_from_catalogue (backup, files);
+
+  for (i = 0; i < count; ++i)
+	  {
+	    VerifyJob *job = &v->jobs[v->count];
+
+	    for (p = 0; prefixes[p] != NULL; ++p)
+		    {
+		      if (strncmp (files[i].name, prefixes[p],
+				   strlen (prefixes[p])) == 0)
+			break;
+		    }
+	    if (prefixes[p] == NULL || !files[i].has_crc)
+	      continue;
+	    snprintf (job->path, sizeof (job->path), "%s/%s", backup,
+		      files[i].name);
+	    // eg. system.tar since compressed to system.tar.gz
+	    if (access (job->path, F_OK) != 0)
+	      continue;
+	    job->name = job->path + strlen (backup) + 1;
+	    job->size = files[i].size;
+	    job->crc = files[i].crc;
+	    job->status = VERIFY_PENDING;
+	    job->cancel = &v->cancel;
+	    v->count++;
+	  }
+
+  for (i = 0; i < v->count; ++i)
+	  {
+	    VerifyJob *job = &v->jobs[i];
+
+	    job->started =
+	      pthread_create (&job->thread, NULL, verify_thread, job) == 0;
+	    if (!job->started)
+	      verify_thread (job);
+	  }
+}
+
+int
+verify_backup_wait (BackupVerify * v)
+{
+  int i, bad = 0;
+
+  for (i = 0; i < v->count; ++i)
+	  {
+	    if (v->jobs[i].started)
+	      pthread_join (v->jobs[i].thread, NULL);
+	    v->jobs[i].started = 0;
+	    if (v->jobs[i].status == VERIFY_BAD)
+	      ++bad;
+	  }
+  return bad;
+}
+
+void
+verify_backup_cancel (BackupVerify * v)
+{
+  v->cancel = 1;
+  verify_backup_wait (v);
+}
+
+int
+verify_backup_ok (const BackupVerify * v, const char *file)
+{
+  int i;
+
+  for (i = 0; i < v->count; ++i)
+	  {
+	    if (strcmp (v->jobs[i].name, file) == 0)
+	      return v->jobs[i].status != VERIFY_BAD;
+	  }
+  return 1;
+}
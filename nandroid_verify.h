@@ -0,0 +1,56 @@
+#ifndef RECOVERY_NANDROID_VERIFY_H
+#define RECOVERY_NANDROID_VERIFY_H
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "nandroid_catalog.h"
+
+// Checks a backup's archives against its manifest before a restore
+// touches any partition, one thread and one sequential stream per
+// file, in the background while the restore asks about the battery.
+
+enum
+{
+  VERIFY_PENDING,
+  VERIFY_OK,
+  VERIFY_BAD
+};
+
+typedef struct
+{
+  char path[PATH_MAX];
+  const char *name;		// within path
+  long long size;
+  unsigned long crc;
+  volatile int status;
+  pthread_t thread;
+  int started;
+  volatile int *cancel;
+} VerifyJob;
+
+typedef struct
+{
+  VerifyJob jobs[CATALOG_MAX_FILES];
+  int count;
+  volatile int cancel;
+} BackupVerify;
+
+// Starts checking the files of 'backup' (a directory) whose names
+// begin with one of 'prefixes' (NULL-terminated, eg. "system.").
+// Files the manifest, or the catalogue of the folder, has no checksum
+// for aren't checked.
+void verify_backup_start (BackupVerify * v, const char *backup,
+			  const char *const *prefixes);
+
+// Waits for the checks; returns how many files failed.
+int verify_backup_wait (BackupVerify * v);
+
+// Stops the checks early, eg. when the restore is abandoned.
+void verify_backup_cancel (BackupVerify * v);
+
+// After verify_backup_wait(): 0 if 'file' (eg. "system.tar.gz")
+// failed its check, 1 if it passed or had no checksum.
+int verify_backup_ok (const BackupVerify * v, const char *file);
+
+#endif
@@ -7,13 +7,11 @@
 #include "recovery.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "prefs.h"
 
 void set_oc (char *speed)
 {
-  FILE * f = fopen ("/tmp/.rzrpref_oc", "w");
-  fputs (speed, f);
-  fputs ("\n", f);
-  fclose (f);
+  pref_set ("oc", speed);
   set_cpufreq (speed);
   ui_print ("max frequency set to %s Hz\n", speed);
 }
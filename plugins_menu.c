@@ -1,6 +1,9 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/wait.h>
 #include <sys/limits.h>
 #include <dirent.h>
@@ -16,6 +19,8 @@
 #include <sys/reboot.h>
   
 #include "nandroid_menu.h"
+#include "install_menu.h"
+#include "untar.h"
 
 char* RZR_DIR;
 char* strip_string(char* string)
@@ -116,27 +121,305 @@ choose_plugin_menu (char *sdpath)
 	  }
 }
 
+// What a plugin holds besides the files unpacked to /tmp.
+typedef struct
+{
+  int system;
+  int data;
+} PluginParts;
+
+static int
+plugin_filter (const char *name, void *cookie)
+{
+  PluginParts *parts = (PluginParts *) cookie;
+
+  // these are unpacked straight onto their partitions afterwards
+  if (strcmp (name, "system.tar") == 0)
+	  {
+	    parts->system = 1;
+	    return TAR_SKIP;
+	  }
+  if (strcmp (name, "data.tar") == 0)
+	  {
+	    parts->data = 1;
+	    return TAR_SKIP;
+	  }
+  return TAR_EXTRACT;
+}
+
+// The menu lists plugins without their extension.
+static int
+find_plugin_archive (const char *filename, char *archive)
+{
+  static const char *exts[] = { "", ".tgz", ".tar", NULL };
+  int i;
+
+  for (i = 0; exts[i] != NULL; ++i)
+	  {
+	    snprintf (archive, PATH_MAX, "%s%s", filename, exts[i]);
+	    if (access (archive, R_OK) == 0)
+	      return 0;
+	  }
+  return -1;
+}
+
+static int
+battery_ok (int required)
+{
+  char buf[16] = "";
+  FILE *fp = fopen ("/sys/class/power_supply/battery/status", "r");
+
+  if (fp != NULL)
+	  {
+	    fgets (buf, sizeof (buf), fp);
+	    fclose (fp);
+	    if (strncmp (buf, "Charging", 8) == 0)
+	      return 1;
+	  }
+  fp = fopen ("/sys/class/power_supply/battery/capacity", "r");
+  if (fp == NULL)
+    return 1;
+  buf[0] = '\0';
+  fgets (buf, sizeof (buf), fp);
+  fclose (fp);
+  if (atoi (buf) >= required)
+    return 1;
+  return ask_question ("Low battery! Continue anyway at your own risk?");
+}
+
+// Whether a file in /tmp/metadata asks for "clobber_<image>=true".
+static int
+plugin_clobbers (const char *image)
+{
+  char key[32], line[256], path[PATH_MAX];
+  struct dirent *de;
+  DIR *dir = opendir ("/tmp/metadata");
+  int clobber = 0;
+
+  if (dir == NULL)
+    return 0;
+  snprintf (key, sizeof (key), "clobber_%s=", image);
+  while (!clobber && (de = readdir (dir)) != NULL)
+	  {
+	    FILE *fp;
+
+	    if (de->d_name[0] == '.')
+	      continue;
+	    snprintf (path, sizeof (path), "/tmp/metadata/%s", de->d_name);
+	    fp = fopen (path, "r");
+	    if (fp == NULL)
+	      continue;
+	    while (!clobber && fgets (line, sizeof (line), fp) != NULL)
+	      clobber = strncmp (line, key, strlen (key)) == 0
+		&& strstr (line, "true") != NULL;
+	    fclose (fp);
+	  }
+  closedir (dir);
+  return clobber;
+}
+
+// The pre.d and post.d scripts are the plugin's own code.  As under
+// nandroid-mobile.sh they are all sourced by one shell, so post.d sees
+// the variables and functions pre.d defined, and they get the helpers
+// and variables that script gave them.  batteryAtLeast can't ask, so
+// it just fails.  Output goes through relay_plugin_output(), which
+// shows "* print" lines as runve() did; "* pre_done" marks the end of
+// pre.d, and the shell then reads fd 4 while the images are unpacked.
+#define PLUGIN_PROLOGUE \
+  "quit () { sync; echo 3 > /proc/sys/vm/drop_caches; exit $1; }; " \
+  "batteryAtLeast () { " \
+  "e=`cat /sys/class/power_supply/battery/capacity`; " \
+  "[ \"`cat /sys/class/power_supply/battery/status`\" == Charging ] " \
+  "&& e=100; " \
+  "[ -z \"$e\" ] || [ \"$e\" -ge \"$1\" ] && return 0; " \
+  "echo \"* print Error: not enough battery power, need at least $1%.\"; " \
+  "quit 101; }; " \
+  "pipeline () { cat; }; " \
+  "PLUGIN=1; PROGRESS=; ECHO=echo; "
+
+#define PLUGIN_SCRIPTS PLUGIN_PROLOGUE \
+  "cd /tmp; " \
+  "for sh in pre.d/[0-9]*.sh; do [ -r \"$sh\" ] && . \"$sh\"; done; " \
+  "echo '* pre_done'; read go <&4 || exit 0; cd /tmp; " \
+  "for sh in post.d/[0-9]*.sh; do [ -r \"$sh\" ] && . \"$sh\"; done; " \
+  "quit 0"
+
+typedef struct
+{
+  pid_t pid;
+  FILE *out;			// the shell's stdout
+  int go;			// write end of the shell's fd 4
+} PluginShell;
+
+// Starts the shell; it sources pre.d straight away.  $ROM_FILE is the
+// plugin archive, as it was for nandroid-mobile.sh --install-rom.
+static int
+start_plugin_shell (PluginShell * sh, const char *archive)
+{
+  int out[2], go[2];
+
+  if (pipe (out) < 0)
+    return -1;
+  if (pipe (go) < 0)
+	  {
+	    close (out[0]);
+	    close (out[1]);
+	    return -1;
+	  }
+  sh->pid = fork ();
+  if (sh->pid == 0)
+	  {
+	    // out of the way of 4 before moving it there
+	    int r = fcntl (go[0], F_DUPFD, 10);
+
+	    dup2 (out[1], 1);
+	    close (out[0]);
+	    close (out[1]);
+	    close (go[0]);
+	    close (go[1]);
+	    dup2 (r, 4);
+	    close (r);
+	    setenv ("ROM_FILE", archive, 1);
+	    execl ("/sbin/sh", "sh", "-c", PLUGIN_SCRIPTS, (char *) NULL);
+	    _exit (127);
+	  }
+  close (out[1]);
+  close (go[0]);
+  if (sh->pid < 0 || (sh->out = fdopen (out[0], "r")) == NULL)
+	  {
+	    close (out[0]);
+	    close (go[1]);
+	    if (sh->pid > 0)
+		    {
+		      kill (sh->pid, SIGKILL);
+		      waitpid (sh->pid, NULL, 0);
+		    }
+	    return -1;
+	  }
+  sh->go = go[1];
+  return 0;
+}
+
+// Logs the shell's output, showing its "* print" lines, until 'until'
+// (or EOF if NULL).  0 if 'until' was seen.
+static int
+relay_plugin_output (PluginShell * sh, const char *until)
+{
+  char line[256];
+
+  while (fgets (line, sizeof (line), sh->out) != NULL)
+	  {
+	    printf ("%s", line);
+	    if (until != NULL && strcmp (line, until) == 0)
+	      return 0;
+	    if (strncmp (line, "* print ", 8) == 0)
+	      ui_print ("%s", line + 8);
+	  }
+  return until == NULL ? 0 : -1;
+}
+
+// 0 once pre.d has run through, -1 if the shell exited during it.
+static int
+wait_pre_scripts (PluginShell * sh)
+{
+  return relay_plugin_output (sh, "* pre_done\n");
+}
+
+// Lets the shell go on to post.d, or stops it before, and reaps it.
+// Returns the exit status it would have given nandroid-mobile.sh.
+static int
+finish_plugin_shell (PluginShell * sh, int run_post)
+{
+  int status;
+
+  if (run_post)
+	  {
+	    sig_t pipesave = signal (SIGPIPE, SIG_IGN);
+
+	    write (sh->go, "\n", 1);
+	    signal (SIGPIPE, pipesave);
+	  }
+  close (sh->go);
+  if (run_post)
+    relay_plugin_output (sh, NULL);
+  fclose (sh->out);
+  while (waitpid (sh->pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  return WIFEXITED (status) ? WEXITSTATUS (status) : 1;
+}
+
  int
 run_plugin (char *filename) 
 {
-   puts(replace(filename, " ", "\\ ")); //escape any spaces
-   printf("About to load plugin %s...\n", filename);
-   char *argv[] =
-    { "/sbin/nandroid-mobile.sh", "--install-rom", filename, "--plugin",
-NULL
-  };
-   char *envp[] = { NULL };
-   int status = runve ("/sbin/nandroid-mobile.sh", argv, envp, 1);
+  static const char *images[] = { "system", "data" };
+  char archive[PATH_MAX], member[16], mount_point[16];
+  PluginParts parts = { 0, 0 };
+  PluginShell shell;
+  int shell_running = 0;
+  int i, status = 0;
 
-  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+  if (find_plugin_archive (filename, archive) < 0)
+	  {
+	    ui_print ("ERROR: plugin %s not found\n", filename);
+	    return 14;
+	  }
+  if (!battery_ok (20))
+    return 0;
+  printf("About to load plugin %s...\n", archive);
+  ui_show_indeterminate_progress ();
+
+  if (tar_extract (archive, "/tmp", plugin_filter, &parts) != 0)
+	  {
+	    status = 15;
+	    goto done;
+	  }
+  if (start_plugin_shell (&shell, archive) != 0)
 	  {
-	    ui_printf_int ("ERROR: plugin exited with status %d\n",
-			    WEXITSTATUS (status));
-		ui_reset_progress ();
-	    __system("cd /tmp; for files in `find . | grep -v rzrpref_ | grep -v recovery\.log`; do rm -rf $files; done");
-	    return WEXITSTATUS (status);
+	    ui_print ("ERROR: unable to run the plugin's scripts\n");
+	    status = 1;
+	    goto done;
 	  }
-  __system("cd /tmp; for files in `find . | grep -v rzrpref_ | grep -v recovery\.log`; do rm -rf $files; done");	  
+  shell_running = 1;
+  if (wait_pre_scripts (&shell) != 0)
+	  {
+	    // a pre.d script quit the install, as it could before
+	    status = finish_plugin_shell (&shell, 0);
+	    shell_running = 0;
+	    goto done;
+	  }
+  for (i = 0; i < 2; i++)
+	  {
+	    if (!(i == 0 ? parts.system : parts.data))
+	      continue;
+	    snprintf (mount_point, sizeof (mount_point), "/%s", images[i]);
+	    snprintf (member, sizeof (member), "%s.tar", images[i]);
+	    if (ensure_path_mounted (mount_point) != 0)
+		    {
+		      ui_print ("ERROR: unable to mount %s\n", mount_point);
+		      status = 16;
+		      goto done;
+		    }
+	    if (plugin_clobbers (images[i]))
+	      delete_tree (mount_point, NULL, 1);
+	    if (tar_extract_member (archive, member, mount_point) != 0)
+		    {
+		      status = 17;
+		      goto done;
+		    }
+	  }
+  status = finish_plugin_shell (&shell, 1);
+  shell_running = 0;
+
+done:
+  if (shell_running)
+    finish_plugin_shell (&shell, 0);
+  if (parts.system)
+    ensure_path_unmounted ("/system");
+  if (parts.data)
+    ensure_path_unmounted ("/data");
+  if (status != 0)
+    ui_printf_int ("ERROR: plugin exited with status %d\n", status);
+  clean_tmp ();
   ui_reset_progress ();
-  return 0;
+  return status;
 }
@@ -0,0 +1,406 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "roots.h"
+#include "recovery.h"
+#include "prefs.h"
+
+// Preferences used to be one /tmp/.rzrpref_<key> file each, copied to
+// and from the storage root with cp and rm.  The menus and the screen
+// redraw read them constantly, so they are now a table in memory; the
+// storage root is only touched to load it at startup and to save it
+// when something changed.
+
+#define MAX_PREFS 32
+#define PREF_KEY_LEN 16
+#define PREF_VALUE_LEN 128
+
+#define PREFS_FILE "prefs"
+#define LEGACY_PREFIX ".rzrpref_"
+
+typedef struct
+{
+  char key[PREF_KEY_LEN];
+  char value[PREF_VALUE_LEN];
+} Pref;
+
+static Pref prefs[MAX_PREFS];
+static int pref_count;
+static int prefs_dirty;
+static int prefs_legacy;	// loaded from .rzrpref_* files
+static pthread_mutex_t prefs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Call with prefs_lock held.
+static Pref *
+find_pref (const char *key)
+{
+  int i;
+
+  for (i = 0; i < pref_count; ++i)
+	  {
+	    if (strcmp (prefs[i].key, key) == 0)
+	      return &prefs[i];
+	  }
+  return NULL;
+}
+
+// Call with prefs_lock held.
+static void
+set_pref_locked (const char *key, const char *value)
+{
+  Pref *p = find_pref (key);
+
+  if (strlen (key) >= PREF_KEY_LEN)
+	  {
+	    LOGW ("pref key too long: %s\n", key);
+	    return;
+	  }
+  if (p == NULL)
+	  {
+	    if (pref_count == MAX_PREFS)
+		    {
+		      LOGW ("too many prefs; dropping %s\n", key);
+		      return;
+		    }
+	    p = &prefs[pref_count++];
+	    strcpy (p->key, key);
+	    p->value[0] = '\0';
+	    prefs_dirty = 1;
+	  }
+  if (strncmp (p->value, value, PREF_VALUE_LEN - 1) != 0)
+	  {
+	    strlcpy (p->value, value, PREF_VALUE_LEN);
+	    prefs_dirty = 1;
+	  }
+}
+
+int
+pref_get (const char *key, char *value, size_t len)
+{
+  Pref *p;
+
+  pthread_mutex_lock (&prefs_lock);
+  p = find_pref (key);
+  if (p != NULL && len > 0)
+    strlcpy (value, p->value, len);
+  pthread_mutex_unlock (&prefs_lock);
+  return p != NULL ? 0 : -1;
+}
+
+int
+pref_get_int (const char *key, int fallback)
+{
+  char value[PREF_VALUE_LEN];
+
+  if (pref_get (key, value, sizeof (value)) != 0 || value[0] == '\0')
+    return fallback;
+  return atoi (value);
+}
+
+int
+pref_isset (const char *key)
+{
+  return pref_get (key, NULL, 0) == 0;
+}
+
+void
+pref_set (const char *key, const char *value)
+{
+  pthread_mutex_lock (&prefs_lock);
+  set_pref_locked (key, value);
+  pthread_mutex_unlock (&prefs_lock);
+}
+
+void
+pref_set_int (const char *key, int value)
+{
+  char buf[16];
+
+  snprintf (buf, sizeof (buf), "%d", value);
+  pref_set (key, buf);
+}
+
+void
+pref_unset (const char *key)
+{
+  Pref *p;
+
+  pthread_mutex_lock (&prefs_lock);
+  p = find_pref (key);
+  if (p != NULL)
+	  {
+	    *p = prefs[--pref_count];
+	    prefs_dirty = 1;
+	  }
+  pthread_mutex_unlock (&prefs_lock);
+}
+
+static void
+parse_prefs (char *data)
+{
+  char *line, *next;
+
+  for (line = data; line != NULL && *line != '\0'; line = next)
+	  {
+	    char *eq;
+
+	    next = strchr (line, '\n');
+	    if (next != NULL)
+	      *next++ = '\0';
+	    eq = strchr (line, '=');
+	    if (line[0] == '#' || eq == NULL)
+	      continue;
+	    *eq = '\0';
+	    set_pref_locked (line, eq + 1);
+	  }
+}
+
+// Reads a whole (small) file into a NUL-terminated buffer.
+static char *
+slurp (const char *path, size_t *len)
+{
+  char buf[1024];
+  char *data = NULL;
+  size_t size = 0;
+  ssize_t n;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  while ((n = read (fd, buf, sizeof (buf))) > 0)
+	  {
+	    char *grown = realloc (data, size + n + 1);
+
+	    if (grown == NULL)
+		    {
+		      n = -1;
+		      break;
+		    }
+	    data = grown;
+	    memcpy (data + size, buf, n);
+	    size += n;
+	  }
+  close (fd);
+  if (n < 0)
+	  {
+	    free (data);
+	    return NULL;
+	  }
+  if (data == NULL)
+    data = calloc (1, 1);
+  else
+    data[size] = '\0';
+  if (len != NULL)
+    *len = size;
+  return data;
+}
+
+// The old files held a bare value ("185", "fat\0\n"), the raw rgb
+// bytes, or nothing at all where only their existence mattered.
+static void
+import_legacy (const char *rzr_dir)
+{
+  char path[PATH_MAX];
+  struct dirent *de;
+  DIR *dir = opendir (rzr_dir);
+
+  if (dir == NULL)
+    return;
+  while ((de = readdir (dir)) != NULL)
+	  {
+	    const char *key = de->d_name + strlen (LEGACY_PREFIX);
+	    char value[PREF_VALUE_LEN];
+	    size_t len;
+	    char *data;
+
+	    if (strncmp (de->d_name, LEGACY_PREFIX, strlen (LEGACY_PREFIX)) != 0)
+	      continue;
+	    snprintf (path, sizeof (path), "%s/%s", rzr_dir, de->d_name);
+	    data = slurp (path, &len);
+	    if (data == NULL)
+	      continue;
+
+	    if (strcmp (key, "rgb") == 0 && len >= 4)
+		    {
+		      unsigned char *c = (unsigned char *) data;
+
+		      snprintf (value, sizeof (value), "%u,%u,%u,%u", c[0], c[1],
+				c[2], c[3]);
+		      set_pref_locked (key, value);
+		    }
+	    else if (strncmp (key, "icon_", 5) == 0)
+	      set_pref_locked ("icon", key + 5);
+	    else if (strcmp (key, "rnd") == 0 || strcmp (key, "yaffs2img") == 0)
+	      set_pref_locked (key, "1");
+	    else
+		    {
+		      // stops at the first NUL or newline
+		      data[strcspn (data, "\n")] = '\0';
+		      set_pref_locked (key, data);
+		    }
+	    free (data);
+	    prefs_legacy = 1;
+	  }
+  closedir (dir);
+}
+
+void
+prefs_load (void)
+{
+  char path[PATH_MAX];
+  char *rzr_dir;
+  char *data;
+
+  if (ensure_path_mounted (get_storage_root ()) != 0)
+	  {
+	    LOGW ("can't mount %s; using default preferences\n",
+		  get_storage_root ());
+	    return;
+	  }
+  rzr_dir = get_rzr_dir ();
+  snprintf (path, sizeof (path), "%s/%s", rzr_dir, PREFS_FILE);
+
+  pthread_mutex_lock (&prefs_lock);
+  data = slurp (path, NULL);
+  if (data != NULL)
+	  {
+	    parse_prefs (data);
+	    free (data);
+	  }
+  else
+    import_legacy (rzr_dir);
+  // only what differs from the file needs saving
+  prefs_dirty = prefs_legacy;
+  pthread_mutex_unlock (&prefs_lock);
+
+  // start a fresh log for this run
+  snprintf (path, sizeof (path), "%s/recovery.log", rzr_dir);
+  unlink (path);
+  ensure_path_unmounted (get_storage_root ());
+}
+
+static int
+write_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+	  {
+	    ssize_t n = write (fd, data, len);
+
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    if (n <= 0)
+	      return -1;
+	    data += n;
+	    len -= n;
+	  }
+  return 0;
+}
+
+static void
+remove_legacy (const char *rzr_dir)
+{
+  struct dirent *de;
+  DIR *dir = opendir (rzr_dir);
+
+  if (dir == NULL)
+    return;
+  while ((de = readdir (dir)) != NULL)
+	  {
+	    if (strncmp (de->d_name, LEGACY_PREFIX, strlen (LEGACY_PREFIX)) == 0)
+	      unlinkat (dirfd (dir), de->d_name, 0);
+	  }
+  closedir (dir);
+}
+
+int
+prefs_save (void)
+{
+  char path[PATH_MAX], tmp[PATH_MAX];
+  char data[MAX_PREFS * (PREF_KEY_LEN + PREF_VALUE_LEN + 2)];
+  size_t len = 0;
+  int legacy, fd, i, ret = -1;
+  char *rzr_dir;
+
+  pthread_mutex_lock (&prefs_lock);
+  if (!prefs_dirty)
+	  {
+	    pthread_mutex_unlock (&prefs_lock);
+	    return 0;
+	  }
+  for (i = 0; i < pref_count; ++i)
+    len += snprintf (data + len, sizeof (data) - len, "%s=%s\n",
+		     prefs[i].key, prefs[i].value);
+  legacy = prefs_legacy;
+  prefs_dirty = 0;
+  pthread_mutex_unlock (&prefs_lock);
+
+  if (ensure_path_mounted (get_storage_root ()) != 0)
+	  {
+	    LOGE ("Can't mount %s\n", get_storage_root ());
+	    goto out;
+	  }
+  rzr_dir = get_rzr_dir ();
+  if (mkdir (rzr_dir, 0755) != 0 && errno != EEXIST)
+	  {
+	    LOGE ("Can't create %s (%s)\n", rzr_dir, strerror (errno));
+	    goto unmount;
+	  }
+  snprintf (path, sizeof (path), "%s/%s", rzr_dir, PREFS_FILE);
+  snprintf (tmp, sizeof (tmp), "%s/%s.tmp", rzr_dir, PREFS_FILE);
+
+  fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+	  {
+	    LOGE ("Can't write %s (%s)\n", tmp, strerror (errno));
+	    goto unmount;
+	  }
+  if (write_all (fd, data, len) != 0 || fsync (fd) != 0)
+	  {
+	    LOGE ("Can't write %s (%s)\n", tmp, strerror (errno));
+	    close (fd);
+	    unlink (tmp);
+	    goto unmount;
+	  }
+  close (fd);
+  if (rename (tmp, path) != 0)
+	  {
+	    LOGE ("Can't rename %s (%s)\n", tmp, strerror (errno));
+	    unlink (tmp);
+	    goto unmount;
+	  }
+  // make the rename itself durable
+  fd = open (rzr_dir, O_RDONLY);
+  if (fd >= 0)
+	  {
+	    fsync (fd);
+	    close (fd);
+	  }
+  if (legacy)
+	  {
+	    remove_legacy (rzr_dir);
+	    pthread_mutex_lock (&prefs_lock);
+	    prefs_legacy = 0;
+	    pthread_mutex_unlock (&prefs_lock);
+	  }
+  ret = 0;
+
+unmount:
+  ensure_path_unmounted (get_storage_root ());
+out:
+  if (ret != 0)
+	  {
+	    pthread_mutex_lock (&prefs_lock);
+	    prefs_dirty = 1;
+	    pthread_mutex_unlock (&prefs_lock);
+	  }
+  return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef RECOVERY_PREFS_H
+#define RECOVERY_PREFS_H
+
+#include <stddef.h>
+
+// Recovery preferences live in memory as a small key/value table and
+// are stored on the storage root as <rzr dir>/prefs, one "key=value"
+// per line.  Keys in use:
+//
+//   oc         max cpu frequency          scroll     key repeat delay (ms)
+//   rgb        menu color "r,g,b,text"    rnd        random menu colors
+//   icon       "rz", "rw" or "gm"         usb        "fat" or "ext"
+//   nandloc    nandroid directory         wipe       "secure" or "discard"
+//   yaffs2img  back up MTD as yaffs2 images
+
+// Load the table from the storage root, importing the old
+// .rzrpref_* files the first time.  Mounts and unmounts it.
+void prefs_load (void);
+
+// Store the table if anything changed since it was loaded or saved:
+// written to a temporary file, synced, and renamed over the old one.
+// Returns 0 on success or if there was nothing to do.
+int prefs_save (void);
+
+// Copies the value of 'key' into 'value'; returns 0 if it is set.
+int pref_get (const char *key, char *value, size_t len);
+int pref_get_int (const char *key, int fallback);
+int pref_isset (const char *key);
+
+void pref_set (const char *key, const char *value);
+void pref_set_int (const char *key, int value);
+void pref_unset (const char *key);
+
+#endif
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "common.h"
+#include "gzstream.h"
+#include "flashutils/flashutils.h"
+#include "raw_restore.h"
+
+// The reader thread fills a small ring of large buffers from the
+// image; the writer takes them in order, and hands each back to the
+// reader as soon as the next one is wanted.
+
+#define RING_BUFFERS 3
+#define RING_BUFFER_SIZE (1024 * 1024)
+
+typedef struct
+{
+  GzStream *in;
+  char *buf[RING_BUFFERS];
+  ssize_t len[RING_BUFFERS];	// 0 at the end, -1 on error
+  int head;			// next for the reader to fill
+  int tail;			// the one the writer is on
+  int count;			// filled and not yet handed back
+  int stop;			// the writer gave up
+  size_t pos;			// writer's offset in buf[tail]
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ImageRing;
+
+static void *
+ring_reader (void *cookie)
+{
+  ImageRing *r = (ImageRing *) cookie;
+  ssize_t n;
+
+  do
+	  {
+	    int slot;
+
+	    pthread_mutex_lock (&r->lock);
+	    while (r->count == RING_BUFFERS && !r->stop)
+	      pthread_cond_wait (&r->cond, &r->lock);
+	    slot = r->head;
+	    if (r->stop)
+		    {
+		      pthread_mutex_unlock (&r->lock);
+		      break;
+		    }
+	    pthread_mutex_unlock (&r->lock);
+
+	    n = gzstream_read (r->in, r->buf[slot], RING_BUFFER_SIZE);
+
+	    pthread_mutex_lock (&r->lock);
+	    r->len[slot] = n;
+	    r->head = (slot + 1) % RING_BUFFERS;
+	    ++r->count;
+	    pthread_cond_broadcast (&r->cond);
+	    pthread_mutex_unlock (&r->lock);
+	  }
+  while (n > 0);
+  return NULL;
+}
+
+// Points 'data' at up to 'want' bytes of the image, valid until the
+// next call.  Returns how many, 0 at the end, or -1.
+static ssize_t
+ring_take (ImageRing * r, size_t want, const char **data)
+{
+  ssize_t n;
+
+  pthread_mutex_lock (&r->lock);
+  if (r->count > 0 && r->len[r->tail] > 0 &&
+      r->pos == (size_t) r->len[r->tail])
+	  {
+	    r->tail = (r->tail + 1) % RING_BUFFERS;
+	    r->pos = 0;
+	    --r->count;
+	    pthread_cond_broadcast (&r->cond);
+	  }
+  while (r->count == 0)
+    pthread_cond_wait (&r->cond, &r->lock);
+  n = r->len[r->tail];
+  pthread_mutex_unlock (&r->lock);
+
+  if (n <= 0)
+    return n;
+  n -= r->pos;
+  if ((size_t) n > want)
+    n = want;
+  *data = r->buf[r->tail] + r->pos;
+  r->pos += n;
+  return n;
+}
+
+// For headers, which may straddle two buffers.
+static int
+ring_read (ImageRing * r, void *dst, size_t len)
+{
+  const char *data;
+  ssize_t n;
+
+  while (len > 0)
+	  {
+	    n = ring_take (r, len, &data);
+	    if (n <= 0)
+	      return -1;
+	    memcpy (dst, data, n);
+	    dst = (char *) dst + n;
+	    len -= n;
+	  }
+  return 0;
+}
+
+static int
+copy_to_flash (ImageRing * r, FlashWriter * w, long long len)
+{
+  const char *data;
+  ssize_t n;
+
+  while (len > 0)
+	  {
+	    n = ring_take (r, len > RING_BUFFER_SIZE ? RING_BUFFER_SIZE : len,
+			   &data);
+	    if (n <= 0 || flash_writer_write (w, data, n))
+	      return -1;
+	    len -= n;
+	  }
+  return 0;
+}
+
+// Android sparse images: a file header, then chunks that each hold raw
+// blocks, one 32-bit value to fill blocks with, or nothing for blocks
+// whose contents don't matter.  All little-endian.
+#define SPARSE_MAGIC 0xed26ff3a
+#define SPARSE_HEADER_LEN 28
+#define CHUNK_HEADER_LEN 12
+#define CHUNK_RAW 0xcac1
+#define CHUNK_FILL 0xcac2
+#define CHUNK_DONT_CARE 0xcac3
+#define CHUNK_CRC32 0xcac4
+
+static unsigned
+le16 (const unsigned char *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static unsigned
+le32 (const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static int
+skip_header_rest (ImageRing * r, unsigned have, unsigned len)
+{
+  char scratch[64];
+
+  while (have < len)
+	  {
+	    unsigned n = len - have > sizeof (scratch) ?
+	      sizeof (scratch) : len - have;
+
+	    if (ring_read (r, scratch, n))
+	      return -1;
+	    have += n;
+	  }
+  return 0;
+}
+
+static int
+fill_blocks (FlashWriter * w, const unsigned char *value, long long len)
+{
+  char pattern[4096];
+  size_t i;
+
+  for (i = 0; i < sizeof (pattern); i += 4)
+    memcpy (pattern + i, value, 4);
+  while (len > 0)
+	  {
+	    size_t n = len > (long long) sizeof (pattern) ?
+	      sizeof (pattern) : len;
+
+	    if (flash_writer_write (w, pattern, n))
+	      return -1;
+	    len -= n;
+	  }
+  return 0;
+}
+
+static int
+write_sparse (ImageRing * r, FlashWriter * w, const unsigned char *header)
+{
+  unsigned header_len = le16 (header + 8);
+  unsigned chunk_header_len = le16 (header + 10);
+  unsigned block_size = le32 (header + 12);
+  unsigned chunks = le32 (header + 20);
+  unsigned char chunk[CHUNK_HEADER_LEN];
+  unsigned char value[4];
+  unsigned i;
+
+  if (le16 (header + 4) != 1 || header_len < SPARSE_HEADER_LEN ||
+      chunk_header_len < CHUNK_HEADER_LEN || block_size == 0 ||
+      block_size % 4)
+	  {
+	    LOGE ("unsupported sparse image\n");
+	    return -1;
+	  }
+  if (skip_header_rest (r, SPARSE_HEADER_LEN, header_len))
+    return -1;
+
+  for (i = 0; i < chunks; ++i)
+	  {
+	    long long len;
+	    int ret;
+
+	    if (ring_read (r, chunk, CHUNK_HEADER_LEN) ||
+		skip_header_rest (r, CHUNK_HEADER_LEN, chunk_header_len))
+	      return -1;
+	    len = (long long) le32 (chunk + 4) * block_size;
+	    switch (le16 (chunk))
+		    {
+		    case CHUNK_RAW:
+		      ret = copy_to_flash (r, w, len);
+		      break;
+		    case CHUNK_FILL:
+		      ret = ring_read (r, value, 4) || fill_blocks (w, value, len);
+		      break;
+		    case CHUNK_DONT_CARE:
+		      ret = flash_writer_skip (w, len);
+		      break;
+		    case CHUNK_CRC32:
+		      ret = ring_read (r, value, 4);
+		      break;
+		    default:
+		      LOGE ("bad sparse chunk type 0x%x\n", le16 (chunk));
+		      ret = -1;
+		    }
+	    if (ret)
+	      return -1;
+	  }
+  return 0;
+}
+
+static int
+write_image (ImageRing * r, FlashWriter * w)
+{
+  unsigned char header[SPARSE_HEADER_LEN];
+  const char *data;
+  ssize_t n;
+  size_t have = 0;
+
+  // enough to tell a sparse image from a plain one
+  while (have < sizeof (header))
+	  {
+	    n = ring_take (r, sizeof (header) - have, &data);
+	    if (n < 0)
+	      return -1;
+	    if (n == 0)
+	      break;
+	    memcpy (header + have, data, n);
+	    have += n;
+	  }
+  if (have == sizeof (header) && le32 (header) == SPARSE_MAGIC)
+    return write_sparse (r, w, header);
+
+  if (flash_writer_write (w, (char *) header, have))
+    return -1;
+  while ((n = ring_take (r, RING_BUFFER_SIZE, &data)) > 0)
+	  {
+	    if (flash_writer_write (w, data, n))
+	      return -1;
+	  }
+  return n < 0 ? -1 : 0;
+}
+
+int
+restore_raw_image (const char *partitionType, const char *partition,
+		   const char *filename)
+{
+  ImageRing r;
+  FlashWriter *w;
+  pthread_t reader;
+  struct timespec start, end;
+  int ret = -1;
+  int i;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  memset (&r, 0, sizeof (r));
+  pthread_mutex_init (&r.lock, NULL);
+  pthread_cond_init (&r.cond, NULL);
+
+  r.in = gzstream_open (filename);
+  if (r.in == NULL)
+	  {
+	    LOGE ("can't open %s (%s)\n", filename, strerror (errno));
+	    return -1;
+	  }
+  for (i = 0; i < RING_BUFFERS; ++i)
+	  {
+	    r.buf[i] = malloc (RING_BUFFER_SIZE);
+	    if (r.buf[i] == NULL)
+	      goto out;
+	  }
+  w = open_raw_partition_writer (partitionType, partition);
+  if (w == NULL)
+	  {
+	    LOGE ("can't open %s for writing\n", partition);
+	    goto out;
+	  }
+  if (pthread_create (&reader, NULL, ring_reader, &r) != 0)
+	  {
+	    flash_writer_abort (w);
+	    goto out;
+	  }
+
+  ret = write_image (&r, w);
+
+  pthread_mutex_lock (&r.lock);
+  r.stop = 1;
+  pthread_cond_broadcast (&r.cond);
+  pthread_mutex_unlock (&r.lock);
+  pthread_join (reader, NULL);
+  if (ret != 0)
+    flash_writer_abort (w);
+  else if (flash_writer_close (w))
+    ret = -1;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  LOGI ("%s %s from %s%s in %ld ms\n",
+	ret == 0 ? "restored" : "failed to restore", partition, filename,
+	gzstream_compressed (r.in) ? " (gzip)" : "",
+	(end.tv_sec - start.tv_sec) * 1000 +
+	(end.tv_nsec - start.tv_nsec) / 1000000);
+out:
+  for (i = 0; i < RING_BUFFERS; ++i)
+    free (r.buf[i]);
+  gzstream_close (r.in);
+  pthread_mutex_destroy (&r.lock);
+  pthread_cond_destroy (&r.cond);
+  return ret;
+}
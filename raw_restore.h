@@ -0,0 +1,14 @@
+#ifndef RECOVERY_RAW_RESTORE_H
+#define RECOVERY_RAW_RESTORE_H
+
+// Writes the image 'filename' onto a raw (mtd, emmc or bml) partition
+// in-process, with no uncompressed copy anywhere.  The image may be
+// plain, gzipped, or an Android sparse image (gzipped or not); it is
+// read and inflated by a second thread while this one writes, so the
+// card, the CPU and the flash are all kept busy.  'partitionType' and
+// 'partition' are as for restore_raw_partition().  Returns 0 on
+// success.
+int restore_raw_image (const char *partitionType, const char *partition,
+		       const char *filename);
+
+#endif
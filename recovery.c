@@ -43,6 +43,9 @@
 #include "flashutils/flashutils.h"
 
 #include "mounts.h"
+#include "mkyaffs2image.h"
+#include "startup.h"
+#include "prefs.h"
 static const struct option OPTIONS[] = { 
     {"send_intent", required_argument, NULL, 's'}, 
   {"update_package", required_argument, NULL, 'u'}, 
@@ -54,18 +57,10 @@ char* STORAGE_ROOT;
 
 void set_bg_icon()
 {
-  int bg_set = 0;
-  if (access("/tmp/.rzrpref_icon_rw", F_OK) != -1) 
-  {  
-    ui_set_background(BACKGROUND_ICON_RW);
-    bg_set = 1;
-  }
-  if (access("/tmp/.rzrpref_icon_rz", F_OK) != -1) 
-  {
-    ui_set_background(BACKGROUND_ICON_RZ);
-    bg_set = 1;
-  }
-  if (!bg_set) ui_set_background(BACKGROUND_ICON_RZ);
+  char icon[8] = "";
+  pref_get("icon", icon, sizeof(icon));
+  if (strcmp(icon, "rw") == 0) ui_set_background(BACKGROUND_ICON_RW);
+  else ui_set_background(BACKGROUND_ICON_RZ);
 }
 
 
@@ -78,10 +73,22 @@ int get_load_silently()
 
 int fail_silently;
 
+static void wait_for_device(const char* path, int timeout_ms)
+{
+  Volume* v = volume_for_path(path);
+  if (v == NULL || v->device[0] != '/') return;
+  while (access(v->device, F_OK) != 0 && timeout_ms > 0)
+  {
+    usleep(20000);
+    timeout_ms -= 20;
+  }
+}
+
 void storage_root_set()
 {
   fail_silently = 1; //dont fill the log with failed mounts, we are just testing
-  sleep(1); // lets delay a second - everything might not be initialized just yet
+  // the sdcard may still be probing; give its node up to a second to show up
+  wait_for_device("/sdcard", 1000);
   //if sdcard is mountable then use it
   if (ensure_path_mounted("/sdcard") == 0) 
   {
@@ -113,14 +120,14 @@ void set_storage_root()
 
 char* get_storage_root() 
 {
-  char STORAGE_ROOT_STRING[PATH_MAX];
+  static char STORAGE_ROOT_STRING[PATH_MAX];
   strcpy(STORAGE_ROOT_STRING, STORAGE_ROOT);
   return STORAGE_ROOT_STRING;
 }  
 
 char* get_rzr_dir()
 {
-  char RZR_DIR_STRING[PATH_MAX];
+  static char RZR_DIR_STRING[PATH_MAX];
   strcpy(RZR_DIR_STRING, STORAGE_ROOT);
   strcat(RZR_DIR_STRING, "/RZR");
   return RZR_DIR_STRING;
@@ -129,7 +136,7 @@ char* get_rzr_dir()
 char* get_plugins_dir()
 {
   char* RZR_DIR = get_rzr_dir();
-  char PLUGINS_DIR_STRING[PATH_MAX];
+  static char PLUGINS_DIR_STRING[PATH_MAX];
   strcpy(PLUGINS_DIR_STRING, RZR_DIR);
   strcat(PLUGINS_DIR_STRING, "/plugins");
   return PLUGINS_DIR_STRING;
@@ -137,7 +144,7 @@ char* get_plugins_dir()
 
 char* get_nandroid_dir()
 {
-  char NANDROID_DIR_STRING[PATH_MAX];
+  static char NANDROID_DIR_STRING[PATH_MAX];
   strcpy(NANDROID_DIR_STRING, STORAGE_ROOT);
   strcat(NANDROID_DIR_STRING, "/nandroid");
   return NANDROID_DIR_STRING;
@@ -351,8 +358,7 @@ void create_fstab ()
 	    return;
 	  }
   Volume * vol = volume_for_path ("/boot");
-  if (NULL != vol && strcmp (vol->fs_type, "mtd") != 0
-       && strcmp (vol->fs_type, "emmc") != 0 && (vol->fs_type, "bml") != 0) {   
+  if (NULL != vol && !(vol->flags & VOLUME_RAW)) {
     write_fstab_root ("/boot", file);
   }  
   write_fstab_root ("/cache", file);
@@ -369,43 +375,21 @@ void create_fstab ()
   LOGI ("Completed outputting fstab.\n\n");
 }
 
-//write recovery files from tmp to sdcard
-  void
+//save the preferences to the sdcard if any changed
+void
 write_files ()
-{  
-  if (ensure_path_mounted (STORAGE_ROOT) != 0)
-  {
-	LOGE ("Can't mount %s\n", STORAGE_ROOT);
-	return;
-  }
-  else
-  {
-  char* RZR_DIR = get_rzr_dir();
-  char CP_CMD[PATH_MAX];
-  char DIR_CMD[PATH_MAX];
-  sprintf(DIR_CMD, "[ ! -d %s ] && mkdir -p %s", RZR_DIR, RZR_DIR);
-  __system(DIR_CMD);
-  char DEL_CMD[PATH_MAX];
-  sprintf(DEL_CMD, "rm %s/.rzrpref_*", RZR_DIR);
-  __system(DEL_CMD);
-  sprintf(CP_CMD, "cp /tmp/.rzrpref_* %s/", RZR_DIR);
-  __system(CP_CMD);
-  }
-  ensure_path_unmounted(STORAGE_ROOT);
-  sync ();
+{
+  prefs_save ();
 }
 
 void read_cpufreq ()
 {
+   char freq[16];
+
    printf("Starting read_cpufreq()...\n");
-   if (access ("/tmp/.rzrpref_oc", F_OK) != -1)
+   if (pref_get ("oc", freq, sizeof (freq)) == 0)
 	  {
 	    printf("Saved clockspeed detected.\n");
-		FILE * fs = fopen ("/tmp/.rzrpref_oc", "r");
-	    char *freq = calloc (9, sizeof (char));
-
-	    fgets (freq, 9, fs);
-	    fclose (fs);
 	    if (access
 		 ("/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq",
 		  F_OK) != -1)
@@ -414,36 +398,15 @@ void read_cpufreq ()
 			  printf("cpufreq set to %s\n", freq);	  
 		    }		
 	  }
-  sync ();
 }
  
-//read recovery files from sdcard to tmp
+//load the preferences from the sdcard
 void read_files ()
 {
- ensure_path_mounted (STORAGE_ROOT);
- 
- char* RZR_DIR = get_rzr_dir();
- if (access(RZR_DIR, F_OK) != -1) 
-  {
-   /*__system("mkdir /cache/recovery");
-   __system("mv /tmp/log /cache/recovery/log");
-   __system("mv /tmp/last_log /cache/recovery/last_log");*/
-   char LOG_CMD[PATH_MAX];
-   sprintf(LOG_CMD, "rm %s/recovery.log", RZR_DIR); //remove the log from last run so we can get a new log
-   __system(LOG_CMD);
-   char CP_CMD[PATH_MAX];
-   sprintf(CP_CMD, "cp %s/.rzrpref_* /tmp/", RZR_DIR);
-   __system(CP_CMD);
-  }
- if (access("/tmp/.rzrpref_nandloc", F_OK) == -1) 
- {
-   FILE * fp = fopen("/tmp/.rzrpref_nandloc", "w");
-   fprintf(fp, "%s\0", get_nandroid_dir());
-   fclose(fp);
- }
- ensure_path_unmounted(STORAGE_ROOT);
- 
- sync ();
+ prefs_load ();
+ if (!pref_isset ("nandloc"))
+   pref_set ("nandloc", get_nandroid_dir ());
+ ev_set_keyhold_delay (pref_get_int ("scroll", 0));
 }
 
 int postrecoveryboot() 
@@ -844,6 +807,43 @@ print_property (const char *key, const char *name, void *cookie)
   printf ("%s=%s\n", key, name);
 }  
 
+// Startup stages (see startup.c).  The volume table, the storage probe
+// and the sdcard sync run in order on one thread while main() brings
+// up the UI; main() waits for each only where it needs its result.
+static void
+start_volumes (void)
+{
+  load_volume_table ();
+  process_volumes ();
+}
+
+static void
+start_prefs (void)
+{
+  postrecoveryboot ();
+  read_files ();
+  read_cpufreq ();
+}
+
+static void
+start_ui (void)
+{
+  ui_init ();
+  gr_color (0, 0, 0, 0);
+  ui_show_indeterminate_progress ();
+  ui_set_background (LOADING);
+}
+
+static StartupStage volumes_stage = { "volumes", start_volumes };
+static StartupStage storage_stage = { "storage", set_storage_root };
+static StartupStage prefs_stage = { "prefs", start_prefs };
+static StartupStage ui_stage = { "ui", start_ui };
+static StartupStage leds_stage = { "leds", activateLEDs };
+
+static StartupStage *storage_chain[] = {
+  &volumes_stage, &storage_stage, &prefs_stage, NULL
+};
+
 int main (int argc, char **argv)
 {
   
@@ -869,6 +869,8 @@ int main (int argc, char **argv)
 	      return reboot_android();
 	    if (strstr (argv[0], "unyaffs") != NULL)
 	      return unyaffs_main(argc, argv);
+	    if (strstr (argv[0], "mkyaffs2image") != NULL)
+	      return mkyaffs2image_main(argc, argv);
 	    if (strstr (argv[0], "keytest") != NULL)
 	      return ui_key_test();
 	    if (strstr (argv[0], "compute_size") != NULL)
@@ -886,12 +888,13 @@ int main (int argc, char **argv)
   setbuf (stderr, NULL);
   time_t start = time (NULL);
   printf ("Starting recovery on %s", ctime (&start));
-  ui_init();
-  gr_color (0, 0, 0, 0);
-  ui_show_indeterminate_progress();
-  ui_set_background(LOADING);
-  load_volume_table ();
-  process_volumes ();
+  startup_begin ();
+  startup_start (storage_chain);
+  startup_run (&ui_stage);
+  startup_run (&leds_stage);
+  // get_args() reads the BCB through mtd_lookup_partition(), which must
+  // not run alongside the storage stage's mounts
+  startup_wait (&storage_stage);
   get_args (&argc, &argv);
   int previous_runs = 0;
   const char *send_intent = NULL;
@@ -921,13 +924,6 @@ int main (int argc, char **argv)
 		      continue;
 		    }
 	  }
-  set_storage_root();
-  postrecoveryboot();
-  read_files();
-  read_cpufreq();
-  activateLEDs();
-  set_bg_icon();
-  ui_reset_progress();
   printf("\n");
   printf("STORAGE_ROOT: %s\n", get_storage_root());
   printf("NANDROID_DIR: %s\n", get_nandroid_dir());
@@ -964,6 +960,11 @@ int main (int argc, char **argv)
   printf ("\n");
   property_list (print_property, NULL);
   printf ("\n");
+  // the sdcard is busy until the preferences are synced, and the
+  // menus need them
+  startup_wait (&prefs_stage);
+  set_bg_icon ();
+  ui_reset_progress ();
    int status = INSTALL_SUCCESS;
 
    if (toggle_secure_fs)
@@ -1035,6 +1036,7 @@ int main (int argc, char **argv)
    if (status != INSTALL_SUCCESS)
   if (status != INSTALL_SUCCESS /*|| ui_text_visible() */ )
 	  {
+	    startup_mark ("first menu");
 	    prompt_and_wait ();
 	  }
    
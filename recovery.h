@@ -21,6 +21,11 @@ int volume_present(char *volume);
 void write_files ();
 void read_files ();
 
+char* get_storage_root();
+char* get_rzr_dir();
+char* get_plugins_dir();
+char* get_nandroid_dir();
+
 void reboot_fn(char* action);
 void reboot_android();
 
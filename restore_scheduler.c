@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "roots.h"
+#include "restore_scheduler.h"
+
+// As with wiping, jobs are grouped by the flash chip they restore to
+// and each chip's jobs are extracted one after another.  A second
+// thread per chip runs the prepare() steps (formatting, mostly) ahead
+// of the extractor, so a volume is already empty by the time its
+// turn comes instead of the chip idling while mke2fs runs.
+
+#define MAX_RESTORE_GROUPS 8
+#define PROGRESS_INTERVAL_US 100000
+
+// share of a job's progress bar taken by prepare()
+#define PREPARE_SHARE 0.2
+
+typedef struct
+{
+  char device[64];		// physical device key
+  RestoreJob *jobs[MAX_RESTORE_JOBS];
+  int count;
+  pthread_t preparer;
+  pthread_t extractor;
+  int started;
+} RestoreGroup;
+
+static int restore_failures;
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t restore_prepared = PTHREAD_COND_INITIALIZER;
+
+static void
+finish_job (RestoreJob * job, int ret)
+{
+  job->status = ret == 0 ? RESTORE_JOB_DONE : RESTORE_JOB_FAILED;
+  ui_print ("-- Restoring %s... %s\n", job->label,
+	    ret == 0 ? "Success!" : "Failed!");
+  if (ret != 0)
+	  {
+	    pthread_mutex_lock (&restore_lock);
+	    ++restore_failures;
+	    pthread_mutex_unlock (&restore_lock);
+	  }
+}
+
+static void *
+prepare_group_thread (void *cookie)
+{
+  RestoreGroup *group = (RestoreGroup *) cookie;
+  int i, ret;
+
+  for (i = 0; i < group->count; ++i)
+	  {
+	    RestoreJob *job = group->jobs[i];
+
+	    set_thread_progress_slot (&job->progress);
+	    ret = job->prepare != NULL ? job->prepare (job) : 0;
+	    set_thread_progress_slot (NULL);
+	    job->progress = 1.0;
+
+	    pthread_mutex_lock (&restore_lock);
+	    job->prepared = ret == 0 ? 1 : -1;
+	    pthread_cond_broadcast (&restore_prepared);
+	    pthread_mutex_unlock (&restore_lock);
+	  }
+  return NULL;
+}
+
+static void *
+extract_group_thread (void *cookie)
+{
+  RestoreGroup *group = (RestoreGroup *) cookie;
+  int i;
+
+  for (i = 0; i < group->count; ++i)
+	  {
+	    RestoreJob *job = group->jobs[i];
+
+	    pthread_mutex_lock (&restore_lock);
+	    while (job->prepared == 0)
+	      pthread_cond_wait (&restore_prepared, &restore_lock);
+	    pthread_mutex_unlock (&restore_lock);
+
+	    if (job->prepared < 0)
+		    {
+		      finish_job (job, -1);
+		      continue;
+		    }
+	    job->status = RESTORE_JOB_RUNNING;
+	    finish_job (job, job->extract (job));
+	  }
+  return NULL;
+}
+
+static int
+all_jobs_finished (RestoreJob * jobs, int count)
+{
+  int i;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    if (jobs[i].status == RESTORE_JOB_PENDING ||
+		jobs[i].status == RESTORE_JOB_RUNNING)
+	      return 0;
+	  }
+  return 1;
+}
+
+static float
+job_progress (const RestoreJob * job)
+{
+  if (job->status == RESTORE_JOB_DONE || job->status == RESTORE_JOB_FAILED)
+    return 1.0;
+  return job->progress * PREPARE_SHARE;
+}
+
+int
+run_restore_jobs (RestoreJob * jobs, int count)
+{
+  RestoreGroup groups[MAX_RESTORE_GROUPS];
+  int group_count = 0;
+  struct timespec start, end;
+  int i, g;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  restore_failures = 0;
+  memset (groups, 0, sizeof (groups));
+  if (count > MAX_RESTORE_JOBS)
+    count = MAX_RESTORE_JOBS;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    char key[64];
+	    Volume *v = volume_for_path (jobs[i].path);
+
+	    jobs[i].progress = 0.0;
+	    jobs[i].prepared = 0;
+	    if (v == NULL)
+		    {
+		      LOGE ("no volume for %s; skipping\n", jobs[i].path);
+		      jobs[i].status = RESTORE_JOB_FAILED;
+		      ++restore_failures;
+		      continue;
+		    }
+	    jobs[i].status = RESTORE_JOB_PENDING;
+	    volume_device_key (v, key, sizeof (key));
+
+	    for (g = 0; g < group_count; ++g)
+		    {
+		      if (strcmp (groups[g].device, key) == 0)
+			break;
+		    }
+	    if (g == group_count)
+		    {
+		      if (group_count == MAX_RESTORE_GROUPS)
+			g = group_count - 1;	// just queue it behind the last chip
+		      else
+			strcpy (groups[group_count++].device, key);
+		    }
+	    groups[g].jobs[groups[g].count++] = &jobs[i];
+	    LOGI ("restore %s on %s\n", jobs[i].label, groups[g].device);
+	  }
+
+  ui_show_progress (1.0, 0);
+  for (g = 0; g < group_count; ++g)
+	  {
+	    int prepared = 0;
+
+	    if (pthread_create (&groups[g].preparer, NULL, prepare_group_thread,
+				&groups[g]) == 0)
+		    {
+		      groups[g].started =
+			pthread_create (&groups[g].extractor, NULL,
+					extract_group_thread, &groups[g]) == 0;
+		      if (groups[g].started)
+			continue;
+		      pthread_join (groups[g].preparer, NULL);
+		      prepared = 1;
+		    }
+	    LOGW ("can't start restore threads; restoring %s serially\n",
+		  groups[g].device);
+	    if (!prepared)
+	      prepare_group_thread (&groups[g]);
+	    extract_group_thread (&groups[g]);
+	  }
+
+  // This thread only keeps the progress bar moving.
+  while (!all_jobs_finished (jobs, count))
+	  {
+	    float total = 0.0;
+
+	    for (i = 0; i < count; ++i)
+	      total += job_progress (&jobs[i]);
+	    ui_set_progress (total / count);
+	    usleep (PROGRESS_INTERVAL_US);
+	  }
+  for (g = 0; g < group_count; ++g)
+	  {
+	    if (groups[g].started)
+		    {
+		      pthread_join (groups[g].preparer, NULL);
+		      pthread_join (groups[g].extractor, NULL);
+		    }
+	  }
+  ui_set_progress (1.0);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  LOGI ("restored %d volumes on %d devices in %ld ms\n", count, group_count,
+	(end.tv_sec - start.tv_sec) * 1000 +
+	(end.tv_nsec - start.tv_nsec) / 1000000);
+  return restore_failures;
+}
@@ -0,0 +1,35 @@
+#ifndef RESTORE_SCHEDULER_H
+#define RESTORE_SCHEDULER_H
+
+#define MAX_RESTORE_JOBS 12
+
+enum
+{
+  RESTORE_JOB_PENDING,
+  RESTORE_JOB_RUNNING,
+  RESTORE_JOB_DONE,
+  RESTORE_JOB_FAILED
+};
+
+typedef struct RestoreJob RestoreJob;
+
+struct RestoreJob
+{
+  const char *label;		// for the log, eg. "/system"
+  const char *path;		// on the volume being restored
+  int (*prepare) (RestoreJob * job);	// eg. format it; may be NULL
+  int (*extract) (RestoreJob * job);
+  void *cookie;
+  volatile int status;
+  volatile int prepared;	// 0 not yet, 1 done, -1 failed
+  volatile float progress;	// of prepare(), for delete_tree()
+};
+
+// Restore the jobs with those on different flash chips in parallel
+// and those on the same chip in list order, preparing each job while
+// the one before it is extracted.  A job whose prepare() fails isn't
+// extracted.  Drives the progress bar; returns the number of jobs
+// that failed.
+int run_restore_jobs (RestoreJob * jobs, int count);
+
+#endif
@@ -16,17 +16,24 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
 #include "mounts.h"
 #include "roots.h"
 #include "common.h"
 #include "make_ext4fs.h"
+#include "minzip/DirUtil.h"
+#include "prefs.h"
 
 #include "flashutils/flashutils.h"
 
@@ -53,12 +60,131 @@ is_null (const char *sz)
   return 0;
 }
 
-static char *
-dupe_string (const char *sz)
+// Volume strings are interned: "ext4", option strings and so on are
+// stored once, and they live as long as recovery does.
+static const char **interned;
+static int interned_count;
+
+static const char *
+intern_string (const char *sz)
 {
+  int i;
+
   if (is_null (sz))
     return NULL;
-  return strdup (sz);
+  for (i = 0; i < interned_count; ++i)
+	  {
+	    if (strcmp (interned[i], sz) == 0)
+	      return interned[i];
+	  }
+  if ((interned_count & (interned_count - 1)) == 0)
+    interned = realloc (interned,
+			(interned_count ? interned_count * 2 : 16) *
+			sizeof (char *));
+  interned[interned_count] = strdup (sz);
+  return interned[interned_count++];
+}
+
+static int
+volume_flags (const char *fs_type)
+{
+  if (strcmp (fs_type, "ramdisk") == 0)
+    return VOLUME_RAMDISK;
+  if (strcmp (fs_type, "mtd") == 0)
+    return VOLUME_RAW | VOLUME_MTD;
+  if (strcmp (fs_type, "emmc") == 0 || strcmp (fs_type, "bml") == 0)
+    return VOLUME_RAW;
+  if (strcmp (fs_type, "yaffs2") == 0)
+    return VOLUME_MTD;
+  if (strcmp (fs_type, "ext2") == 0)
+    return VOLUME_EXT;
+  if (strcmp (fs_type, "ext3") == 0 || strcmp (fs_type, "ext4") == 0)
+    return VOLUME_EXT | VOLUME_MOUNT;
+  if (strcmp (fs_type, "rfs") == 0 || strcmp (fs_type, "vfat") == 0)
+    return VOLUME_MOUNT;
+  return 0;
+}
+
+// volume_for_path() walks a trie of mount point components ("sdcard",
+// "sd-ext", ...) instead of comparing against every volume.
+typedef struct VolumeNode
+{
+  const char *name;
+  int len;
+  int volume;			// index into device_volumes, or -1
+  struct VolumeNode *child;
+  struct VolumeNode *next;
+} VolumeNode;
+
+static VolumeNode volume_root = { "", 0, -1, NULL, NULL };
+
+static void
+free_volume_nodes (VolumeNode * node)
+{
+  while (node != NULL)
+	  {
+	    VolumeNode *next = node->next;
+
+	    free_volume_nodes (node->child);
+	    free (node);
+	    node = next;
+	  }
+}
+
+static VolumeNode *
+find_volume_child (VolumeNode * node, const char *name, int len)
+{
+  VolumeNode *c;
+
+  for (c = node->child; c != NULL; c = c->next)
+	  {
+	    if (c->len == len && memcmp (c->name, name, len) == 0)
+	      return c;
+	  }
+  return NULL;
+}
+
+static void
+build_volume_index ()
+{
+  int i;
+
+  free_volume_nodes (volume_root.child);
+  volume_root.child = NULL;
+  for (i = 0; i < num_volumes; ++i)
+	  {
+	    const char *p = device_volumes[i].mount_point;
+	    VolumeNode *node = &volume_root;
+
+	    device_volumes[i].flags = volume_flags (device_volumes[i].fs_type);
+	    if (p[0] != '/')
+	      continue;
+	    while (*p)
+		    {
+		      while (*p == '/')
+			++p;
+		      if (*p == '\0')
+			break;
+
+		      int len = strcspn (p, "/");
+		      VolumeNode *c = find_volume_child (node, p, len);
+
+		      if (c == NULL)
+			      {
+				c = calloc (1, sizeof (VolumeNode));
+				c->name = p;
+				c->len = len;
+				c->volume = -1;
+				c->next = node->child;
+				node->child = c;
+			      }
+		      node = c;
+		      p += len;
+		    }
+	    // the first entry for a mount point wins, as before
+	    if (node != &volume_root && node->volume < 0)
+	      node->volume = i;
+	  }
 }
 
 void
@@ -77,6 +203,7 @@ load_volume_table ()
   device_volumes[0].device2 = NULL;
   device_volumes[0].fs_options = NULL;
   device_volumes[0].fs_options2 = NULL;
+  device_volumes[0].fs_type2 = NULL;
   num_volumes = 1;
 
   FILE *fstab = fopen ("/etc/recovery.fstab", "r");
@@ -85,6 +212,7 @@ load_volume_table ()
 	  {
 	    LOGE ("failed to open /etc/recovery.fstab (%s)\n",
 		  strerror (errno));
+	    build_volume_index ();
 	    return;
 	  }
 
@@ -120,29 +248,30 @@ load_volume_table ()
 					   alloc * sizeof (Volume));
 			      }
 		      device_volumes[num_volumes].mount_point =
-			strdup (mount_point);
+			intern_string (mount_point);
 		      device_volumes[num_volumes].fs_type =
-			!is_null (fs_type2) ? strdup (fs_type2) :
-			strdup (fs_type);
-		      device_volumes[num_volumes].device = strdup (device);
+			!is_null (fs_type2) ? intern_string (fs_type2) :
+			intern_string (fs_type);
+		      device_volumes[num_volumes].device =
+			intern_string (device);
 		      device_volumes[num_volumes].device2 =
-			!is_null (device2) ? strdup (device2) : NULL;
+			intern_string (device2);
 		      device_volumes[num_volumes].fs_type2 =
-			!is_null (fs_type2) ? strdup (fs_type) : NULL;
+			!is_null (fs_type2) ? intern_string (fs_type) : NULL;
 
 		      if (!is_null (fs_type2))
 			      {
 				device_volumes[num_volumes].fs_options2 =
-				  dupe_string (fs_options);
+				  intern_string (fs_options);
 				device_volumes[num_volumes].fs_options =
-				  dupe_string (fs_options2);
+				  intern_string (fs_options2);
 			      }
 		      else
 			      {
 				device_volumes[num_volumes].fs_options2 =
 				  NULL;
 				device_volumes[num_volumes].fs_options =
-				  dupe_string (fs_options);
+				  intern_string (fs_options);
 			      }
 		      ++num_volumes;
 		    }
@@ -155,6 +284,7 @@ load_volume_table ()
 	  }
 
   fclose (fstab);
+  build_volume_index ();
 
   if (!load_silently)
   {
@@ -171,8 +301,12 @@ load_volume_table ()
   }
 }
 
-int
-is_path_mounted (const char *path)
+// The mount table and partition scans behind these are global, and
+// run_wipe_jobs() calls them from several threads.
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+is_path_mounted_locked (const char *path)
 {
   Volume *v = volume_for_path (path);
 
@@ -180,7 +314,7 @@ is_path_mounted (const char *path)
 	  {
 	    return 0;
 	  }
-  if (strcmp (v->fs_type, "ramdisk") == 0)
+  if (v->flags & VOLUME_RAMDISK)
 	  {
 	    // the ramdisk is always mounted.
 	    return 1;
@@ -208,20 +342,29 @@ is_path_mounted (const char *path)
 Volume *
 volume_for_path (const char *path)
 {
-  int i;
-  
-  for (i = 0; i < num_volumes; ++i)
+  VolumeNode *node = &volume_root;
+  int best = -1;
+
+  if (path[0] != '/')
+    return NULL;
+  while (*path)
 	  {
-	    Volume *v = device_volumes + i;
-	    int len = strlen (v->mount_point);
+	    while (*path == '/')
+	      ++path;
+	    if (*path == '\0')
+	      break;
 
-	    if (strncmp (path, v->mount_point, len) == 0 &&
-		(path[len] == '\0' || path[len] == '/'))
-		    {
-		      return v;
-		    }
+	    int len = strcspn (path, "/");
+
+	    node = find_volume_child (node, path, len);
+	    if (node == NULL)
+	      break;
+	    // table order decides between nested mount points, as before
+	    if (node->volume >= 0 && (best < 0 || node->volume < best))
+	      best = node->volume;
+	    path += len;
 	  }
-  return NULL;
+  return best < 0 ? NULL : device_volumes + best;
 }
 
 int
@@ -252,8 +395,8 @@ try_mount (const char *device, const char *mount_point, const char *fs_type,
   return ret;
 }
 
-int
-ensure_path_mounted (const char *path)
+static int
+ensure_path_mounted_locked (const char *path)
 {
   int fail_silently = get_fail_silently();
 
@@ -264,7 +407,7 @@ ensure_path_mounted (const char *path)
 	    if (!fail_silently) LOGE ("unknown volume for path [%s]\n", path);
 	    return -1;
 	  }
-  if (strcmp (v->fs_type, "ramdisk") == 0)
+  if (v->flags & VOLUME_RAMDISK)
 	  {
 	    // the ramdisk is always mounted.
 	    return 0;
@@ -288,14 +431,15 @@ ensure_path_mounted (const char *path)
 	  }
 
   mkdir (v->mount_point, 0755);	// in case it doesn't already exist
+  // whatever happens next changes the mount table
+  invalidate_mounted_volumes ();
 
-  if (strcmp (v->fs_type, "yaffs2") == 0)
+  if ((v->flags & (VOLUME_MTD | VOLUME_RAW)) == VOLUME_MTD)
 	  {
 	    // mount an MTD partition as a YAFFS2 filesystem.
-	    mtd_scan_partitions ();
 	    const MtdPartition *partition;
 
-	    partition = mtd_find_partition_by_name (v->device);
+	    partition = mtd_lookup_partition (v->device);
 	    if (partition == NULL)
 		    {
 		      LOGE
@@ -306,10 +450,7 @@ ensure_path_mounted (const char *path)
 	    return mtd_mount_partition (partition, v->mount_point, v->fs_type,
 					0);
 	  }
-  else if (strcmp (v->fs_type, "ext4") == 0 ||
-	   strcmp (v->fs_type, "ext3") == 0 ||
-	   strcmp (v->fs_type, "rfs") == 0 ||
-	   strcmp (v->fs_type, "vfat") == 0)
+  else if (v->flags & VOLUME_MOUNT)
 	  {
 	    if ((result =
 		 try_mount (v->device, v->mount_point, v->fs_type,
@@ -342,8 +483,8 @@ ensure_path_mounted (const char *path)
   return -1;
 }
 
-int
-ensure_path_unmounted (const char *path)
+static int
+ensure_path_unmounted_locked (const char *path)
 {
   // if we are using /data/media, do not ever unmount volumes /data or /sdcard
   if (volume_for_path ("/sdcard") == NULL
@@ -359,7 +500,7 @@ ensure_path_unmounted (const char *path)
 	    LOGE ("unknown volume for path [%s]\n", path);
 	    return -1;
 	  }
-  if (strcmp (v->fs_type, "ramdisk") == 0)
+  if (v->flags & VOLUME_RAMDISK)
 	  {
 	    // the ramdisk is always mounted; you can't unmount it.
 	    return -1;
@@ -385,6 +526,87 @@ ensure_path_unmounted (const char *path)
   return unmount_mounted_volume (mv);
 }
 
+int
+is_path_mounted (const char *path)
+{
+  pthread_mutex_lock (&mount_lock);
+  int ret = is_path_mounted_locked (path);
+
+  pthread_mutex_unlock (&mount_lock);
+  return ret;
+}
+
+int
+ensure_path_mounted (const char *path)
+{
+  pthread_mutex_lock (&mount_lock);
+  int ret = ensure_path_mounted_locked (path);
+
+  pthread_mutex_unlock (&mount_lock);
+  return ret;
+}
+
+int
+ensure_path_unmounted (const char *path)
+{
+  pthread_mutex_lock (&mount_lock);
+  int ret = ensure_path_unmounted_locked (path);
+
+  pthread_mutex_unlock (&mount_lock);
+  return ret;
+}
+
+int
+get_fast_wipe_mode ()
+{
+  char mode[16] = "";
+
+  if (pref_get ("wipe", mode, sizeof (mode)) != 0)
+    return FAST_WIPE_OFF;
+  if (strncmp (mode, "secure", 6) == 0)
+    return FAST_WIPE_SECURE;
+  if (strncmp (mode, "discard", 7) == 0)
+    return FAST_WIPE_DISCARD;
+  return FAST_WIPE_OFF;
+}
+
+void
+set_fast_wipe_mode (int mode)
+{
+  if (mode == FAST_WIPE_OFF)
+	  {
+	    pref_unset ("wipe");
+	    return;
+	  }
+  pref_set ("wipe", mode == FAST_WIPE_SECURE ? "secure" : "discard");
+}
+
+// Hand the whole partition back to the eMMC controller before a new
+// filesystem goes on it.  Plain discard is only an optimisation, so
+// it's skipped quietly if unsupported; secure mode zero-fills instead.
+static void
+discard_block_device (const char *device)
+{
+  int mode = get_fast_wipe_mode ();
+
+  if (mode == FAST_WIPE_OFF || strncmp (device, "/dev/block/", 11) != 0)
+    return;
+
+  int flags = mode == FAST_WIPE_SECURE ?
+    MMC_DISCARD_SECURE | MMC_DISCARD_ZERO : 0;
+
+  ui_print ("Discarding %s...\n", device);
+  if (mmc_discard_device (device, flags) != 0)
+	  {
+	    if (errno == EOPNOTSUPP)
+	      LOGI ("%s doesn't support discard\n", device);
+	    else
+	      LOGW ("discard of %s failed (%s)\n", device, strerror (errno));
+	  }
+}
+
+static pthread_mutex_t ext4_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int
 format_volume (const char *volume)
 {
@@ -401,7 +623,7 @@ format_volume (const char *volume)
 	    LOGE ("unknown volume \"%s\"\n", volume);
 	    return -1;
 	  }
-  if (strcmp (v->fs_type, "ramdisk") == 0)
+  if (v->flags & VOLUME_RAMDISK)
 	  {
 	    // you can't format the ramdisk.
 	    LOGE ("can't format_volume \"%s\"", volume);
@@ -422,11 +644,9 @@ format_volume (const char *volume)
 	    return -1;
 	  }
 
-  if (strcmp (v->fs_type, "yaffs2") == 0 || strcmp (v->fs_type, "mtd") == 0)
+  if (v->flags & VOLUME_MTD)
 	  {
-	    mtd_scan_partitions ();
-	    const MtdPartition *partition =
-	      mtd_find_partition_by_name (v->device);
+	    const MtdPartition *partition = mtd_lookup_partition (v->device);
 	    if (partition == NULL)
 		    {
 		      LOGE ("format_volume: no MTD partition \"%s\"\n",
@@ -460,9 +680,14 @@ format_volume (const char *volume)
 
   if (strcmp (v->fs_type, "ext4") == 0)
 	  {
+	    discard_block_device (v->device);
+	    // make_ext4fs keeps its state in globals
+	    pthread_mutex_lock (&ext4_lock);
 	    reset_ext4fs_info ();
 	    int result = make_ext4fs (v->device, NULL, NULL, 0, 0, 0);
 
+	    pthread_mutex_unlock (&ext4_lock);
+
 	    if (result != 0)
 		    {
 		      LOGE ("format_volume: make_extf4fs failed on %s\n",
@@ -479,6 +704,122 @@ format_volume (const char *volume)
   return format_unknown_device (v->device, volume, v->fs_type);
 }
 
+// mmcblk0p12 and mmcblk0p13 share mmcblk0, every MTD partition shares
+// the NAND, and on Samsung OneNAND devices the bml, stl and tfsr layers
+// all sit on one chip.
+void
+volume_device_key (const Volume * v, char *key, size_t len)
+{
+  char resolved[PATH_MAX];
+  const char *dev = v->device;
+  const char *name;
+  int n;
+
+  if (v->flags & VOLUME_MTD)
+	  {
+	    snprintf (key, len, "mtd");
+	    return;
+	  }
+  if (dev[0] != '/')
+	  {
+	    // a bare partition name, handled by the flash layer
+	    snprintf (key, len, "%s", v->fs_type);
+	    return;
+	  }
+  // by-name links point at the real node
+  if (realpath (dev, resolved) != NULL)
+    dev = resolved;
+  name = strrchr (dev, '/') ? strrchr (dev, '/') + 1 : dev;
+
+  if (strncmp (name, "mtdblock", 8) == 0)
+	  {
+	    snprintf (key, len, "mtd");
+	    return;
+	  }
+  if (strncmp (name, "bml", 3) == 0 || strncmp (name, "stl", 3) == 0 ||
+      strncmp (name, "tfsr", 4) == 0)
+	  {
+	    snprintf (key, len, "onenand");
+	    return;
+	  }
+  if (strncmp (name, "mmcblk", 6) == 0)
+	  {
+	    for (n = 6; isdigit (name[n]); ++n);
+	    snprintf (key, len, "%.*s", n, name);
+	    return;
+	  }
+  // sda1, sdb2...: drop the partition number
+  for (n = strlen (name); n > 0 && isdigit (name[n - 1]); --n);
+  snprintf (key, len, "%.*s", n, name);
+}
+
+static pthread_key_t progress_slot_key;
+static pthread_once_t progress_slot_once = PTHREAD_ONCE_INIT;
+
+static void
+progress_slot_init ()
+{
+  pthread_key_create (&progress_slot_key, NULL);
+}
+
+void
+set_thread_progress_slot (volatile float *fraction)
+{
+  pthread_once (&progress_slot_once, progress_slot_init);
+  pthread_setspecific (progress_slot_key, (void *) fraction);
+}
+
+static volatile float *
+thread_progress_slot ()
+{
+  pthread_once (&progress_slot_once, progress_slot_init);
+  return (volatile float *) pthread_getspecific (progress_slot_key);
+}
+
+static void
+delete_tree_progress (int done, int total, void *cookie)
+{
+  volatile float *slot = (volatile float *) cookie;
+
+  if (slot != NULL)
+    *slot = (float) done / total;
+  else
+    ui_set_progress ((float) done / total);
+}
+
+int
+delete_tree (const char *path, const char *const *exclude, int keep_root)
+{
+  struct timespec start, end;
+
+  volatile float *slot = thread_progress_slot ();
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if (slot == NULL)
+    ui_show_progress (1.0, 0);
+  int ret = dirUnlinkTree (path, exclude, keep_root, delete_tree_progress,
+			   (void *) slot);
+  int err = errno;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  LOGI ("Deleted %s%s in %ld ms\n", path, keep_root ? "/*" : "",
+	(end.tv_sec - start.tv_sec) * 1000 +
+	(end.tv_nsec - start.tv_nsec) / 1000000);
+  if (ret != 0 && err != ENOENT)
+    LOGW ("failed to delete all of %s (%s)\n", path, strerror (err));
+  return ret;
+}
+
+void
+clean_tmp ()
+{
+  // everything else is left over from installs and plugins
+  static const char *const keep[] = { "/tmp/recovery.log", NULL };
+
+  if (dirUnlinkTree ("/tmp", keep, true, NULL, NULL) != 0 && errno != ENOENT)
+    LOGW ("failed to clean up /tmp (%s)\n", strerror (errno));
+}
+
 int
 format_unknown_device (const char *device, const char *path,
 		       const char *fs_type)
@@ -487,7 +828,18 @@ format_unknown_device (const char *device, const char *path,
 
   // device may simply be a name, like "system"
   if (get_flash_type (fs_type) != UNSUPPORTED)
-    return erase_raw_partition (fs_type, device);
+	  {
+	    char block[PATH_MAX];
+
+	    if (get_flash_type (fs_type) == MMC)
+		    {
+		      if (device[0] == '/')
+			discard_block_device (device);
+		      else if (get_partition_device (device, block) == 0)
+			discard_block_device (block);
+		    }
+	    return erase_raw_partition (fs_type, device);
+	  }
 
   // if this is SDEXT:, don't worry about it if it does not exist.
   if (0 == strcmp (path, "/sd-ext"))
@@ -513,6 +865,7 @@ format_unknown_device (const char *device, const char *path,
 				LOGE ("Error while unmounting %s.\n", path);
 				return -12;
 			      }
+		      discard_block_device (device);
 		      return format_ext3_device (device);
 		    }
 
@@ -524,6 +877,7 @@ format_unknown_device (const char *device, const char *path,
 				LOGE ("Error while unmounting %s.\n", path);
 				return -12;
 			      }
+		      discard_block_device (device);
 		      return format_ext2_device (device);
 		    }
 	  }
@@ -535,21 +889,10 @@ format_unknown_device (const char *device, const char *path,
 	    return 0;
 	  }
 
-  static char tmp[PATH_MAX];
+  // /data/media is the internal sdcard on some devices; leave it be.
+  static const char *const data_exclude[] = { "/data/media", NULL };
 
-  if (strcmp (path, "/data") == 0)
-	  {
-	    sprintf (tmp,
-		     "cd /data ; for f in $(ls -a | grep -v ^media$); do rm -rf $f; done");
-	    __system(tmp);
-	  }
-  else
-	  {
-	    sprintf (tmp, "rm -rf %s/*", path);
-	    __system(tmp);
-	    sprintf (tmp, "rm -rf %s/.*", path);
-	    __system(tmp);
-	  }
+  delete_tree (path, strcmp (path, "/data") == 0 ? data_exclude : NULL, 1);
 
   ensure_path_unmounted (path);
   return 0;
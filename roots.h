@@ -42,4 +42,28 @@ int is_path_mounted (const char *path);
 int format_volume (const char *volume);
 int erase_raw_partition (const char *partitionType, const char *partition);
 
+// Whether formatting an eMMC volume discards it first; kept in the
+// "wipe" preference.
+#define FAST_WIPE_OFF 0
+#define FAST_WIPE_DISCARD 1
+#define FAST_WIPE_SECURE 2
+int get_fast_wipe_mode ();
+void set_fast_wipe_mode (int mode);
+
+// rm -rf 'path' in-process, skipping the NULL-terminated 'exclude'
+// list (may be NULL) and keeping 'path' itself if keep_root is set.
+// Drives the progress bar.  Returns 0 if everything went.
+int delete_tree (const char *path, const char *const *exclude, int keep_root);
+
+// Empty /tmp in-process, keeping the recovery log.
+void clean_tmp ();
+
+// Names the physical flash chip 'v' lives on (eg. "mmcblk0"), so
+// work on different chips can run in parallel.
+void volume_device_key (const Volume * v, char *key, size_t len);
+
+// Have delete_tree() on this thread write its progress (0.0 - 1.0)
+// to 'fraction' rather than the progress bar; NULL to undo.
+void set_thread_progress_slot (volatile float *fraction);
+
 #endif // RECOVERY_ROOTS_H_
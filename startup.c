@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "startup.h"
+
+// Everything recovery does before its first menu used to happen one
+// step after another.  Stages here are grouped into chains: each chain
+// runs in order on its own thread, chains run alongside each other and
+// alongside main(), and main() only blocks on a stage when it needs
+// its result.  Every stage and mark is logged against one clock, so
+// the recovery log carries a timeline like
+//
+//     I:startup:  volumes      0 ->   137 ms
+//     I:startup:       ui      0 ->   412 ms
+//     I:startup:    first menu at   431 ms
+
+static struct timespec startup_t0;
+static pthread_mutex_t startup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+static long
+elapsed_ms (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - startup_t0.tv_sec) * 1000 +
+    (now.tv_nsec - startup_t0.tv_nsec) / 1000000;
+}
+
+void
+startup_begin (void)
+{
+  clock_gettime (CLOCK_MONOTONIC, &startup_t0);
+}
+
+void
+startup_run (StartupStage * stage)
+{
+  pthread_mutex_lock (&startup_lock);
+  stage->state = STARTUP_RUNNING;
+  pthread_mutex_unlock (&startup_lock);
+
+  stage->start_ms = elapsed_ms ();
+  stage->run ();
+  stage->end_ms = elapsed_ms ();
+  LOGI ("startup: %8s %6ld -> %5ld ms\n", stage->name, stage->start_ms,
+	stage->end_ms);
+
+  pthread_mutex_lock (&startup_lock);
+  stage->state = STARTUP_DONE;
+  pthread_cond_broadcast (&startup_cond);
+  pthread_mutex_unlock (&startup_lock);
+}
+
+static void *
+chain_thread (void *cookie)
+{
+  StartupStage **stages = (StartupStage **) cookie;
+
+  for (; *stages != NULL; ++stages)
+    startup_run (*stages);
+  return NULL;
+}
+
+void
+startup_start (StartupStage ** stages)
+{
+  pthread_t thread;
+  int i;
+
+  pthread_mutex_lock (&startup_lock);
+  for (i = 0; stages[i] != NULL; ++i)
+    stages[i]->state = STARTUP_QUEUED;
+  pthread_mutex_unlock (&startup_lock);
+
+  if (pthread_create (&thread, NULL, chain_thread, stages) != 0)
+	  {
+	    LOGW ("can't start %s thread; running it now\n", stages[0]->name);
+	    chain_thread (stages);
+	    return;
+	  }
+  pthread_detach (thread);
+}
+
+void
+startup_wait (StartupStage * stage)
+{
+  long from = elapsed_ms ();
+
+  pthread_mutex_lock (&startup_lock);
+  if (stage->state == STARTUP_IDLE)
+	  {
+	    pthread_mutex_unlock (&startup_lock);
+	    startup_run (stage);
+	    return;
+	  }
+  while (stage->state != STARTUP_DONE)
+    pthread_cond_wait (&startup_cond, &startup_lock);
+  pthread_mutex_unlock (&startup_lock);
+
+  if (stage->end_ms > from)
+    LOGI ("startup: waited %ld ms for %s\n", stage->end_ms - from,
+	  stage->name);
+}
+
+void
+startup_mark (const char *event)
+{
+  LOGI ("startup: %13s at %5ld ms\n", event, elapsed_ms ());
+}
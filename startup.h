@@ -0,0 +1,37 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+enum
+{
+  STARTUP_IDLE,
+  STARTUP_QUEUED,
+  STARTUP_RUNNING,
+  STARTUP_DONE
+};
+
+typedef struct
+{
+  const char *name;		// for the timeline, eg. "volumes"
+  void (*run) (void);
+  volatile int state;
+  long start_ms, end_ms;	// since startup_begin()
+} StartupStage;
+
+// Start the clock every stage is timed against.
+void startup_begin (void);
+
+// Run 'stage' on this thread.
+void startup_run (StartupStage * stage);
+
+// Run the NULL-terminated 'stages' one after another on a background
+// thread, so later stages can rely on earlier ones.  Falls back to
+// running them here if the thread can't be started.
+void startup_start (StartupStage ** stages);
+
+// Block until 'stage' has finished; an idle stage is run here.
+void startup_wait (StartupStage * stage);
+
+// Log a named point on the timeline, eg. "first menu".
+void startup_mark (const char *event);
+
+#endif
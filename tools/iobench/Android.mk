@@ -0,0 +1,41 @@
+LOCAL_PATH := $(call my-dir)
+
+# Host-side throughput benchmarks for the recovery's I/O code.  The
+# sources are built straight from the recovery tree so the numbers are
+# for exactly the code that ships.
+#
+#   out/host/<os>-x86/bin/iobench -t bootable/recovery/testdata
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	iobench.c \
+	../../minzip/Hash.c \
+	../../minzip/SysUtil.c \
+	../../minzip/DirUtil.c \
+	../../minzip/Inlines.c \
+	../../minzip/Zip.c \
+	../../minzip/ZipIndex.c \
+	../../verifier.c \
+	../../applypatch/bspatch.c \
+	../../applypatch/imgpatch.c \
+	../../applypatch/utils.c \
+	../../applypatch/bsdiff.c \
+	../../mtdutils/mtdutils.c \
+	../../mkyaffs2image.c \
+	../../unyaffs.c
+
+LOCAL_MODULE := iobench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += \
+	bootable/recovery \
+	external/zlib \
+	external/bzip2 \
+	external/safe-iop/include
+LOCAL_CFLAGS += -Wall
+# open() and ioctl() on /proc/mtd and /dev/mtd/mtd0 go to fixture files
+LOCAL_LDFLAGS += -Wl,--wrap=open -Wl,--wrap=open64 -Wl,--wrap=ioctl
+LOCAL_LDLIBS += -lpthread
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz libz
+
+include $(BUILD_HOST_EXECUTABLE)
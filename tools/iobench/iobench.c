@@ -0,0 +1,1295 @@
+/*
+ * iobench: throughput benchmarks for the recovery's I/O primitives.
+ *
+ *   iobench [-v] [-s fixture_mb] [-d work_dir] [-t testdata_dir]
+ *           [-o results.json] [-b baseline.json [-T percent]]
+ *
+ * Generates its own fixtures under the work directory (a synthetic ROM
+ * zip, a system tree, bsdiff and imgdiff patch pairs, an MTD partition
+ * file), then runs each primitive in a child process so that peak RSS
+ * and the read/write syscall counts (from /proc/self/io) belong to that
+ * primitive alone.  Results are written as JSON, one benchmark per line.
+ * With -b, any benchmark slower than the baseline by more than -T
+ * percent (default 10) is reported and the exit status is 2.  The
+ * primitives' own logging is discarded unless -v is given.
+ *
+ * MTD access goes to a plain file: the binary is linked with
+ * --wrap=open/open64/ioctl, and the wrappers below stand in for
+ * /proc/mtd and /dev/mtd/mtd0 so mtdutils runs unmodified without
+ * nandsim.  Fixture files are dropped from the page cache before each
+ * run where the kernel allows it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <mtd/mtd-user.h>
+
+#include "zlib.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "minzip/DirUtil.h"
+#include "verifier.h"
+#include "applypatch/applypatch.h"
+#include "applypatch/imgdiff.h"
+#include "mtdutils/mtdutils.h"
+#include "mkyaffs2image.h"
+#include "unyaffs.h"
+
+int bsdiff (u_char * old, off_t oldsize, off_t ** IP, u_char * new,
+	    off_t newsize, const char *patch_filename);
+
+// build/target/product/security/testkey.x509.pem, as in verifier_test.c;
+// testdata/otasigned.zip is signed with it.
+static RSAPublicKey test_key = { 64, 0xc926ad21,
+  {1795090719, 2141396315, 950055447, -1713398866,
+   -26044131, 1920809988, 546586521, -795969498,
+   1776797858, -554906482, 1805317999, 1429410244,
+   129622599, 1422441418, 1783893377, 1222374759,
+   -1731647369, 323993566, 28517732, 609753416,
+   1826472888, 215237850, -33324596, -245884705,
+   -1066504894, 774857746, 154822455, -1797768399,
+   -1536767878, -1275951968, -1500189652, 87251430,
+   -1760039318, 120774784, 571297800, -599067824,
+   -1815042109, -483341846, -893134306, -1900097649,
+   -1027721089, 950095497, 555058928, 414729973,
+   1136544882, -1250377212, 465547824, -236820568,
+   -1563171242, 1689838846, -404210357, 1048029507,
+   895090649, 247140249, 178744550, -747082073,
+   -1129788053, 109881576, -350362881, 1044303212,
+   -522594267, -1309816990, -557446364, -695002876}
+  ,
+  {-857949815, -510492167, -1494742324, -1208744608,
+   251333580, 2131931323, 512774938, 325948880,
+   -1637480859, 2102694287, -474399070, 792812816,
+   1026422502, 2053275343, -1494078096, -1181380486,
+   165549746, -21447327, -229719404, 1902789247,
+   772932719, -353118870, -642223187, 216871947,
+   -1130566647, 1942378755, -298201445, 1055777370,
+   964047799, 629391717, -2062222979, -384408304,
+   191868569, -1536083459, -612150544, -1297252564,
+   -1592438046, -724266841, -518093464, -370899750,
+   -739277751, -1536141862, 1323144535, 61311905,
+   1997411085, 376844204, 213777604, -217643712,
+   9135381, 1625809335, -1490225159, -1342673351,
+   1117190829, -57654514, 1825108855, -1281819325,
+   1111251351, -1726129724, 1684324211, -1773988491,
+   367251975, 810756730, -1941182952, 1175080310}
+};
+
+// The recovery UI isn't linked in.
+void
+ui_print (const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start (ap, fmt);
+  vfprintf (stderr, fmt, ap);
+  va_end (ap);
+}
+
+void
+ui_set_progress (float fraction)
+{
+}
+
+#define MTD_ERASE_SIZE (128 * 1024)
+#define MTD_WRITE_SIZE 2048
+#define IO_CHUNK (64 * 1024)
+
+static char work_dir[PATH_MAX] = "";
+static const char *testdata_dir = "bootable/recovery/testdata";
+static int fixture_mb = 64;
+static int verbose = 0;
+
+// ------------------------------------------------------------------
+// MTD stand-in
+
+static char mtd_proc_path[PATH_MAX];
+static char mtd_dev_path[PATH_MAX];
+static off_t mtd_size;
+static int mtd_fds[256];
+
+int __real_open (const char *path, int flags, ...);
+int __real_open64 (const char *path, int flags, ...);
+int __real_ioctl (int fd, unsigned long request, ...);
+
+static const char *
+mtd_redirect (const char *path, int *is_dev)
+{
+  *is_dev = 0;
+  if (mtd_dev_path[0] == '\0')
+    return path;
+  if (strcmp (path, "/proc/mtd") == 0)
+    return mtd_proc_path;
+  if (strcmp (path, "/dev/mtd/mtd0") == 0)
+	  {
+	    *is_dev = 1;
+	    return mtd_dev_path;
+	  }
+  return path;
+}
+
+static int
+mtd_track (int fd, int is_dev)
+{
+  if (fd >= 0 && fd < (int) (sizeof (mtd_fds) / sizeof (mtd_fds[0])))
+    mtd_fds[fd] = is_dev;
+  return fd;
+}
+
+int
+__wrap_open (const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  int is_dev;
+
+  if (flags & O_CREAT)
+	  {
+	    va_list ap;
+
+	    va_start (ap, flags);
+	    mode = va_arg (ap, int);
+	    va_end (ap);
+	  }
+  path = mtd_redirect (path, &is_dev);
+  return mtd_track (__real_open (path, flags, mode), is_dev);
+}
+
+int
+__wrap_open64 (const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  int is_dev;
+
+  if (flags & O_CREAT)
+	  {
+	    va_list ap;
+
+	    va_start (ap, flags);
+	    mode = va_arg (ap, int);
+	    va_end (ap);
+	  }
+  path = mtd_redirect (path, &is_dev);
+  return mtd_track (__real_open64 (path, flags, mode), is_dev);
+}
+
+static int
+mtd_erase (int fd, const struct erase_info_user *erase)
+{
+  static char ff[IO_CHUNK];
+  off_t pos = erase->start;
+  off_t end = (off_t) erase->start + erase->length;
+
+  memset (ff, 0xff, sizeof (ff));
+  while (pos < end)
+	  {
+	    size_t n = end - pos < IO_CHUNK ? end - pos : IO_CHUNK;
+
+	    if (pwrite (fd, ff, n, pos) != (ssize_t) n)
+	      return -1;
+	    pos += n;
+	  }
+  return 0;
+}
+
+int
+__wrap_ioctl (int fd, unsigned long request, ...)
+{
+  va_list ap;
+  void *arg;
+
+  va_start (ap, request);
+  arg = va_arg (ap, void *);
+  va_end (ap);
+
+  if (fd < 0 || fd >= (int) (sizeof (mtd_fds) / sizeof (mtd_fds[0]))
+      || !mtd_fds[fd])
+    return __real_ioctl (fd, request, arg);
+
+  switch (request)
+	  {
+	  case MEMGETINFO:
+		  {
+		    struct mtd_info_user *info = arg;
+
+		    memset (info, 0, sizeof (*info));
+		    info->type = MTD_NANDFLASH;
+		    info->flags = MTD_CAP_NANDFLASH;
+		    info->size = mtd_size;
+		    info->erasesize = MTD_ERASE_SIZE;
+		    info->writesize = MTD_WRITE_SIZE;
+		    info->oobsize = MTD_WRITE_SIZE / 32;
+		    return 0;
+		  }
+	  case MEMERASE:
+	    return mtd_erase (fd, arg);
+	  case MEMGETBADBLOCK:
+	    return 0;
+	  case ECCGETSTATS:
+	    memset (arg, 0, sizeof (struct mtd_ecc_stats));
+	    return 0;
+	  }
+  errno = EINVAL;
+  return -1;
+}
+
+// ------------------------------------------------------------------
+// Fixtures
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned
+rng (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (unsigned) (rng_state >> 16);
+}
+
+// Half-text, half-noise data: roughly what a system image deflates to.
+static void
+fill_data (unsigned char *buf, size_t len, int compressible)
+{
+  static const char *words[] = {
+    "android", "system", "framework", "<manifest", "package=",
+    "com.android.", "0x7f0", "libc.so", "dalvik", "/data/app/",
+    "    ", "\n", "resources", "activity", "\0\0\0\0", "ELF",
+  };
+  size_t i = 0;
+
+  if (!compressible)
+	  {
+	    for (; i + 4 <= len; i += 4)
+		    {
+		      unsigned r = rng ();
+
+		      memcpy (buf + i, &r, 4);
+		    }
+	    for (; i < len; ++i)
+	      buf[i] = rng ();
+	    return;
+	  }
+  while (i < len)
+	  {
+	    const char *w = words[rng () % (sizeof (words) / sizeof (words[0]))];
+	    size_t n = strlen (w) ? strlen (w) : 4;
+
+	    if (rng () % 8 == 0)
+		    {
+		      buf[i++] = rng ();
+		      continue;
+		    }
+	    if (n > len - i)
+	      n = len - i;
+	    memcpy (buf + i, w, n);
+	    i += n;
+	  }
+}
+
+static int
+write_file (const char *path, const void *data, size_t len)
+{
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  const char *p = data;
+
+  if (fd < 0)
+    return -1;
+  while (len > 0)
+	  {
+	    ssize_t n = write (fd, p, len);
+
+	    if (n <= 0)
+		    {
+		      close (fd);
+		      return -1;
+		    }
+	    p += n;
+	    len -= n;
+	  }
+  return close (fd);
+}
+
+static void *
+read_file (const char *path, ssize_t * len)
+{
+  struct stat st;
+  char *data = NULL;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    goto fail;
+  data = malloc (st.st_size ? st.st_size : 1);
+  if (data == NULL || read (fd, data, st.st_size) != st.st_size)
+    goto fail;
+  close (fd);
+  *len = st.st_size;
+  return data;
+
+fail:
+  if (fd >= 0)
+    close (fd);
+  free (data);
+  return NULL;
+}
+
+static void
+work_path (char *out, const char *name)
+{
+  snprintf (out, PATH_MAX, "%s/%s", work_dir, name);
+}
+
+static void
+put2 (unsigned char *p, unsigned v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void
+put4 (unsigned char *p, unsigned v)
+{
+  put2 (p, v);
+  put2 (p + 2, v >> 16);
+}
+
+static void
+put8 (unsigned char *p, unsigned long long v)
+{
+  put4 (p, v);
+  put4 (p + 4, v >> 32);
+}
+
+// Deflates in raw (windowBits -15) form, the way zip and imgdiff
+// store it.
+static unsigned char *
+deflate_raw (const unsigned char *in, size_t len, size_t *out_len, int level)
+{
+  z_stream zs;
+  size_t cap = compressBound (len) + 64;
+  unsigned char *out = malloc (cap);
+
+  memset (&zs, 0, sizeof (zs));
+  if (out == NULL
+      || deflateInit2 (&zs, level, Z_DEFLATED, -15, 8,
+		       Z_DEFAULT_STRATEGY) != Z_OK)
+	  {
+	    free (out);
+	    return NULL;
+	  }
+  zs.next_in = (unsigned char *) in;
+  zs.avail_in = len;
+  zs.next_out = out;
+  zs.avail_out = cap;
+  deflate (&zs, Z_FINISH);
+  *out_len = zs.total_out;
+  deflateEnd (&zs);
+  return out;
+}
+
+typedef struct
+{
+  char name[64];
+  unsigned crc, csize, usize, offset;
+  int method;
+} ZipOut;
+
+// A ROM-like zip: system/app, system/lib and system/framework files
+// from 4K to 2M, text-like ones deflated and noise stored.
+static long long
+make_rom_zip (const char *path, long long budget)
+{
+  static const unsigned sizes[] = { 4096, 16384, 65536, 262144, 2097152 };
+  static const char *dirs[] = { "system/app", "system/lib",
+    "system/framework", "system/etc"
+  };
+  FILE *f = fopen (path, "wb");
+  ZipOut *entries = NULL;
+  int count = 0, allocd = 0, i;
+  long long total = 0;
+  unsigned offset = 0;
+  unsigned char hdr[46];
+
+  if (f == NULL)
+    return -1;
+  while (total < budget)
+	  {
+	    unsigned usize = sizes[count % 5];
+	    unsigned char *data = malloc (usize);
+	    size_t csize;
+	    unsigned char *cdata;
+	    int compressible = count % 3 != 0;
+
+	    if (count == allocd)
+		    {
+		      allocd = allocd ? allocd * 2 : 64;
+		      entries = realloc (entries, allocd * sizeof (ZipOut));
+		    }
+	    ZipOut *e = &entries[count];
+
+	    snprintf (e->name, sizeof (e->name), "%s/bench%04d.%s",
+		      dirs[count % 4], count, compressible ? "apk" : "so");
+	    fill_data (data, usize, compressible);
+	    e->usize = usize;
+	    e->crc = crc32 (0, data, usize);
+	    e->method = compressible ? 8 : 0;
+	    cdata = compressible ? deflate_raw (data, usize, &csize, 6) : data;
+	    e->csize = compressible ? csize : usize;
+	    e->offset = offset;
+
+	    memset (hdr, 0, 30);
+	    put4 (hdr, 0x04034b50);
+	    put2 (hdr + 4, 20);
+	    put2 (hdr + 8, e->method);
+	    put4 (hdr + 14, e->crc);
+	    put4 (hdr + 18, e->csize);
+	    put4 (hdr + 22, e->usize);
+	    put2 (hdr + 26, strlen (e->name));
+	    fwrite (hdr, 30, 1, f);
+	    fwrite (e->name, strlen (e->name), 1, f);
+	    fwrite (cdata, e->csize, 1, f);
+	    offset += 30 + strlen (e->name) + e->csize;
+
+	    if (cdata != data)
+	      free (cdata);
+	    free (data);
+	    total += usize;
+	    ++count;
+	  }
+
+  unsigned cd_start = offset;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    ZipOut *e = &entries[i];
+
+	    memset (hdr, 0, 46);
+	    put4 (hdr, 0x02014b50);
+	    put2 (hdr + 4, (3 << 8) | 20);	// made by unix
+	    put2 (hdr + 6, 20);
+	    put2 (hdr + 10, e->method);
+	    put4 (hdr + 16, e->crc);
+	    put4 (hdr + 20, e->csize);
+	    put4 (hdr + 24, e->usize);
+	    put2 (hdr + 28, strlen (e->name));
+	    put4 (hdr + 38, 0100644u << 16);
+	    put4 (hdr + 42, e->offset);
+	    fwrite (hdr, 46, 1, f);
+	    fwrite (e->name, strlen (e->name), 1, f);
+	    offset += 46 + strlen (e->name);
+	  }
+  memset (hdr, 0, 22);
+  put4 (hdr, 0x06054b50);
+  put2 (hdr + 8, count);
+  put2 (hdr + 10, count);
+  put4 (hdr + 12, offset - cd_start);
+  put4 (hdr + 16, cd_start);
+  fwrite (hdr, 22, 1, f);
+  free (entries);
+  if (fclose (f) != 0)
+    return -1;
+  return total;
+}
+
+// A system-partition-like tree for the nandroid paths.
+static long long
+make_tree (const char *root, long long budget)
+{
+  static const unsigned sizes[] = { 512, 4096, 32768, 131072, 1048576 };
+  char path[PATH_MAX];
+  long long total = 0;
+  int i = 0;
+
+  mkdir (root, 0755);
+  while (total < budget)
+	  {
+	    unsigned size = sizes[i % 5];
+	    unsigned char *data = malloc (size);
+
+	    if (i % 32 == 0)
+		    {
+		      snprintf (path, sizeof (path), "%s/dir%03d", root, i / 32);
+		      mkdir (path, 0755);
+		    }
+	    snprintf (path, sizeof (path), "%s/dir%03d/file%05d", root,
+		      i / 32, i);
+	    fill_data (data, size, i % 3 != 0);
+	    if (write_file (path, data, size) < 0)
+		    {
+		      free (data);
+		      return -1;
+		    }
+	    free (data);
+	    total += size;
+	    ++i;
+	  }
+  return total;
+}
+
+// An old/new pair that differs the way two builds of a file do: a few
+// edits and an insertion that shifts everything after it.
+static int
+make_patch_pair (const char *old_path, const char *new_path,
+		 const char *patch_path, size_t len)
+{
+  unsigned char *old_data = malloc (len);
+  unsigned char *new_data = malloc (len + 4096);
+  off_t *index = NULL;
+  size_t i;
+  int ret = -1;
+
+  if (old_data == NULL || new_data == NULL)
+    goto out;
+  fill_data (old_data, len, 1);
+  memcpy (new_data, old_data, len / 2);
+  fill_data (new_data + len / 2, 4096, 0);
+  memcpy (new_data + len / 2 + 4096, old_data + len / 2, len - len / 2);
+  for (i = 0; i < len / 1024; ++i)
+    new_data[rng () % (len + 4096)] = rng ();
+
+  if (write_file (old_path, old_data, len) < 0
+      || write_file (new_path, new_data, len + 4096) < 0)
+    goto out;
+  if (patch_path != NULL
+      && bsdiff (old_data, len, &index, new_data, len + 4096, patch_path) != 0)
+    goto out;
+  ret = 0;
+
+out:
+  free (index);
+  free (old_data);
+  free (new_data);
+  return ret;
+}
+
+// An IMGDIFF2 patch for a boot-image-like file: a raw header, a
+// deflated payload and a raw tail.  The payload is rebuilt by the
+// CHUNK_DEFLATE path (inflate, bsdiff, deflate), the rest is RAW.
+static int
+make_image_patch (size_t payload_len)
+{
+  char old_path[PATH_MAX], new_path[PATH_MAX], bsd_path[PATH_MAX];
+  char a_path[PATH_MAX], b_path[PATH_MAX], patch_path[PATH_MAX];
+  unsigned char head[4096], tail[2048];
+  ssize_t a_len, b_len, bsd_len;
+  size_t za_len, zb_len;
+  int ret = -1;
+
+  work_path (a_path, "img_a.raw");
+  work_path (b_path, "img_b.raw");
+  work_path (bsd_path, "img_payload.bsdiff");
+  if (make_patch_pair (a_path, b_path, bsd_path, payload_len) < 0)
+    return -1;
+
+  unsigned char *a = read_file (a_path, &a_len);
+  unsigned char *b = read_file (b_path, &b_len);
+  unsigned char *bsd = read_file (bsd_path, &bsd_len);
+  unsigned char *za = a ? deflate_raw (a, a_len, &za_len, 6) : NULL;
+  unsigned char *zb = b ? deflate_raw (b, b_len, &zb_len, 6) : NULL;
+
+  if (za == NULL || zb == NULL || bsd == NULL)
+    goto out;
+
+  work_path (old_path, "img_old.img");
+  work_path (new_path, "img_new.img");
+  work_path (patch_path, "img.imgdiff");
+
+  FILE *fo = fopen (old_path, "wb");
+  FILE *fn = fopen (new_path, "wb");
+  FILE *fp = fopen (patch_path, "wb");
+
+  if (fo == NULL || fn == NULL || fp == NULL)
+	  {
+	    if (fo)
+	      fclose (fo);
+	    if (fn)
+	      fclose (fn);
+	    if (fp)
+	      fclose (fp);
+	    goto out;
+	  }
+  fill_data (head, sizeof (head), 0);
+  fill_data (tail, sizeof (tail), 0);
+  fwrite (head, sizeof (head), 1, fo);
+  fwrite (za, za_len, 1, fo);
+  fwrite (tail, sizeof (tail), 1, fo);
+  head[0] ^= 0xff;		// the new header differs
+  fwrite (head, sizeof (head), 1, fn);
+  fwrite (zb, zb_len, 1, fn);
+  fwrite (tail, sizeof (tail), 1, fn);
+
+  unsigned char rec[64];
+  long long patch_offset = 12 + (4 + 4 + sizeof (head)) + (4 + 60)
+    + (4 + 4 + sizeof (tail));
+
+  fwrite ("IMGDIFF2", 8, 1, fp);
+  put4 (rec, 3);
+  fwrite (rec, 4, 1, fp);
+
+  put4 (rec, CHUNK_RAW);
+  put4 (rec + 4, sizeof (head));
+  fwrite (rec, 8, 1, fp);
+  fwrite (head, sizeof (head), 1, fp);
+
+  put4 (rec, CHUNK_DEFLATE);
+  put8 (rec + 4, sizeof (head));
+  put8 (rec + 12, za_len);
+  put8 (rec + 20, patch_offset);
+  put8 (rec + 28, a_len);
+  put8 (rec + 36, b_len);
+  put4 (rec + 44, 6);
+  put4 (rec + 48, Z_DEFLATED);
+  put4 (rec + 52, -15);
+  put4 (rec + 56, 8);
+  put4 (rec + 60, Z_DEFAULT_STRATEGY);
+  fwrite (rec, 64, 1, fp);
+
+  put4 (rec, CHUNK_RAW);
+  put4 (rec + 4, sizeof (tail));
+  fwrite (rec, 8, 1, fp);
+  fwrite (tail, sizeof (tail), 1, fp);
+
+  fwrite (bsd, bsd_len, 1, fp);
+  fclose (fo);
+  fclose (fn);
+  ret = fclose (fp) == 0 ? 0 : -1;
+
+out:
+  free (a);
+  free (b);
+  free (bsd);
+  free (za);
+  free (zb);
+  unlink (a_path);
+  unlink (b_path);
+  unlink (bsd_path);
+  return ret;
+}
+
+static int
+make_mtd (long long size)
+{
+  FILE *f;
+
+  work_path (mtd_dev_path, "mtd0.bin");
+  work_path (mtd_proc_path, "proc_mtd");
+  mtd_size = (size + MTD_ERASE_SIZE - 1) / MTD_ERASE_SIZE * MTD_ERASE_SIZE;
+  if (truncate (mtd_dev_path, 0) < 0 && errno != ENOENT)
+    return -1;
+  f = fopen (mtd_dev_path, "wb");
+  if (f == NULL || ftruncate (fileno (f), mtd_size) < 0)
+    return -1;
+  fclose (f);
+  f = fopen (mtd_proc_path, "w");
+  if (f == NULL)
+    return -1;
+  fprintf (f, "dev:    size   erasesize  name\n");
+  fprintf (f, "mtd0: %08llx %08x \"bench\"\n", (long long) mtd_size,
+	   MTD_ERASE_SIZE);
+  return fclose (f);
+}
+
+// ------------------------------------------------------------------
+// Measurement
+
+typedef struct
+{
+  int ok;
+  long long bytes;
+  double seconds;
+  long long syscr, syscw;
+  char note[128];
+} BenchResult;
+
+static struct timespec bench_t0;
+static long long bench_r0, bench_w0;
+
+// One read() of the whole file, so the probe itself costs exactly one
+// read syscall (stdio would make a second one to see EOF).
+static void
+read_proc_io (long long *syscr, long long *syscw)
+{
+  char buf[512];
+  const char *p;
+  ssize_t n;
+  int fd = open ("/proc/self/io", O_RDONLY);
+
+  *syscr = *syscw = -1;
+  if (fd < 0)
+    return;
+  n = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (n <= 0)
+    return;
+  buf[n] = '\0';
+  if ((p = strstr (buf, "syscr: ")) != NULL)
+    sscanf (p, "syscr: %lld", syscr);
+  if ((p = strstr (buf, "syscw: ")) != NULL)
+    sscanf (p, "syscw: %lld", syscw);
+}
+
+// Benchmarks call these around the part being measured, so fixture
+// loading doesn't count.
+static void
+bench_begin (void)
+{
+  read_proc_io (&bench_r0, &bench_w0);
+  clock_gettime (CLOCK_MONOTONIC, &bench_t0);
+}
+
+static void
+bench_end (BenchResult * r)
+{
+  struct timespec t1;
+  long long rd, wr;
+
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  read_proc_io (&rd, &wr);
+  r->seconds = (t1.tv_sec - bench_t0.tv_sec) +
+    (t1.tv_nsec - bench_t0.tv_nsec) / 1e9;
+  // don't count the read of /proc/self/io itself
+  r->syscr = rd >= 0 && bench_r0 >= 0 ? rd - bench_r0 - 1 : -1;
+  r->syscw = wr >= 0 && bench_w0 >= 0 ? wr - bench_w0 : -1;
+}
+
+static void
+evict (const char *path)
+{
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return;
+  fdatasync (fd);
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+  close (fd);
+}
+
+static long long tree_bytes, zip_bytes;
+
+typedef struct
+{
+  SHA_CTX sha;
+  long long bytes;
+} PatchSink;
+
+static ssize_t
+patch_sink (unsigned char *data, ssize_t len, void *token)
+{
+  PatchSink *s = token;
+
+  s->bytes += len;
+  return len;
+}
+
+static int
+check_sha (PatchSink * s, const char *expected_path, BenchResult * r)
+{
+  ssize_t len;
+  unsigned char *expected = read_file (expected_path, &len);
+  SHA_CTX ctx;
+  uint8_t want[SHA_DIGEST_SIZE];
+
+  if (expected == NULL)
+    return -1;
+  SHA_init (&ctx);
+  SHA_update (&ctx, expected, len);
+  memcpy (want, SHA_final (&ctx), SHA_DIGEST_SIZE);
+  free (expected);
+  if (memcmp (want, SHA_final (&s->sha), SHA_DIGEST_SIZE) != 0)
+	  {
+	    snprintf (r->note, sizeof (r->note), "output sha1 mismatch");
+	    return -1;
+	  }
+  return 0;
+}
+
+static int
+bench_zip_extract (BenchResult * r)
+{
+  char zip_path[PATH_MAX], out[PATH_MAX];
+  ZipArchive zip;
+  struct utimbuf ts = { 1217592000, 1217592000 };
+
+  work_path (zip_path, "rom.zip");
+  work_path (out, "zip_out");
+  mkdir (out, 0755);
+  evict (zip_path);
+  bench_begin ();
+  if (mzOpenZipArchive (zip_path, &zip) != 0)
+    return -1;
+  bool ok = mzExtractRecursive (&zip, "system", out, 0, &ts, NULL, NULL);
+
+  mzCloseZipArchive (&zip);
+  bench_end (r);
+  r->bytes = zip_bytes;
+  dirUnlinkTree (out, NULL, false, NULL, NULL);
+  return ok ? 0 : -1;
+}
+
+static int
+bench_verify_file (BenchResult * r)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  int i, iterations;
+
+  snprintf (path, sizeof (path), "%s/otasigned.zip", testdata_dir);
+  if (stat (path, &st) < 0)
+	  {
+	    snprintf (r->note, sizeof (r->note), "no %s (use -t)", path);
+	    return -1;
+	  }
+  // the fixture is small; hash about as much data as the others move
+  iterations = (long long) fixture_mb * 1024 * 1024 / (st.st_size + 1) + 1;
+  if (iterations > 10000)
+    iterations = 10000;
+  bench_begin ();
+  for (i = 0; i < iterations; ++i)
+	  {
+	    if (verify_file (path, &test_key, 1) != VERIFY_SUCCESS)
+		    {
+		      snprintf (r->note, sizeof (r->note), "verification failed");
+		      return -1;
+		    }
+	  }
+  bench_end (r);
+  r->bytes = (long long) st.st_size * iterations;
+  snprintf (r->note, sizeof (r->note), "%d passes over %s", iterations,
+	    path);
+  return 0;
+}
+
+static int
+bench_bspatch (BenchResult * r)
+{
+  char old_path[PATH_MAX], new_path[PATH_MAX], patch_path[PATH_MAX];
+  Value patch;
+  PatchSink sink;
+  ssize_t old_len;
+
+  work_path (old_path, "bs_old.bin");
+  work_path (new_path, "bs_new.bin");
+  work_path (patch_path, "bs.bsdiff");
+  unsigned char *old_data = read_file (old_path, &old_len);
+
+  patch.type = VAL_BLOB;
+  patch.data = read_file (patch_path, &patch.size);
+  if (old_data == NULL || patch.data == NULL)
+    return -1;
+  memset (&sink, 0, sizeof (sink));
+  SHA_init (&sink.sha);
+  bench_begin ();
+  int ret = ApplyBSDiffPatch (old_data, old_len, &patch, 0, patch_sink,
+			      &sink, &sink.sha);
+
+  bench_end (r);
+  r->bytes = sink.bytes;
+  free (old_data);
+  free (patch.data);
+  return ret == 0 ? check_sha (&sink, new_path, r) : -1;
+}
+
+static int
+bench_imgpatch (BenchResult * r)
+{
+  char old_path[PATH_MAX], new_path[PATH_MAX], patch_path[PATH_MAX];
+  Value patch;
+  PatchSink sink;
+  ssize_t old_len;
+
+  work_path (old_path, "img_old.img");
+  work_path (new_path, "img_new.img");
+  work_path (patch_path, "img.imgdiff");
+  unsigned char *old_data = read_file (old_path, &old_len);
+
+  patch.type = VAL_BLOB;
+  patch.data = read_file (patch_path, &patch.size);
+  if (old_data == NULL || patch.data == NULL)
+    return -1;
+  memset (&sink, 0, sizeof (sink));
+  SHA_init (&sink.sha);
+  bench_begin ();
+  int ret = ApplyImagePatch (old_data, old_len, &patch, patch_sink, &sink,
+			     &sink.sha);
+
+  bench_end (r);
+  r->bytes = sink.bytes;
+  free (old_data);
+  free (patch.data);
+  return ret == 0 ? check_sha (&sink, new_path, r) : -1;
+}
+
+static int
+bench_mtd_write (BenchResult * r)
+{
+  const MtdPartition *part;
+  MtdWriteContext *ctx;
+  char *buf = malloc (IO_CHUNK);
+  long long done = 0;
+
+  if (buf == NULL)
+    return -1;
+  fill_data ((unsigned char *) buf, IO_CHUNK, 0);
+  bench_begin ();
+  if (mtd_scan_partitions () <= 0
+      || (part = mtd_find_partition_by_name ("bench")) == NULL
+      || (ctx = mtd_write_partition (part)) == NULL)
+	  {
+	    free (buf);
+	    return -1;
+	  }
+  while (done < mtd_size)
+	  {
+	    if (mtd_write_data (ctx, buf, IO_CHUNK) != IO_CHUNK)
+	      break;
+	    done += IO_CHUNK;
+	  }
+  int ret = mtd_write_close (ctx);
+
+  bench_end (r);
+  r->bytes = done;
+  free (buf);
+  return ret == 0 && done == mtd_size ? 0 : -1;
+}
+
+static int
+bench_mtd_read (BenchResult * r)
+{
+  const MtdPartition *part;
+  MtdReadContext *ctx;
+  char *buf = malloc (IO_CHUNK);
+  long long done = 0;
+
+  if (buf == NULL)
+    return -1;
+  evict (mtd_dev_path);
+  bench_begin ();
+  if (mtd_scan_partitions () <= 0
+      || (part = mtd_find_partition_by_name ("bench")) == NULL
+      || (ctx = mtd_read_partition (part)) == NULL)
+	  {
+	    free (buf);
+	    return -1;
+	  }
+  while (done < mtd_size)
+	  {
+	    if (mtd_read_data (ctx, buf, IO_CHUNK) != IO_CHUNK)
+	      break;
+	    done += IO_CHUNK;
+	  }
+  mtd_read_close (ctx);
+  bench_end (r);
+  r->bytes = done;
+  free (buf);
+  return done == mtd_size ? 0 : -1;
+}
+
+static int
+bench_mkyaffs2image (BenchResult * r)
+{
+  char tree[PATH_MAX], image[PATH_MAX];
+
+  work_path (tree, "tree");
+  work_path (image, "tree.yaffs2");
+  bench_begin ();
+  int ret = mkyaffs2image (tree, image, 2048, 64, NULL);
+
+  bench_end (r);
+  r->bytes = tree_bytes;
+  return ret == 0 ? 0 : -1;
+}
+
+static int
+bench_unyaffs (BenchResult * r)
+{
+  char image[PATH_MAX], out[PATH_MAX];
+
+  work_path (image, "tree.yaffs2");
+  work_path (out, "yaffs_out");
+  mkdir (out, 0755);
+  evict (image);
+  bench_begin ();
+  int ret = unyaffs_extract (image, out, 2048, 64);
+
+  bench_end (r);
+  r->bytes = tree_bytes;
+  return ret == 0 ? 0 : -1;
+}
+
+static int
+bench_delete_tree (BenchResult * r)
+{
+  char out[PATH_MAX];
+
+  // unyaffs left this behind for us
+  work_path (out, "yaffs_out");
+  bench_begin ();
+  int ret = dirUnlinkTree (out, NULL, false, NULL, NULL);
+
+  bench_end (r);
+  r->bytes = tree_bytes;
+  return ret;
+}
+
+typedef struct
+{
+  const char *name;
+  int (*fn) (BenchResult *);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+  {"zip_extract", bench_zip_extract},
+  {"verify_file", bench_verify_file},
+  {"bspatch", bench_bspatch},
+  {"imgpatch", bench_imgpatch},
+  {"mtd_write", bench_mtd_write},
+  {"mtd_read", bench_mtd_read},
+  {"mkyaffs2image", bench_mkyaffs2image},
+  {"unyaffs", bench_unyaffs},
+  {"delete_tree", bench_delete_tree},
+  {NULL, NULL}
+};
+
+// Runs one benchmark in a child so its peak RSS is its own.
+static void
+run_benchmark (const Benchmark * b, BenchResult * r, long *peak_rss_kb)
+{
+  int fds[2];
+  pid_t pid;
+  int status;
+  struct rusage ru;
+
+  memset (r, 0, sizeof (*r));
+  *peak_rss_kb = -1;
+  if (pipe (fds) < 0)
+    return;
+  fflush (stdout);
+  pid = fork ();
+  if (pid == 0)
+	  {
+	    close (fds[0]);
+	    // The code under test logs to stdout too, which may be where
+	    // the JSON is going; results come back through the pipe.
+	    if (!verbose)
+		    {
+		      int null_fd = open ("/dev/null", O_WRONLY);
+
+		      if (null_fd >= 0)
+			      {
+				dup2 (null_fd, STDOUT_FILENO);
+				dup2 (null_fd, STDERR_FILENO);
+				close (null_fd);
+			      }
+		    }
+	    else
+	      dup2 (STDERR_FILENO, STDOUT_FILENO);
+	    r->ok = b->fn (r) == 0;
+	    write (fds[1], r, sizeof (*r));
+	    _exit (0);
+	  }
+  close (fds[1]);
+  if (pid < 0 || read (fds[0], r, sizeof (*r)) != sizeof (*r))
+	  {
+	    memset (r, 0, sizeof (*r));
+	    snprintf (r->note, sizeof (r->note), "benchmark crashed");
+	  }
+  close (fds[0]);
+  if (pid > 0 && wait4 (pid, &status, 0, &ru) == pid)
+    *peak_rss_kb = ru.ru_maxrss;
+}
+
+static void
+json_string (FILE * f, const char *s)
+{
+  fputc ('"', f);
+  for (; *s; ++s)
+	  {
+	    if (*s == '"' || *s == '\\')
+	      fputc ('\\', f);
+	    if ((unsigned char) *s < 0x20)
+	      fprintf (f, "\\u%04x", *s);
+	    else
+	      fputc (*s, f);
+	  }
+  fputc ('"', f);
+}
+
+// Baseline files are our own output: one benchmark object per line.
+static double
+baseline_rate (const char *baseline, const char *name)
+{
+  char line[1024], key[96];
+  FILE *f = fopen (baseline, "r");
+  double rate = -1;
+
+  if (f == NULL)
+    return -1;
+  snprintf (key, sizeof (key), "\"name\": \"%s\"", name);
+  while (fgets (line, sizeof (line), f))
+	  {
+	    char *p;
+
+	    if (strstr (line, key) == NULL || strstr (line, "\"ok\"") == NULL)
+	      continue;
+	    p = strstr (line, "\"mb_per_s\": ");
+	    if (p != NULL)
+	      rate = strtod (p + 12, NULL);
+	    break;
+	  }
+  fclose (f);
+  return rate;
+}
+
+static int
+usage (void)
+{
+  fprintf (stderr, "usage: iobench [-v] [-s fixture_mb] [-d work_dir] "
+	   "[-t testdata_dir]\n"
+	   "               [-o results.json] [-b baseline.json [-T percent]]\n");
+  return 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *output = NULL;
+  const char *baseline = NULL;
+  double threshold = 10.0;
+  int keep_work = 0;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "vs:d:t:o:b:T:")) != -1)
+	  {
+	    switch (opt)
+		    {
+		    case 'v':
+		      verbose = 1;
+		      break;
+		    case 's':
+		      fixture_mb = atoi (optarg);
+		      break;
+		    case 'd':
+		      snprintf (work_dir, sizeof (work_dir), "%s", optarg);
+		      keep_work = 1;
+		      break;
+		    case 't':
+		      testdata_dir = optarg;
+		      break;
+		    case 'o':
+		      output = optarg;
+		      break;
+		    case 'b':
+		      baseline = optarg;
+		      break;
+		    case 'T':
+		      threshold = atof (optarg);
+		      break;
+		    default:
+		      return usage ();
+		    }
+	  }
+  if (fixture_mb < 1)
+    return usage ();
+
+  if (work_dir[0] == '\0')
+	  {
+	    snprintf (work_dir, sizeof (work_dir), "/tmp/iobench.XXXXXX");
+	    if (mkdtemp (work_dir) == NULL)
+		    {
+		      perror ("mkdtemp");
+		      return 1;
+		    }
+	  }
+  else
+    mkdir (work_dir, 0755);
+
+  char path[PATH_MAX], path2[PATH_MAX], path3[PATH_MAX];
+  long long fixture = (long long) fixture_mb * 1024 * 1024;
+  size_t patch_len = fixture / 8;
+
+  // bsdiff needs ~16 bytes of index per input byte
+  if (patch_len > 8 * 1024 * 1024)
+    patch_len = 8 * 1024 * 1024;
+  fprintf (stderr, "iobench: generating %d MB fixtures in %s\n", fixture_mb,
+	   work_dir);
+  work_path (path, "rom.zip");
+  zip_bytes = make_rom_zip (path, fixture);
+  work_path (path, "tree");
+  tree_bytes = make_tree (path, fixture);
+  work_path (path, "bs_old.bin");
+  work_path (path2, "bs_new.bin");
+  work_path (path3, "bs.bsdiff");
+  if (zip_bytes < 0 || tree_bytes < 0
+      || make_patch_pair (path, path2, path3, patch_len) < 0
+      || make_image_patch (patch_len) < 0 || make_mtd (fixture) < 0)
+	  {
+	    fprintf (stderr, "iobench: can't create fixtures: %s\n",
+		     strerror (errno));
+	    return 1;
+	  }
+
+  FILE *out = output ? fopen (output, "w") : stdout;
+  int regressions = 0;
+  const Benchmark *b;
+
+  if (out == NULL)
+	  {
+	    perror (output);
+	    return 1;
+	  }
+  fprintf (out, "{\n  \"tool\": \"iobench\",\n  \"fixture_mb\": %d,\n"
+	   "  \"benchmarks\": [\n", fixture_mb);
+  for (b = benchmarks; b->name != NULL; ++b)
+	  {
+	    BenchResult r;
+	    long rss;
+	    double rate;
+
+	    run_benchmark (b, &r, &rss);
+	    rate = r.ok && r.seconds > 0 ? r.bytes / r.seconds / 1048576.0 : 0;
+	    fprintf (stderr, "iobench: %-14s %-6s %9.1f MB/s %8ld KB rss\n",
+		     b->name, r.ok ? "ok" : "FAILED", rate, rss);
+	    fprintf (out, "    {\"name\": \"%s\", \"status\": \"%s\", "
+		     "\"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+		     "\"peak_rss_kb\": %ld, \"read_syscalls\": %lld, "
+		     "\"write_syscalls\": %lld, \"note\": ", b->name,
+		     r.ok ? "ok" : "failed", r.bytes, r.seconds, rate, rss,
+		     r.syscr, r.syscw);
+	    json_string (out, r.note);
+	    fprintf (out, "}%s\n", b[1].name ? "," : "");
+
+	    if (baseline != NULL && r.ok)
+		    {
+		      double base = baseline_rate (baseline, b->name);
+
+		      if (base > 0 && rate < base * (1 - threshold / 100))
+			      {
+				fprintf (stderr,
+					 "iobench: REGRESSION %s: %.1f MB/s, "
+					 "baseline %.1f MB/s\n", b->name, rate,
+					 base);
+				++regressions;
+			      }
+		    }
+	  }
+  fprintf (out, "  ]\n}\n");
+  if (out != stdout)
+    fclose (out);
+
+  if (!keep_work)
+    dirUnlinkTree (work_dir, NULL, false, NULL, NULL);
+  return regressions ? 2 : 0;
+}
@@ -16,6 +16,7 @@
   
 #include <linux/input.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 #include "common.h"
 #include "minui/minui.h"
 #include "recovery_ui.h"
+#include "prefs.h"
   
 #define MAX_COLS 96
 #define MAX_ROWS 43
@@ -140,12 +142,30 @@ static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
 
  
-// Key event input queue
-static pthread_mutex_t key_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
-static int key_queue[256], key_queue_len = 0;
+// Key event input queue: a single-producer (input_thread) /
+// single-consumer (ui_wait_key) ring.  Only the producer moves
+// key_queue_head and only the consumer moves key_queue_tail, so no lock
+// is needed; key_queue_sem just lets an idle consumer sleep.
+#define KEY_QUEUE_SIZE 256	// must be a power of two
+static int key_queue[KEY_QUEUE_SIZE];
+static volatile unsigned key_queue_head = 0, key_queue_tail = 0;
+static sem_t key_queue_sem;
 static volatile char key_pressed[KEY_MAX + 1];
 
+// Called only from input_thread.  Drops the key if the queue is full.
+static void
+key_queue_push (int code)
+{
+  unsigned head = key_queue_head;
+
+  if (head - key_queue_tail >= KEY_QUEUE_SIZE)
+    return;
+  key_queue[head & (KEY_QUEUE_SIZE - 1)] = code;
+  __sync_synchronize ();	// publish the slot before the new head
+  key_queue_head = head + 1;
+  sem_post (&key_queue_sem);
+}
+
  
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
@@ -173,19 +193,6 @@ draw_progress_locked ()
 {
   if (gProgressBarType == PROGRESSBAR_TYPE_NONE)
     return;
-  int iconHeight;
-  if (access("/tmp/.rzrpref_icon_rz", F_OK) != -1)
-  {
-    iconHeight = gr_get_height (gBackgroundIcon[BACKGROUND_ICON_RZ]);
-  }
-  else if (access("/tmp/.rzrpref_icon_rw", F_OK) != -1)
-  {
-    iconHeight = gr_get_height (gBackgroundIcon[BACKGROUND_ICON_RW]);
-  }  
-  else
-  {
-    iconHeight = gr_get_height (gBackgroundIcon[BACKGROUND_ICON_GM]);
-  }
   int width = gr_get_width (gProgressBarEmpty);
   int height = gr_get_height (gProgressBarEmpty);
   int dx = (gr_fb_width () - width) / 2;
@@ -238,8 +245,10 @@ draw_screen_locked (void)
   
     //define menu color integers
   char cRv , cGv, cBv, txt, bg;
+  unsigned rgb[4];
+  char color[32];
 
-  if (access ("/tmp/.rzrpref_rnd", F_OK) != -1)
+  if (pref_isset ("rnd"))
   {
     struct timeval tv;
     struct timezone tz;
@@ -255,14 +264,13 @@ draw_screen_locked (void)
     if (cGv >= 150) txt = 0; else txt = 255;
   } else {
   
-  	if (access ("/tmp/.rzrpref_rgb", F_OK) != -1)
+  	if (pref_get ("rgb", color, sizeof (color)) == 0 &&
+  	    sscanf (color, "%u,%u,%u,%u", &rgb[0], &rgb[1], &rgb[2], &rgb[3]) == 4)
   	{
-      		FILE * fp = fopen ("/tmp/.rzrpref_rgb", "rb");
-      		fread (&cRv, 1, 1, fp);
-      		fread (&cGv, 1, 1, fp);
-     		fread (&cBv, 1, 1, fp);
-      		fread (&txt, 1, 1, fp);
-      		fclose (fp);
+      		cRv = rgb[0];
+      		cGv = rgb[1];
+      		cBv = rgb[2];
+      		txt = rgb[3];
   	} else {
       		cRv = 54;
       		cGv = 74;
@@ -412,7 +420,6 @@ input_thread (void *cookie)
   int rel_sum = 0;
   int fake_key = 0;
   int last_code = 0;
-  unsigned keyheld;
 
   for (;;)
 	  {
@@ -423,18 +430,21 @@ input_thread (void *cookie)
 	    
 	    do
 		    {
-		    if (ev_get(&ev, 0, keyheld) != 1) {
-			// Check for an up/down key press
+		    if (ev_get(&ev, 0) != 1) {
+			// A volume key press arms the repeat timer; its release,
+			// or any other key, stops it.  SYN events don't count.
 			if (ev.type == EV_KEY && (ev.code == 
 				KEY_VOLUMEUP
 				|| ev.code == KEY_VOLUMEDOWN ) && ev.value == 1) {
-					keyheld = 1;
 					last_code = ev.code;
-				} else { 
-					keyheld =0;
+					ev_repeat(1);
+				} else if (ev.type == EV_KEY && last_code != 0 &&
+				  (ev.code != last_code || ev.value == 0)) {
+					last_code = 0;
+					ev_repeat(0);
 				}
 			} else {
-				// A return value of 1 means the last key should be repeated
+				// The repeat timer fired: repeat the held key
 				ev.type = EV_KEY;
 				ev.code = last_code;
 				ev.value = 1;
@@ -480,7 +490,6 @@ input_thread (void *cookie)
 			      }
 		    }
 	    while (ev.type != EV_KEY || ev.code > KEY_MAX);
-	     pthread_mutex_lock (&key_queue_mutex);
 	    if (!fake_key)
 		    {
 		      
@@ -490,14 +499,11 @@ input_thread (void *cookie)
 			key_pressed[ev.code] = ev.value;
 		    }
 	    fake_key = 0;
-	    const int queue_max = sizeof (key_queue) / sizeof (key_queue[0]);
 
-	    if (ev.value > 0 && key_queue_len < queue_max)
+	    if (ev.value > 0)
 		    {
-		      key_queue[key_queue_len++] = ev.code;
-		      pthread_cond_signal (&key_queue_cond);
+		      key_queue_push (ev.code);
 		    }
-	    pthread_mutex_unlock (&key_queue_mutex);
 	  }
   return NULL;
 }
@@ -507,6 +513,8 @@ ui_init (void)
 {
   gr_init ();
   ev_init ();
+  // startup stages may already be logging from other threads
+  pthread_mutex_lock (&gUpdateMutex);
    text_col = text_row = 0;
   text_rows = gr_fb_height () / CHAR_HEIGHT;
   if (text_rows > MAX_ROWS)
@@ -515,12 +523,17 @@ ui_init (void)
    text_cols = gr_fb_width () / CHAR_WIDTH;
   if (text_cols > MAX_COLS - 1)
     text_cols = MAX_COLS - 1;
+  pthread_mutex_unlock (&gUpdateMutex);
    int i;
 
+  // Decode into a local and publish it under the lock, since a stage
+  // logging meanwhile may be drawing with these; LOGE itself takes the
+  // lock, so it can't be held across the load.
   for (i = 0; BITMAPS[i].name != NULL; ++i)
 	  {
-	    int result =
-	      res_create_surface (BITMAPS[i].name, BITMAPS[i].surface);
+	    gr_surface surface = NULL;
+	    int result = res_create_surface (BITMAPS[i].name, &surface);
+
 	    if (result < 0)
 		    {
 		      if (result == -2)
@@ -533,10 +546,14 @@ ui_init (void)
 				LOGE ("Missing bitmap %s\n(Code %d)\n",
 				       BITMAPS[i].name, result);
 			      }
-		      *BITMAPS[i].surface = NULL;
+		      surface = NULL;
 		    }
+	    pthread_mutex_lock (&gUpdateMutex);
+	    *BITMAPS[i].surface = surface;
+	    pthread_mutex_unlock (&gUpdateMutex);
 	  }
-   pthread_t t;
+   sem_init (&key_queue_sem, 0, 0);
+  pthread_t t;
   pthread_create (&t, NULL, progress_thread, NULL);
   pthread_create (&t, NULL, input_thread, NULL);
 }
@@ -609,6 +626,29 @@ ui_reset_progress ()
   pthread_mutex_unlock (&gUpdateMutex);
 } 
 
+// Append text to the log overlay.  Should only be called with
+// gUpdateMutex locked.
+static void
+append_text_locked (const char *buf)
+{
+  const char *ptr;
+
+  for (ptr = buf; *ptr != '\0'; ++ptr)
+	  {
+	    if (*ptr == '\n' || text_col >= text_cols)
+		    {
+		      text[text_row][text_col] = '\0';
+		      text_col = 0;
+		      text_row = (text_row + 1) % text_rows;
+		      if (text_row == text_top)
+			text_top = (text_top + 1) % text_rows;
+		    }
+	    if (*ptr != '\n')
+	      text[text_row][text_col++] = *ptr;
+	  }
+  text[text_row][text_col] = '\0';
+}
+
 void
 ui_print (const char *fmt, ...) 
 {
@@ -624,22 +664,21 @@ ui_print (const char *fmt, ...)
     pthread_mutex_lock (&gUpdateMutex);
   if (text_rows > 0 && text_cols > 0)
 	  {
-	    char *ptr;
+	    append_text_locked (buf);
+	    update_screen_locked ();
+	  }
+  pthread_mutex_unlock (&gUpdateMutex);
+}
 
-	    for (ptr = buf; *ptr != '\0'; ++ptr)
-		    {
-		      if (*ptr == '\n' || text_col >= text_cols)
-			      {
-				text[text_row][text_col] = '\0';
-				text_col = 0;
-				text_row = (text_row + 1) % text_rows;
-				if (text_row == text_top)
-				  text_top = (text_top + 1) % text_rows;
-			      }
-		      if (*ptr != '\n')
-			text[text_row][text_col++] = *ptr;
-		    }
-	    text[text_row][text_col] = '\0';
+void
+ui_print_text (const char *str)
+{
+  if (ui_log_stdout) fputs (str, stdout);
+
+  pthread_mutex_lock (&gUpdateMutex);
+  if (text_rows > 0 && text_cols > 0)
+	  {
+	    append_text_locked (str);
 	    update_screen_locked ();
 	  }
   pthread_mutex_unlock (&gUpdateMutex);
@@ -813,15 +852,21 @@ ui_end_menu ()
  int
 ui_wait_key () 
 {
-  pthread_mutex_lock (&key_queue_mutex);
-  while (key_queue_len == 0)
+  unsigned tail = key_queue_tail;
+
+  // Take one post per key, so the count stays in step with the queue.
+  // A post can still outlive its key when ui_clear_key_queue() drops it
+  // before it was posted; that one is taken here with the queue empty.
+  for (;;)
 	  {
-	    pthread_cond_wait (&key_queue_cond, &key_queue_mutex);
+	    if (sem_wait (&key_queue_sem) == 0 && key_queue_head != tail)
+	      break;
 	  }
-   int key = key_queue[0];
+  __sync_synchronize ();	// read the slot only after seeing the head
+  int key = key_queue[tail & (KEY_QUEUE_SIZE - 1)];
 
-  memcpy (&key_queue[0], &key_queue[1], sizeof (int) * --key_queue_len);
-  pthread_mutex_unlock (&key_queue_mutex);
+  __sync_synchronize ();	// finish the read before freeing the slot
+  key_queue_tail = tail + 1;
   return key;
 }
 
@@ -836,7 +881,12 @@ ui_key_pressed (int key)
  void
 ui_clear_key_queue ()
 {
-  pthread_mutex_lock (&key_queue_mutex);
-  key_queue_len = 0;
-  pthread_mutex_unlock (&key_queue_mutex);
+  // Consumer side only: drop everything queued so far, with the posts
+  // that went with it.
+  unsigned head = key_queue_head;
+  unsigned dropped = head - key_queue_tail;
+
+  key_queue_tail = head;
+  while (dropped-- > 0 && sem_trywait (&key_queue_sem) == 0)
+    ;
 } 
@@ -6,36 +6,45 @@
 #include <errno.h>
 #include <limits.h>
 #include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "mincrypt/sha.h"
 #include "bootimg.h"
+#include "mkbootimg.h"
 
-typedef unsigned char byte;
-
-int read_padding(FILE* f, unsigned itemsize, int pagesize)
+int write_string_to_file(char* file, char* string)
 {
-    byte* buf = (byte*)malloc(sizeof(byte) * pagesize);
-    unsigned pagemask = pagesize - 1;
-    unsigned count;
-
-    if((itemsize & pagemask) == 0) {
-        free(buf);
-        return 0;
+    FILE* f = fopen(file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "error: could not create '%s': %s\n", file, strerror(errno));
+        return -1;
     }
-
-    count = pagesize - (itemsize & pagemask);
-
-    fread(buf, count, 1, f);
-    free(buf);
-    return count;
+    fprintf(f, "%s\n", string);
+    return fclose(f);
 }
 
-void write_string_to_file(char* file, char* string)
+/* Copies a section of the image straight into its own file. */
+static int write_section(int img, off_t offset, unsigned size, char* file)
 {
-    FILE* f = fopen(file, "w");
-    fwrite(string, strlen(string), 1, f);
-    fwrite("\n", 1, 1, f);
-    fclose(f);
+    int fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not create '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+    int failed = bootimg_copy(img, offset, fd, size) != 0;
+    int err = errno;
+    /* closed here and only here, whatever happened */
+    if (close(fd) && !failed) {
+        failed = 1;
+        err = errno;
+    }
+    if (failed) {
+        fprintf(stderr, "error: failed writing '%s': %s\n", file, strerror(err));
+        unlink(file);
+        return -1;
+    }
+    return 0;
 }
 
 int unpackbootimg_usage() {
@@ -75,12 +84,21 @@ int unpack_bootimg_main(int argc, char** argv)
         return unpackbootimg_usage();
     }
     
-    int total_read = 0;
-    FILE* f = fopen(filename, "rb");
+    int img = open(filename, O_RDONLY);
     boot_img_hdr header;
+    struct stat st;
 
-    //printf("Reading header...\n");
-    fread(&header, sizeof(header), 1, f);
+    if (img < 0 || fstat(img, &st) < 0) {
+        fprintf(stderr, "error: could not open '%s'\n", filename);
+        return 1;
+    }
+    if (pread(img, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "error: '%s' is not a boot image\n", filename);
+        close(img);
+        return 1;
+    }
+    header.cmdline[BOOT_ARGS_SIZE - 1] = '\0';
     printf("BOARD_KERNEL_CMDLINE %s\n", header.cmdline);
     printf("BOARD_KERNEL_BASE %08x\n", header.kernel_addr - 0x00008000);
     printf("BOARD_PAGE_SIZE %d\n", header.page_size);
@@ -88,55 +106,53 @@ int unpack_bootimg_main(int argc, char** argv)
     if (pagesize == 0) {
         pagesize = header.page_size;
     }
+    if (pagesize <= 0 || (pagesize & (pagesize - 1))) {
+        fprintf(stderr, "error: bad page size %d\n", pagesize);
+        close(img);
+        return 1;
+    }
+
+    /* each section starts on a page boundary after the one before */
+    unsigned pagemask = pagesize - 1;
+    off_t kernel_offset = (sizeof(header) + pagemask) & ~pagemask;
+    off_t ramdisk_offset = kernel_offset + ((header.kernel_size + pagemask) & ~pagemask);
+    off_t second_offset = ramdisk_offset + ((header.ramdisk_size + pagemask) & ~pagemask);
+
+    if (ramdisk_offset > st.st_size ||
+        ramdisk_offset + header.ramdisk_size > st.st_size ||
+        second_offset + header.second_size > st.st_size) {
+        fprintf(stderr, "error: '%s' is truncated\n", filename);
+        close(img);
+        return 1;
+    }
+
+    int ret = 0;
+    char* name = basename(filename);
+
+    sprintf(tmp, "%s/%s-cmdline", directory, name);
+    ret |= write_string_to_file(tmp, (char*)header.cmdline);
     
-    //printf("cmdline...\n");
-    sprintf(tmp, "%s/%s", directory, basename(filename));
-    strcat(tmp, "-cmdline");
-    write_string_to_file(tmp, header.cmdline);
-    
-    //printf("base...\n");
-    sprintf(tmp, "%s/%s", directory, basename(filename));
-    strcat(tmp, "-base");
+    sprintf(tmp, "%s/%s-base", directory, name);
     char basetmp[200];
     sprintf(basetmp, "%08x", header.kernel_addr - 0x00008000);
-    write_string_to_file(tmp, basetmp);
+    ret |= write_string_to_file(tmp, basetmp);
 
-    //printf("pagesize...\n");
-    sprintf(tmp, "%s/%s", directory, basename(filename));
-    strcat(tmp, "-pagesize");
+    sprintf(tmp, "%s/%s-pagesize", directory, name);
     char pagesizetmp[200];
     sprintf(pagesizetmp, "%d", header.page_size);
-    write_string_to_file(tmp, pagesizetmp);
+    ret |= write_string_to_file(tmp, pagesizetmp);
     
-    total_read += sizeof(header);
-    //printf("total read: %d\n", total_read);
-    total_read += read_padding(f, sizeof(header), pagesize);
+    sprintf(tmp, "%s/%s-zImage", directory, name);
+    ret |= write_section(img, kernel_offset, header.kernel_size, tmp);
 
-    sprintf(tmp, "%s/%s", directory, basename(filename));
-    strcat(tmp, "-zImage");
-    FILE *k = fopen(tmp, "wb");
-    byte* kernel = (byte*)malloc(header.kernel_size);
-    //printf("Reading kernel...\n");
-    fread(kernel, header.kernel_size, 1, f);
-    total_read += header.kernel_size;
-    fwrite(kernel, header.kernel_size, 1, k);
-    fclose(k);
+    sprintf(tmp, "%s/%s-ramdisk.gz", directory, name);
+    ret |= write_section(img, ramdisk_offset, header.ramdisk_size, tmp);
 
-    //printf("total read: %d\n", header.kernel_size);
-    total_read += read_padding(f, header.kernel_size, pagesize);
+    if (header.second_size > 0) {
+        sprintf(tmp, "%s/%s-second", directory, name);
+        ret |= write_section(img, second_offset, header.second_size, tmp);
+    }
 
-    sprintf(tmp, "%s/%s", directory, basename(filename));
-    strcat(tmp, "-ramdisk.gz");
-    FILE *r = fopen(tmp, "wb");
-    byte* ramdisk = (byte*)malloc(header.ramdisk_size);
-    //printf("Reading ramdisk...\n");
-    fread(ramdisk, header.ramdisk_size, 1, f);
-    total_read += header.ramdisk_size;
-    fwrite(ramdisk, header.ramdisk_size, 1, r);
-    fclose(r);
-    
-    fclose(f);
-    
-    //printf("Total Read: %d\n", total_read);
-    return 0;
+    close(img);
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,578 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+#include "gzstream.h"
+#include "minzip/DirUtil.h"
+#include "untar.h"
+
+#define TAR_BLOCK 512
+#define TAR_COPY_BUF (128 * 1024)
+#define TAR_PAX_MAX (64 * 1024)
+
+typedef struct
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TarHeader;
+
+typedef struct
+{
+  char name[PATH_MAX];
+  char link[PATH_MAX];
+  char type;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  off_t size;
+  time_t mtime;
+  unsigned major, minor;
+} TarEntry;
+
+typedef struct
+{
+  GzStream *s;
+  off_t left;			// of the member being read as a tar, or -1
+  int broken;			// the stream can't be followed any further
+  char *buf;
+} TarIn;
+
+static ssize_t
+tar_read (TarIn * in, void *buf, size_t len)
+{
+  ssize_t n;
+
+  if (in->left >= 0 && (off_t) len > in->left)
+    len = in->left;
+  n = gzstream_read (in->s, buf, len);
+  if (n < 0)
+    in->broken = 1;
+  else if (in->left >= 0)
+    in->left -= n;
+  return n;
+}
+
+static int
+tar_skip (TarIn * in, off_t len)
+{
+  if (in->left >= 0)
+	  {
+	    if (len > in->left)
+		    {
+		      in->broken = 1;
+		      return -1;
+		    }
+	    in->left -= len;
+	  }
+  if (gzstream_skip (in->s, len) < 0)
+	  {
+	    in->broken = 1;
+	    return -1;
+	  }
+  return 0;
+}
+
+static off_t
+padding (off_t size)
+{
+  return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// Octal, or GNU base-256 for values that don't fit.
+static unsigned long long
+parse_number (const char *p, size_t len)
+{
+  unsigned long long v = 0;
+  size_t i = 0;
+
+  if ((unsigned char) p[0] & 0x80)
+	  {
+	    v = p[0] & 0x3f;
+	    for (i = 1; i < len; ++i)
+	      v = (v << 8) | (unsigned char) p[i];
+	    return v;
+	  }
+  while (i < len && (p[i] == ' ' || p[i] == '\0'))
+    ++i;
+  for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+    v = (v << 3) | (p[i] - '0');
+  return v;
+}
+
+static int
+header_ok (const unsigned char *block)
+{
+  unsigned long sum = 0;
+  long ssum = 0;
+  unsigned long stored;
+  int i;
+
+  for (i = 0; i < TAR_BLOCK; ++i)
+	  {
+	    // the checksum field counts as spaces
+	    unsigned char c = i >= 148 && i < 156 ? ' ' : block[i];
+
+	    sum += c;
+	    ssum += (signed char) c;
+	  }
+  stored = parse_number (((const TarHeader *) block)->chksum, 8);
+  return stored == sum || (long) stored == ssum;
+}
+
+// Reads a GNU long name or link of 'size' bytes into 'out'.
+static int
+read_long_string (TarIn * in, off_t size, char *out, size_t len)
+{
+  char block[TAR_BLOCK];
+  off_t done = 0;
+
+  while (done < size)
+	  {
+	    off_t n = size - done < TAR_BLOCK ? size - done : TAR_BLOCK;
+
+	    if (tar_read (in, block, TAR_BLOCK) != TAR_BLOCK)
+		    {
+		      in->broken = 1;
+		      return -1;
+		    }
+	    if ((size_t) done < len - 1)
+	      memcpy (out + done,
+		      block, (size_t) n < len - 1 - done ? (size_t) n :
+		      len - 1 - done);
+	    done += n;
+	  }
+  out[(size_t) size < len - 1 ? (size_t) size : len - 1] = '\0';
+  return 0;
+}
+
+// Picks path and linkpath out of a pax extended header; the other
+// records (times, names of owners, ...) aren't needed here.
+static int
+read_pax (TarIn * in, off_t size, TarEntry * e, int *have_name,
+	  int *have_link)
+{
+  char *data, *p, *end;
+
+  if (size > TAR_PAX_MAX)
+    return tar_skip (in, size + padding (size));
+  data = malloc (size + padding (size) + 1);
+  if (data == NULL)
+    return tar_skip (in, size + padding (size));
+  if (tar_read (in, data, size + padding (size)) != size + padding (size))
+	  {
+	    in->broken = 1;
+	    free (data);
+	    return -1;
+	  }
+  data[size] = '\0';
+  for (p = data, end = data + size; p < end;)
+	  {
+	    // "<length> <key>=<value>\n", length counting everything
+	    char *sp, *eq;
+	    long rec = strtol (p, &sp, 10);
+
+	    if (rec <= 0 || *sp != ' ' || rec > end - p)
+	      break;
+	    p[rec - 1] = '\0';
+	    eq = strchr (sp + 1, '=');
+	    if (eq != NULL)
+		    {
+		      *eq = '\0';
+		      if (strcmp (sp + 1, "path") == 0)
+			      {
+				strlcpy (e->name, eq + 1, sizeof (e->name));
+				*have_name = 1;
+			      }
+		      else if (strcmp (sp + 1, "linkpath") == 0)
+			      {
+				strlcpy (e->link, eq + 1, sizeof (e->link));
+				*have_link = 1;
+			      }
+		    }
+	    p += rec;
+	  }
+  free (data);
+  return 0;
+}
+
+// Returns 1 with the next entry in 'e', 0 at the end of the archive,
+// or -1 if it can't be read.
+static int
+next_entry (TarIn * in, TarEntry * e)
+{
+  unsigned char block[TAR_BLOCK];
+  const TarHeader *h = (const TarHeader *) block;
+  int have_name = 0, have_link = 0;
+
+  for (;;)
+	  {
+	    ssize_t n = tar_read (in, block, TAR_BLOCK);
+	    off_t size;
+
+	    // some writers leave out the two zero blocks at the end
+	    if (n == 0 || (n == TAR_BLOCK && block[0] == '\0'))
+	      return 0;
+	    if (n != TAR_BLOCK || !header_ok (block))
+		    {
+		      in->broken = 1;
+		      return -1;
+		    }
+	    size = parse_number (h->size, sizeof (h->size));
+	    switch (h->typeflag)
+		    {
+		    case 'L':
+		      if (read_long_string (in, size, e->name, sizeof (e->name)) < 0)
+			return -1;
+		      have_name = 1;
+		      continue;
+		    case 'K':
+		      if (read_long_string (in, size, e->link, sizeof (e->link)) < 0)
+			return -1;
+		      have_link = 1;
+		      continue;
+		    case 'x':
+		      if (read_pax (in, size, e, &have_name, &have_link) < 0)
+			return -1;
+		      continue;
+		    case 'g':
+		      if (tar_skip (in, size + padding (size)) < 0)
+			return -1;
+		      continue;
+		    }
+
+	    if (!have_name)
+		    {
+		      // only POSIX ustar has the prefix; old GNU puts times there
+		      if (memcmp (h->magic, "ustar", 6) == 0 && h->prefix[0] != '\0')
+			snprintf (e->name, sizeof (e->name), "%.155s/%.100s",
+				  h->prefix, h->name);
+		      else
+			snprintf (e->name, sizeof (e->name), "%.100s", h->name);
+		    }
+	    if (!have_link)
+	      snprintf (e->link, sizeof (e->link), "%.100s", h->linkname);
+	    e->type = h->typeflag;
+	    e->mode = parse_number (h->mode, sizeof (h->mode)) & 07777;
+	    e->uid = parse_number (h->uid, sizeof (h->uid));
+	    e->gid = parse_number (h->gid, sizeof (h->gid));
+	    e->size = size;
+	    e->mtime = parse_number (h->mtime, sizeof (h->mtime));
+	    e->major = parse_number (h->devmajor, sizeof (h->devmajor));
+	    e->minor = parse_number (h->devminor, sizeof (h->devminor));
+	    return 1;
+	  }
+}
+
+// Strips leading "/" and "./" and any trailing "/".  Returns NULL for
+// names that would climb out of the destination with "..".
+static char *
+clean_name (char *name)
+{
+  char *p = name, *c;
+  size_t len;
+
+  for (;;)
+	  {
+	    if (p[0] == '/')
+	      ++p;
+	    else if (p[0] == '.' && p[1] == '/')
+	      p += 2;
+	    else
+	      break;
+	  }
+  if (strcmp (p, ".") == 0)
+    ++p;
+  len = strlen (p);
+  while (len > 0 && p[len - 1] == '/')
+    p[--len] = '\0';
+  for (c = p; c != NULL; c = strchr (c, '/'))
+	  {
+	    if (*c == '/')
+	      ++c;
+	    if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0'))
+	      return NULL;
+	  }
+  return p;
+}
+
+// After a call failed with ENOENT, creates the missing parents of
+// 'path' so it can be tried again.
+static int
+made_parents (const char *path)
+{
+  return errno == ENOENT && dirCreateHierarchy (path, 0755, NULL, true) == 0;
+}
+
+static int
+write_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+	  {
+	    ssize_t n = write (fd, data, len);
+
+	    if (n < 0 && errno == EINTR)
+	      continue;
+	    if (n <= 0)
+	      return -1;
+	    data += n;
+	    len -= n;
+	  }
+  return 0;
+}
+
+static int
+extract_file (TarIn * in, const TarEntry * e, const char *path)
+{
+  off_t left = e->size;
+  int fd, failed = 0;
+
+  // replace, rather than write through, whatever is there
+  unlink (path);
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 && made_parents (path))
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+	  {
+	    LOGW ("can't create %s (%s)\n", path, strerror (errno));
+	    tar_skip (in, e->size);
+	    return -1;
+	  }
+  while (left > 0)
+	  {
+	    size_t want = left < TAR_COPY_BUF ? (size_t) left : TAR_COPY_BUF;
+	    ssize_t n = tar_read (in, in->buf, want);
+
+	    if (n != (ssize_t) want)
+		    {
+		      in->broken = 1;
+		      close (fd);
+		      return -1;
+		    }
+	    // keep reading past a full disk to stay in step with the archive
+	    if (!failed && write_all (fd, in->buf, n) < 0)
+		    {
+		      LOGW ("can't write %s (%s)\n", path, strerror (errno));
+		      failed = 1;
+		    }
+	    left -= n;
+	  }
+  // chown before chmod, which would otherwise lose setuid bits
+  if (!failed && (fchown (fd, e->uid, e->gid) < 0 || fchmod (fd, e->mode) < 0))
+	  {
+	    LOGW ("can't set owner of %s (%s)\n", path, strerror (errno));
+	    failed = 1;
+	  }
+  if (close (fd) < 0)
+    failed = 1;
+  if (!failed)
+	  {
+	    struct utimbuf times = { e->mtime, e->mtime };
+
+	    utime (path, &times);
+	  }
+  return -failed;
+}
+
+// Everything but the contents of regular files.
+static int
+extract_special (const TarEntry * e, const char *path, const char *dest)
+{
+  char target[PATH_MAX];
+  char linkname[PATH_MAX];
+  char *name;
+  mode_t type;
+  int r;
+
+  switch (e->type)
+	  {
+	  case '5':
+	    r = mkdir (path, e->mode);
+	    if (r < 0 && made_parents (path))
+	      r = mkdir (path, e->mode);
+	    if (r < 0 && errno != EEXIST)
+	      return -1;
+	    if (chown (path, e->uid, e->gid) < 0 || chmod (path, e->mode) < 0)
+	      return -1;
+	    return 0;
+	  case '2':
+	    unlink (path);
+	    r = symlink (e->link, path);
+	    if (r < 0 && made_parents (path))
+	      r = symlink (e->link, path);
+	    if (r < 0)
+	      return -1;
+	    return lchown (path, e->uid, e->gid);
+	  case '1':
+	    strlcpy (linkname, e->link, sizeof (linkname));
+	    name = clean_name (linkname);
+	    if (name == NULL)
+		    {
+		      errno = EINVAL;
+		      return -1;
+		    }
+	    snprintf (target, sizeof (target), "%s/%s", dest, name);
+	    unlink (path);
+	    r = link (target, path);
+	    if (r < 0 && made_parents (path))
+	      r = link (target, path);
+	    return r;
+	  case '3':
+	    type = S_IFCHR;
+	    break;
+	  case '4':
+	    type = S_IFBLK;
+	    break;
+	  case '6':
+	    type = S_IFIFO;
+	    break;
+	  default:
+	    LOGW ("skipping %s: unknown tar entry type '%c'\n", path, e->type);
+	    return 0;
+	  }
+  unlink (path);
+  r = mknod (path, type | e->mode, makedev (e->major, e->minor));
+  if (r < 0 && made_parents (path))
+    r = mknod (path, type | e->mode, makedev (e->major, e->minor));
+  if (r < 0)
+    return -1;
+  if (chown (path, e->uid, e->gid) < 0 || chmod (path, e->mode) < 0)
+    return -1;
+  return 0;
+}
+
+static int
+extract_all (TarIn * in, const char *dest, TarFilter filter, void *cookie)
+{
+  TarEntry e;
+  char path[PATH_MAX];
+  int r, failed = 0;
+
+  if (dirCreateHierarchy (dest, 0755, NULL, false) < 0)
+	  {
+	    LOGE ("Can't create %s (%s)\n", dest, strerror (errno));
+	    return -1;
+	  }
+  while ((r = next_entry (in, &e)) > 0)
+	  {
+	    char *name = clean_name (e.name);
+	    int regular = e.type == '0' || e.type == '\0' || e.type == '7';
+	    off_t skip = e.size + padding (e.size);
+
+	    if (name == NULL)
+	      LOGW ("skipping %s: outside of %s\n", e.name, dest);
+	    else if (name[0] != '\0'
+		     && (filter == NULL || filter (name, cookie) == TAR_EXTRACT))
+		    {
+		      snprintf (path, sizeof (path), "%s/%s", dest, name);
+		      if (regular)
+			      {
+				failed |= extract_file (in, &e, path) < 0;
+				skip = padding (e.size);
+			      }
+		      else if (extract_special (&e, path, dest) < 0)
+			      {
+				LOGW ("can't create %s (%s)\n", path,
+				      strerror (errno));
+				failed = 1;
+			      }
+		    }
+	    if (in->broken || tar_skip (in, skip) < 0)
+	      return -1;
+	  }
+  return r < 0 || failed ? -1 : 0;
+}
+
+static int
+open_archive (TarIn * in, const char *archive)
+{
+  in->left = -1;
+  in->broken = 0;
+  in->buf = malloc (TAR_COPY_BUF);
+  in->s = in->buf != NULL ? gzstream_open (archive) : NULL;
+  if (in->s == NULL)
+	  {
+	    LOGE ("Can't open %s (%s)\n", archive, strerror (errno));
+	    free (in->buf);
+	    return -1;
+	  }
+  return 0;
+}
+
+static void
+close_archive (TarIn * in, const char *archive)
+{
+  if (in->broken)
+    LOGE ("%s is truncated or corrupt\n", archive);
+  gzstream_close (in->s);
+  free (in->buf);
+}
+
+int
+tar_extract (const char *archive, const char *dest, TarFilter filter,
+	     void *cookie)
+{
+  TarIn in;
+  int ret;
+
+  if (open_archive (&in, archive) < 0)
+    return -1;
+  ret = extract_all (&in, dest, filter, cookie);
+  close_archive (&in, archive);
+  return ret;
+}
+
+int
+tar_extract_member (const char *archive, const char *member,
+		    const char *dest)
+{
+  TarIn in;
+  TarEntry e;
+  int r, ret = 1;
+
+  if (open_archive (&in, archive) < 0)
+    return -1;
+  while ((r = next_entry (&in, &e)) > 0)
+	  {
+	    char *name = clean_name (e.name);
+
+	    if (name != NULL && strcmp (name, member) == 0)
+		    {
+		      // the member's data is read as a tar of its own
+		      TarIn inner = { in.s, e.size, 0, in.buf };
+
+		      ret = extract_all (&inner, dest, NULL, NULL);
+		      in.broken = inner.broken;
+		      break;
+		    }
+	    if (tar_skip (&in, e.size + padding (e.size)) < 0)
+	      break;
+	  }
+  if (r < 0 || in.broken)
+    ret = -1;
+  close_archive (&in, archive);
+  return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef RECOVERY_UNTAR_H
+#define RECOVERY_UNTAR_H
+
+// In-process tar x for plugins and ROM packages: ustar, GNU long
+// names and pax paths, plain or gzipped (see gzstream.h).  Owners,
+// modes and mtimes are restored as tar does when run as root.
+
+#define TAR_EXTRACT 0
+#define TAR_SKIP 1
+
+// Called with each entry's name, minus any leading "./" or "/";
+// returns TAR_EXTRACT or TAR_SKIP.
+typedef int (*TarFilter) (const char *name, void *cookie);
+
+// Unpack 'archive' into the directory 'dest', creating it if needed.
+// 'filter' may be NULL.  Returns 0, or -1 if the archive could not be
+// read or an entry could not be written.
+int tar_extract (const char *archive, const char *dest, TarFilter filter,
+		 void *cookie);
+
+// Unpack the tar stored as 'member' inside 'archive' (eg. the
+// system.tar of a ROM package) straight into 'dest', without writing
+// the inner tar out first.  Returns 1 if there is no such member.
+int tar_extract_member (const char *archive, const char *member,
+			const char *dest);
+
+#endif
@@ -9,111 +9,592 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "unyaffs.h"
 
-#define CHUNK_SIZE 2048
-#define SPARE_SIZE 64
-#define MAX_OBJECTS 10000
+/*
+ * The image is mmapped and scanned once to build an object table
+ * (hashed by object id) holding, for each object, its header chunk
+ * and its data chunks by chunk id.  Directories are then created in
+ * tree order, and the files of each directory are written by worker
+ * threads relative to that directory's fd.  Hard links go last, once
+ * their targets exist.  Each object gets the owner, mode and times of
+ * its header; directories only once everything below them is written,
+ * since creating their entries changes their times.
+ */
+
+#define DEFAULT_CHUNK_SIZE 2048
+#define DEFAULT_SPARE_SIZE 64
 #define YAFFS_OBJECTID_ROOT     1
+#define UNYAFFS_THREADS 4
+#define MAX_IOV 64
+
+/* Header chunks of images read back from NAND carry extra bits. */
+#define EXTRA_HEADER_INFO_FLAG 0x80000000
+#define ALL_EXTRA_FLAGS 0xF0000000
+
+typedef struct {
+	unsigned id;
+	unsigned parent_id;
+	int header;		/* chunk index of the latest header, -1 if none */
+	int *chunks;		/* data chunk index by chunkId - 1, -1 if missing */
+	int nchunks;
+	int parent;		/* object index, -1 if unresolved */
+	int first_child;
+	int next_sibling;
+	char *path;		/* directories only */
+} yaffs_Object;
 
+typedef struct {
+	const unsigned char *base;
+	size_t nchunks;
+	int chunk_size;
+	int stride;		/* chunk + spare */
 
-unsigned char data[CHUNK_SIZE + SPARE_SIZE];
-unsigned char *chunk_data = data;
-unsigned char *spare_data = data + CHUNK_SIZE;
-int img_file;
+	yaffs_Object *objs;
+	int count;
+	int allocd;
+	int *slots;		/* object index + 1, 0 if empty */
+	int nslots;
 
-char *obj_list[MAX_OBJECTS];
-void process_chunk()
+	int *dirs;		/* directories with something to write */
+	int ndirs;
+	int next_dir;
+	pthread_mutex_t lock;
+	volatile int errors;
+} unyaffs_state;
+
+static const yaffs_ObjectHeader *
+object_header(unyaffs_state *s, const yaffs_Object *o)
 {
-	int out_file, remain, s;
-	char *full_path_name;
+	return (const yaffs_ObjectHeader *)(s->base + (size_t)o->header * s->stride);
+}
 
-	yaffs_PackedTags2 *pt = (yaffs_PackedTags2 *)spare_data;
-	if (pt->t.byteCount == 0xffff)  {	//a new object 
+static const yaffs_PackedTags2 *
+chunk_tags(unyaffs_state *s, size_t i)
+{
+	return (const yaffs_PackedTags2 *)(s->base + i * s->stride + s->chunk_size);
+}
 
-		yaffs_ObjectHeader *oh = (yaffs_ObjectHeader *)malloc(sizeof(yaffs_ObjectHeader));
-		memcpy(oh, chunk_data, sizeof(yaffs_ObjectHeader));
+/* The name isn't guaranteed to be terminated, and the image is read-only. */
+static void
+object_name(const yaffs_ObjectHeader *oh, char *name)
+{
+	size_t len = strnlen(oh->name, YAFFS_MAX_NAME_LENGTH);
+
+	memcpy(name, oh->name, len);
+	name[len] = '\0';
+}
+
+static int
+find_object(unyaffs_state *s, unsigned id, int create)
+{
+	unsigned h;
+
+	if (create && s->count * 2 >= s->nslots) {
+		int *old = s->slots;
+		int old_size = s->nslots, i;
 
-		full_path_name = (char *)malloc(strlen(oh->name) + strlen(obj_list[oh->parentObjectId]) + 2);
-		if (full_path_name == NULL) {
-			perror("malloc full path name\n");
+		s->nslots = old_size ? old_size * 2 : 1024;
+		s->slots = calloc(s->nslots, sizeof(int));
+		if (s->slots == NULL) {
+			s->slots = old;
+			s->nslots = old_size;
+			return -1;
 		}
-		strcpy(full_path_name, obj_list[oh->parentObjectId]);
-		strcat(full_path_name, "/");
-		strcat(full_path_name, oh->name);
-		obj_list[pt->t.objectId] = full_path_name;
+		for (i = 0; i < old_size; i++) {
+			if (old[i] == 0)
+				continue;
+			h = (s->objs[old[i] - 1].id * 2654435761U) & (s->nslots - 1);
+			while (s->slots[h] != 0)
+				h = (h + 1) & (s->nslots - 1);
+			s->slots[h] = old[i];
+		}
+		free(old);
+	}
+
+	if (s->nslots == 0)
+		return -1;
+	h = (id * 2654435761U) & (s->nslots - 1);
+	while (s->slots[h] != 0) {
+		if (s->objs[s->slots[h] - 1].id == id)
+			return s->slots[h] - 1;
+		h = (h + 1) & (s->nslots - 1);
+	}
+	if (!create)
+		return -1;
+
+	if (s->count == s->allocd) {
+		int n = s->allocd ? s->allocd * 2 : 1024;
+		yaffs_Object *objs = realloc(s->objs, n * sizeof(yaffs_Object));
+
+		if (objs == NULL)
+			return -1;
+		s->objs = objs;
+		s->allocd = n;
+	}
+	yaffs_Object *o = &s->objs[s->count];
+
+	memset(o, 0, sizeof(*o));
+	o->id = id;
+	o->header = -1;
+	o->parent = -1;
+	o->first_child = -1;
+	o->next_sibling = -1;
+	s->slots[h] = s->count + 1;
+	return s->count++;
+}
+
+static int
+add_data_chunk(yaffs_Object *o, unsigned chunk_id, int index)
+{
+	if ((int)chunk_id > o->nchunks) {
+		int n = o->nchunks ? o->nchunks : 16;
+		int i;
+
+		while (n < (int)chunk_id)
+			n *= 2;
+		int *chunks = realloc(o->chunks, n * sizeof(int));
+
+		if (chunks == NULL)
+			return -1;
+		for (i = o->nchunks; i < n; i++)
+			chunks[i] = -1;
+		o->chunks = chunks;
+		o->nchunks = n;
+	}
+	o->chunks[chunk_id - 1] = index;
+	return 0;
+}
+
+/* One pass over the image; later chunks replace earlier ones. */
+static int
+scan_image(unyaffs_state *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->nchunks; i++) {
+		const yaffs_PackedTags2 *pt = chunk_tags(s, i);
+		unsigned chunk_id = pt->t.chunkId;
+		unsigned obj_id = pt->t.objectId;
+		int is_header = pt->t.byteCount == 0xffff || chunk_id == 0;
+
+		if (chunk_id & EXTRA_HEADER_INFO_FLAG) {
+			is_header = 1;
+			obj_id &= ~ALL_EXTRA_FLAGS;
+		}
+		chunk_id &= ~ALL_EXTRA_FLAGS;
+		/* erased or unused */
+		if (obj_id == 0 || pt->t.objectId == 0xffffffff)
+			continue;
+
+		int idx = find_object(s, obj_id, 1);
+
+		if (idx < 0) {
+			fprintf(stderr, "out of memory indexing image\n");
+			return -1;
+		}
+		if (is_header) {
+			s->objs[idx].header = i;
+		} else if (add_data_chunk(&s->objs[idx], chunk_id, i) < 0) {
+			fprintf(stderr, "out of memory indexing image\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+link_tree(unyaffs_state *s)
+{
+	int i;
+
+	for (i = 0; i < s->count; i++) {
+		yaffs_Object *o = &s->objs[i];
+
+		if (o->header < 0 || o->id == YAFFS_OBJECTID_ROOT)
+			continue;
+		o->parent_id = object_header(s, o)->parentObjectId;
+		o->parent = find_object(s, o->parent_id, 0);
+		if (o->parent < 0) {
+			fprintf(stderr, "object %u has no parent %u; skipped\n",
+				o->id, o->parent_id);
+			continue;
+		}
+		o->next_sibling = s->objs[o->parent].first_child;
+		s->objs[o->parent].first_child = i;
+	}
+}
+
+static int
+is_type(unyaffs_state *s, const yaffs_Object *o, yaffs_ObjectType type)
+{
+	return o->header >= 0 && object_header(s, o)->type == type;
+}
+
+/* Create the directories below object 'dir' (open as dirfd). */
+static void
+make_directories(unyaffs_state *s, int dir, int dirfd, int depth)
+{
+	int c, has_files = 0;
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+
+	for (c = s->objs[dir].first_child; c >= 0; c = s->objs[c].next_sibling) {
+		yaffs_Object *o = &s->objs[c];
+
+		if (!is_type(s, o, YAFFS_OBJECT_TYPE_DIRECTORY)) {
+			has_files = 1;
+			continue;
+		}
+		/* guard against a corrupt image looping back on itself */
+		if (depth > 256 || o->path != NULL)
+			continue;
+		object_name(object_header(s, o), name);
+		if (mkdirat(dirfd, name, 0777) < 0 && errno != EEXIST) {
+			fprintf(stderr, "can't create %s/%s: %s\n",
+				s->objs[dir].path, name, strerror(errno));
+			__sync_fetch_and_add(&s->errors, 1);
+			continue;
+		}
+		if (asprintf(&o->path, "%s/%s", s->objs[dir].path, name) < 0) {
+			o->path = NULL;
+			__sync_fetch_and_add(&s->errors, 1);
+			continue;
+		}
+
+		int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+		if (fd < 0) {
+			__sync_fetch_and_add(&s->errors, 1);
+			continue;
+		}
+		make_directories(s, c, fd, depth + 1);
+		close(fd);
+	}
+	if (has_files)
+		s->dirs[s->ndirs++] = dir;
+}
+
+/* Give 'name' in dirfd the owner, mode and times recorded in its header. */
+static int
+set_metadata(int dirfd, const char *name, const yaffs_ObjectHeader *oh)
+{
+	struct timespec times[2];
+	int is_link = oh->type == YAFFS_OBJECT_TYPE_SYMLINK;
 
-		switch(oh->type) {
+	if (fchownat(dirfd, name, oh->yst_uid, oh->yst_gid,
+		     AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	/* after the chown, which clears set-id bits; links have no mode */
+	if (!is_link && fchmodat(dirfd, name, oh->yst_mode & 07777, 0) < 0)
+		return -1;
+	times[0].tv_sec = oh->yst_atime;
+	times[0].tv_nsec = 0;
+	times[1].tv_sec = oh->yst_mtime;
+	times[1].tv_nsec = 0;
+	return utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int
+write_file(unyaffs_state *s, int dirfd, const char *name,
+	   const yaffs_Object *o, const yaffs_ObjectHeader *oh)
+{
+	struct iovec iov[MAX_IOV];
+	int niov = 0, k;
+	long long remain = (unsigned)oh->fileSize;
+	int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, oh->yst_mode & 07777);
+
+	if (fd < 0)
+		return -1;
+	for (k = 0; remain > 0 && k < o->nchunks; k++) {
+		int idx = o->chunks[k];
+		long long len;
+
+		if (idx < 0) {
+			/* missing chunk: leave a hole */
+			if (niov > 0 && writev(fd, iov, niov) < 0)
+				goto fail;
+			niov = 0;
+			len = remain < s->chunk_size ? remain : s->chunk_size;
+			if (lseek(fd, len, SEEK_CUR) < 0)
+				goto fail;
+			remain -= len;
+			continue;
+		}
+		len = chunk_tags(s, idx)->t.byteCount;
+		if (len > s->chunk_size)
+			len = s->chunk_size;
+		if (len > remain)
+			len = remain;
+		iov[niov].iov_base = (void *)(s->base + (size_t)idx * s->stride);
+		iov[niov].iov_len = len;
+		remain -= len;
+		if (++niov == MAX_IOV) {
+			if (writev(fd, iov, niov) < 0)
+				goto fail;
+			niov = 0;
+		}
+	}
+	if (niov > 0 && writev(fd, iov, niov) < 0)
+		goto fail;
+	if (ftruncate(fd, (unsigned)oh->fileSize) < 0)
+		goto fail;
+	return close(fd);
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static void
+extract_directory(unyaffs_state *s, int dir)
+{
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+	int dirfd = open(s->objs[dir].path, O_RDONLY | O_DIRECTORY);
+	int c;
+
+	if (dirfd < 0) {
+		fprintf(stderr, "can't open %s: %s\n", s->objs[dir].path,
+			strerror(errno));
+		__sync_fetch_and_add(&s->errors, 1);
+		return;
+	}
+	for (c = s->objs[dir].first_child; c >= 0; c = s->objs[c].next_sibling) {
+		const yaffs_Object *o = &s->objs[c];
+		const yaffs_ObjectHeader *oh;
+		int ret = 0;
+
+		if (o->header < 0)
+			continue;
+		oh = object_header(s, o);
+		object_name(oh, name);
+		switch (oh->type) {
 			case YAFFS_OBJECT_TYPE_FILE:
-				remain = oh->fileSize;
-				out_file = creat(full_path_name, oh->yst_mode);
-				while(remain > 0) {
-					if (read_chunk())
-						return -1;
-					s = (remain < pt->t.byteCount) ? remain : pt->t.byteCount;	
-					if (write(out_file, chunk_data, s) == -1)
-						return -1;
-					remain -= s;
-				}
-				close(out_file);
+				ret = write_file(s, dirfd, name, o, oh);
 				break;
 			case YAFFS_OBJECT_TYPE_SYMLINK:
-				symlink(oh->alias, full_path_name);
+				memcpy(alias, oh->alias, YAFFS_MAX_ALIAS_LENGTH);
+				alias[YAFFS_MAX_ALIAS_LENGTH] = '\0';
+				ret = symlinkat(alias, dirfd, name);
 				break;
-			case YAFFS_OBJECT_TYPE_DIRECTORY:
-				mkdir(full_path_name, 0777);
-				break;
-			case YAFFS_OBJECT_TYPE_HARDLINK:
-				link(obj_list[oh->equivalentObjectId], full_path_name);
+			case YAFFS_OBJECT_TYPE_SPECIAL:
+				/* devices, fifos and sockets */
+				ret = mknodat(dirfd, name, oh->yst_mode, oh->yst_rdev);
 				break;
+			default:
+				/* directories come last, hard links share
+				 * their target's inode */
+				continue;
+		}
+		if (ret == 0)
+			ret = set_metadata(dirfd, name, oh);
+		if (ret < 0) {
+			fprintf(stderr, "can't extract %s/%s: %s\n",
+				s->objs[dir].path, name, strerror(errno));
+			__sync_fetch_and_add(&s->errors, 1);
 		}
 	}
+	close(dirfd);
 }
 
+/* Children first, so nothing changes a directory's times afterwards. */
+static void
+finish_directories(unyaffs_state *s, int dir, int depth)
+{
+	int c;
+
+	for (c = s->objs[dir].first_child; c >= 0; c = s->objs[c].next_sibling) {
+		const yaffs_Object *o = &s->objs[c];
+
+		if (!is_type(s, o, YAFFS_OBJECT_TYPE_DIRECTORY) ||
+		    o->path == NULL || depth > 256)
+			continue;
+		finish_directories(s, c, depth + 1);
+		if (set_metadata(AT_FDCWD, o->path, object_header(s, o)) < 0) {
+			fprintf(stderr, "can't set attributes of %s: %s\n",
+				o->path, strerror(errno));
+			__sync_fetch_and_add(&s->errors, 1);
+		}
+	}
+}
 
-int read_chunk()
+static void *
+extract_worker(void *cookie)
 {
-	ssize_t s;
-	int ret = -1;
-	memset(chunk_data, 0xff, sizeof(chunk_data));
-	s = read(img_file, data, CHUNK_SIZE + SPARE_SIZE);
-	if (s == -1) {
-		perror("read image file\n");
-	} else if (s == 0) {
-		printf("end of image\n");
-	} else if ((s == (CHUNK_SIZE + SPARE_SIZE))) {
-		ret = 0;
-	} else {
-		fprintf(stderr, "broken image file\n");
-		ret = 1;
+	unyaffs_state *s = cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		int i = s->next_dir++;
+		pthread_mutex_unlock(&s->lock);
+
+		if (i >= s->ndirs)
+			break;
+		extract_directory(s, s->dirs[i]);
 	}
-	return ret;
+	return NULL;
 }
 
-int unyaffs_main(int argc, char **argv)
+static void
+make_hard_links(unyaffs_state *s)
 {
-	if (argc != 2) {
-		printf("Usage: unyaffs image_file_name\n");
-		exit(1);
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+	char target[YAFFS_MAX_NAME_LENGTH + 1];
+	int i;
+
+	for (i = 0; i < s->count; i++) {
+		const yaffs_Object *o = &s->objs[i];
+
+		if (!is_type(s, o, YAFFS_OBJECT_TYPE_HARDLINK) || o->parent < 0)
+			continue;
+
+		const yaffs_ObjectHeader *oh = object_header(s, o);
+		int t = find_object(s, oh->equivalentObjectId, 0);
+
+		if (t < 0 || s->objs[t].header < 0 || s->objs[t].parent < 0 ||
+		    s->objs[o->parent].path == NULL ||
+		    s->objs[s->objs[t].parent].path == NULL) {
+			fprintf(stderr, "hard link object %u has no target\n", o->id);
+			__sync_fetch_and_add(&s->errors, 1);
+			continue;
+		}
+		object_name(oh, name);
+		object_name(object_header(s, &s->objs[t]), target);
+
+		char *from, *to;
+
+		if (asprintf(&from, "%s/%s", s->objs[s->objs[t].parent].path, target) < 0)
+			continue;
+		if (asprintf(&to, "%s/%s", s->objs[o->parent].path, name) < 0) {
+			free(from);
+			continue;
+		}
+		if (link(from, to) < 0) {
+			fprintf(stderr, "can't link %s to %s: %s\n", to, from,
+				strerror(errno));
+			__sync_fetch_and_add(&s->errors, 1);
+		}
+		free(from);
+		free(to);
 	}
-	img_file = open(argv[1], O_RDONLY);
-	if (img_file == -1) {
+}
+
+int
+unyaffs_extract(const char *image, const char *out_dir, int chunk_size,
+		int spare_size)
+{
+	unyaffs_state s;
+	struct stat st;
+	int img_file, i, n;
+	pthread_t threads[UNYAFFS_THREADS];
+
+	memset(&s, 0, sizeof(s));
+	img_file = open(image, O_RDONLY);
+	if (img_file == -1 || fstat(img_file, &st) < 0) {
 		printf("open image file failed\n");
-		exit(1);
+		return 1;
+	}
+	s.chunk_size = chunk_size;
+	s.stride = chunk_size + spare_size;
+	s.nchunks = st.st_size / s.stride;
+	if (st.st_size % s.stride)
+		fprintf(stderr, "broken image file (%lld trailing bytes)\n",
+			(long long)(st.st_size % s.stride));
+	if (s.nchunks == 0) {
+		close(img_file);
+		printf("end of image\n");
+		return 0;
+	}
+	s.base = mmap(NULL, s.nchunks * s.stride, PROT_READ, MAP_PRIVATE,
+		      img_file, 0);
+	close(img_file);
+	if (s.base == MAP_FAILED) {
+		perror("mmap image file");
+		return 1;
 	}
+	madvise((void *)s.base, s.nchunks * s.stride, MADV_SEQUENTIAL);
+	pthread_mutex_init(&s.lock, NULL);
+
+	int root = find_object(&s, YAFFS_OBJECTID_ROOT, 1);
+
+	if (root < 0 || scan_image(&s) < 0)
+		goto done;
+	link_tree(&s);
+
+	s.dirs = malloc(s.count * sizeof(int));
+	s.objs[root].path = strdup(out_dir);
+	int rootfd = open(out_dir, O_RDONLY | O_DIRECTORY);
 
-	obj_list[YAFFS_OBJECTID_ROOT] = ".";
-	while(1) {
-		if (read_chunk() == -1)
+	if (s.dirs == NULL || s.objs[root].path == NULL || rootfd < 0) {
+		fprintf(stderr, "can't open %s\n", out_dir);
+		s.errors = 1;
+		goto done;
+	}
+	make_directories(&s, root, rootfd, 0);
+	close(rootfd);
+
+	n = s.ndirs < UNYAFFS_THREADS ? s.ndirs : UNYAFFS_THREADS;
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, extract_worker, &s) != 0)
 			break;
-		process_chunk();
 	}
-	close(img_file);
-	return 0;
+	n = i;
+	extract_worker(&s);
+	for (i = 1; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	make_hard_links(&s);
+	finish_directories(&s, root, 0);
+	/* a root header, if the image has one, belongs to out_dir itself */
+	if (s.objs[root].header >= 0 &&
+	    set_metadata(AT_FDCWD, out_dir, object_header(&s, &s.objs[root])) < 0)
+		s.errors = 1;
+
+done:
+	for (i = 0; i < s.count; i++) {
+		free(s.objs[i].chunks);
+		free(s.objs[i].path);
+	}
+	free(s.objs);
+	free(s.slots);
+	free(s.dirs);
+	munmap((void *)s.base, s.nchunks * s.stride);
+	pthread_mutex_destroy(&s.lock);
+	return s.errors ? 1 : 0;
+}
+
+int unyaffs_main(int argc, char **argv)
+{
+	int chunk_size = DEFAULT_CHUNK_SIZE;
+	int spare_size = DEFAULT_SPARE_SIZE;
+	int i = 1;
+
+	while (i + 1 < argc && argv[i][0] == '-') {
+		if (strcmp(argv[i], "-c") == 0)
+			chunk_size = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			spare_size = atoi(argv[i + 1]);
+		else
+			break;
+		i += 2;
+	}
+	if (argc - i < 1 || argc - i > 2 || chunk_size <= 0 ||
+	    spare_size < (int)sizeof(yaffs_PackedTags2TagsPart)) {
+		printf("Usage: unyaffs [-c chunk_size] [-s spare_size] image_file_name [dir]\n");
+		printf("  defaults: -c %d -s %d (use -c 4096 -s 128 for 4KiB pages)\n",
+		       DEFAULT_CHUNK_SIZE, DEFAULT_SPARE_SIZE);
+		exit(1);
+	}
+	return unyaffs_extract(argv[i], argc - i == 2 ? argv[i + 1] : ".",
+			       chunk_size, spare_size);
 }
@@ -5,6 +5,7 @@
 #ifndef __UNYAFFS_H__
 #define __UNYAFFS_H__
 
+#include <linux/types.h>
 
 #define YAFFS_MAX_NAME_LENGTH       255
 #define YAFFS_MAX_ALIAS_LENGTH      159
@@ -137,4 +138,7 @@ typedef struct {
 
 } yaffs_ObjectHeader;
 
+int unyaffs_extract(const char *image, const char *out_dir, int chunk_size, int spare_size);
+int unyaffs_main(int argc, char **argv);
+
 #endif
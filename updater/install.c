@@ -33,6 +33,7 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "mmcutils/mmcutils.h"
 #include "updater.h"
 #include "applypatch/applypatch.h"
 
@@ -94,6 +95,7 @@ MountFn (const char *name, State * state, int argc, Expr * argv[])
 	  }
 
   mkdir (mount_point, 0755);
+  invalidate_mounted_volumes ();
 
   if (strcmp (partition_type, "MTD") == 0)
 	  {
@@ -240,16 +242,20 @@ FormatFn (const char *name, State * state, int argc, Expr * argv[])
 {
   char *result = NULL;
 
-  if (argc != 3)
+  if (argc != 3 && argc != 4)
 	  {
-	    return ErrorAbort (state, "%s() expects 3 args, got %d", name,
+	    return ErrorAbort (state, "%s() expects 3 or 4 args, got %d", name,
 			       argc);
 	  }
   char *fs_type;
   char *partition_type;
   char *location;
+  char *wipe_mode = NULL;
 
-  if (ReadArgs (state, argv, 3, &fs_type, &partition_type, &location) < 0)
+  if (argc == 4 ?
+      ReadArgs (state, argv, 4, &fs_type, &partition_type, &location,
+		&wipe_mode) < 0 :
+      ReadArgs (state, argv, 3, &fs_type, &partition_type, &location) < 0)
 	  {
 	    return NULL;
 	  }
@@ -274,6 +280,21 @@ FormatFn (const char *name, State * state, int argc, Expr * argv[])
 	    goto done;
 	  }
 
+  // Optional fourth argument: "discard" or "secure_discard" the
+  // block device before the new filesystem is made.
+  int discard_flags = -1;
+
+  if (wipe_mode != NULL && strcmp (wipe_mode, "discard") == 0)
+    discard_flags = 0;
+  else if (wipe_mode != NULL && strcmp (wipe_mode, "secure_discard") == 0)
+    discard_flags = MMC_DISCARD_SECURE | MMC_DISCARD_ZERO;
+  else if (wipe_mode != NULL && strlen (wipe_mode) > 0)
+	  {
+	    ErrorAbort (state, "unknown wipe mode \"%s\" passed to %s()",
+			wipe_mode, name);
+	    goto done;
+	  }
+
   if (strcmp (partition_type, "MTD") == 0)
 	  {
 	    mtd_scan_partitions ();
@@ -315,6 +336,12 @@ FormatFn (const char *name, State * state, int argc, Expr * argv[])
 	  }
   else if (strcmp (fs_type, "ext4") == 0)
 	  {
+	    if (discard_flags >= 0 &&
+		mmc_discard_device (location, discard_flags) != 0)
+		    {
+		      fprintf (stderr, "%s: discard of %s failed (%s)\n", name,
+			       location, strerror (errno));
+		    }
 	    reset_ext4fs_info ();
 	    int status = make_ext4fs (location, NULL, NULL, 0, 0, 0);
 
@@ -338,6 +365,7 @@ FormatFn (const char *name, State * state, int argc, Expr * argv[])
 done:
   free (fs_type);
   free (partition_type);
+  free (wipe_mode);
   if (result != location)
     free (location);
   return StringValue (result);
@@ -437,6 +465,16 @@ SetProgressFn (const char *name, State * state, int argc, Expr * argv[])
   return StringValue (frac_str);
 }
 
+// Only used when profiling, to account for the data written.
+static void
+extracted_file_cb (const char *fn, void *cookie)
+{
+  struct stat st;
+
+  if (lstat (fn, &st) == 0)
+    ProfileAddBytes (st.st_size);
+}
+
 // package_extract_dir(package_path, destination_path)
 Value *
 PackageExtractDirFn (const char *name, State * state, int argc, Expr * argv[])
@@ -459,7 +497,8 @@ PackageExtractDirFn (const char *name, State * state, int argc, Expr * argv[])
 
   bool success = mzExtractRecursive (za, zip_path, dest_path,
 				     MZ_EXTRACT_FILES_ONLY, &timestamp,
-				     NULL, NULL);
+				     gProfileEnabled ? extracted_file_cb : NULL,
+				     NULL);
 
   free (zip_path);
   free (dest_path);
@@ -513,6 +552,7 @@ PackageExtractFileFn (const char *name, State * state,
 		    }
 	    success = mzExtractZipEntryToFile (za, entry, fileno (f));
 	    fclose (f);
+	    ProfileAddBytes (mzGetZipEntryUncompLen (entry));
 
 	  done2:
 	    free (zip_path);
@@ -556,6 +596,8 @@ PackageExtractFileFn (const char *name, State * state,
 
 	    success = mzExtractZipEntryToBuffer (za, entry,
 						 (unsigned char *) v->data);
+	    if (success)
+	      ProfileAddBytes (v->size);
 
 	  done1:
 	    free (zip_path);
@@ -586,7 +628,7 @@ SymlinkFn (const char *name, State * state, int argc, Expr * argv[])
   if (target == NULL)
     return NULL;
 
-  char **srcs = ReadVarArgs (state, argc - 1, argv + 1);
+  char **srcs = ReadSharedVarArgs (state, argc - 1, argv + 1);
 
   if (srcs == NULL)
 	  {
@@ -612,13 +654,88 @@ SymlinkFn (const char *name, State * state, int argc, Expr * argv[])
 		      fprintf (stderr, "%s: failed to symlink %s to %s: %s\n",
 			       name, srcs[i], target, strerror (errno));
 		    }
-	    free (srcs[i]);
 	  }
-  free (srcs);
+  FreeSharedArgs (srcs, argc - 1, argv + 1);
+  free (target);
   return StringValue (strdup (""));
 }
 
 
+// Parse the arguments of one set_perm / set_perm_recursive call
+// ("uid gid mode path..." or "uid gid dirmode filemode path...") and
+// append a DirPermission per path to *perms.  Returns NULL on success,
+// otherwise a malloc'd error message.
+static char *
+parse_perm_args (const char *name, bool recursive, int argc, char **args,
+		 DirPermission ** perms, int *count)
+{
+  char *err = NULL;
+  char *end;
+  int modes[2];
+  int mode_count = recursive ? 2 : 1;
+  int i;
+
+  if (argc < 3 + mode_count)
+	  {
+	    asprintf (&err, "%s() expects %d+ args, got %d", name,
+		      3 + mode_count, argc);
+	    return err;
+	  }
+
+  int uid = strtoul (args[0], &end, 0);
+
+  if (*end != '\0' || args[0][0] == 0)
+	  {
+	    asprintf (&err, "%s: \"%s\" not a valid uid", name, args[0]);
+	    return err;
+	  }
+
+  int gid = strtoul (args[1], &end, 0);
+
+  if (*end != '\0' || args[1][0] == 0)
+	  {
+	    asprintf (&err, "%s: \"%s\" not a valid gid", name, args[1]);
+	    return err;
+	  }
+
+  for (i = 0; i < mode_count; ++i)
+	  {
+	    modes[i] = strtoul (args[2 + i], &end, 0);
+	    if (*end != '\0' || args[2 + i][0] == 0)
+		    {
+		      asprintf (&err, "%s: \"%s\" not a valid %s", name,
+				args[2 + i], !recursive ? "mode" :
+				i == 0 ? "dirmode" : "filemode");
+		      return err;
+		    }
+	  }
+
+  DirPermission *p = realloc (*perms, (*count + argc - 2 - mode_count) *
+			      sizeof (DirPermission));
+
+  if (p == NULL)
+	  {
+	    asprintf (&err, "%s: out of memory", name);
+	    return err;
+	  }
+  *perms = p;
+  for (i = 2 + mode_count; i < argc; ++i)
+	  {
+	    p[*count].path = args[i];
+	    p[*count].uid = uid;
+	    p[*count].gid = gid;
+	    p[*count].dirMode = modes[0];
+	    p[*count].fileMode = recursive ? modes[1] : -1;
+	    ++*count;
+	  }
+  return NULL;
+}
+
+// set_perm(uid, gid, mode, path, ...)
+// set_perm_recursive(uid, gid, dirmode, filemode, path, ...)
+//
+//   All paths are handled by one dirApplyPermissions() pass, which
+//   leaves alone anything that already has the right owner and mode.
 Value *
 SetPermFn (const char *name, State * state, int argc, Expr * argv[])
 {
@@ -630,97 +747,153 @@ SetPermFn (const char *name, State * state, int argc, Expr * argv[])
   if (argc < min_args)
 	  {
 	    return ErrorAbort (state, "%s() expects %d+ args, got %d", name,
-			       argc);
+			       min_args, argc);
 	  }
 
-  char **args = ReadVarArgs (state, argc, argv);
+  char **args = ReadSharedVarArgs (state, argc, argv);
 
   if (args == NULL)
     return NULL;
 
-  char *end;
-  int i;
+  DirPermission *perms = NULL;
+  int count = 0;
+  char *err = parse_perm_args (name, recursive, argc, args, &perms, &count);
 
-  int uid = strtoul (args[0], &end, 0);
+  if (err != NULL)
+	  {
+	    ErrorAbort (state, "%s", err);
+	    free (err);
+	    goto done;
+	  }
 
-  if (*end != '\0' || args[0][0] == 0)
+  if (dirApplyPermissions (perms, count) < 0)
 	  {
-	    ErrorAbort (state, "%s: \"%s\" not a valid uid", name, args[0]);
+	    fprintf (stderr, "%s: some permissions could not be set\n", name);
+	  }
+  result = strdup ("");
+
+done:
+  free (perms);
+  FreeSharedArgs (args, argc, argv);
+
+  return StringValue (result);
+}
+
+// set_perm_manifest(package_path)
+//
+//   Applies a permission manifest from the package in a single pass.
+//   Each line is a set_perm or set_perm_recursive call written without
+//   the punctuation, e.g.
+//
+//      set_perm_recursive 0 0 0755 0644 /system
+//      set_perm 0 2000 0755 /system/bin/sh /system/bin/toolbox
+//
+//   Blank lines and lines starting with '#' are ignored.  The result
+//   is the same as running the calls in order.
+Value *
+SetPermManifestFn (const char *name, State * state, int argc,
+		   Expr * argv[])
+{
+  if (argc != 1)
+	  {
+	    return ErrorAbort (state, "%s() expects 1 arg, got %d", name,
+			       argc);
+	  }
+  char *zip_path;
+
+  if (ReadArgs (state, argv, 1, &zip_path) < 0)
+    return NULL;
+
+  char *result = NULL;
+  char *data = NULL;
+  char **words = NULL;
+  int word_cap = 0;
+  DirPermission *perms = NULL;
+  int count = 0;
+
+  ZipArchive *za = ((UpdaterInfo *) (state->cookie))->package_zip;
+  const ZipEntry *entry = mzFindZipEntry (za, zip_path);
+
+  if (entry == NULL)
+	  {
+	    ErrorAbort (state, "%s: no %s in package", name, zip_path);
 	    goto done;
 	  }
 
-  int gid = strtoul (args[1], &end, 0);
+  unsigned int len = mzGetZipEntryUncompLen (entry);
 
-  if (*end != '\0' || args[1][0] == 0)
+  data = malloc (len + 1);
+  if (data == NULL || !mzReadZipEntry (za, entry, data, len))
 	  {
-	    ErrorAbort (state, "%s: \"%s\" not a valid gid", name, args[1]);
+	    ErrorAbort (state, "%s: failed to read %s", name, zip_path);
 	    goto done;
 	  }
+  data[len] = '\0';
+
+  // The DirPermissions point into data, which lives until the end.
+  char *save_line;
+  char *line;
+  int line_no = 0;
 
-  if (recursive)
+  for (line = strtok_r (data, "\n", &save_line); line != NULL;
+       line = strtok_r (NULL, "\n", &save_line))
 	  {
-	    int dir_mode = strtoul (args[2], &end, 0);
+	    char *save_word;
+	    char *word;
+	    int n = 0;
 
-	    if (*end != '\0' || args[2][0] == 0)
+	    ++line_no;
+	    for (word = strtok_r (line, " \t\r", &save_word); word != NULL;
+		 word = strtok_r (NULL, " \t\r", &save_word))
 		    {
-		      ErrorAbort (state, "%s: \"%s\" not a valid dirmode",
-				  name, args[2]);
-		      goto done;
+		      if (n == word_cap)
+			      {
+				word_cap = word_cap * 2 + 8;
+				words = realloc (words, word_cap * sizeof (char *));
+			      }
+		      words[n++] = word;
 		    }
+	    if (n == 0 || words[0][0] == '#')
+	      continue;
 
-	    int file_mode = strtoul (args[3], &end, 0);
+	    bool recursive;
 
-	    if (*end != '\0' || args[3][0] == 0)
+	    if (strcmp (words[0], "set_perm") == 0)
+	      recursive = false;
+	    else if (strcmp (words[0], "set_perm_recursive") == 0)
+	      recursive = true;
+	    else
 		    {
-		      ErrorAbort (state, "%s: \"%s\" not a valid filemode",
-				  name, args[3]);
+		      ErrorAbort (state, "%s: %s line %d: unknown command \"%s\"",
+				  name, zip_path, line_no, words[0]);
 		      goto done;
 		    }
 
-	    for (i = 4; i < argc; ++i)
-		    {
-		      dirSetHierarchyPermissions (args[i], uid, gid, dir_mode,
-						  file_mode);
-		    }
-	  }
-  else
-	  {
-	    int mode = strtoul (args[2], &end, 0);
+	    char *err = parse_perm_args (words[0], recursive, n - 1, words + 1,
+					 &perms, &count);
 
-	    if (*end != '\0' || args[2][0] == 0)
+	    if (err != NULL)
 		    {
-		      ErrorAbort (state, "%s: \"%s\" not a valid mode", name,
-				  args[2]);
+		      ErrorAbort (state, "%s: %s line %d: %s", name, zip_path,
+				  line_no, err);
+		      free (err);
 		      goto done;
 		    }
-
-	    for (i = 3; i < argc; ++i)
-		    {
-		      if (chown (args[i], uid, gid) < 0)
-			      {
-				fprintf (stderr,
-					 "%s: chown of %s to %d %d failed: %s\n",
-					 name, args[i], uid, gid,
-					 strerror (errno));
-			      }
-		      if (chmod (args[i], mode) < 0)
-			      {
-				fprintf (stderr,
-					 "%s: chmod of %s to %o failed: %s\n",
-					 name, args[i], mode,
-					 strerror (errno));
-			      }
-		    }
 	  }
-  result = strdup ("");
 
-done:
-  for (i = 0; i < argc; ++i)
+  printf ("%s: applying %d permission entries from %s\n", name, count,
+	  zip_path);
+  if (dirApplyPermissions (perms, count) < 0)
 	  {
-	    free (args[i]);
+	    fprintf (stderr, "%s: some permissions could not be set\n", name);
 	  }
-  free (args);
+  result = strdup ("");
 
+done:
+  free (perms);
+  free (words);
+  free (data);
+  free (zip_path);
   return StringValue (result);
 }
 
@@ -953,6 +1126,7 @@ WriteRawImageFn (const char *name, State * state, int argc, Expr * argv[])
 	  {
 	    int wrote = mtd_write_data (ctx, buffer, read);
 
+	    ProfileAddBytes (wrote > 0 ? wrote : 0);
 	    success = success && (wrote == read);
 	    if (!success)
 		    {
@@ -1091,6 +1265,9 @@ ApplyPatchFn (const char *name, State * state, int argc, Expr * argv[])
 			   target_sha1, target_size,
 			   patchcount, patch_sha_str, patches);
 
+  if (result == 0)
+    ProfileAddBytes (target_size);
+
   for (i = 0; i < patchcount; ++i)
 	  {
 	    FreeValue (patches[i]);
@@ -1369,6 +1546,7 @@ ReadFileFn (const char *name, State * state, int argc, Expr * argv[])
 
   v->size = fc.size;
   v->data = (char *) fc.data;
+  ProfileAddBytes (fc.size);
 
   free (filename);
   return v;
@@ -1390,6 +1568,7 @@ RegisterInstallFunctions ()
   RegisterFunction ("symlink", SymlinkFn);
   RegisterFunction ("set_perm", SetPermFn);
   RegisterFunction ("set_perm_recursive", SetPermFn);
+  RegisterFunction ("set_perm_manifest", SetPermManifestFn);
 
   RegisterFunction ("getprop", GetPropFn);
   RegisterFunction ("file_getprop", FileGetPropFn);
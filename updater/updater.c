@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "edify/expr.h"
 #include "updater.h"
@@ -32,6 +33,26 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Where the profile report goes when profiling is enabled, either with
+// UPDATER_PROFILE set in the environment or "--profile" as an extra
+// argument.
+#define PROFILE_REPORT_FILE "/tmp/updater_profile.txt"
+
+static void
+write_profile_report (void)
+{
+  if (!gProfileEnabled)
+    return;
+  ProfileReport (stderr);
+  FILE *f = fopen (PROFILE_REPORT_FILE, "w");
+
+  if (f != NULL)
+	  {
+	    ProfileReport (f);
+	    fclose (f);
+	  }
+}
+
 int
 main (int argc, char **argv)
 {
@@ -41,7 +62,7 @@ main (int argc, char **argv)
   setbuf (stdout, NULL);
   setbuf (stderr, NULL);
 
-  if (argc != 4)
+  if (argc != 4 && (argc != 5 || strcmp (argv[4], "--profile") != 0))
 	  {
 	    fprintf (stderr, "unexpected number of arguments (%d)\n", argc);
 	    return 1;
@@ -118,6 +139,14 @@ main (int argc, char **argv)
 	    return 6;
 	  }
 
+  // Lower the tree into a single block before running it.
+  root = Compile (root);
+  if (root == NULL)
+	  {
+	    fprintf (stderr, "out of memory compiling script\n");
+	    return 6;
+	  }
+
   // Evaluate the parsed script.
 
   UpdaterInfo updater_info;
@@ -132,8 +161,15 @@ main (int argc, char **argv)
   state.script = script;
   state.errmsg = NULL;
 
+  if (argc == 5 || getenv ("UPDATER_PROFILE") != NULL)
+	  {
+	    ProfileStart (&state);
+	  }
+
   char *result = Evaluate (&state, root);
 
+  write_profile_report ();
+
   if (result == NULL)
 	  {
 	    if (state.errmsg == NULL)
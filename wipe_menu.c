@@ -1,11 +1,14 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
 
 #include "mtdutils/mtdutils.h"
 #include "mmcutils/mmcutils.h"
 #include "recovery.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "wipe_scheduler.h"
 
 
 int wipe_partition(char* partition, int autoaccept) 
@@ -14,9 +17,9 @@ int wipe_partition(char* partition, int autoaccept)
 	char path_string[255] = "";
 	char operation[255] = "";
 	
-	//wipe android_secure command:
-	char SEC_CMD[60];
-	sprintf(SEC_CMD, "rm -rf %s/.android_secure/*", get_storage_root());
+	//android_secure path:
+	char SEC_PATH[PATH_MAX];
+	sprintf(SEC_PATH, "%s/.android_secure", get_storage_root());
 	
 
 	if (strcmp(partition,"battery statistics") != 0 && strcmp(partition,"dalvik-cache") !=0 &&
@@ -35,30 +38,31 @@ int wipe_partition(char* partition, int autoaccept)
 	if (strcmp (partition, "all") == 0)
 	{
 	    if (confirm_selection("Wipe EVERYTHING?", "Yes - wipe the entire device", autoaccept)) {
+			WipeJob jobs[MAX_WIPE_JOBS];
+			int count = 0;
+
+			memset(jobs, 0, sizeof(jobs));
 			ui_print("Preparing to wipe everything...\n");
-			ui_show_indeterminate_progress();
-			ui_print ("\n-- Wiping system... ");
-			ensure_path_unmounted ("/system");
-			erase_volume ("/system");
-			if (volume_present("/datadata")) 
+			jobs[count].label = "system";
+			jobs[count++].path = "/system";
+			if (volume_present("/datadata"))
 			{
-			   ui_print("\n-- Wiping datadata");
-			   ensure_path_unmounted("/datadata");
-			   erase_volume("/datadata");
-                        }
-			ui_print ("\n-- Wiping data... ");
-			ensure_path_unmounted ("/data");
-			erase_volume ("/data");
-			ui_print ("\n-- Wiping cache... ");
-			ensure_path_unmounted ("/cache");
-			erase_volume ("/cache");
-			ui_print ("\n-- Wiping .android_secure... ");
-			ensure_path_mounted (get_storage_root());
-			__system (SEC_CMD);
-			ensure_path_unmounted(get_storage_root());
-			ui_print ("\n-- Wiping boot...");
-			erase_volume("/boot");
-			ui_print ("\nDone.\n");
+			  jobs[count].label = "datadata";
+			  jobs[count++].path = "/datadata";
+			}
+			jobs[count].label = "data";
+			jobs[count++].path = "/data";
+			jobs[count].label = "cache";
+			jobs[count++].path = "/cache";
+			jobs[count].label = ".android_secure";
+			jobs[count].path = SEC_PATH;
+			jobs[count++].delete_contents = 1;
+			jobs[count].label = "boot";
+			jobs[count++].path = "/boot";
+			int failed = run_wipe_jobs(jobs, count);
+			if (failed)
+			  ui_print ("%d of %d wipes failed.\n", failed, count);
+			ui_print ("Done.\n");
 			ui_print ("Device completely wiped.\n\n");
 			ui_print ("All that remains is RZR.\n");
 			ui_reset_progress();
@@ -87,7 +91,7 @@ int wipe_partition(char* partition, int autoaccept)
 		if (strcmp (partition, "android_secure") == 0)
 		{
 			ensure_path_mounted (get_storage_root());
-			__system (SEC_CMD);
+			delete_tree (SEC_PATH, NULL, 1);
 			ensure_path_unmounted(get_storage_root());
 			ui_print("Done.\n");
 			ui_reset_progress();
@@ -98,8 +102,8 @@ int wipe_partition(char* partition, int autoaccept)
 		{
 			if (!is_path_mounted("/data")) ensure_path_mounted ("/data");
 			if (!is_path_mounted("/cache")) ensure_path_mounted("/cache");
-			__system ("rm -rf /cache/dalvik-cache/*");
-			__system ("rm -rf /data/dalvik-cache/*");
+			delete_tree ("/cache/dalvik-cache", NULL, 1);
+			delete_tree ("/data/dalvik-cache", NULL, 1);
 			ensure_path_unmounted("/data");
 			ensure_path_unmounted("/cache");
 			ui_print("Done.\n");
@@ -136,6 +140,32 @@ int wipe_partition(char* partition, int autoaccept)
 }
 
 
+void
+show_fast_wipe_menu ()
+{
+  static char *headers[] = { "Fast wipe mode",
+    "Discard hands the freed",
+    "blocks back to the eMMC",
+    "before formatting",
+    "",
+    NULL
+  };
+
+  char *items[] = { "Off (plain format)",
+    "Discard",
+    "Secure discard (slow)",
+    NULL
+  };
+
+  int chosen_item = get_menu_selection (headers, items, 0,
+					get_fast_wipe_mode ());
+
+  if (chosen_item == ITEM_BACK)
+    return;
+  set_fast_wipe_mode (chosen_item);
+  ui_print ("Fast wipe mode: %s\n", items[chosen_item]);
+}
+
 void
 show_wipe_menu ()
 {
@@ -156,6 +186,7 @@ show_wipe_menu ()
     "Wipe cache",
     "Wipe battery stats",
     "Wipe dalvik-cache",
+    "Fast wipe mode",
     NULL
   };
 
@@ -167,6 +198,7 @@ show_wipe_menu ()
 #define WIPE_CACHE			5
 #define WIPE_BATT			6
 #define WIPE_DK				7
+#define WIPE_MODE			8
 
 
   int chosen_item = -1;
@@ -211,6 +243,10 @@ show_wipe_menu ()
 		    case WIPE_DK:
 		      wipe_partition("dalvik-cache", 0);
 		      break;
+
+		    case WIPE_MODE:
+		      show_fast_wipe_menu();
+		      break;
 		    }
 	  }
 }
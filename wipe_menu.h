@@ -1 +1,2 @@
 void show_wipe_menu ();
+void show_fast_wipe_menu ();
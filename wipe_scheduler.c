@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "common.h"
+#include "roots.h"
+#include "wipe_scheduler.h"
+
+// Jobs are grouped by the physical flash chip their volume lives on.
+// Each group gets a thread that runs its jobs in list order, so two
+// partitions of the same chip never compete for it while separate
+// chips (internal eMMC, sdcard, NAND) are wiped at the same time.
+
+#define MAX_WIPE_GROUPS 8
+#define PROGRESS_INTERVAL_US 100000
+
+typedef struct
+{
+  char device[64];		// physical device key
+  WipeJob *jobs[MAX_WIPE_JOBS];
+  int count;
+  pthread_t thread;
+  int started;
+} WipeGroup;
+
+static int wipe_failures;
+static pthread_mutex_t wipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+run_wipe_job (WipeJob * job)
+{
+  int ret;
+
+  set_thread_progress_slot (&job->progress);
+  if (job->delete_contents)
+	  {
+	    ensure_path_mounted (job->path);
+	    ret = delete_tree (job->path, NULL, 1);
+	    // nothing to empty (it may have gone with its volume)
+	    if (ret != 0 && errno == ENOENT)
+	      ret = 0;
+	    ensure_path_unmounted (job->path);
+	  }
+  else
+	  {
+	    ensure_path_unmounted (job->path);
+	    ret = format_volume (job->path);
+	  }
+  set_thread_progress_slot (NULL);
+
+  job->progress = 1.0;
+  job->status = ret == 0 ? WIPE_JOB_DONE : WIPE_JOB_FAILED;
+  ui_print ("-- Wiping %s... %s\n", job->label,
+	    ret == 0 ? "Done." : "Failed!");
+  if (ret != 0)
+	  {
+	    pthread_mutex_lock (&wipe_lock);
+	    ++wipe_failures;
+	    pthread_mutex_unlock (&wipe_lock);
+	  }
+}
+
+static void *
+wipe_group_thread (void *cookie)
+{
+  WipeGroup *group = (WipeGroup *) cookie;
+  int i;
+
+  for (i = 0; i < group->count; ++i)
+	  {
+	    group->jobs[i]->status = WIPE_JOB_RUNNING;
+	    run_wipe_job (group->jobs[i]);
+	  }
+  return NULL;
+}
+
+static int
+all_jobs_finished (WipeJob * jobs, int count)
+{
+  int i;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    if (jobs[i].status == WIPE_JOB_PENDING ||
+		jobs[i].status == WIPE_JOB_RUNNING)
+	      return 0;
+	  }
+  return 1;
+}
+
+int
+run_wipe_jobs (WipeJob * jobs, int count)
+{
+  WipeGroup groups[MAX_WIPE_GROUPS];
+  int group_count = 0;
+  struct timespec start, end;
+  int i, g;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  wipe_failures = 0;
+  memset (groups, 0, sizeof (groups));
+  if (count > MAX_WIPE_JOBS)
+    count = MAX_WIPE_JOBS;
+
+  for (i = 0; i < count; ++i)
+	  {
+	    char key[64];
+	    Volume *v = volume_for_path (jobs[i].path);
+
+	    jobs[i].progress = 0.0;
+	    if (v == NULL)
+		    {
+		      LOGE ("no volume for %s; skipping\n", jobs[i].path);
+		      jobs[i].status = WIPE_JOB_FAILED;
+		      ++wipe_failures;
+		      continue;
+		    }
+	    jobs[i].status = WIPE_JOB_PENDING;
+	    volume_device_key (v, key, sizeof (key));
+
+	    for (g = 0; g < group_count; ++g)
+		    {
+		      if (strcmp (groups[g].device, key) == 0)
+			break;
+		    }
+	    if (g == group_count)
+		    {
+		      if (group_count == MAX_WIPE_GROUPS)
+			g = group_count - 1;	// just queue it behind the last chip
+		      else
+			strcpy (groups[group_count++].device, key);
+		    }
+	    groups[g].jobs[groups[g].count++] = &jobs[i];
+	    LOGI ("wipe %s on %s\n", jobs[i].label, groups[g].device);
+	  }
+
+  ui_show_progress (1.0, 0);
+  for (g = 0; g < group_count; ++g)
+	  {
+	    groups[g].started =
+	      pthread_create (&groups[g].thread, NULL, wipe_group_thread,
+			      &groups[g]) == 0;
+	    if (!groups[g].started)
+		    {
+		      LOGW ("can't start wipe thread; wiping %s serially\n",
+			    groups[g].device);
+		      wipe_group_thread (&groups[g]);
+		    }
+	  }
+
+  // This thread only keeps the progress bar moving.
+  while (!all_jobs_finished (jobs, count))
+	  {
+	    float total = 0.0;
+
+	    for (i = 0; i < count; ++i)
+	      total += jobs[i].progress;
+	    ui_set_progress (total / count);
+	    usleep (PROGRESS_INTERVAL_US);
+	  }
+  for (g = 0; g < group_count; ++g)
+	  {
+	    if (groups[g].started)
+	      pthread_join (groups[g].thread, NULL);
+	  }
+  ui_set_progress (1.0);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  LOGI ("wiped %d volumes on %d devices in %ld ms\n", count, group_count,
+	(end.tv_sec - start.tv_sec) * 1000 +
+	(end.tv_nsec - start.tv_nsec) / 1000000);
+  return wipe_failures;
+}
@@ -0,0 +1,28 @@
+#ifndef WIPE_SCHEDULER_H
+#define WIPE_SCHEDULER_H
+
+#define MAX_WIPE_JOBS 16
+
+enum
+{
+  WIPE_JOB_PENDING,
+  WIPE_JOB_RUNNING,
+  WIPE_JOB_DONE,
+  WIPE_JOB_FAILED
+};
+
+typedef struct
+{
+  const char *label;		// for the log, eg. "data"
+  const char *path;		// volume to format, or directory to empty
+  int delete_contents;		// empty 'path' instead of formatting it
+  volatile int status;
+  volatile float progress;
+} WipeJob;
+
+// Run the jobs with those on different flash chips in parallel and
+// those on the same chip one after another, in list order.  Drives
+// the progress bar; returns the number of jobs that failed.
+int run_wipe_jobs (WipeJob * jobs, int count);
+
+#endif